@@ -9,6 +9,367 @@ strokelist_init_bucket(StrokeBucket* bucket)
     bucket->bounding_rect = rect_without_size();
 }
 
+// ==== Spatial index
+
+// Map a canvas coordinate to index space, where the root cell starts at 0.
+static u64
+index_coord(i64 c)
+{
+    return (u64)c ^ (1ULL << 63);
+}
+
+static i64
+canvas_coord(u64 c)
+{
+    return (i64)(c ^ (1ULL << 63));
+}
+
+// Depth of the deepest cell that is larger than the rect.
+static i32
+index_depth(Rect bounds)
+{
+    u64 w = bounds.right > bounds.left ? index_coord(bounds.right) - index_coord(bounds.left) : 0;
+    u64 h = bounds.bottom > bounds.top ? index_coord(bounds.bottom) - index_coord(bounds.top) : 0;
+    u64 size = max(w, h);
+
+    i32 depth = STROKE_INDEX_MAX_DEPTH;
+    while ( depth > 0 && (size >> (64 - depth)) != 0 ) {
+        depth -= 1;
+    }
+    return depth;
+}
+
+static u64
+index_center(i64 a, i64 b)
+{
+    u64 ua = index_coord(a);
+    u64 ub = index_coord(b);
+    if ( ub < ua ) {
+        ub = ua;
+    }
+    return ua + (ub - ua) / 2;
+}
+
+static StrokeIndexNode*
+index_create_node(Arena* arena, u64 x, u64 y, i32 depth)
+{
+    StrokeIndexNode* node = arena_alloc_elem(arena, StrokeIndexNode);
+    *node = {};
+    node->x = x;
+    node->y = y;
+    node->depth = depth;
+    return node;
+}
+
+// The cell of the node, grown by half a cell on every side.
+static Rect
+index_node_bounds(StrokeIndexNode* node)
+{
+    Rect bounds;
+    if ( node->depth == 0 ) {
+        bounds.left = bounds.top = I64_MIN;
+        bounds.right = bounds.bottom = I64_MAX;
+    }
+    else {
+        u64 size = 1ULL << (64 - node->depth);
+        u64 half = size / 2;
+        u64 x_max = node->x + (size - 1);
+        u64 y_max = node->y + (size - 1);
+
+        bounds.left   = canvas_coord(node->x >= half ? node->x - half : 0);
+        bounds.top    = canvas_coord(node->y >= half ? node->y - half : 0);
+        bounds.right  = canvas_coord(U64_MAX - x_max >= half ? x_max + half : U64_MAX);
+        bounds.bottom = canvas_coord(U64_MAX - y_max >= half ? y_max + half : U64_MAX);
+    }
+    return bounds;
+}
+
+// Walk from the root to the node where a stroke with these bounds belongs,
+// creating nodes on the way and adding `delta` to their subtree counts.
+static StrokeIndexNode*
+index_find_node(StrokeList* list, Rect bounds, i64 delta)
+{
+    i32 depth = index_depth(bounds);
+    u64 cx = index_center(bounds.left, bounds.right);
+    u64 cy = index_center(bounds.top, bounds.bottom);
+
+    if ( !list->index ) {
+        list->index = index_create_node(list->arena, 0, 0, 0);
+    }
+    StrokeIndexNode* node = list->index;
+    node->subtree_count += delta;
+    while ( node->depth < depth ) {
+        i32 shift = 63 - node->depth;
+        u64 bx = cx & (1ULL << shift);
+        u64 by = cy & (1ULL << shift);
+        int child_i = (bx ? 1 : 0) | (by ? 2 : 0);
+        if ( !node->children[child_i] ) {
+            node->children[child_i] = index_create_node(list->arena, node->x | bx, node->y | by, node->depth + 1);
+        }
+        node = node->children[child_i];
+        node->subtree_count += delta;
+    }
+    return node;
+}
+
+static void
+index_insert(StrokeList* list, Stroke* stroke, i64 index)
+{
+    StrokeIndexNode* node = index_find_node(list, stroke->bounding_rect, 1);
+    if ( node->count == node->capacity ) {
+        // Entries live in the list's arena, like the buckets. The old array is
+        // left behind, so growing by doubling wastes at most as much as is used.
+        i32 capacity = node->capacity ? node->capacity * 2 : 4;
+        StrokeIndexEntry* entries = arena_alloc_array(list->arena, capacity, StrokeIndexEntry);
+        if ( node->count ) {
+            memcpy(entries, node->entries, node->count * sizeof(*entries));
+        }
+        node->entries = entries;
+        node->capacity = capacity;
+    }
+    StrokeIndexEntry* entry = &node->entries[node->count++];
+    entry->bounds = stroke->bounding_rect;
+    entry->stroke = stroke;
+    entry->index = index;
+}
+
+// Strokes are only ever popped from the end, so the last stroke is the last
+// entry in its node.
+static void
+index_remove_last(StrokeList* list, Rect bounds, i64 index)
+{
+    StrokeIndexNode* node = index_find_node(list, bounds, -1);
+    mlt_assert(node->count > 0 && node->entries[node->count - 1].index == index);
+    node->count -= 1;
+}
+
+// Appends one run of entries per node, each in paint order.
+static void
+index_query(StrokeIndexNode* node, Rect rect, DArray<StrokeIndexEntry>* out)
+{
+    if ( node->subtree_count > 0 && rect_intersects_rect(index_node_bounds(node), rect) ) {
+        for ( i32 i = 0; i < node->count; ++i ) {
+            if ( rect_intersects_rect(node->entries[i].bounds, rect) ) {
+                push(out, node->entries[i]);
+            }
+        }
+        for ( int ci = 0; ci < 4; ++ci ) {
+            if ( node->children[ci] ) {
+                index_query(node->children[ci], rect, out);
+            }
+        }
+    }
+}
+
+// Like index_query, but sets the bit of each stroke in the bucket masks.
+static void
+index_mark(StrokeIndexNode* node, Rect rect, u64* masks)
+{
+    if ( node->subtree_count > 0 && rect_intersects_rect(index_node_bounds(node), rect) ) {
+        for ( i32 i = 0; i < node->count; ++i ) {
+            StrokeIndexEntry* e = &node->entries[i];
+            if ( rect_intersects_rect(e->bounds, rect) ) {
+                i64 bi = e->index % STROKELIST_BUCKET_COUNT;
+                masks[(e->index / STROKELIST_BUCKET_COUNT) * STROKELIST_MASK_WORDS + bi / 64] |= 1ULL << (bi % 64);
+            }
+        }
+        for ( int ci = 0; ci < 4; ++ci ) {
+            if ( node->children[ci] ) {
+                index_mark(node->children[ci], rect, masks);
+            }
+        }
+    }
+}
+
+// Length of the run of increasing indices starting at `first`.
+static i64
+index_run_end(StrokeIndexEntry* entries, i64 first, i64 n)
+{
+    i64 end = first + 1;
+    while ( end < n && entries[end - 1].index < entries[end].index ) {
+        end += 1;
+    }
+    return end;
+}
+
+// Sort query results back into paint order. They come in as a handful of
+// sorted runs, so merge neighbouring runs until only one is left.
+static void
+index_sort(StrokeIndexEntry* entries, i64 n, StrokeIndexEntry* scratch)
+{
+    StrokeIndexEntry* src = entries;
+    StrokeIndexEntry* dst = scratch;
+
+    while ( index_run_end(src, 0, n) < n ) {
+        i64 first = 0;
+        while ( first < n ) {
+            i64 mid = index_run_end(src, first, n);
+            i64 end = mid < n ? index_run_end(src, mid, n) : n;
+            i64 a = first;
+            i64 b = mid;
+            i64 o = first;
+            while ( a < mid && b < end ) {
+                dst[o++] = src[a].index < src[b].index ? src[a++] : src[b++];
+            }
+            while ( a < mid ) { dst[o++] = src[a++]; }
+            while ( b < end ) { dst[o++] = src[b++]; }
+            first = end;
+        }
+        StrokeIndexEntry* tmp = src;
+        src = dst;
+        dst = tmp;
+    }
+
+    if ( src != entries ) {
+        memcpy(entries, src, n * sizeof(*entries));
+    }
+}
+
+// ==== Bucket culling
+
+enum CullKernel
+{
+    CullKernel_SCALAR,
+    CullKernel_SSE42,
+    CullKernel_AVX2,
+};
+
+static void
+bucket_set_bounds(StrokeBucket* bucket, i64 i, Rect bounds)
+{
+    bucket->left[i]   = bounds.left;
+    bucket->top[i]    = bounds.top;
+    bucket->right[i]  = bounds.right;
+    bucket->bottom[i] = bounds.bottom;
+}
+
+static CullKernel
+cull_detect_kernel()
+{
+    b32 sse42 = false;
+    b32 avx2 = false;
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    int max_leaf = info[0];
+    __cpuid(info, 1);
+    sse42 = (info[2] >> 20) & 1;
+    b32 osxsave = (info[2] >> 27) & 1;
+    b32 avx = (info[2] >> 28) & 1;
+    // The OS has to save the YMM registers too.
+    if ( max_leaf >= 7 && osxsave && avx && (_xgetbv(0) & 6) == 6 ) {
+        __cpuidex(info, 7, 0);
+        avx2 = (info[1] >> 5) & 1;
+    }
+#else
+    __builtin_cpu_init();
+    sse42 = __builtin_cpu_supports("sse4.2");
+    avx2 = __builtin_cpu_supports("avx2");
+#endif
+    CullKernel kernel = CullKernel_SCALAR;
+    if ( avx2 ) {
+        kernel = CullKernel_AVX2;
+    }
+    else if ( sse42 ) {
+        kernel = CullKernel_SSE42;
+    }
+    return kernel;
+}
+
+// Strokes from `first` on. Same test as rect_intersects_rect.
+static void
+cull_bucket_scalar(StrokeBucket* b, i64 first, i64 count, Rect rect, u64* mask)
+{
+    for ( i64 i = first; i < count; ++i ) {
+        u64 outside =   (u64)(b->left[i] > rect.right) | (u64)(rect.left > b->right[i])
+                      | (u64)(b->top[i] > rect.bottom) | (u64)(rect.top > b->bottom[i]);
+        mask[i / 64] |= (outside ^ 1) << (i % 64);
+    }
+}
+
+MLT_TARGET("sse4.2") static i64
+cull_bucket_sse42(StrokeBucket* b, i64 count, Rect rect, u64* mask)
+{
+    __m128i r_left   = _mm_set1_epi64x(rect.left);
+    __m128i r_top    = _mm_set1_epi64x(rect.top);
+    __m128i r_right  = _mm_set1_epi64x(rect.right);
+    __m128i r_bottom = _mm_set1_epi64x(rect.bottom);
+
+    i64 i = 0;
+    for ( ; i + 2 <= count; i += 2 ) {
+        __m128i left   = _mm_loadu_si128((__m128i*)(b->left + i));
+        __m128i top    = _mm_loadu_si128((__m128i*)(b->top + i));
+        __m128i right  = _mm_loadu_si128((__m128i*)(b->right + i));
+        __m128i bottom = _mm_loadu_si128((__m128i*)(b->bottom + i));
+
+        __m128i outside = _mm_or_si128(_mm_or_si128(_mm_cmpgt_epi64(left, r_right),
+                                                    _mm_cmpgt_epi64(r_left, right)),
+                                       _mm_or_si128(_mm_cmpgt_epi64(top, r_bottom),
+                                                    _mm_cmpgt_epi64(r_top, bottom)));
+        u64 bits = (u64)(~_mm_movemask_pd(_mm_castsi128_pd(outside)) & 0x3);
+        mask[i / 64] |= bits << (i % 64);
+    }
+    return i;
+}
+
+MLT_TARGET("avx2") static i64
+cull_bucket_avx2(StrokeBucket* b, i64 count, Rect rect, u64* mask)
+{
+    __m256i r_left   = _mm256_set1_epi64x(rect.left);
+    __m256i r_top    = _mm256_set1_epi64x(rect.top);
+    __m256i r_right  = _mm256_set1_epi64x(rect.right);
+    __m256i r_bottom = _mm256_set1_epi64x(rect.bottom);
+
+    i64 i = 0;
+    for ( ; i + 4 <= count; i += 4 ) {
+        __m256i left   = _mm256_loadu_si256((__m256i*)(b->left + i));
+        __m256i top    = _mm256_loadu_si256((__m256i*)(b->top + i));
+        __m256i right  = _mm256_loadu_si256((__m256i*)(b->right + i));
+        __m256i bottom = _mm256_loadu_si256((__m256i*)(b->bottom + i));
+
+        __m256i outside = _mm256_or_si256(_mm256_or_si256(_mm256_cmpgt_epi64(left, r_right),
+                                                          _mm256_cmpgt_epi64(r_left, right)),
+                                          _mm256_or_si256(_mm256_cmpgt_epi64(top, r_bottom),
+                                                          _mm256_cmpgt_epi64(r_top, bottom)));
+        // Groups of 4 never straddle a mask word.
+        u64 bits = (u64)(~_mm256_movemask_pd(_mm256_castsi256_pd(outside)) & 0xf);
+        mask[i / 64] |= bits << (i % 64);
+    }
+    return i;
+}
+
+void
+strokelist_cull_bucket(StrokeBucket* bucket, i64 count, Rect rect, u64 mask[STROKELIST_MASK_WORDS])
+{
+    static CullKernel kernel = cull_detect_kernel();
+
+    mlt_assert(count <= STROKELIST_BUCKET_COUNT);
+    memset(mask, 0, STROKELIST_MASK_WORDS * sizeof(*mask));
+
+    i64 done = 0;
+    switch ( kernel ) {
+        case CullKernel_AVX2: {
+            done = cull_bucket_avx2(bucket, count, rect, mask);
+        } break;
+        case CullKernel_SSE42: {
+            done = cull_bucket_sse42(bucket, count, rect, mask);
+        } break;
+        default: {
+        } break;
+    }
+    cull_bucket_scalar(bucket, done, count, rect, mask);
+}
+
+// ====
+
+static void
+touch(StrokeList* list)
+{
+    // Only changed on the main thread.
+    static u64 g_version = 0;
+    list->version = ++g_version;
+}
+
 static StrokeBucket*
 create_bucket(Arena* arena)
 {
@@ -33,10 +394,14 @@ push(StrokeList* list, const Stroke& element)
     }
 
     bucket->data[i] = element;
+    bucket_set_bounds(bucket, i, element.bounding_rect);
 
     bucket->bounding_rect = rect_union(bucket->bounding_rect, element.bounding_rect);
 
+    index_insert(list, &bucket->data[i], list->count);
+
     list->count += 1;
+    touch(list);
 }
 
 Stroke*
@@ -57,7 +422,11 @@ pop(StrokeList* list)
 {
     mlt_assert(list->count > 0);
     Stroke result = *get(list, list->count-1);
+    if ( list->index ) {
+        index_remove_last(list, result.bounding_rect, list->count-1);
+    }
     list->count--;
+    touch(list);
     return result;
 }
 
@@ -78,6 +447,9 @@ reset(StrokeList* list)
         bucket->bounding_rect = rect_without_size();
         bucket = bucket->next;
     }
+    // The old nodes stay in the arena until the canvas is freed.
+    list->index = NULL;
+    touch(list);
 }
 
 i64
@@ -86,6 +458,67 @@ count(StrokeList* list)
     return list->count;
 }
 
+void
+resize(StrokeList* list, i64 count)
+{
+    StrokeBucket* bucket = &list->root;
+    for ( i64 i = STROKELIST_BUCKET_COUNT; i < count; i += STROKELIST_BUCKET_COUNT ) {
+        if ( !bucket->next ) {
+            bucket->next = create_bucket(list->arena);
+        }
+        bucket = bucket->next;
+    }
+    list->count = count;
+    touch(list);
+}
+
+void
+strokelist_update_bounds(StrokeList* list)
+{
+    i64 i = 0;
+    for ( StrokeBucket* bucket = &list->root; bucket; bucket = bucket->next ) {
+        bucket->bounding_rect = rect_without_size();
+        for ( i64 bi = 0; bi < STROKELIST_BUCKET_COUNT && i < list->count; ++bi, ++i ) {
+            bucket->bounding_rect = rect_union(bucket->bounding_rect, bucket->data[bi].bounding_rect);
+            bucket_set_bounds(bucket, bi, bucket->data[bi].bounding_rect);
+        }
+    }
+
+    // Rebuild the index from scratch. This only happens when loading, so the
+    // old nodes are left in the arena.
+    list->index = NULL;
+    i = 0;
+    for ( StrokeBucket* bucket = &list->root; bucket; bucket = bucket->next ) {
+        for ( i64 bi = 0; bi < STROKELIST_BUCKET_COUNT && i < list->count; ++bi, ++i ) {
+            index_insert(list, &bucket->data[bi], i);
+        }
+    }
+    touch(list);
+}
+
+void
+strokelist_query(StrokeList* list, Rect rect, DArray<StrokeIndexEntry>* out)
+{
+    if ( list->index ) {
+        i64 first = out->count;
+        index_query(list->index, rect, out);
+        i64 n = out->count - first;
+        if ( n > 1 ) {
+            // Use the spare capacity of `out` as scratch space for the merge.
+            reserve(out, out->count + n);
+            index_sort(out->data + first, n, out->data + out->count);
+        }
+    }
+}
+
+void
+strokelist_mark(StrokeList* list, Rect rect, u64* masks)
+{
+    if ( list->index ) {
+        index_mark(list->index, rect, masks);
+    }
+}
+
 Stroke*
 StrokeList::operator[] (i64 i)
 {
@@ -11,24 +11,73 @@
 
 #include "stroke.h"
 
+#include "DArray.h"
 #include "memory.h"
 
 #define STROKELIST_BUCKET_COUNT 4196
 
+// Words in a visibility mask with one bit per stroke in a bucket.
+#define STROKELIST_MASK_WORDS   ((STROKELIST_BUCKET_COUNT + 63) / 64)
+
 struct StrokeBucket
 {
     Stroke          data[STROKELIST_BUCKET_COUNT];
     StrokeBucket*   next;
     Rect            bounding_rect;
+
+    // Bounding rects of the strokes in data, one array per side, so that
+    // culling doesn't have to read the strokes.
+    i64             left[STROKELIST_BUCKET_COUNT];
+    i64             top[STROKELIST_BUCKET_COUNT];
+    i64             right[STROKELIST_BUCKET_COUNT];
+    i64             bottom[STROKELIST_BUCKET_COUNT];
+};
+
+// Spatial index
+//
+// A loose quadtree over canvas space. Each stroke goes into the deepest node
+// whose cell is bigger than the stroke, under the cell that contains the
+// stroke's center. Nodes reach half a cell past their cell on every side, so
+// they contain all of their strokes.
+//
+// Coordinates are offset by 2^63 so that the root cell covers every i64. The
+// root is at depth 0 and cells at depth d are 2^(64-d) wide.
+
+#define STROKE_INDEX_MAX_DEPTH  56  // Smallest cells are 256 canvas units wide.
+
+struct StrokeIndexEntry
+{
+    Rect        bounds;
+    Stroke*     stroke;
+    i64         index;  // Position in the StrokeList, i.e. paint order.
+};
+
+struct StrokeIndexNode
+{
+    u64                 x;
+    u64                 y;
+    i32                 depth;
+    i64                 subtree_count;  // Strokes in this node and below it.
+    StrokeIndexNode*    children[4];
+
+    StrokeIndexEntry*   entries;  // In paint order.
+    i32                 count;
+    i32                 capacity;
 };
 
 struct StrokeList
 {
-    StrokeBucket    root;
-    i64             count;
-    Stroke*         operator[](i64 i);
+    StrokeBucket        root;
+    i64                 count;
+    Stroke*             operator[](i64 i);
 
-    Arena*          arena;
+    Arena*              arena;
+
+    StrokeIndexNode*    index;  // NULL until the first push.
+
+    // Changes whenever strokes are added or removed. Never repeats, even
+    // across lists, so it also tells lists apart.
+    u64                 version;
 };
 
 void strokelist_init_bucket(StrokeBucket* bucket);
@@ -39,6 +88,22 @@ Stroke pop(StrokeList* list);
 Stroke* peek(StrokeList* list);
 void reset(StrokeList* list);
 i64 count(StrokeList* list);
+// Grow or shrink to count elements. New elements are uninitialized, and bucket
+// bounds and the spatial index are left alone. Call strokelist_update_bounds
+// after filling them in.
+void resize(StrokeList* list, i64 count);
+void strokelist_update_bounds(StrokeList* list);
+
+// Set one bit in `mask` for each of the first `count` strokes of the bucket,
+// telling whether its bounding rect intersects `rect`. Uses AVX2 or SSE4.2
+// when the CPU has them.
+void strokelist_cull_bucket(StrokeBucket* bucket, i64 count, Rect rect, u64 mask[STROKELIST_MASK_WORDS]);
+
+// Append the strokes whose bounding rect intersects `rect` to `out`, in paint order.
+void strokelist_query(StrokeList* list, Rect rect, DArray<StrokeIndexEntry>* out);
+// Like strokelist_query, but set each stroke's bit in `masks`, which holds
+// STROKELIST_MASK_WORDS words per bucket, instead of sorting.
+void strokelist_mark(StrokeList* list, Rect rect, u64* masks);
 
 struct StrokeIterator;
 
@@ -3,7 +3,8 @@
 
 uniform sampler2D u_canvas;
 uniform vec2 u_screen_size;
-uniform int u_kernel_size;
+uniform int u_kernel_size;  // Number of samples.
+uniform int u_step;         // Pixels between samples.
 uniform int u_direction;
 
 
@@ -11,25 +12,18 @@ void
 main()
 {
     vec2 screen_point = vec2(gl_FragCoord.x, gl_FragCoord.y);
-    // LINEAR
-    vec2 half_pixel_size = 1 / (2*u_screen_size);
-    int n_samples = 0;
+    vec2 direction = (u_direction == 0) ? vec2(0.0, 1.0) : vec2(1.0, 0.0);
     out_color = vec4(0);
     if ( u_kernel_size > 1 ) {
-        if ( u_direction == 0 ) {
-            for ( int y = -u_kernel_size+1; y < u_kernel_size; y+=2 ) {
-                vec2 coord = (screen_point+vec2(0.0,y-0.5)) / u_screen_size;
-                vec4 sample = texture(u_canvas, coord);
-                out_color += sample * sample;
-            }
-        } else {
-            for ( int x = -u_kernel_size+1; x < u_kernel_size; x+=2 ) {
-                vec2 coord = (screen_point+vec2(x-0.5,0.0)) / u_screen_size;
-                vec4 sample = texture(u_canvas, coord);
-                out_color += sample * sample;
-            }
+        // Samples are centered on the pixel. Each one falls between two
+        // pixels, and LINEAR filtering averages them.
+        float first = -0.5*float((u_kernel_size - 1)*u_step) - 0.5;
+        for ( int i = 0; i < u_kernel_size; ++i ) {
+            vec2 coord = (screen_point + direction*(first + float(i*u_step))) / u_screen_size;
+            vec4 sample = texture(u_canvas, coord);
+            out_color += sample * sample;
         }
-        out_color /= u_kernel_size;
+        out_color /= float(u_kernel_size);
         out_color = sqrt(out_color);
     } else {
         out_color = texture(u_canvas, screen_point / u_screen_size);
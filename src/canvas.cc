@@ -2,6 +2,7 @@
 // License: https://github.com/serge-rgb/milton#license
 
 #include "canvas.h"
+#include "jobs.h"
 #include "utils.h"
 
 v2l
@@ -170,8 +171,57 @@ canvas_rect_to_raster_rect(CanvasView* view, Rect canvas_rect)
 }
 
 
+struct CountClippedJobs
+{
+    Layer*  root;
+    i64     num_jobs;
+    i64*    counts;  // One per job.
+};
+
+// Job i counts the buckets whose index is i modulo the number of jobs.
+static void
+count_clipped_job(void* data, i64 job_index)
+{
+    CountClippedJobs* jobs = (CountClippedJobs*)data;
+    i64 count = 0;
+    for ( Layer* l = jobs->root; l != NULL; l = l->next ) {
+        i64 first = 0;
+        for ( StrokeBucket* bucket = &l->strokes.root;
+              bucket && first < l->strokes.count;
+              bucket = bucket->next, first += STROKELIST_BUCKET_COUNT ) {
+            if ( (first / STROKELIST_BUCKET_COUNT) % jobs->num_jobs == job_index ) {
+                i64 n = min(l->strokes.count - first, (i64)STROKELIST_BUCKET_COUNT);
+                for ( i64 i = 0; i < n; ++i ) {
+                    if ( gpu_stroke_is_cooked(&bucket->data[i]) ) {
+                        ++count;
+                    }
+                }
+            }
+        }
+    }
+    jobs->counts[job_index] = count;
+}
+
 namespace layer
 {
+    i64
+    count_clipped_strokes(Layer* root, i32 num_workers)
+    {
+        CountClippedJobs jobs = {};
+        jobs.root = root;
+        jobs.num_jobs = max(num_workers, 1);
+        jobs.counts = (i64*)mlt_calloc((size_t)jobs.num_jobs, sizeof(i64), "Clip");
+
+        jobs_run(count_clipped_job, &jobs, jobs.num_jobs);
+
+        i64 count = 0;
+        for ( i64 i = 0; i < jobs.num_jobs; ++i ) {
+            count += jobs.counts[i];
+        }
+        mlt_free(jobs.counts, "Clip");
+        return count;
+    }
+
     i64
     count_strokes(Layer* root)
     {
@@ -2,9 +2,6 @@
 // License: https://github.com/serge-rgb/milton#license
 
 
-// Per-stroke uniforms
-uniform vec4 u_brush_color;
-
 // CanvasView elements:
 uniform mat2 u_rotation;
 uniform mat2 u_rotation_inverse;
@@ -12,7 +9,6 @@ uniform ivec2 u_pan_center;
 uniform ivec2 u_zoom_center;
 uniform vec2  u_screen_size;
 uniform int   u_scale;
-uniform int   u_radius;
 
 vec2
 canvas_to_raster_gl(vec2 cp)
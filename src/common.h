@@ -46,6 +46,14 @@ typedef i32         b32;
     #endif
 #endif // ALIGN
 
+// Compile a function for an instruction set the build doesn't target by
+// default. Only call it after checking that the CPU supports it.
+#if defined(_MSC_VER)
+    #define MLT_TARGET(isa)
+#else
+    #define MLT_TARGET(isa) __attribute__(( target (isa) ))
+#endif
+
 // Assert implementation
 
 #if defined(mlt_assert)
@@ -25,6 +25,7 @@
     X(void,     glBindFramebufferEXT,     GLenum target, GLuint framebuffer)                      \
     X(void,     glBindTexture,            GLenum target, GLuint text) \
     X(void,     glBufferData,             GLenum target, GLsizeiptr size, const GLvoid *data, GLenum usage) \
+    X(void,     glBufferSubData,          GLenum target, GLintptr offset, GLsizeiptr size, const GLvoid *data) \
     X(void,     glCompileShader,          GLuint shader)                                          \
     X(void,     glEnable, GLenum cap )\
     X(void,     glFramebufferTexture2DEXT, GLenum target, GLenum attachment, GLenum textarget, GLuint texture, GLint level) \
@@ -37,6 +38,8 @@
     X(void,     glGetIntegerv, GLenum pname, GLint *params )\
     X(void,     glGetProgramInfoLog,      GLuint program, GLsizei bufSize, GLsizei *length, GLchar *infoLog) \
     X(void,     glGetProgramiv,           GLuint program, GLenum pname, GLint* params)            \
+    X(void,     glGetActiveAttrib,        GLuint program, GLuint index, GLsizei bufSize, GLsizei* length, GLint* size, GLenum* type, GLchar* name) \
+    X(void,     glGetActiveUniform,       GLuint program, GLuint index, GLsizei bufSize, GLsizei* length, GLint* size, GLenum* type, GLchar* name) \
     X(void,     glGetShaderInfoLog,       GLuint shader, GLsizei bufSize, GLsizei* length, GLchar* source) \
     X(void,     glGetShaderiv,            GLuint shader, GLenum pname, GLint* params)             \
     X(void,     glLinkProgram,            GLuint program)                                         \
@@ -78,7 +81,10 @@
     X(void,     glDisable,                GLenum cap) \
     X(void,     glDrawArrays, GLenum mode, GLint first, GLsizei count)\
     X(void,     glDrawElements,           GLenum mode, GLsizei count, GLenum type, const void *indices)\
+    X(void,     glDrawArraysInstancedARB, GLenum mode, GLint first, GLsizei count, GLsizei primcount)\
+    X(void,     glMultiDrawElements,      GLenum mode, const GLsizei *count, GLenum type, const void *const *indices, GLsizei drawcount)\
     X(void,     glEnableVertexAttribArray, GLuint index)                                          \
+    X(void,     glVertexAttribDivisorARB, GLuint index, GLuint divisor)\
     X(void,     glPixelStorei,            GLenum pname, GLint param)\
     X(void,     glReadPixels,             GLint x, GLint y, GLsizei width, GLsizei height, GLenum format, GLenum type, void *pixels)\
     X(void,     glScissor,                GLint x, GLint y, GLsizei width, GLsizei height) \
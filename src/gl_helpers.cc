@@ -19,6 +19,50 @@
 // Global variable that keeps track of Milton's GL configuration. See GLHelperFlags.
 static int g_gl_helper_flags;
 
+// Program reflection.
+//
+// link_program records the locations of the active uniforms and attributes
+// of each program, so the helpers below don't ask the driver for them. The
+// last value set on each uniform is kept, and setting the same value again
+// does nothing.
+
+#define MAX_PROGRAMS            32
+#define MAX_PROGRAM_UNIFORMS    32
+#define MAX_PROGRAM_ATTRIBUTES  16
+#define MAX_REFLECTED_NAME_LEN  48
+#define MAX_SHADOWED_BYTES      16  // Enough for a vec4 or a mat2.
+
+struct ReflectedUniform
+{
+    char    name[MAX_REFLECTED_NAME_LEN];
+    GLint   location;
+    i32     value_size;  // 0 when the value is not known.
+    u8      value[MAX_SHADOWED_BYTES];
+};
+
+struct ReflectedAttribute
+{
+    char    name[MAX_REFLECTED_NAME_LEN];
+    GLint   location;
+};
+
+struct ReflectedProgram
+{
+    GLuint              program;
+    i32                 num_uniforms;
+    ReflectedUniform    uniforms[MAX_PROGRAM_UNIFORMS];
+    i32                 num_attributes;
+    ReflectedAttribute  attributes[MAX_PROGRAM_ATTRIBUTES];
+};
+
+static ReflectedProgram g_programs[MAX_PROGRAMS];
+static i32 g_num_programs;
+
+// Program in use, as set by gl::use_program.
+static GLuint g_current_program;
+
+static GLHelperStats g_gl_stats;
+
 namespace gl {
 
 // Static helpers
@@ -99,20 +143,33 @@ load ()
     bool ok = true;
     // Extension checking.
 
+    // Instanced strokes need both of these.
+    bool instanced_arrays = false;
+    bool draw_instanced = false;
+    auto check_extension = [&instanced_arrays, &draw_instanced](const char* ext) {
 #if MULTISAMPLING_ENABLED
+        if ( strcmp(ext, "GL_ARB_sample_shading") == 0 ) {
+            gl::set_flags(GLHelperFlags_SAMPLE_SHADING);
+        }
+        if ( strcmp(ext, "GL_ARB_texture_multisample") == 0 ) {
+            gl::set_flags(GLHelperFlags_TEXTURE_MULTISAMPLE);
+        }
+#endif
+        if ( strcmp(ext, "GL_ARB_instanced_arrays") == 0 ) {
+            instanced_arrays = true;
+        }
+        if ( strcmp(ext, "GL_ARB_draw_instanced") == 0 ) {
+            draw_instanced = true;
+        }
+    };
+
     i64 num_extensions = 0;
     glGetIntegerv(GL_NUM_EXTENSIONS, (GLint*)&num_extensions);
 
     if ( num_extensions > 0 ) {
         for ( i64 extension_i = 0; extension_i < num_extensions; ++extension_i ) {
             char* extension_string = (char*)glGetStringi(GL_EXTENSIONS, (GLuint)extension_i);
-
-                if ( strcmp(extension_string, "GL_ARB_sample_shading") == 0 ) {
-                    gl::set_flags(GLHelperFlags_SAMPLE_SHADING);
-                }
-                if ( strcmp(extension_string, "GL_ARB_texture_multisample") == 0 ) {
-                    gl::set_flags(GLHelperFlags_TEXTURE_MULTISAMPLE);
-                }
+            check_extension(extension_string);
         }
     }
     // glGetStringi probably does not handle GL_EXTENSIONS
@@ -130,12 +187,7 @@ load ()
                 if ( len < MAX_EXTENSION_LEN ) {
                     memcpy((void*)ext, (void*)begin, len);
                     ext[len]='\0';
-                        if ( strcmp(ext, "GL_ARB_sample_shading") == 0 ) {
-                            gl::set_flags(GLHelperFlags_SAMPLE_SHADING);
-                        }
-                        if ( strcmp(ext, "GL_ARB_texture_multisample") == 0 ) {
-                            gl::set_flags(GLHelperFlags_TEXTURE_MULTISAMPLE);
-                        }
+                    check_extension(ext);
                     begin = end+1;
                 }
                 else {
@@ -144,7 +196,11 @@ load ()
             }
         }
     }
-#endif
+
+    if ( instanced_arrays && draw_instanced &&
+         glVertexAttribDivisorARB && glDrawArraysInstancedARB ) {
+        gl::set_flags(GLHelperFlags_INSTANCED_ARRAYS);
+    }
 
 #if defined(_WIN32)
 #pragma warning(push, 0)
@@ -245,6 +301,70 @@ compile_shader (const char* in_src, GLuint type, char* config, char* variation_c
 #define glUseProgramObjectARB glUseProgram
 #endif
 
+static ReflectedProgram*
+find_program(GLuint program)
+{
+    for ( i32 i = 0; i < g_num_programs; ++i ) {
+        if ( g_programs[i].program == program ) {
+            return &g_programs[i];
+        }
+    }
+    return NULL;
+}
+
+// Uniform arrays are reported as "name[0]".
+static void
+copy_reflected_name(char* dst, char* src)
+{
+    strncpy(dst, src, MAX_REFLECTED_NAME_LEN - 1);
+    dst[MAX_REFLECTED_NAME_LEN - 1] = '\0';
+    char* bracket = strchr(dst, '[');
+    if ( bracket ) {
+        *bracket = '\0';
+    }
+}
+
+static void
+reflect_program(GLuint program)
+{
+    ReflectedProgram* p = find_program(program);
+    if ( p == NULL ) {
+        if ( g_num_programs == MAX_PROGRAMS ) {
+            milton_log("WARNING: Too many programs to reflect. Program %d will query the driver.\n", program);
+            return;
+        }
+        p = &g_programs[g_num_programs++];
+    }
+    *p = {};
+    p->program = program;
+
+    char name[MAX_REFLECTED_NAME_LEN];
+    GLint size;
+    GLenum type;
+
+    GLint num_uniforms = 0;
+    glGetProgramiv(program, GL_ACTIVE_UNIFORMS, &num_uniforms);
+    for ( GLint i = 0; i < num_uniforms && p->num_uniforms < MAX_PROGRAM_UNIFORMS; ++i ) {
+        GLsizei len = 0;
+        glGetActiveUniform(program, (GLuint)i, MAX_REFLECTED_NAME_LEN, &len, &size, &type, (GLchar*)name);
+        ReflectedUniform* u = &p->uniforms[p->num_uniforms++];
+        copy_reflected_name(u->name, name);
+        u->location = glGetUniformLocation(program, (GLchar*)u->name);
+    }
+    mlt_assert(num_uniforms <= MAX_PROGRAM_UNIFORMS);
+
+    GLint num_attributes = 0;
+    glGetProgramiv(program, GL_ACTIVE_ATTRIBUTES, &num_attributes);
+    for ( GLint i = 0; i < num_attributes && p->num_attributes < MAX_PROGRAM_ATTRIBUTES; ++i ) {
+        GLsizei len = 0;
+        glGetActiveAttrib(program, (GLuint)i, MAX_REFLECTED_NAME_LEN, &len, &size, &type, (GLchar*)name);
+        ReflectedAttribute* a = &p->attributes[p->num_attributes++];
+        copy_reflected_name(a->name, name);
+        a->location = glGetAttribLocation(program, (GLchar*)a->name);
+    }
+    mlt_assert(num_attributes <= MAX_PROGRAM_ATTRIBUTES);
+}
+
 void
 link_program (GLuint obj, GLuint shaders[], int64_t num_shaders)
 {
@@ -272,6 +392,8 @@ link_program (GLuint obj, GLuint shaders[], int64_t num_shaders)
         mlt_assert(!"program linking error");
     }
     glValidateProgram(obj);
+
+    reflect_program(obj);
 }
 #if defined(__MACH__)
 #undef glGetObjectParameterivARB
@@ -286,7 +408,7 @@ bool
 set_attribute_vec2(GLuint program, char* name, GLfloat* data, size_t data_sz)
 {
     bool ok = true;
-    GLint loc = glGetAttribLocation(program, (GLchar*)name);
+    GLint loc = attrib_location(program, name);
     ok = loc >= 0;
     if ( ok ) {
         glBufferData(GL_ARRAY_BUFFER, (GLsizeiptr)data_sz, data, GL_STATIC_DRAW);
@@ -298,166 +420,223 @@ set_attribute_vec2(GLuint program, char* name, GLfloat* data, size_t data_sz)
 void
 use_program(GLuint program)
 {
-    static GLuint cached_program = 0;
-    if (program != cached_program) {
+    if (program != g_current_program) {
         glUseProgram(program);
-        cached_program = program;
+        g_current_program = program;
+        g_gl_stats.program_switches += 1;
     }
 }
 
+static ReflectedUniform*
+find_uniform(ReflectedProgram* p, char* name)
+{
+    for ( i32 i = 0; i < p->num_uniforms; ++i ) {
+        if ( strcmp(p->uniforms[i].name, name) == 0 ) {
+            return &p->uniforms[i];
+        }
+    }
+    return NULL;
+}
+
+GLint
+attrib_location(GLuint program, char* name)
+{
+    GLint loc = -1;
+    ReflectedProgram* p = find_program(program);
+    if ( p ) {
+        for ( i32 i = 0; i < p->num_attributes; ++i ) {
+            if ( strcmp(p->attributes[i].name, name) == 0 ) {
+                loc = p->attributes[i].location;
+                break;
+            }
+        }
+    }
+    else {
+        loc = glGetAttribLocation(program, (GLchar*)name);
+        g_gl_stats.location_queries += 1;
+    }
+    return loc;
+}
+
+// Uniforms are set with their program in use. begin_set_uniform makes it
+// current when the value has to be set, and end_set_uniform puts back the
+// program that was current before.
+struct UniformWrite
+{
+    bool    ok;      // The program has the uniform.
+    bool    needed;  // The value is not the one the uniform already has.
+    GLint   location;
+    GLuint  last_program;
+};
+
+static UniformWrite
+begin_set_uniform(GLuint program, char* name, void* value, size_t value_size)
+{
+    UniformWrite w = {};
+    w.location = -1;
+    ReflectedProgram* p = find_program(program);
+    if ( p ) {
+        ReflectedUniform* u = find_uniform(p, name);
+        if ( u && u->location >= 0 ) {
+            w.location = u->location;
+            if ( value_size <= MAX_SHADOWED_BYTES ) {
+                if ( u->value_size == (i32)value_size && memcmp(u->value, value, value_size) == 0 ) {
+                    g_gl_stats.uniforms_skipped += 1;
+                    w.ok = true;
+                    return w;
+                }
+                memcpy(u->value, value, value_size);
+                u->value_size = (i32)value_size;
+            }
+            else {
+                u->value_size = 0;
+            }
+        }
+    }
+    else {
+        w.location = glGetUniformLocation(program, (GLchar*)name);
+        g_gl_stats.location_queries += 1;
+    }
+
+    if ( w.location >= 0 ) {
+        w.ok = true;
+        w.needed = true;
+        w.last_program = g_current_program;
+        use_program(program);
+        g_gl_stats.uniforms_set += 1;
+    }
+    return w;
+}
+
+static void
+end_set_uniform(UniformWrite* w)
+{
+    use_program(w->last_program);
+}
+
 bool
 set_uniform_vec4(GLuint program, char* name, size_t count, float* vals)
 {
-    GLint last_program; glGetIntegerv(GL_CURRENT_PROGRAM, &last_program);
-    use_program(program);
-    bool ok = true;
-    GLint loc = glGetUniformLocation(program, (GLchar*)name);
-    ok = loc >= 0;
-
-    if ( ok ) {
-        glUniform4fv(loc, (GLsizei)count, vals);
+    UniformWrite w = begin_set_uniform(program, name, vals, count*4*sizeof(float));
+    if ( w.needed ) {
+        glUniform4fv(w.location, (GLsizei)count, vals);
+        end_set_uniform(&w);
     }
-    use_program(last_program);
-    return ok;
+    return w.ok;
 }
 
 bool
 set_uniform_vec3i(GLuint program, char* name, size_t count, i32* vals)
 {
-    GLint last_program; glGetIntegerv(GL_CURRENT_PROGRAM, &last_program);
-    use_program(program);
-    bool ok = true;
-    GLint loc = glGetUniformLocation(program, (GLchar*)name);
-    ok = loc >= 0;
-
-    if ( ok ) {
-        glUniform3iv(loc, (GLsizei)count, vals);
+    UniformWrite w = begin_set_uniform(program, name, vals, count*3*sizeof(i32));
+    if ( w.needed ) {
+        glUniform3iv(w.location, (GLsizei)count, vals);
+        end_set_uniform(&w);
     }
-    use_program(last_program);
-    return ok;
+    return w.ok;
 }
 
 bool
 set_uniform_vec3(GLuint program, char* name, size_t count, float* vals)
 {
-    GLint last_program; glGetIntegerv(GL_CURRENT_PROGRAM, &last_program);
-    use_program(program);
-    bool ok = true;
-    GLint loc = glGetUniformLocation(program, (GLchar*)name);
-    ok = loc >= 0;
-
-    if ( ok ) {
-        glUniform3fv(loc, (GLsizei)count, vals);
+    UniformWrite w = begin_set_uniform(program, name, vals, count*3*sizeof(float));
+    if ( w.needed ) {
+        glUniform3fv(w.location, (GLsizei)count, vals);
+        end_set_uniform(&w);
     }
-    use_program(last_program);
-    return ok;
+    return w.ok;
 }
 
 bool
 set_uniform_vec2(GLuint program, char* name, size_t count, float* vals)
 {
-    GLint last_program; glGetIntegerv(GL_CURRENT_PROGRAM, &last_program);
-    use_program(program);
-    bool ok = true;
-    GLint loc = glGetUniformLocation(program, (GLchar*)name);
-    ok = loc >= 0;
-    if ( ok ) {
-        glUniform2fv(loc, (GLsizei)count, vals);
+    UniformWrite w = begin_set_uniform(program, name, vals, count*2*sizeof(float));
+    if ( w.needed ) {
+        glUniform2fv(w.location, (GLsizei)count, vals);
+        end_set_uniform(&w);
     }
-    use_program(last_program);
-    return ok;
+    return w.ok;
 }
 
 bool
 set_uniform_vec2(GLuint program, char* name, float x, float y)
 {
-    GLint last_program; glGetIntegerv(GL_CURRENT_PROGRAM, &last_program);
-    use_program(program);
-    bool ok = true;
-    GLint loc = glGetUniformLocation(program, (GLchar*)name);
-    ok = loc >= 0;
-    if ( ok ) {
-        glUniform2f(loc, x, y);
+    float vals[2] = { x, y };
+    UniformWrite w = begin_set_uniform(program, name, vals, sizeof(vals));
+    if ( w.needed ) {
+        glUniform2f(w.location, x, y);
+        end_set_uniform(&w);
     }
-    use_program(last_program);
-    return ok;
+    return w.ok;
 }
 
 bool
 set_uniform_vec2i(GLuint program, char* name, size_t count, i32* vals)
 {
-    GLint last_program; glGetIntegerv(GL_CURRENT_PROGRAM, &last_program);
-    use_program(program);
-    bool ok = true;
-    GLint loc = glGetUniformLocation(program, (GLchar*)name);
-    ok = loc >= 0;
-    if ( ok ) {
-        glUniform2iv(loc, (GLsizei)count, vals);
+    UniformWrite w = begin_set_uniform(program, name, vals, count*2*sizeof(i32));
+    if ( w.needed ) {
+        glUniform2iv(w.location, (GLsizei)count, vals);
+        end_set_uniform(&w);
     }
-    use_program(last_program);
-    return ok;
+    return w.ok;
 }
 
 bool
 set_uniform_f(GLuint program, char* name, float val)
 {
-    GLint last_program; glGetIntegerv(GL_CURRENT_PROGRAM, &last_program);
-    use_program(program);
-    bool ok = true;
-    GLint loc = glGetUniformLocation(program, (GLchar*)name);
-    ok = loc >= 0;
-    if ( ok ) {
-        glUniform1f(loc, val);
+    UniformWrite w = begin_set_uniform(program, name, &val, sizeof(val));
+    if ( w.needed ) {
+        glUniform1f(w.location, val);
+        end_set_uniform(&w);
     }
-    use_program(last_program);
-    return ok;
+    return w.ok;
 }
 
 bool
 set_uniform_i(GLuint program, char* name, i32 val)
 {
-    GLint last_program; glGetIntegerv(GL_CURRENT_PROGRAM, &last_program);
-    use_program(program);
-    bool ok = true;
-    GLint loc = glGetUniformLocation(program, (GLchar*)name);
-    ok = loc >= 0;
-    if ( ok ) {
-        glUniform1i(loc, val);
+    UniformWrite w = begin_set_uniform(program, name, &val, sizeof(val));
+    if ( w.needed ) {
+        glUniform1i(w.location, val);
+        end_set_uniform(&w);
     }
-    use_program(last_program);
-    return ok;
+    return w.ok;
 }
 
 bool
 set_uniform_vec2i(GLuint program, char* name, i32 x, i32 y)
 {
-    GLint last_program; glGetIntegerv(GL_CURRENT_PROGRAM, &last_program);
-    use_program(program);
-    bool ok = true;
-    GLint loc = glGetUniformLocation(program, (GLchar*)name);
-    ok = loc >= 0;
-    if ( ok ) {
-        glUniform2i(loc, x, y);
+    i32 vals[2] = { x, y };
+    UniformWrite w = begin_set_uniform(program, name, vals, sizeof(vals));
+    if ( w.needed ) {
+        glUniform2i(w.location, x, y);
+        end_set_uniform(&w);
     }
-    use_program(last_program);
-    return ok;
+    return w.ok;
 }
 
 bool
 set_uniform_mat2 (GLuint program, char* name, f32* vals)
 {
-    GLint last_program; glGetIntegerv(GL_CURRENT_PROGRAM, &last_program);
-    use_program(program);
-    bool ok = true;
-    GLint loc = glGetUniformLocation(program, (GLchar*)name);
-    ok = loc >= 0;
-    if ( ok ) {
-        glUniformMatrix2fv(loc, 1, /*transpose*/false, vals);
+    UniformWrite w = begin_set_uniform(program, name, vals, 4*sizeof(f32));
+    if ( w.needed ) {
+        glUniformMatrix2fv(w.location, 1, /*transpose*/false, vals);
+        end_set_uniform(&w);
     }
-    use_program(last_program);
-    return ok;
+    return w.ok;
 }
 
+GLHelperStats
+get_stats()
+{
+    return g_gl_stats;
+}
+
+void
+reset_stats()
+{
+    g_gl_stats = {};
+}
 
 GLuint
 new_color_texture(int w, int h)
@@ -613,7 +792,7 @@ resize_depth_stencil_texture(GLuint t, int w, int h)
 void
 vertex_attrib_v3f(GLuint program, char* name, GLuint vbo)
 {
-    GLint loc = glGetAttribLocation(program, name);
+    GLint loc = attrib_location(program, name);
     if (loc >= 0) {
         glBindBuffer(GL_ARRAY_BUFFER, vbo);
         glEnableVertexAttribArray((GLuint)loc);
@@ -623,10 +802,32 @@ vertex_attrib_v3f(GLuint program, char* name, GLuint vbo)
     }
 }
 
+void
+vertex_attrib_f(GLuint program, char* name, GLuint vbo, i32 components, i32 stride, size_t offset)
+{
+    GLint loc = attrib_location(program, name);
+    if (loc >= 0) {
+        glBindBuffer(GL_ARRAY_BUFFER, vbo);
+        glEnableVertexAttribArray((GLuint)loc);
+        glVertexAttribPointer(/*attrib location*/ (GLuint)loc,
+                              /*size*/ components, GL_FLOAT, /*normalize*/ GL_FALSE,
+                              /*stride*/ stride, /*ptr*/ (GLvoid*)offset);
+    }
+}
+
+void
+vertex_attrib_divisor(GLuint program, char* name, GLuint divisor)
+{
+    GLint loc = attrib_location(program, name);
+    if (loc >= 0) {
+        glVertexAttribDivisorARB((GLuint)loc, divisor);
+    }
+}
+
 void
 vertex_attrib_v2f(GLuint program, char* name, GLuint vbo)
 {
-    GLint loc = glGetAttribLocation(program, name);
+    GLint loc = attrib_location(program, name);
     if (loc >= 0) {
         glBindBuffer(GL_ARRAY_BUFFER, vbo);
         glEnableVertexAttribArray((GLuint)loc);
@@ -24,6 +24,16 @@ enum GLHelperFlags
 {
     GLHelperFlags_SAMPLE_SHADING        = 1<<0,
     GLHelperFlags_TEXTURE_MULTISAMPLE   = 1<<1,
+    GLHelperFlags_INSTANCED_ARRAYS      = 1<<2,  // glVertexAttribDivisorARB and glDrawArraysInstancedARB.
+};
+
+// Work done and avoided by the gl helpers. See gl::get_stats.
+struct GLHelperStats
+{
+    i64 uniforms_set;       // glUniform calls.
+    i64 uniforms_skipped;   // Uniforms that already had the value.
+    i64 program_switches;   // glUseProgram calls.
+    i64 location_queries;   // Locations asked to the driver, for programs not linked with link_program.
 };
 
 namespace gl {
@@ -36,6 +46,13 @@ GLuint  compile_shader (const char* src, GLuint type, char* config = "", char* v
 void    link_program (GLuint obj, GLuint shaders[], int64_t num_shaders);
 void    use_program(GLuint program);
 
+// Locations come from the reflection done by link_program.
+GLint   attrib_location(GLuint program, char* name);
+
+// Counts since the last reset_stats.
+GLHelperStats get_stats();
+void    reset_stats();
+
 
 bool    set_attribute_vec2 (GLuint program, char* name, GLfloat* data, size_t data_sz);
 bool    set_uniform_vec4 (GLuint program, char* name, size_t count, float* vals);
@@ -51,6 +68,10 @@ bool    set_uniform_vec2i (GLuint program, char* name, i32 x, i32 y);
 bool    set_uniform_mat2 (GLuint program, char* name, f32* vals);
 
 void    vertex_attrib_v3f(GLuint program, char* name);
+// Float attribute of interleaved vertices. stride and offset are in bytes.
+void    vertex_attrib_f(GLuint program, char* name, GLuint vbo, i32 components, i32 stride, size_t offset);
+// Needs GLHelperFlags_INSTANCED_ARRAYS.
+void    vertex_attrib_divisor(GLuint program, char* name, GLuint divisor);
 
 GLuint  new_color_texture (int w, int h);
 GLuint  new_depth_stencil_texture (int w, int h);
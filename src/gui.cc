@@ -7,6 +7,7 @@
 #include "localization.h"
 #include "color.h"
 #include "renderer.h"
+#include "gl_helpers.h"
 #include "milton.h"
 #include "persist.h"
 #include "platform.h"
@@ -815,6 +816,9 @@ milton_imgui_tick(MiltonInput* input, PlatformState* platform,  Milton* milton,
                     milton->settings->peek_out_increment = (peek_out_percent / 100.0f) * peek_range;
                 }
 
+                ImGui::SliderFloat(loc(TXT_render_budget_ms), &milton->settings->render_budget_ms, 1.0f, 100.0f, "%.0f");
+                ImGui::SliderInt(loc(TXT_stroke_memory_budget_mb), &milton->settings->stroke_memory_budget_mb, 64, 4096);
+
                 ImGui::Separator();
 
                 MiltonBindings* bs = &milton->settings->bindings;
@@ -897,11 +901,10 @@ milton_imgui_tick(MiltonInput* input, PlatformState* platform,  Milton* milton,
                 if ( exporter->scale <= 0 ) {
                     exporter->scale = 1;
                 }
-                float viewport_limits[2] = {};
-                gpu_get_viewport_limits(milton->renderer, viewport_limits);
-
-                while ( exporter->scale*raster_w > viewport_limits[0]
-                        || exporter->scale*raster_h > viewport_limits[1] ) {
+                // Exports are rendered in tiles, so the GPU viewport does not limit the scale.
+                while ( exporter->scale > 1
+                        && ( exporter->scale*raster_w > IMAGE_EXPORT_MAX_SIDE
+                             || exporter->scale*raster_h > IMAGE_EXPORT_MAX_SIDE ) ) {
                     --exporter->scale;
                 }
                 i32 max_scale = milton->view->scale / 2;
@@ -917,24 +920,11 @@ milton_imgui_tick(MiltonInput* input, PlatformState* platform,  Milton* milton,
                 bool transparent_background = radio_v == 1;
 
                 if ( ImGui::Button(loc(TXT_export_selection_to_image_DOTS)) ) {
-                    // Render to buffer
-                    int bpp = 4;  // bytes per pixel
-                    i32 w = raster_w * exporter->scale;
-                    i32 h = raster_h * exporter->scale;
-                    size_t size = (size_t)w * h * bpp;
-                    u8* buffer = (u8*)mlt_calloc(1, size, "Bitmap");
-                    if ( buffer ) {
-                        opened = false;
-                        gpu_render_to_buffer(milton, buffer, exporter->scale,
-                                             x,y, raster_w, raster_h, transparent_background ? 0.0f : 1.0f);
-                        //milton_render_to_buffer(milton, buffer, x,y, raster_w, raster_h, exporter->scale);
-                        PATH_CHAR* fname = platform_save_dialog(FileKind_IMAGE);
-                        if ( fname ) {
-                            milton_save_buffer_to_file(fname, buffer, w, h);
-                        }
-                        mlt_free (buffer, "Bitmap");
-                    } else {
-                        platform_dialog(loc(TXT_MSG_memerr_did_not_write), loc(TXT_error));
+                    opened = false;
+                    PATH_CHAR* fname = platform_save_dialog(FileKind_IMAGE);
+                    if ( fname ) {
+                        milton_export_image(milton, fname, x, y, raster_w, raster_h, exporter->scale,
+                                            transparent_background ? 0.0f : 1.0f);
                     }
                 }
             }
@@ -1002,6 +992,26 @@ milton_imgui_tick(MiltonInput* input, PlatformState* platform,  Milton* milton,
                      gpu_get_num_clipped_strokes(milton->canvas->root_layer));
             ImGui::Text(msg);
 
+            ResidencyStats stroke_memory = gpu_get_stroke_memory_stats(milton->renderer);
+            snprintf(msg, array_count(msg),
+                     "Stroke memory: %d pages, %.1f / %d MB, %d evicted\n",
+                     (int)stroke_memory.resident_count,
+                     (double)stroke_memory.resident_bytes / (1<<20),
+                     (int)(stroke_memory.budget_bytes >> 20),
+                     (int)stroke_memory.evictions);
+            ImGui::Text(msg);
+
+            // Counted since the profiler was last drawn, which is once a frame.
+            GLHelperStats gl_stats = gl::get_stats();
+            gl::reset_stats();
+            snprintf(msg, array_count(msg),
+                     "GL uniforms: %d set, %d unchanged. %d program switches, %d location queries\n",
+                     (int)gl_stats.uniforms_set,
+                     (int)gl_stats.uniforms_skipped,
+                     (int)gl_stats.program_switches,
+                     (int)gl_stats.location_queries);
+            ImGui::Text(msg);
+
             float hist[] = { poll, update, raster, GL, system };
             ImGui::PlotHistogram("Graph",
                             (const float*)hist, array_count(hist));
@@ -0,0 +1,130 @@
+// Copyright (c) 2015 Sergio Gonzalez. All rights reserved.
+// License: https://github.com/serge-rgb/milton#license
+
+#include "jobs.h"
+
+#include "platform.h"
+
+#define JOBS_MAX_WORKERS 63
+
+struct JobBatch
+{
+    JobFunc*        func;
+    void*           data;
+    i64             num_jobs;
+    SDL_atomic_t    next;
+};
+
+struct JobPool
+{
+    SDL_Thread*     workers[JOBS_MAX_WORKERS];
+    i32             num_workers;
+
+    SDL_mutex*      batch_mutex;  // Held by jobs_run.
+    JobBatch*       batch;
+    SDL_sem*        wake;         // One post per worker that should join the batch.
+    SDL_sem*        finished;     // Posted by each of those workers when they are done with it.
+    b32             quit;
+};
+
+static JobPool g_jobs;
+
+static void
+jobs_work(JobBatch* batch)
+{
+    for ( ;; ) {
+        i64 i = SDL_AtomicAdd(&batch->next, 1);
+        if ( i >= batch->num_jobs ) {
+            break;
+        }
+        batch->func(batch->data, i);
+    }
+}
+
+static int
+jobs_worker_thread(void*)
+{
+    for ( ;; ) {
+        SDL_SemWait(g_jobs.wake);
+        if ( g_jobs.quit ) {
+            break;
+        }
+        jobs_work(g_jobs.batch);
+        SDL_SemPost(g_jobs.finished);
+    }
+    return 0;
+}
+
+void
+jobs_init()
+{
+    if ( g_jobs.batch_mutex == NULL ) {
+        g_jobs.batch_mutex = SDL_CreateMutex();
+        g_jobs.wake = SDL_CreateSemaphore(0);
+        g_jobs.finished = SDL_CreateSemaphore(0);
+
+        i32 num_workers = min(SDL_GetCPUCount() - 1, JOBS_MAX_WORKERS);
+        for ( i32 i = 0; i < num_workers; ++i ) {
+            SDL_Thread* thread = SDL_CreateThread(jobs_worker_thread, "Worker", NULL);
+            if ( thread ) {
+                g_jobs.workers[g_jobs.num_workers++] = thread;
+            }
+        }
+        milton_log("Started %d worker threads.\n", g_jobs.num_workers);
+    }
+}
+
+void
+jobs_deinit()
+{
+    if ( g_jobs.batch_mutex ) {
+        g_jobs.quit = true;
+        for ( i32 i = 0; i < g_jobs.num_workers; ++i ) {
+            SDL_SemPost(g_jobs.wake);
+        }
+        for ( i32 i = 0; i < g_jobs.num_workers; ++i ) {
+            SDL_WaitThread(g_jobs.workers[i], NULL);
+        }
+        SDL_DestroySemaphore(g_jobs.wake);
+        SDL_DestroySemaphore(g_jobs.finished);
+        SDL_DestroyMutex(g_jobs.batch_mutex);
+        g_jobs = {};
+    }
+}
+
+i32
+jobs_num_threads()
+{
+    return g_jobs.num_workers + 1;
+}
+
+void
+jobs_run(JobFunc* func, void* data, i64 num_jobs)
+{
+    JobBatch batch = {};
+    batch.func = func;
+    batch.data = data;
+    batch.num_jobs = num_jobs;
+
+    // Wake as many workers as there are jobs beyond our own.
+    i32 num_helpers = (i32)min((i64)g_jobs.num_workers, num_jobs - 1);
+    if ( num_helpers <= 0 ) {
+        jobs_work(&batch);
+    }
+    else {
+        SDL_LockMutex(g_jobs.batch_mutex);
+        g_jobs.batch = &batch;
+        for ( i32 i = 0; i < num_helpers; ++i ) {
+            SDL_SemPost(g_jobs.wake);
+        }
+
+        jobs_work(&batch);
+
+        // Workers touch the batch until they post. It lives on our stack.
+        for ( i32 i = 0; i < num_helpers; ++i ) {
+            SDL_SemWait(g_jobs.finished);
+        }
+        g_jobs.batch = NULL;
+        SDL_UnlockMutex(g_jobs.batch_mutex);
+    }
+}
@@ -0,0 +1,27 @@
+// Copyright (c) 2015 Sergio Gonzalez. All rights reserved.
+// License: https://github.com/serge-rgb/milton#license
+
+#pragma once
+
+#include "common.h"
+
+// Jobs
+//
+// A pool of worker threads, one per core. jobs_run splits work into indexed
+// jobs and returns when all of them are done. The calling thread works too,
+// so it is fine to call it when there are no workers.
+//
+// Only one batch runs at a time. Concurrent callers wait for their turn, so
+// jobs must not call jobs_run themselves.
+
+typedef void JobFunc(void* data, i64 job_index);
+
+// Spawns the workers. Called once at startup.
+void    jobs_init();
+void    jobs_deinit();
+
+// Number of threads that can work on a batch, including the caller.
+i32     jobs_num_threads();
+
+// Calls func(data, i) for every i in [0, num_jobs).
+void    jobs_run(JobFunc* func, void* data, i64 num_jobs);
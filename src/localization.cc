@@ -101,6 +101,8 @@ init_localization()
         EN(TXT_OPENBRACKET_default_canvas_CLOSE_BRACKET, "[Default canvas]");
         EN(TXT_could_not_delete_default_canvas, "Could not delete default canvas. Contents will be still there when you create a new canvas.");
         EN(TXT_peek_out_increment_percent, "Peek-out increment percentage");
+        EN(TXT_render_budget_ms, "Milliseconds per frame to load strokes");
+        EN(TXT_stroke_memory_budget_mb, "Megabytes of GPU memory for strokes");
         EN(TXT_opacity_pressure, "Use pressure for opacity");
         EN(TXT_soft_brush, "Soft brush");
         EN(TXT_minimum, "Minimum");
@@ -7,6 +7,7 @@
 #include "color.h"
 #include "canvas.h"
 #include "gui.h"
+#include "jobs.h"
 #include "renderer.h"
 #include "localization.h"
 #include "persist.h"
@@ -613,6 +614,8 @@ settings_init(MiltonSettings* s)
 {
     s->background_color = v3f{1,1,1};
     s->peek_out_increment = DEFAULT_PEEK_OUT_INCREMENT_LOG;
+    s->render_budget_ms = DEFAULT_RENDER_BUDGET_MS;
+    s->stroke_memory_budget_mb = DEFAULT_STROKE_MEMORY_BUDGET_MB;
 }
 
 int milton_save_thread(void* state_);  // forward
@@ -658,6 +661,9 @@ milton_init(Milton* milton, i32 width, i32 height, f32 ui_scale, PATH_CHAR* file
     milton->transform = arena_alloc_elem(&milton->root_arena, TransformMode);
 
     milton->persist->target_MB_per_sec = 0.2f;
+    milton->persist->compact_points = MILTON_SAVE_COMPACT_POINTS;
+
+    jobs_init();
 
     gui_init(&milton->root_arena, milton->gui, ui_scale);
     settings_init(milton->settings);
@@ -749,8 +755,12 @@ milton_init(Milton* milton, i32 width, i32 height, f32 ui_scale, PATH_CHAR* file
 
 #if MILTON_SAVE_ASYNC
     milton->save_mutex = SDL_CreateMutex();
+    milton->save_write_mutex = SDL_CreateMutex();
     milton->save_cond = SDL_CreateCond();
-    milton->save_thread = SDL_CreateThread(milton_save_thread, "Save thread", (void*)milton);
+    if ( !(init_flags & MiltonInit_FOR_TEST) ) {
+        // Tests save synchronously. Their Milton structs don't outlive the test.
+        milton->save_thread = SDL_CreateThread(milton_save_thread, "Save thread", (void*)milton);
+    }
 #endif
 
     milton->grid_rows = 4;
@@ -805,10 +815,30 @@ milton_reset_canvas(Milton* milton)
 {
     CanvasState* canvas = milton->canvas;
 
+#if MILTON_SAVE_ASYNC
+    // Saves share stroke points with the canvas. Wait for the one being
+    // written, and write the one that is waiting before the canvas goes away.
+    if ( milton->save_write_mutex ) {
+        SDL_LockMutex(milton->save_write_mutex);
+        SDL_LockMutex(milton->save_mutex);
+        SaveRequest request = milton->persist->save_request;
+        milton->persist->save_request = {};
+        if ( milton->save_flag != SaveEnum_KILL ) {
+            milton->save_flag = SaveEnum_WAITING;
+        }
+        SDL_UnlockMutex(milton->save_mutex);
+        milton_save_write(milton, &request);
+        milton_save_request_release(&request);
+    }
+#endif
+
     gpu_free_strokes(milton->renderer, milton->canvas);
     milton->persist->mlt_binary_version = MILTON_MINOR_VERSION;
     milton->persist->last_save_time = {};
 
+    // Pending journal entries point to the canvas arena, which is about to go away.
+    milton_journal_discard(milton);
+
     // Clear history
     release(&canvas->history);
     release(&canvas->redo_stack);
@@ -818,6 +848,18 @@ milton_reset_canvas(Milton* milton)
     arena_free(&canvas->arena);  // Note: This destroys the canvas
     milton->canvas = arena_bootstrap(CanvasState, arena, size);
 
+    if ( milton->persist->mlt_mapping ) {
+        platform_unmap_file(milton->persist->mlt_mapping, milton->persist->mlt_mapping_size);
+        milton->persist->mlt_mapping = NULL;
+        milton->persist->mlt_mapping_size = 0;
+    }
+
+#if MILTON_SAVE_ASYNC
+    if ( milton->save_write_mutex ) {
+        SDL_UnlockMutex(milton->save_write_mutex);
+    }
+#endif
+
     mlt_assert(milton->canvas->history.count == 0);
 }
 
@@ -914,11 +956,11 @@ milton_try_quit(Milton* milton)
 }
 
 void
-milton_save_postlude(Milton* milton)
+milton_save_postlude(Milton* milton, i64 num_strokes)
 {
     MiltonPersist* p = milton->persist;
     p->last_save_time = platform_get_walltime();
-    p->last_save_stroke_count = layer::count_strokes(milton->canvas->root_layer);
+    p->last_save_stroke_count = num_strokes;
 
     milton->flags &= ~MiltonStateFlags_LAST_SAVE_FAILED;
 }
@@ -927,8 +969,13 @@ milton_save_postlude(Milton* milton)
 void
 trigger_async_save(Milton* milton)
 {
+    // Capture here, so the save thread never looks at the canvas while we draw.
+    SaveRequest request = {};
+    milton_save_capture(milton, &request, /*full*/false);
+
     SDL_LockMutex(milton->save_mutex);
     {
+        milton_save_request_merge(&milton->persist->save_request, &request);
         milton->save_flag = SaveEnum_SAVE_REQUESTED;
     }
     SDL_UnlockMutex(milton->save_mutex);
@@ -986,7 +1033,29 @@ milton_save_thread(void* state_)
         if ( do_save ) {
             // Wait. Either one frame, or the time to stay below bandwidth.
             u64 begin_us = perf_counter();
-            u64 bytes_written = milton_save(milton);
+
+            SDL_LockMutex(milton->save_write_mutex);
+            SaveRequest request = {};
+            SDL_LockMutex(milton->save_mutex);
+            request = p->save_request;
+            p->save_request = {};
+            SDL_UnlockMutex(milton->save_mutex);
+
+            u64 bytes_written = milton_save_write(milton, &request);
+            b32 wants_snapshot = request.wants_snapshot;
+            milton_save_request_release(&request);
+            SDL_UnlockMutex(milton->save_write_mutex);
+
+            if ( wants_snapshot ) {
+                // The journal could not take the request. Only the main thread
+                // can capture the canvas.
+                SDL_LockMutex(milton->save_mutex);
+                if ( milton->save_flag == SaveEnum_WAITING ) {
+                    milton->save_flag = SaveEnum_SNAPSHOT_REQUESTED;
+                }
+                SDL_UnlockMutex(milton->save_mutex);
+            }
+
             u64 duration_us = perf_counter() - begin_us;
 
             // Sleep, if necessary.
@@ -1081,6 +1150,71 @@ milton_toggle_brush_smoothing(Milton* milton)
     }
 }
 
+Stroke*
+milton_commit_stroke(Milton* milton, Layer* layer, Stroke stroke)
+{
+    Stroke* pushed = layer::layer_push_stroke(layer, stroke);
+
+    HistoryElement h = { HistoryElement_STROKE_ADD, layer->id };
+    push(&milton->canvas->history, h);
+
+    clear_stroke_redo(milton);
+
+    return pushed;
+}
+
+b32
+milton_undo(Milton* milton)
+{
+    b32 undid = false;
+    // Grab undo elements. They might be from deleted layers, so discard dead results.
+    while ( milton->canvas->history.count > 0 ) {
+        HistoryElement h = pop(&milton->canvas->history);
+        Layer* l = layer::get_by_id(milton->canvas->root_layer, h.layer_id);
+        // found a thing to undo.
+        if ( l ) {
+            if ( l->strokes.count > 0 ) {
+                Stroke stroke = pop(&l->strokes);
+                push(&milton->canvas->stroke_graveyard, stroke);
+                push(&milton->canvas->redo_stack, h);
+
+                undid = true;
+            }
+            break;
+        }
+    }
+    return undid;
+}
+
+Stroke*
+milton_redo(Milton* milton)
+{
+    Stroke* redone = NULL;
+    if ( milton->canvas->redo_stack.count > 0 ) {
+        HistoryElement h = pop(&milton->canvas->redo_stack);
+        switch ( h.type ) {
+        case HistoryElement_STROKE_ADD: {
+            Layer* l = layer::get_by_id(milton->canvas->root_layer, h.layer_id);
+            if ( l && count(&milton->canvas->stroke_graveyard) > 0 ) {
+                Stroke stroke = pop(&milton->canvas->stroke_graveyard);
+                if ( stroke.layer_id == h.layer_id ) {
+                    redone = layer::layer_push_stroke(l, stroke);
+                    push(&milton->canvas->history, h);
+
+                    break;
+                }
+
+                stroke = pop(&milton->canvas->stroke_graveyard);  // Keep popping in case the graveyard has info from deleted layers
+            }
+
+        } break;
+        /* case HistoryElement_LAYER_DELETE: { */
+        /* } break; */
+        }
+    }
+    return redone;
+}
+
 static void
 milton_validate(Milton* milton)
 {
@@ -1350,11 +1484,13 @@ milton_update_and_render(Milton* milton, MiltonInput const* input)
     milton->flags &= ~MiltonStateFlags_FINISH_CURRENT_STROKE;
 
     milton->render_settings.do_full_redraw = false;
+    milton->render_settings.do_pan_copy = false;
 
     b32 brush_outline_should_draw = false;
     int render_flags = RenderBackendFlags_NONE;
 
     b32 draw_custom_rectangle = false;  // Custom rectangle used for new strokes, undo/redo.
+    Rect custom_rectangle = rect_without_size();  // In canvas space.
 
     b32 should_save =
             ((input->flags & MiltonInputFlags_OPEN_FILE)) ||
@@ -1417,7 +1553,7 @@ milton_update_and_render(Milton* milton, MiltonInput const* input)
         // If we are *not* zooming and we are panning, we can copy most of the
         // framebuffer
         if ( !(input->pan_delta == v2l{}) ) {
-            milton->render_settings.do_full_redraw = true;
+            milton->render_settings.do_pan_copy = true;
         }
     }
 
@@ -1428,48 +1564,19 @@ milton_update_and_render(Milton* milton, MiltonInput const* input)
 
     { // Undo / Redo
         if ( (input->flags & MiltonInputFlags_UNDO) ) {
-            // Grab undo elements. They might be from deleted layers, so discard dead results.
-            while ( milton->canvas->history.count > 0 ) {
-                HistoryElement h = pop(&milton->canvas->history);
-                Layer* l = layer::get_by_id(milton->canvas->root_layer, h.layer_id);
-                // found a thing to undo.
-                if ( l ) {
-                    if ( l->strokes.count > 0 ) {
-                        Stroke* stroke_ptr = peek(&l->strokes);
-                        Stroke stroke = pop(&l->strokes);
-                        push(&milton->canvas->stroke_graveyard, stroke);
-                        push(&milton->canvas->redo_stack, h);
-
-                        milton->render_settings.do_full_redraw = true;
-                    }
-                    break;
-                }
+            if ( milton_undo(milton) ) {
+                milton_journal_push(milton, JournalRecord_UNDO);
+                draw_custom_rectangle = true;
+                custom_rectangle = rect_union(custom_rectangle,
+                                              peek(&milton->canvas->stroke_graveyard)->bounding_rect);
             }
         }
         else if ( (input->flags & MiltonInputFlags_REDO) ) {
-            if ( milton->canvas->redo_stack.count > 0 ) {
-                HistoryElement h = pop(&milton->canvas->redo_stack);
-                switch ( h.type ) {
-                case HistoryElement_STROKE_ADD: {
-                    Layer* l = layer::get_by_id(milton->canvas->root_layer, h.layer_id);
-                    if ( l && count(&milton->canvas->stroke_graveyard) > 0 ) {
-                        Stroke stroke = pop(&milton->canvas->stroke_graveyard);
-                        if ( stroke.layer_id == h.layer_id ) {
-                            push(&l->strokes, stroke);
-                            push(&milton->canvas->history, h);
-
-                            milton->render_settings.do_full_redraw = true;
-
-                            break;
-                        }
-
-                        stroke = pop(&milton->canvas->stroke_graveyard);  // Keep popping in case the graveyard has info from deleted layers
-                    }
-
-                } break;
-                /* case HistoryElement_LAYER_DELETE: { */
-                /* } break; */
-                }
+            Stroke* stroke = milton_redo(milton);
+            if ( stroke ) {
+                milton_journal_push(milton, JournalRecord_STROKE_REDO, stroke);
+                draw_custom_rectangle = true;
+                custom_rectangle = rect_union(custom_rectangle, stroke->bounding_rect);
             }
         }
     }
@@ -1625,19 +1732,17 @@ milton_update_and_render(Milton* milton, MiltonInput const* input)
 
                 mlt_assert(new_stroke.num_points > 0);
                 mlt_assert(new_stroke.num_points <= STROKE_MAX_POINTS);
-                auto* stroke = layer::layer_push_stroke(milton->canvas->working_layer, new_stroke);
+                auto* stroke = milton_commit_stroke(milton, milton->canvas->working_layer, new_stroke);
+                milton_journal_push(milton, JournalRecord_STROKE_ADD, stroke);
 
                 // Invalidate working stroke render element
 
-                HistoryElement h = { HistoryElement_STROKE_ADD, milton->canvas->working_layer->id };
-                push(&milton->canvas->history, h);
-
                 reset_working_stroke(milton);
 
-                clear_stroke_redo(milton);
-
-                // Make sure we show blurred layers when finishing a stroke.
-                milton->render_settings.do_full_redraw = true;
+                // Redraw the stroke in its layer. With blurred layers, this
+                // becomes a full redraw below.
+                draw_custom_rectangle = true;
+                custom_rectangle = rect_union(custom_rectangle, stroke->bounding_rect);
             }
         }
     }
@@ -1732,7 +1837,7 @@ milton_update_and_render(Milton* milton, MiltonInput const* input)
 #if MILTON_SAVE_ASYNC
             trigger_async_save(milton);
 #else
-            milton_save(milton);
+            milton_journal_flush(milton);
 #endif
         }
         // We're about to close and the last save failed and the drawing changed.
@@ -1782,6 +1887,7 @@ milton_update_and_render(Milton* milton, MiltonInput const* input)
             // Release resources
             milton_reset_canvas(milton);
             gpu_release_data(milton->renderer);
+            jobs_deinit();
 
             debug_memory_dump_allocations();
         }
@@ -1789,8 +1895,12 @@ milton_update_and_render(Milton* milton, MiltonInput const* input)
 
 #if MILTON_SAVE_ASYNC
     SDL_LockMutex(milton->save_mutex);
+    b32 snapshot_requested = milton->save_flag == SaveEnum_SNAPSHOT_REQUESTED;
     SDL_CondSignal(milton->save_cond);
     SDL_UnlockMutex(milton->save_mutex);
+    if ( snapshot_requested ) {
+        trigger_async_save(milton);
+    }
 #endif
 
     // Update render resources after loading
@@ -1805,6 +1915,12 @@ milton_update_and_render(Milton* milton, MiltonInput const* input)
     i32 view_width = 0;
     i32 view_height = 0;
 
+    b32 has_working_stroke = milton->working_stroke.num_points > 0;
+
+    if (has_working_stroke) {
+        render_flags |= RenderBackendFlags_WORKING_STROKE;
+    }
+
     gpu_reset_render_flags(milton->renderer, render_flags);
 
     ClipFlags clip_flags = ClipFlags_JUST_CLIP;
@@ -1813,11 +1929,8 @@ milton_update_and_render(Milton* milton, MiltonInput const* input)
     milton->render_settings.do_full_redraw = true;
 #endif
 
-    b32 has_working_stroke = milton->working_stroke.num_points > 0;
-
-    if (has_working_stroke) {
-        b32 has_blur = false;
-
+    b32 has_blur = false;
+    {
         Layer* layer = milton->canvas->root_layer;
         while (layer) {
             if (layer->flags & LayerFlags_VISIBLE) {
@@ -1833,10 +1946,15 @@ milton_update_and_render(Milton* milton, MiltonInput const* input)
             if (has_blur) { break; }
             layer = layer->next;
         }
+    }
 
-        if (has_blur) {
-            milton->render_settings.do_full_redraw = true;
-        }
+    // Blurs reach outside of the area being redrawn. Blurred layers that
+    // haven't changed are drawn from their cache, so partial redraws only
+    // work when every blurred layer has one.
+    if (has_blur && (has_working_stroke || draw_custom_rectangle) &&
+        !gpu_blur_caches_valid(milton->renderer, milton->view,
+                               milton->canvas->root_layer, &milton->working_stroke)) {
+        milton->render_settings.do_full_redraw = true;
     }
 
     static u64 scale_of_last_full_redraw = 0;
@@ -1848,6 +1966,24 @@ milton_update_and_render(Milton* milton, MiltonInput const* input)
         milton->render_settings.do_full_redraw = true;
     }
 
+    if ( !gpu_render_is_complete(milton->renderer) ) {
+        // Keep filling in the strokes that didn't fit in the last frame.
+        milton->render_settings.do_full_redraw = true;
+    }
+
+    if ( draw_custom_rectangle ) {
+        gpu_tiles_invalidate(milton->renderer,
+                             rect_enlarge(canvas_to_raster_bounding_rect(milton->view, custom_rectangle), 2));
+    }
+
+    Rect pan_bounds = {};
+    if ( milton->render_settings.do_pan_copy && !milton->render_settings.do_full_redraw ) {
+        // Tiles don't have the new points of the working stroke.
+        if ( has_working_stroke || !gpu_tiles_pan(milton->renderer, milton->view, &pan_bounds) ) {
+            milton->render_settings.do_full_redraw = true;
+        }
+    }
+
     // Note: We flip the rectangles. GL is bottom-left by default.
     if ( milton->render_settings.do_full_redraw ) {
         view_width = milton->view->screen_size.w;
@@ -1858,9 +1994,40 @@ milton_update_and_render(Milton* milton, MiltonInput const* input)
         clip_flags = ClipFlags_UPDATE_GPU_DATA;
         scale_of_last_full_redraw = milton_render_scale(milton);
         angle_of_last_full_redraw = milton->view->angle;
+
+        gpu_tiles_reset(milton->renderer, milton->view, /*enabled*/!has_blur);
+    }
+    else if ( milton->render_settings.do_pan_copy ) {
+        // gpu_tiles_pan copied the tiles it had. Render the rest.
+        view_x      = pan_bounds.left;
+        view_y      = pan_bounds.top;
+        view_width  = pan_bounds.right - pan_bounds.left;
+        view_height = pan_bounds.bottom - pan_bounds.top;
     }
     else if (has_working_stroke) {
-        Rect bounds  = canvas_to_raster_bounding_rect(milton->view, milton->working_stroke.bounding_rect);
+        Stroke* ws = &milton->working_stroke;
+        RenderSettings* settings = &milton->render_settings;
+
+        // Pen and eraser strokes only ever append points, so everything up to
+        // the last rendered point is already on the canvas texture. Redraw the
+        // new points plus the one before them, so the joining segment is
+        // covered. Primitives move their points around and a brush change
+        // affects the whole stroke; those redraw the full stroke bounds, which
+        // also cover wherever the stroke was in previous frames.
+        Rect canvas_bounds;
+        if ( !mode_is_for_primitives(milton->current_mode) &&
+             settings->working_stroke_rendered_points > 0 &&
+             settings->working_stroke_rendered_points <= ws->num_points &&
+             memcmp(&settings->working_stroke_rendered_brush, &ws->brush, sizeof(Brush)) == 0 ) {
+            i32 last_n = ws->num_points - settings->working_stroke_rendered_points + 1;
+            canvas_bounds = bounding_box_for_last_n_points(ws, last_n);
+        } else {
+            canvas_bounds = ws->bounding_rect;
+        }
+        if ( draw_custom_rectangle ) {
+            canvas_bounds = rect_union(canvas_bounds, custom_rectangle);
+        }
+        Rect bounds  = canvas_to_raster_bounding_rect(milton->view, canvas_bounds);
 
         view_x           = bounds.left;
         view_y           = bounds.top;
@@ -1868,17 +2035,39 @@ milton_update_and_render(Milton* milton, MiltonInput const* input)
         view_width  = bounds.right - bounds.left;
         view_height = bounds.bottom - bounds.top;
     }
+    else if ( draw_custom_rectangle ) {
+        // Enlarge for antialiasing. Clip so that strokes that go far off
+        // screen don't overflow.
+        Rect bounds = rect_enlarge(canvas_to_raster_bounding_rect(milton->view, custom_rectangle), 2);
+        bounds = rect_intersect(bounds, rect_from_xywh(0, 0, milton->view->screen_size.w, milton->view->screen_size.h));
+
+        view_x      = bounds.left;
+        view_y      = bounds.top;
+        view_width  = bounds.right - bounds.left;
+        view_height = bounds.bottom - bounds.top;
+    }
 
     PROFILE_GRAPH_BEGIN(clipping);
 
     i64 render_scale = milton_render_scale(milton);
 
+    gpu_update_render_budget(milton->renderer, milton->settings->render_budget_ms);
+    gpu_update_stroke_memory_budget(milton->renderer, milton->settings->stroke_memory_budget_mb);
     gpu_clip_strokes_and_update(&milton->root_arena, milton->renderer, milton->view, render_scale,
                                 milton->canvas->root_layer, &milton->working_stroke,
-                                view_x, view_y, view_width, view_height, clip_flags);
+                                view_x, view_y, view_width, view_height,
+                                (ClipFlags)(clip_flags | ClipFlags_DRAW_ITERATIVELY));
     PROFILE_GRAPH_END(clipping);
 
     gpu_render(milton->renderer, view_x, view_y, view_width, view_height);
 
+    if ( !gpu_render_is_complete(milton->renderer) ) {
+        // Don't wait for input before the next frame.
+        milton->platform->force_next_frame = true;
+    }
+
+    milton->render_settings.working_stroke_rendered_points = milton->working_stroke.num_points;
+    milton->render_settings.working_stroke_rendered_brush = milton->working_stroke.brush;
+
     ARENA_VALIDATE(&milton->root_arena);
 }
@@ -103,6 +103,9 @@ struct MiltonSettings
     float peek_out_increment;
 
     MiltonBindings bindings;
+
+    float render_budget_ms;  // See DEFAULT_RENDER_BUDGET_MS
+    i32 stroke_memory_budget_mb;  // See DEFAULT_STROKE_MEMORY_BUDGET_MB
 };
 #pragma pack(pop)
 
@@ -140,6 +143,12 @@ struct PeekOut
 struct RenderSettings
 {
     b32 do_full_redraw;
+    b32 do_pan_copy;  // Panning. Copy what the tile cache has instead of redrawing.
+
+    // Working stroke as of the last frame. Partial redraws only need to cover
+    // the points that were appended since then.
+    i32   working_stroke_rendered_points;
+    Brush working_stroke_rendered_brush;
 };
 
 struct MiltonDragBrush
@@ -170,6 +179,7 @@ struct Milton
 
 #if MILTON_SAVE_ASYNC
     SDL_mutex*  save_mutex;
+    SDL_mutex*  save_write_mutex;  // Held while a save is written. See milton_reset_canvas
     i64         save_flag;   // See SaveEnum
     SDL_cond*   save_cond;
     SDL_Thread* save_thread;
@@ -287,6 +297,7 @@ enum SaveEnum
 {
     SaveEnum_WAITING,
     SaveEnum_SAVE_REQUESTED,
+    SaveEnum_SNAPSHOT_REQUESTED,  // Set by the save thread. The main thread captures a full snapshot.
     SaveEnum_KILL,
 };
 
@@ -303,8 +314,13 @@ void milton_set_default_canvas_file(Milton* milton);
 void milton_set_last_canvas_fname(PATH_CHAR* last_fname);
 void milton_unset_last_canvas_fname();
 
-void milton_save_postlude(Milton* milton);
+void milton_save_postlude(Milton* milton, i64 num_strokes);
+
 
+// Push a finished stroke and make it the newest step in the undo history.
+Stroke* milton_commit_stroke(Milton* milton, Layer* layer, Stroke stroke);
+b32     milton_undo(Milton* milton);  // Returns true if a stroke was undone.
+Stroke* milton_redo(Milton* milton);  // Returns the stroke that came back, or NULL.
 
 void milton_reset_canvas(Milton* milton);
 void milton_reset_canvas_and_set_default(Milton* milton);
@@ -4,8 +4,8 @@
 #pragma once
 
 #define MILTON_MAJOR_VERSION 1
-#define MILTON_MINOR_VERSION 9
-#define MILTON_MICRO_VERSION 1
+#define MILTON_MINOR_VERSION 11
+#define MILTON_MICRO_VERSION 0
 
 
 #if !defined(MILTON_DEBUG)  // Might be defined by cmake
@@ -52,6 +52,14 @@
 
 #define PEEK_OUT_SPEED 20  // ms / increment
 
+// Milliseconds per frame spent putting strokes on the GPU. When a zoom brings
+// more strokes into view than fit, the canvas fills in over several frames.
+#define DEFAULT_RENDER_BUDGET_MS 8.0f
+
+// Megabytes of GPU memory for stroke geometry. Strokes that haven't been on
+// screen for the longest time are freed first, a page of strokes at a time.
+#define DEFAULT_STROKE_MEMORY_BUDGET_MB 512
+
 // No support for system cursor on linux or macos for now
 #if defined(__linux__) || defined(__MACH__)
 #undef MILTON_HARDWARE_BRUSH_CURSOR
@@ -73,6 +81,15 @@
 // Spawn threads to save the canvas.
 #define MILTON_SAVE_ASYNC 1
 
+// Append committed changes to a journal next to the .mlt file instead of
+// re-writing the whole canvas every time.
+#define MILTON_SAVE_JOURNAL 1
+
+// Store stroke points as varint deltas and pressures as 16 bit integers. Files
+// get about 2.5x smaller, but loaded strokes can't point into the mapped file,
+// so loading is slower. Files are saved with raw points unless this is on.
+#define MILTON_SAVE_COMPACT_POINTS 0
+
 // NOTE: Multisampling is no longer supported in Milton. This define is left
 // in because there is some helper code which I would prefer not to delete.
 #define MULTISAMPLING_ENABLED 0
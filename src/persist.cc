@@ -3,10 +3,9 @@
 
 #include "persist.h"
 
-#include <stb_image_write.h>
-
 #include "common.h"
 #include "gui.h"
+#include "jobs.h"
 #include "memory.h"
 #include "milton.h"
 #include "platform.h"
@@ -14,6 +13,11 @@
 
 
 #define MILTON_MAGIC_NUMBER 0X11DECAF3
+#define MILTON_JOURNAL_MAGIC_NUMBER 0X11DECAF4
+
+// Re-write the .mlt snapshot when the journal grows past both of these.
+#define MILTON_JOURNAL_COMPACT_MIN_BYTES (4 * 1024 * 1024)
+#define MILTON_JOURNAL_COMPACT_RATIO     4  // Fraction of the snapshot size.
 
 static u64 g_bytes_written = 0;
 
@@ -31,8 +35,54 @@ struct PersistStrokePoint
     v2l point;
     f32 pressure;
 };
+
+// MLT v10 and later start with a table of contents. Each entry points to a
+// section of the file, so that readers can seek directly to a given layer.
+enum MltSectionType
+{
+    MltSection_CANVAS,   // View, number of layers and layer guid.
+    MltSection_LAYER,    // One per layer. Name, flags, strokes, effects and alpha.
+    MltSection_PICKER,   // Picker color and color buttons.
+    MltSection_BRUSHES,
+    MltSection_HISTORY,
+
+    MltSection_COUNT,
+};
+
+// MLT v11 and later have a u32 with these flags right after the version.
+enum MltFileFlags
+{
+    MltFileFlags_COMPACT_POINTS = 1<<0,  // Varint point deltas and 16 bit pressures. See encode_points.
+};
+
+struct MltSection
+{
+    u32     type;          // MltSectionType
+    i32     layer_id;      // MltSection_LAYER
+    u64     offset;        // From the start of the file.
+    u64     size;
+    i64     num_strokes;   // MltSection_LAYER
+    Rect    bounds;        // MltSection_LAYER. Union of its strokes, in canvas space.
+};
+
+struct JournalHeader
+{
+    u32 magic;
+    u32 version;
+    u64 snapshot_bytes;  // Size of the .mlt file this journal applies to.
+};
+
+struct JournalRecordHeader
+{
+    u32 type;  // JournalRecordType
+    u32 size;  // Bytes following this header.
+};
 #pragma pack(pop)
 
+static b32  journal_replay(Milton* milton, u64 snapshot_bytes);
+static void journal_reset(Milton* milton, SaveRequest* request, u64 snapshot_bytes);
+static void journal_set_needs_snapshot(Milton* milton);
+
 static b32
 fread_checked(void* dst, size_t sz, size_t count, FILE* fd)
 {
@@ -46,6 +96,42 @@ fread_checked(void* dst, size_t sz, size_t count, FILE* fd)
     return ok;
 }
 
+// Bounds-checked cursor over a file that was read or mapped into memory.
+// Reads past the end fail, and so does every read after that.
+struct MltReader
+{
+    u8*     data;
+    u64     size;
+    u64     pos;
+    b32     ok;
+};
+
+static b32
+read_checked(MltReader* r, void* dst, size_t sz, size_t count)
+{
+    u64 bytes = (u64)sz * (u64)count;
+    if ( r->ok && bytes <= r->size - r->pos ) {
+        memcpy(dst, r->data + r->pos, (size_t)bytes);
+        r->pos += bytes;
+    }
+    else {
+        r->ok = false;
+    }
+    return r->ok;
+}
+
+static b32
+read_skip(MltReader* r, u64 bytes)
+{
+    if ( r->ok && bytes <= r->size - r->pos ) {
+        r->pos += bytes;
+    }
+    else {
+        r->ok = false;
+    }
+    return r->ok;
+}
+
 void
 milton_unset_last_canvas_fname()
 {
@@ -56,23 +142,462 @@ milton_unset_last_canvas_fname()
 }
 
 static b32
-read_brushes(Brush* brushes, i32 num_brushes, FILE* fd)
+seek_checked(FILE* fd, u64 offset)
+{
+#if defined(_WIN32)
+    b32 ok = _fseeki64(fd, (__int64)offset, SEEK_SET) == 0;
+#else
+    b32 ok = fseeko(fd, (off_t)offset, SEEK_SET) == 0;
+#endif
+    return ok;
+}
+
+static b32
+tell_checked(FILE* fd, u64* offset)
+{
+#if defined(_WIN32)
+    __int64 pos = _ftelli64(fd);
+#else
+    off_t pos = ftello(fd);
+#endif
+    b32 ok = pos >= 0;
+    if ( ok ) {
+        *offset = (u64)pos;
+    }
+    return ok;
+}
+
+// Map the file, or read it with a single fread when it can't be mapped.
+static b32
+read_whole_file(PATH_CHAR* fname, MltReader* r, b32* mapped)
+{
+    u64 size = 0;
+    u8* data = (u8*)platform_map_file(fname, &size);
+    *mapped = data != NULL;
+
+    if ( !data ) {
+        FILE* fd = platform_fopen(fname, TO_PATH_STR("rb"));
+        if ( fd ) {
+            if ( fseek(fd, 0, SEEK_END) == 0 && tell_checked(fd, &size) && size > 0 && seek_checked(fd, 0) ) {
+                data = (u8*)mlt_calloc((size_t)size, 1, "Persist");
+                if ( !fread_checked(data, (size_t)size, 1, fd) ) {
+                    mlt_free(data, "Persist");
+                    data = NULL;
+                }
+            }
+            fclose(fd);
+        }
+    }
+
+    *r = {};
+    r->data = data;
+    r->size = data ? size : 0;
+    r->ok = data != NULL;
+
+    return r->ok;
+}
+
+// Move the reader to the index-th section of the given type.
+static b32
+seek_section(MltReader* r, MltSection* sections, i32 num_sections, u32 type, i32 index)
+{
+    b32 ok = false;
+    for ( i32 i = 0; i < num_sections; ++i ) {
+        if ( sections[i].type == type && index-- == 0 ) {
+            ok = sections[i].offset <= r->size;
+            if ( ok ) {
+                r->pos = sections[i].offset;
+            }
+            break;
+        }
+    }
+    return ok;
+}
+
+// MLT 10 aligns the points of each stroke to 8 bytes, with the pressures right
+// after them. When the file is mapped, the stroke points into the mapping
+// instead of copying to the arena.
+static b32
+read_aligned_points(MltReader* r, b32 in_place, Arena* arena, Stroke* stroke)
+{
+    u64 points_offset = (r->pos + 7) & ~(u64)7;
+    u64 points_size = sizeof(v2l) * (u64)stroke->num_points;
+
+    b32 ok = points_offset <= r->size;
+    if ( ok ) {
+        r->pos = points_offset;
+        if ( in_place ) {
+            stroke->points = (v2l*)(r->data + r->pos);
+            ok = read_skip(r, points_size);
+            stroke->pressures = (f32*)(r->data + r->pos);
+            ok = ok && read_skip(r, sizeof(f32) * (u64)stroke->num_points);
+        }
+        else {
+            stroke->points = arena_alloc_array(arena, stroke->num_points, v2l);
+            stroke->pressures = arena_alloc_array(arena, stroke->num_points, f32);
+            ok = read_checked(r, stroke->points, sizeof(v2l), (size_t)stroke->num_points) &&
+                 read_checked(r, stroke->pressures, sizeof(f32), (size_t)stroke->num_points);
+        }
+    }
+#if STROKE_DEBUG_VIZ
+    stroke->debug_flags = arena_alloc_array(arena, stroke->num_points, int);
+#endif
+    return ok;
+}
+
+// Compact points. Each point is stored as its difference from the previous
+// point, as two zig-zag LEB128 varints. Pressures are 16 bit fixed point.
+#define VARINT_MAX_BYTES        10
+#define COMPACT_POINT_MAX_BYTES (2 * VARINT_MAX_BYTES)
+
+static u64
+zigzag_encode(i64 value)
+{
+    return ((u64)value << 1) ^ (u64)(value >> 63);
+}
+
+static i64
+zigzag_decode(u64 value)
+{
+    return (i64)(value >> 1) ^ -(i64)(value & 1);
+}
+
+static u8*
+varint_encode(u8* dst, u64 value)
+{
+    while ( value >= 0x80 ) {
+        *dst++ = (u8)(value | 0x80);
+        value >>= 7;
+    }
+    *dst++ = (u8)value;
+    return dst;
+}
+
+// Returns a pointer past the varint, or NULL when it is malformed.
+static u8*
+varint_decode(u8* src, u8* end, u64* out)
+{
+    u8* result = NULL;
+    if ( src < end && *src < 0x80 ) {
+        *out = *src;
+        result = src + 1;
+    }
+    else {
+        u64 value = 0;
+        u8* limit = (end - src > VARINT_MAX_BYTES) ? src + VARINT_MAX_BYTES : end;
+        for ( int shift = 0; src < limit; shift += 7 ) {
+            u8 byte = *src++;
+            value |= (u64)(byte & 0x7f) << shift;
+            if ( byte < 0x80 ) {
+                *out = value;
+                result = src;
+                break;
+            }
+        }
+    }
+    return result;
+}
+
+// dst needs room for COMPACT_POINT_MAX_BYTES per point. Returns the number of
+// bytes written.
+static u64
+encode_points(v2l* points, i32 num_points, u8* dst)
+{
+    u8* cursor = dst;
+    v2l prev = {};
+    for ( i32 i = 0; i < num_points; ++i ) {
+        // Differences wrap around, so that any pair of i64 can be encoded.
+        cursor = varint_encode(cursor, zigzag_encode((i64)((u64)points[i].x - (u64)prev.x)));
+        cursor = varint_encode(cursor, zigzag_encode((i64)((u64)points[i].y - (u64)prev.y)));
+        prev = points[i];
+    }
+    return (u64)(cursor - dst);
+}
+
+// Doesn't check bounds. There must be VARINT_MAX_BYTES left to read.
+static u8*
+varint_decode_unchecked(u8* src, u64* out)
+{
+    u64 byte = src[0];
+    u64 value = byte & 0x7f;
+    if ( byte < 0x80 ) {
+        *out = value;
+        return src + 1;
+    }
+    byte = src[1];
+    value |= (byte & 0x7f) << 7;
+    if ( byte < 0x80 ) {
+        *out = value;
+        return src + 2;
+    }
+    for ( int i = 2; i < VARINT_MAX_BYTES; ++i ) {
+        byte = src[i];
+        value |= (byte & 0x7f) << (7 * i);
+        if ( byte < 0x80 ) {
+            *out = value;
+            return src + i + 1;
+        }
+    }
+    return NULL;
+}
+
+static b32
+decode_points(u8* src, u64 size, v2l* points, i32 num_points)
+{
+    u8* end = src + size;
+    u64 x = 0;
+    u64 y = 0;
+    i32 i = 0;
+    // Most of the stroke: no bounds checks.
+    while ( src && i < num_points && end - src >= COMPACT_POINT_MAX_BYTES ) {
+        u64 dx = 0;
+        u64 dy = 0;
+        src = varint_decode_unchecked(src, &dx);
+        if ( src ) {
+            src = varint_decode_unchecked(src, &dy);
+        }
+        x += (u64)zigzag_decode(dx);
+        y += (u64)zigzag_decode(dy);
+        points[i++] = { (i64)x, (i64)y };
+    }
+    while ( src && i < num_points ) {
+        u64 dx = 0;
+        u64 dy = 0;
+        src = varint_decode(src, end, &dx);
+        if ( src ) {
+            src = varint_decode(src, end, &dy);
+        }
+        x += (u64)zigzag_decode(dx);
+        y += (u64)zigzag_decode(dy);
+        points[i++] = { (i64)x, (i64)y };
+    }
+    return src == end;
+}
+
+static void
+encode_pressures(f32* pressures, i32 num_points, u16* dst)
+{
+    for ( i32 i = 0; i < num_points; ++i ) {
+        dst[i] = (u16)(clamp(pressures[i], 0.0f, 1.0f) * 65535.0f + 0.5f);
+    }
+}
+
+static b32
+read_compact_points(MltReader* r, Arena* arena, Stroke* stroke)
+{
+    u32 encoded_size = 0;
+    b32 ok = read_checked(r, &encoded_size, sizeof(u32), 1);
+    u8* encoded = r->data + r->pos;
+    ok = ok && read_skip(r, encoded_size);
+    u8* quantized = r->data + r->pos;
+    ok = ok && read_skip(r, sizeof(u16) * (u64)stroke->num_points);
+    if ( ok ) {
+        stroke->points = arena_alloc_array(arena, stroke->num_points, v2l);
+        stroke->pressures = arena_alloc_array(arena, stroke->num_points, f32);
+        ok = decode_points(encoded, encoded_size, stroke->points, stroke->num_points);
+        for ( i32 i = 0; i < stroke->num_points; ++i ) {
+            u16 q = 0;
+            memcpy(&q, quantized + i * sizeof(u16), sizeof(u16));
+            stroke->pressures[i] = q / 65535.0f;
+        }
+    }
+#if STROKE_DEBUG_VIZ
+    stroke->debug_flags = arena_alloc_array(arena, stroke->num_points, int);
+#endif
+    return ok;
+}
+
+static b32
+read_brushes(Brush* brushes, i32 num_brushes, MltReader* r)
 {
     i32 size = 0;
-    b32 ok = fread_checked(&size, sizeof(size), 1, fd);
+    b32 ok = read_checked(r, &size, sizeof(size), 1);
 
-    if (size == 0 || size > sizeof(Brush)) {
+    if (size <= 0 || (size_t)size > sizeof(Brush)) {
         ok = false;
     }
 
     for (i32 i = 0; i < num_brushes; ++i) {
         brushes[i] = default_brush();
-        if (ok) { ok = fread_checked(brushes + i, size, 1, fd); }
+        if (ok) { ok = read_checked(r, brushes + i, (size_t)size, 1); }
+    }
+
+    return ok;
+}
+
+// One stroke of MLT v10 and later, with its bounding rect.
+static b32
+read_stroke(MltReader* r, u32 file_flags, b32 in_place, Arena* arena, Stroke* stroke)
+{
+    b32 ok = read_brushes(&stroke->brush, 1, r) &&
+             read_checked(r, &stroke->flags, sizeof(stroke->flags), 1) &&
+             read_checked(r, &stroke->num_points, sizeof(i32), 1);
+    if ( ok && (stroke->num_points > STROKE_MAX_POINTS || stroke->num_points <= 0) ) {
+        milton_log("ERROR: File has a stroke with %d points\n", stroke->num_points);
+        ok = false;
+    }
+    if ( ok ) {
+        if ( file_flags & MltFileFlags_COMPACT_POINTS ) {
+            ok = read_compact_points(r, arena, stroke);
+        }
+        else {
+            ok = read_aligned_points(r, in_place, arena, stroke);
+        }
+    }
+    ok = ok && read_checked(r, &stroke->layer_id, sizeof(i32), 1);
+    if ( ok ) {
+        stroke->bounding_rect = bounding_box_for_stroke(stroke);
+    }
+    return ok;
+}
+
+// Move past a stroke without decoding it. Adds the memory that read_stroke
+// will take from the arena to arena_bytes.
+static b32
+skip_stroke(MltReader* r, u32 file_flags, b32 in_place, u64* arena_bytes)
+{
+    Stroke stroke = {};
+    i32 brush_size = 0;
+    b32 ok = read_checked(r, &brush_size, sizeof(i32), 1) &&
+             brush_size > 0 && (size_t)brush_size <= sizeof(Brush) &&
+             read_skip(r, (u64)brush_size) &&
+             read_skip(r, sizeof(stroke.flags)) &&
+             read_checked(r, &stroke.num_points, sizeof(i32), 1);
+    if ( ok && (stroke.num_points > STROKE_MAX_POINTS || stroke.num_points <= 0) ) {
+        milton_log("ERROR: File has a stroke with %d points\n", stroke.num_points);
+        ok = false;
+    }
+    if ( ok ) {
+        u64 n = (u64)stroke.num_points;
+        if ( file_flags & MltFileFlags_COMPACT_POINTS ) {
+            u32 encoded_size = 0;
+            ok = read_checked(r, &encoded_size, sizeof(u32), 1) &&
+                 read_skip(r, encoded_size + sizeof(u16) * n);
+            *arena_bytes += n * (sizeof(v2l) + sizeof(f32));
+        }
+        else {
+            u64 points_offset = (r->pos + 7) & ~(u64)7;
+            ok = read_skip(r, points_offset - r->pos) &&
+                 read_skip(r, n * (sizeof(v2l) + sizeof(f32)));
+            if ( !in_place ) {
+                *arena_bytes += n * (sizeof(v2l) + sizeof(f32));
+            }
+        }
+#if STROKE_DEBUG_VIZ
+        *arena_bytes += n * sizeof(int);
+#endif
+        ok = ok && read_skip(r, sizeof(i32));
+    }
+    return ok;
+}
+
+// Since MLT v10 strokes are decoded in parallel. milton_load indexes the
+// strokes of every layer and fills the StrokeLists afterwards, in chunks that
+// don't cross StrokeList buckets.
+#define LOAD_CHUNK_STROKES (STROKELIST_BUCKET_COUNT / 4)
+
+struct LoadChunk
+{
+    Layer*  layer;
+    i64     first;          // Index in the layer of the first stroke.
+    i64     count;
+    i64     first_offset;   // Into StrokeLoader::offsets.
+    i32     first_id;
+    Arena   arena;          // Exactly big enough for the points of these strokes.
+    b32     ok;
+};
+
+struct StrokeLoader
+{
+    MltReader*          reader;
+    u32                 file_flags;
+    b32                 in_place;
+    DArray<u64>         offsets;  // File offset of each stroke.
+    DArray<LoadChunk>   chunks;
+};
+
+static b32
+loader_add_layer(StrokeLoader* loader, Arena* arena, Layer* layer, i32 num_strokes, i32* stroke_id_count)
+{
+    MltReader* r = loader->reader;
+    b32 ok = true;
+    LoadChunk chunk = {};
+    u64 chunk_bytes = 0;
+    for ( i32 i = 0; ok && i < num_strokes; ++i ) {
+        if ( chunk.count == 0 ) {
+            chunk.layer = layer;
+            chunk.first = i;
+            chunk.first_offset = loader->offsets.count;
+            chunk.first_id = *stroke_id_count + i;
+        }
+        push(&loader->offsets, r->pos);
+        ok = skip_stroke(r, loader->file_flags, loader->in_place, &chunk_bytes);
+        chunk.count++;
+        if ( chunk.count == LOAD_CHUNK_STROKES || i == num_strokes - 1 ) {
+            chunk.arena = arena_spawn(arena, (size_t)chunk_bytes);
+            push(&loader->chunks, chunk);
+            chunk = {};
+            chunk_bytes = 0;
+        }
+    }
+    if ( ok ) {
+        *stroke_id_count += num_strokes;
+        resize(&layer->strokes, num_strokes);
+    }
+    return ok;
+}
+
+static void
+load_chunk_job(void* data, i64 job_index)
+{
+    StrokeLoader* loader = (StrokeLoader*)data;
+    LoadChunk* chunk = &loader->chunks.data[job_index];
+
+    // The chunk doesn't cross buckets, so its strokes are contiguous.
+    Stroke* strokes = get(&chunk->layer->strokes, chunk->first);
+    MltReader r = *loader->reader;
+    chunk->ok = true;
+    for ( i64 i = 0; chunk->ok && i < chunk->count; ++i ) {
+        Stroke* stroke = &strokes[i];
+        *stroke = {};
+        stroke->id = chunk->first_id + (i32)i;
+        r.pos = loader->offsets.data[chunk->first_offset + i];
+        chunk->ok = read_stroke(&r, loader->file_flags, loader->in_place, &chunk->arena, stroke);
     }
+}
 
+// Decode all the strokes that were added, on every core.
+static b32
+loader_run(StrokeLoader* loader)
+{
+    jobs_run(load_chunk_job, loader, loader->chunks.count);
+
+    b32 ok = true;
+    Layer* layer = NULL;
+    for ( i64 i = 0; i < loader->chunks.count; ++i ) {
+        LoadChunk* chunk = &loader->chunks.data[i];
+        ok = ok && chunk->ok;
+        if ( chunk->layer != layer ) {
+            layer = chunk->layer;
+            strokelist_update_bounds(&layer->strokes);
+        }
+    }
     return ok;
 }
 
+static void
+loader_release(StrokeLoader* loader, b32 decoded)
+{
+    if ( !decoded ) {
+        // Indexed layers have room for strokes that were never filled in.
+        for ( i64 i = 0; i < loader->chunks.count; ++i ) {
+            reset(&loader->chunks.data[i].layer->strokes);
+        }
+    }
+    release(&loader->offsets);
+    release(&loader->chunks);
+}
+
 void
 milton_load(Milton* milton)
 {
@@ -80,9 +605,13 @@ milton_load(Milton* milton)
     i32 history_count = 0;
     i32 num_layers = 0;
     i32 saved_working_layer_id = 0;
-    int err = 0;
 
     i32 layer_guid = 0;
+    i64 snapshot_bytes = 0;
+    i32 num_sections = 0;
+    u32 file_flags = 0;
+    MltSection* sections = NULL;
+    StrokeLoader loader = {};
     ColorButton* btn = NULL;
     MiltonGui* gui = NULL;
     auto saved_size = milton->view->screen_size;
@@ -92,20 +621,24 @@ milton_load(Milton* milton)
     milton_reset_canvas(milton);
 
     CanvasState* canvas = milton->canvas;
-#define READ(address, size, num, fd) do { ok = fread_checked(address,size,num,fd); if (!ok){ goto END; } } while(0)
+#define READ(address, size, num) do { ok = read_checked(&reader,address,size,num); if (!ok){ goto END; } } while(0)
+#define SEEK_SECTION(type, index) do { if ( sections ) { ok = seek_section(&reader, sections, num_sections, type, index); if (!ok){ goto END; } } } while(0)
 
     // Unload gpu data if the strokes have been cooked.
     gpu_free_strokes(milton->renderer, milton->canvas);
     mlt_assert(milton->persist->mlt_file_path);
-    FILE* fd = platform_fopen(milton->persist->mlt_file_path, TO_PATH_STR("rb"));
-    b32 ok = true;  // fread check
+    // Parse the whole file from memory.
+    MltReader reader = {};
+    b32 mapped = false;
+    read_whole_file(milton->persist->mlt_file_path, &reader, &mapped);
+    b32 ok = true;  // read check
     b32 handled = false;  // when ok==false but we don't need to prompt a scary message.
+    u32 milton_binary_version = (u32)-1;
 
-    if ( fd ) {
-        u32 milton_binary_version = (u32)-1;
+    if ( reader.ok ) {
         u32 milton_magic = (u32)-1;
-        READ(&milton_magic, sizeof(u32), 1, fd);
-        READ(&milton_binary_version, sizeof(u32), 1, fd);
+        READ(&milton_magic, sizeof(u32), 1);
+        READ(&milton_binary_version, sizeof(u32), 1);
 
         if (ok) {
             if ( milton_binary_version < MILTON_MINOR_VERSION ) {
@@ -131,11 +664,32 @@ milton_load(Milton* milton)
             goto END;
         }
 
+        if ( milton_binary_version >= 11 ) {
+            READ(&file_flags, sizeof(u32), 1);
+        }
+
+        loader.reader = &reader;
+        loader.file_flags = file_flags;
+        loader.in_place = mapped;
+
+        if ( milton_binary_version >= 10 ) {
+            READ(&num_sections, sizeof(i32), 1);
+            if ( num_sections <= 0 || num_sections > (1 << 24) ) {
+                milton_log("Corrupt file. Bad number of sections: %d\n", num_sections);
+                ok = false;
+                goto END;
+            }
+            sections = (MltSection*)mlt_calloc((size_t)num_sections, sizeof(MltSection), "Persist");
+            READ(sections, sizeof(MltSection), (size_t)num_sections);
+        }
+
+        SEEK_SECTION(MltSection_CANVAS, 0);
+
         if ( milton_binary_version >= 9 ) {
             // Defaults
             *milton->view = {};
 
-            READ(&milton->view->size, sizeof(u32), 1, fd); // Read size.
+            READ(&milton->view->size, sizeof(u32), 1); // Read size.
             if (milton->view->size > sizeof(CanvasView)) {
                 ok = false;
                 handled = true;
@@ -143,8 +697,7 @@ milton_load(Milton* milton)
             }
             READ((u8*)milton->view + offsetof(CanvasView, screen_size),
                 milton->view->size - sizeof(u32),
-                1,
-                fd);  // Rest of the struct.
+                1);  // Rest of the struct.
 
             milton->view->size = sizeof(CanvasView);
         }
@@ -153,13 +706,13 @@ milton_load(Milton* milton)
 
             size_t bytes_offset = offsetof(CanvasView, screen_size);
 
-            READ((u8*)milton->view + bytes_offset, sizeof(CanvasViewPreV9), 1, fd);
+            READ((u8*)milton->view + bytes_offset, sizeof(CanvasViewPreV9), 1);
 
             // Patch angle, which was stomped by the old num_layers member, which we don't use anymore.
             milton->view->angle = 0.0f;
         } else {
             CanvasViewPreV4 legacy_view = {};
-            READ(&legacy_view, sizeof(CanvasViewPreV4), 1, fd);
+            READ(&legacy_view, sizeof(CanvasViewPreV4), 1);
             milton->view->screen_size = legacy_view.screen_size;
             milton->view->scale = legacy_view.scale;
             milton->view->zoom_center = legacy_view.zoom_center;
@@ -183,12 +736,14 @@ milton_load(Milton* milton)
         }
 
         num_layers = 0;
-        READ(&num_layers, sizeof(i32), 1, fd);
-        READ(&layer_guid, sizeof(i32), 1, fd);
+        READ(&num_layers, sizeof(i32), 1);
+        READ(&layer_guid, sizeof(i32), 1);
 
         for ( int layer_i = 0; ok && layer_i < num_layers; ++layer_i ) {
+            SEEK_SECTION(MltSection_LAYER, layer_i);
+
             i32 len = 0;
-            READ(&len, sizeof(i32), 1, fd);
+            READ(&len, sizeof(i32), 1);
 
             if ( len > MAX_LAYER_NAME_LEN ) {
                 milton_log("Corrupt file. Layer name is too long.\n");
@@ -200,129 +755,159 @@ milton_load(Milton* milton)
 
             Layer* layer = milton->canvas->working_layer;
 
-            READ(layer->name, sizeof(char), (size_t)len, fd);
+            READ(layer->name, sizeof(char), (size_t)len);
 
-            READ(&layer->id, sizeof(i32), 1, fd);
-            READ(&layer->flags, sizeof(layer->flags), 1, fd);
+            READ(&layer->id, sizeof(i32), 1);
+            READ(&layer->flags, sizeof(layer->flags), 1);
 
             if ( ok ) {
                 i32 num_strokes = 0;
-                READ(&num_strokes, sizeof(i32), 1, fd);
+                READ(&num_strokes, sizeof(i32), 1);
+
+                if ( num_strokes < 0 ) {
+                    milton_log("Corrupt file. Negative stroke count.\n");
+                    ok = false;
+                    goto END;
+                }
 
-                for ( i32 stroke_i = 0; ok && stroke_i < num_strokes; ++stroke_i ) {
-                    Stroke stroke = {};
+                if ( sections ) {
+                    // Decoded in parallel once every layer has been indexed.
+                    if ( !loader_add_layer(&loader, &canvas->arena, layer, num_strokes, &canvas->stroke_id_count) ) {
+                        ok = false;
+                        goto END;
+                    }
+                }
+                else {
+                    for ( i32 stroke_i = 0; ok && stroke_i < num_strokes; ++stroke_i ) {
+                        Stroke stroke = {};
 
-                    stroke.id = milton->canvas->stroke_id_count++;
+                        stroke.id = milton->canvas->stroke_id_count++;
 
-                    if ( milton_binary_version < 7 ) {
-                        READ(&stroke.brush, sizeof(BrushPreV7), 1, fd);
+                        if ( milton_binary_version < 7 ) {
+                            READ(&stroke.brush, sizeof(BrushPreV7), 1);
 
-                        // Previous versions used a magic value for the eraser.
-                        v4f k_eraser_color = {23,34,45,56};
+                            // Previous versions used a magic value for the eraser.
+                            v4f k_eraser_color = {23,34,45,56};
 
-                        if (stroke.brush.color == k_eraser_color) {
-                            stroke.flags |= StrokeFlag_ERASER;
+                            if (stroke.brush.color == k_eraser_color) {
+                                stroke.flags |= StrokeFlag_ERASER;
+                            }
+                            stroke.brush.hardness = 10.0f;
                         }
-                        stroke.brush.hardness = 10.0f;
-                    }
-                    else if ( milton_binary_version < 8 ) {
-                        READ(&stroke.brush, sizeof(BrushPreV8), 1, fd);
-                        READ(&stroke.flags, sizeof(stroke.flags), 1, fd);
-                        stroke.brush.hardness = 2.0f;
-                    }
-                    else {
-                        if (!read_brushes(&stroke.brush, 1, fd)) {
-                            ok = false;
-                            goto END;
+                        else if ( milton_binary_version < 8 ) {
+                            READ(&stroke.brush, sizeof(BrushPreV8), 1);
+                            READ(&stroke.flags, sizeof(stroke.flags), 1);
+                            stroke.brush.hardness = 2.0f;
+                        }
+                        else {
+                            if (!read_brushes(&stroke.brush, 1, &reader)) {
+                                ok = false;
+                                goto END;
+                            }
+                            READ(&stroke.flags, sizeof(stroke.flags), 1);
                         }
-                        READ(&stroke.flags, sizeof(stroke.flags), 1, fd);
-                    }
 
-                    READ(&stroke.num_points, sizeof(i32), 1, fd);
+                        READ(&stroke.num_points, sizeof(i32), 1);
+
+                        if ( stroke.num_points > STROKE_MAX_POINTS || stroke.num_points <= 0 ) {
+                            milton_log("ERROR: File has a stroke with %d points\n",
+                                       stroke.num_points);
+                            // Older versions have a possible off-by-one bug here.
+                            if (stroke.num_points == STROKE_MAX_POINTS)  {
+                                stroke.points = arena_alloc_array(&canvas->arena, stroke.num_points, v2l);
+                                READ(stroke.points, sizeof(v2l), (size_t)stroke.num_points);
+                                stroke.pressures = arena_alloc_array(&canvas->arena, stroke.num_points, f32);
+                                READ(stroke.pressures, sizeof(f32), (size_t)stroke.num_points);
+                                READ(&stroke.layer_id, sizeof(i32), 1);
+    #if STROKE_DEBUG_VIZ
+                                stroke.debug_flags = arena_alloc_array(&canvas->arena, stroke.num_points, int);
+    #endif
+
+                                stroke.bounding_rect = bounding_box_for_stroke(&stroke);
+
+                                layer::layer_push_stroke(layer, stroke);
+                            } else {
+                                ok = false;
+                                goto END;
+                            }
+                        } else {
+                            if ( milton_binary_version >= 4 ) {
+                                stroke.points = arena_alloc_array(&canvas->arena, stroke.num_points, v2l);
+                                READ(stroke.points, sizeof(v2l), (size_t)stroke.num_points);
+                            } else {
+                                stroke.points = arena_alloc_array(&canvas->arena, stroke.num_points, v2l);
+                                v2i* points_32bit = (v2i*)mlt_calloc((size_t)stroke.num_points, sizeof(v2i), "Persist");
 
-                    if ( stroke.num_points > STROKE_MAX_POINTS || stroke.num_points <= 0 ) {
-                        milton_log("ERROR: File has a stroke with %d points\n",
-                                   stroke.num_points);
-                        // Older versions have a possible off-by-one bug here.
-                        if (stroke.num_points == STROKE_MAX_POINTS)  {
-                            stroke.points = arena_alloc_array(&canvas->arena, stroke.num_points, v2l);
-                            READ(stroke.points, sizeof(v2l), (size_t)stroke.num_points, fd);
-                            stroke.pressures = arena_alloc_array(&canvas->arena, stroke.num_points, f32);
-                            READ(stroke.pressures, sizeof(f32), (size_t)stroke.num_points, fd);
-                            READ(&stroke.layer_id, sizeof(i32), 1, fd);
-#if STROKE_DEBUG_VIZ
+                                READ(points_32bit, sizeof(v2i), (size_t)stroke.num_points);
+                                for (int i = 0; i < stroke.num_points; ++i) {
+                                    stroke.points[i] = VEC2L(points_32bit[i]);
+                                }
+                                mlt_free(points_32bit, "Persist");
+                            }
+    #if STROKE_DEBUG_VIZ
                             stroke.debug_flags = arena_alloc_array(&canvas->arena, stroke.num_points, int);
-#endif
-
+    #endif
+                            stroke.pressures = arena_alloc_array(&canvas->arena, stroke.num_points, f32);
+                            READ(stroke.pressures, sizeof(f32), (size_t)stroke.num_points);
+                            READ(&stroke.layer_id, sizeof(i32), 1);
                             stroke.bounding_rect = bounding_box_for_stroke(&stroke);
-
                             layer::layer_push_stroke(layer, stroke);
-                        } else {
-                            ok = false;
-                            goto END;
-                        }
-                    } else {
-                        if ( milton_binary_version >= 4 ) {
-                            stroke.points = arena_alloc_array(&canvas->arena, stroke.num_points, v2l);
-                            READ(stroke.points, sizeof(v2l), (size_t)stroke.num_points, fd);
-                        } else {
-                            stroke.points = arena_alloc_array(&canvas->arena, stroke.num_points, v2l);
-                            v2i* points_32bit = (v2i*)mlt_calloc((size_t)stroke.num_points, sizeof(v2i), "Persist");
-
-                            READ(points_32bit, sizeof(v2i), (size_t)stroke.num_points, fd);
-                            for (int i = 0; i < stroke.num_points; ++i) {
-                                stroke.points[i] = VEC2L(points_32bit[i]);
-                            }
                         }
-#if STROKE_DEBUG_VIZ
-                        stroke.debug_flags = arena_alloc_array(&canvas->arena, stroke.num_points, int);
-#endif
-                        stroke.pressures = arena_alloc_array(&canvas->arena, stroke.num_points, f32);
-                        READ(stroke.pressures, sizeof(f32), (size_t)stroke.num_points, fd);
-                        READ(&stroke.layer_id, sizeof(i32), 1, fd);
-                        stroke.bounding_rect = bounding_box_for_stroke(&stroke);
-                        layer::layer_push_stroke(layer, stroke);
-                    }
-                }
-
-                // Set the flags of the working layer to the last stroke of the working layer.
-                if (layer->id == saved_working_layer_id) {
-                    i64 stroke_count = count(&layer->strokes);
-                    if (stroke_count > 0) {
-                        milton->working_stroke.flags = layer->strokes[ stroke_count - 1]->flags;
                     }
                 }
             }
 
             if ( milton_binary_version >= 4 ) {
                 i64 num_effects = 0;
-                READ(&num_effects, sizeof(num_effects), 1, fd);
+                READ(&num_effects, sizeof(num_effects), 1);
                 if ( num_effects > 0 ) {
                     LayerEffect** e = &layer->effects;
                     for ( i64 i = 0; i < num_effects; ++i ) {
                         mlt_assert(*e == NULL);
                         *e = arena_alloc_elem(&canvas->arena, LayerEffect);
-                        READ(&(*e)->type, sizeof((*e)->type), 1, fd);
-                        READ(&(*e)->enabled, sizeof((*e)->enabled), 1, fd);
+                        READ(&(*e)->type, sizeof((*e)->type), 1);
+                        READ(&(*e)->enabled, sizeof((*e)->enabled), 1);
                         switch ((*e)->type) {
                             case LayerEffectType_BLUR: {
-                                READ(&(*e)->blur.original_scale, sizeof((*e)->blur.original_scale), 1, fd);
-                                READ(&(*e)->blur.kernel_size, sizeof((*e)->blur.kernel_size), 1, fd);
+                                READ(&(*e)->blur.original_scale, sizeof((*e)->blur.original_scale), 1);
+                                READ(&(*e)->blur.kernel_size, sizeof((*e)->blur.kernel_size), 1);
                             } break;
                         }
                         e = &(*e)->next;
                     }
                 }
             }
+
+            if ( milton_binary_version >= 10 ) {
+                READ(&layer->alpha, sizeof(layer->alpha), 1);
+            }
+        }
+
+        if ( !loader_run(&loader) ) {
+            milton_log("Corrupt file. Could not decode strokes.\n");
+            ok = false;
+            goto END;
+        }
+
+        // Set the flags of the working layer to the last stroke of the working layer.
+        for ( Layer* layer = milton->canvas->root_layer; layer; layer = layer->next ) {
+            if ( layer->id == saved_working_layer_id ) {
+                i64 stroke_count = count(&layer->strokes);
+                if ( stroke_count > 0 ) {
+                    milton->working_stroke.flags = layer->strokes[ stroke_count - 1]->flags;
+                }
+            }
         }
         milton->view->working_layer_id = saved_working_layer_id;
 
+        SEEK_SECTION(MltSection_PICKER, 0);
+
         if ( milton_binary_version >= 5 ) {
             v3f rgb;
-            READ(&rgb, sizeof(v3f), 1, fd);
+            READ(&rgb, sizeof(v3f), 1);
             gui_picker_from_rgb(&milton->gui->picker, rgb);
         } else {
-            READ(&milton->gui->picker.data, sizeof(PickerData), 1, fd);
+            READ(&milton->gui->picker.data, sizeof(PickerData), 1);
         }
 
 
@@ -332,81 +917,86 @@ milton_load(Milton* milton)
             gui = milton->gui;
             btn = gui->picker.color_buttons;
 
-            READ(&button_count, sizeof(i32), 1, fd);
+            READ(&button_count, sizeof(i32), 1);
             for ( i32 i = 0;
                   btn!=NULL && i < button_count;
                   ++i, btn=btn->next ) {
-                READ(&btn->rgba, sizeof(v4f), 1, fd);
+                READ(&btn->rgba, sizeof(v4f), 1);
             }
         }
 
         // Brush
+        SEEK_SECTION(MltSection_BRUSHES, 0);
+
         if ( milton_binary_version >= 2 && milton_binary_version <= 5  ) {
             // PEN, ERASER
             for (int i = 0; i < 2; ++i) {
-                READ(&milton->brushes[i], sizeof(BrushPreV7), 1, fd);
+                READ(&milton->brushes[i], sizeof(BrushPreV7), 1);
             }
             // Sizes
-            READ(&milton->brush_sizes, sizeof(i32), 2, fd);
+            READ(&milton->brush_sizes, sizeof(i32), 2);
         }
         else if ( milton_binary_version > 5 ) {
             u16 num_brushes = 0;
-            READ(&num_brushes, sizeof(u16), 1, fd);
+            READ(&num_brushes, sizeof(u16), 1);
             if ( num_brushes > BrushEnum_COUNT ) {
                 milton_log("Error loading file: too many brushes: %d\n", num_brushes);
             }
             if ( milton_binary_version < 7 ) {
                 for (int i = 0; i < num_brushes; ++i) {
                     milton->brushes[i] = default_brush();
-                    READ(milton->brushes + i, sizeof(BrushPreV7), 1, fd);
+                    READ(milton->brushes + i, sizeof(BrushPreV7), 1);
                 }
             }
             else if (milton_binary_version < 8) {
                 for (int i = 0; i < num_brushes; ++i) {
                     milton->brushes[i] = default_brush();
-                    READ(milton->brushes + i, sizeof(BrushPreV8), 1, fd);
+                    READ(milton->brushes + i, sizeof(BrushPreV8), 1);
                 }
             }
             else {
-                if (!read_brushes(milton->brushes, num_brushes, fd)) {
+                if (!read_brushes(milton->brushes, num_brushes, &reader)) {
                     ok = false;
                     goto END;
                 }
 
             }
 
-            READ(&milton->brush_sizes, sizeof(i32), num_brushes, fd);
+            READ(&milton->brush_sizes, sizeof(i32), num_brushes);
         }
 
+        SEEK_SECTION(MltSection_HISTORY, 0);
+
         history_count = 0;
-        READ(&history_count, sizeof(history_count), 1, fd);
+        READ(&history_count, sizeof(history_count), 1);
         reset(&milton->canvas->history);
         reserve(&milton->canvas->history, history_count);
-        READ(milton->canvas->history.data, sizeof(*milton->canvas->history.data), (size_t)history_count, fd);
+        READ(milton->canvas->history.data, sizeof(*milton->canvas->history.data), (size_t)history_count);
         milton->canvas->history.count = history_count;
 
         // MLT 3
-        // Layer alpha
-        if ( milton_binary_version >= 3 ) {
+        // Layer alpha. Part of the layer sections since MLT 10.
+        if ( milton_binary_version >= 3 && milton_binary_version < 10 ) {
             Layer* l = milton->canvas->root_layer;
             for ( i64 i = 0; ok && i < num_layers; ++i ) {
                 mlt_assert(l != NULL);
-                READ(&l->alpha, sizeof(l->alpha), 1, fd);
+                READ(&l->alpha, sizeof(l->alpha), 1);
                 l = l->next;
             }
-        } else {
+        } else if ( milton_binary_version < 3 ) {
             for ( Layer* l = milton->canvas->root_layer; l != NULL; l = l->next ) {
                 l->alpha = 1.0f;
             }
         }
 
-        err = fclose(fd);
-        if ( err != 0 ) {
-            ok = false;
-        }
+        snapshot_bytes = (i64)reader.size;
 
 END:
         // Finished loading
+        if ( sections ) {
+            mlt_free(sections, "Persist");
+        }
+        loader_release(&loader, ok);
         if ( !ok ) {
             if ( !handled ) {
                 platform_dialog("Tried to load a corrupt Milton file or there was an error reading from disk.", "Error");
@@ -426,26 +1016,167 @@ END:
             }
             milton->canvas->layer_guid = layer_guid;
 
+#if MILTON_SAVE_JOURNAL
+            // Apply changes that were saved after the snapshot.
+            if ( snapshot_bytes > 0 ) {
+                journal_replay(milton, (u64)snapshot_bytes);
+            }
+#endif
+
             // Update GPU
             milton->flags |= MiltonStateFlags_JUST_SAVED;
         }
+
+        if ( ok && mapped && milton_binary_version >= 10 && !(file_flags & MltFileFlags_COMPACT_POINTS) ) {
+            // Loaded strokes point into the mapping. It goes away with the canvas.
+            milton->persist->mlt_mapping = reader.data;
+            milton->persist->mlt_mapping_size = reader.size;
+        }
+        else if ( mapped ) {
+            platform_unmap_file(reader.data, reader.size);
+        }
+        else {
+            mlt_free(reader.data, "Persist");
+        }
     } else {
         milton_log("milton_load: Could not open file!\n");
         milton_reset_canvas_and_set_default(milton);
     }
+#undef SEEK_SECTION
 #undef READ
 }
 
+// Saves go through a WriteBuffer. Small fields are copied into a staging
+// area, stroke data is referenced where it lives, and everything is handed to
+// the OS in a few large writes.
+#define WRITE_BUFFER_STAGING_SIZE   (1 * 1024 * 1024)
+#define WRITE_BUFFER_FLUSH_SIZE     (8 * 1024 * 1024)  // Pending bytes, including referenced data.
+#define WRITE_BUFFER_MAX_CHUNKS     4096
+
+struct WriteBuffer
+{
+    FILE*   fd;
+    u8*     staging;
+    u64     staging_used;
+
+    DArray<PlatformWriteChunk> chunks;
+    u64     pending_bytes;
+
+    b32     ok;
+};
+
+static void
+write_buffer_init(WriteBuffer* wb, FILE* fd)
+{
+    *wb = {};
+    wb->fd = fd;
+    wb->staging = (u8*)mlt_calloc(WRITE_BUFFER_STAGING_SIZE, 1, "Persist");
+    wb->ok = wb->staging != NULL;
+}
+
+static b32
+write_buffer_flush(WriteBuffer* wb)
+{
+    if ( wb->ok && wb->chunks.count > 0 ) {
+        wb->ok = platform_write_gather(wb->fd, wb->chunks.data, wb->chunks.count);
+    }
+    reset(&wb->chunks);
+    wb->staging_used = 0;
+    wb->pending_bytes = 0;
+    return wb->ok;
+}
+
+static void
+write_buffer_release(WriteBuffer* wb)
+{
+    mlt_free(wb->staging, "Persist");
+    release(&wb->chunks);
+    *wb = {};
+}
+
+static void
+write_buffer_push_chunk(WriteBuffer* wb, void* data, u64 size)
+{
+    PlatformWriteChunk* last = peek(&wb->chunks);
+    if ( last && (u8*)last->data + last->size == (u8*)data ) {
+        last->size += size;
+    }
+    else {
+        push(&wb->chunks, PlatformWriteChunk{ data, size });
+    }
+    wb->pending_bytes += size;
+    g_bytes_written += size;
+
+    if ( wb->pending_bytes >= WRITE_BUFFER_FLUSH_SIZE || wb->chunks.count >= WRITE_BUFFER_MAX_CHUNKS ) {
+        write_buffer_flush(wb);
+    }
+}
+
+// Copy into the staging area. The data can change as soon as this returns.
+static bool
+write_data(void* address, size_t size, size_t count, WriteBuffer* wb)
+{
+    u8* src = (u8*)address;
+    u64 left = (u64)size * count;
+    while ( wb->ok && left > 0 ) {
+        if ( wb->staging_used == WRITE_BUFFER_STAGING_SIZE ) {
+            write_buffer_flush(wb);
+        }
+        else {
+            u64 bytes = min(left, WRITE_BUFFER_STAGING_SIZE - wb->staging_used);
+            u8* dst = wb->staging + wb->staging_used;
+            memcpy(dst, src, (size_t)bytes);
+            wb->staging_used += bytes;
+            write_buffer_push_chunk(wb, dst, bytes);
+            src += bytes;
+            left -= bytes;
+        }
+    }
+    return wb->ok;
+}
+
+// Write without copying. The data must stay put until the next flush.
+static bool
+write_data_in_place(void* address, size_t size, size_t count, WriteBuffer* wb)
+{
+    u64 bytes = (u64)size * count;
+    if ( wb->ok && bytes > 0 ) {
+        write_buffer_push_chunk(wb, address, bytes);
+    }
+    return wb->ok;
+}
+
+// Pad with zeros until the file offset is a multiple of alignment.
+static bool
+write_padding(u64 alignment, WriteBuffer* wb)
+{
+    u8 zeros[16] = {};
+    mlt_assert(alignment <= sizeof(zeros));
+    u64 padding = (alignment - g_bytes_written % alignment) % alignment;
+    bool ok = padding == 0 || write_data(zeros, 1, (size_t)padding, wb);
+    return ok;
+}
+
+// Points and pressures of a stroke. Compact when there is a scratch buffer for
+// the encoding, otherwise raw and, since v10, aligned to 8 bytes.
 static bool
-write_data(void* address, size_t size, size_t count, FILE* fd)
+write_stroke_points(Stroke* stroke, u32 milton_binary_version, u8* compact_scratch, WriteBuffer* wb)
 {
     bool ok = true;
-    size_t written = fwrite(address, size, count, fd);
-    if ( written != count ) {
-        ok = false;
+    if ( compact_scratch ) {
+        mlt_assert(stroke->num_points <= STROKE_MAX_POINTS);
+        u16* pressures = (u16*)compact_scratch;
+        u8* encoded = compact_scratch + STROKE_MAX_POINTS * sizeof(u16);
+        encode_pressures(stroke->pressures, stroke->num_points, pressures);
+        u32 encoded_size = (u32)encode_points(stroke->points, stroke->num_points, encoded);
+        ok = write_data(&encoded_size, sizeof(u32), 1, wb) &&
+             write_data(encoded, 1, encoded_size, wb) &&
+             write_data(pressures, sizeof(u16), (size_t)stroke->num_points, wb);
     }
     else {
-        g_bytes_written += written * size;
+        ok = (milton_binary_version < 10 || write_padding(8, wb)) &&
+             write_data_in_place(stroke->points, sizeof(v2l), (size_t)stroke->num_points, wb) &&
+             write_data_in_place(stroke->pressures, sizeof(f32), (size_t)stroke->num_points, wb);
     }
     return ok;
 }
@@ -462,36 +1193,228 @@ end_data_tracking()
     return g_bytes_written;
 }
 
-u64
-milton_save(Milton* milton)
+static void
+section_begin(MltSection* section, u32 type)
+{
+    section->type = type;
+    section->offset = g_bytes_written;
+}
+
+static void
+section_end(MltSection* section)
+{
+    section->size = g_bytes_written - section->offset;
+}
+
+//
+// Snapshots
+//
+// A full save writes the canvas state as it was when the save was requested.
+// Layers, stroke headers, history, brushes and picker colors are copied into
+// the snapshot's arena. Stroke points are shared with the canvas: they don't
+// change after a stroke is committed, and they live until the canvas gets
+// reset, which waits for the save that is being written.
+//
+
+struct SnapshotLayer
+{
+    i32             id;
+    char            name[MAX_LAYER_NAME_LEN];
+    i32             flags;
+    float           alpha;
+    LayerEffect*    effects;
+    Stroke*         strokes;
+    i32             num_strokes;
+};
+
+struct CanvasSnapshot
+{
+    Arena           arena;
+
+    CanvasView      view;
+    i32             layer_guid;
+    SnapshotLayer*  layers;
+    i32             num_layers;
+
+    v3f             picker_rgb;
+    PickerData      picker_data;
+    v4f*            button_colors;
+    i32             num_buttons;
+
+    Brush           brushes[BrushEnum_COUNT];
+    i32             brush_sizes[BrushEnum_COUNT];
+
+    HistoryElement* history;
+    i32             history_count;
+
+    b32             compact_points;
+};
+
+static CanvasSnapshot*
+snapshot_capture(Milton* milton)
+{
+    CanvasState* canvas = milton->canvas;
+    MiltonGui* gui = milton->gui;
+
+    i32 num_layers = layer::number_of_layers(canvas->root_layer);
+    i64 num_strokes = 0;
+    i64 num_effects = 0;
+    for ( Layer* l = canvas->root_layer; l != NULL; l = l->next ) {
+        if ( l->strokes.count > INT_MAX ) {
+            milton_die_gracefully("FATAL. Number of strokes in layer greater than can be stored in file format. ");
+        }
+        num_strokes += l->strokes.count;
+        for ( LayerEffect* e = l->effects; e != NULL; e = e->next ) {
+            ++num_effects;
+        }
+    }
+    i32 num_buttons = 0;
+    for ( ColorButton* b = gui->picker.color_buttons; b != NULL; b = b->next ) {
+        ++num_buttons;
+    }
+    i32 history_count = (i32)canvas->history.count;
+    if ( canvas->history.count > INT_MAX ) {
+        history_count = 0;
+    }
+
+    // Everything fits in the first block.
+    size_t size = num_layers * sizeof(SnapshotLayer) +
+                  (size_t)num_strokes * sizeof(Stroke) +
+                  (size_t)num_effects * sizeof(LayerEffect) +
+                  num_buttons * sizeof(v4f) +
+                  history_count * sizeof(HistoryElement);
+    CanvasSnapshot* snapshot = arena_bootstrap(CanvasSnapshot, arena, size);
+
+    mlt_assert(sizeof(CanvasView) == milton->view->size);
+    snapshot->view = *milton->view;
+    snapshot->layer_guid = canvas->layer_guid;
+
+    snapshot->num_layers = num_layers;
+    snapshot->layers = arena_alloc_array(&snapshot->arena, num_layers, SnapshotLayer);
+    SnapshotLayer* sl = snapshot->layers;
+    for ( Layer* l = canvas->root_layer; l != NULL; l = l->next, ++sl ) {
+        sl->id = l->id;
+        memcpy(sl->name, l->name, sizeof(sl->name));
+        sl->flags = l->flags;
+        sl->alpha = l->alpha;
+
+        LayerEffect** tail = &sl->effects;
+        for ( LayerEffect* e = l->effects; e != NULL; e = e->next ) {
+            LayerEffect* copy = arena_alloc_elem(&snapshot->arena, LayerEffect);
+            *copy = *e;
+            copy->next = NULL;
+            *tail = copy;
+            tail = &copy->next;
+        }
+
+        // One copy per bucket.
+        sl->num_strokes = (i32)l->strokes.count;
+        sl->strokes = arena_alloc_array(&snapshot->arena, sl->num_strokes, Stroke);
+        i64 copied = 0;
+        for ( StrokeBucket* bucket = &l->strokes.root;
+              copied < sl->num_strokes;
+              bucket = bucket->next ) {
+            i64 n = min((i64)sl->num_strokes - copied, (i64)STROKELIST_BUCKET_COUNT);
+            memcpy(sl->strokes + copied, bucket->data, (size_t)n * sizeof(Stroke));
+            copied += n;
+        }
+    }
+
+    snapshot->picker_rgb = gui_get_picker_rgb(gui);
+    snapshot->picker_data = gui->picker.data;
+    snapshot->num_buttons = num_buttons;
+    snapshot->button_colors = arena_alloc_array(&snapshot->arena, num_buttons, v4f);
+    i32 button_i = 0;
+    for ( ColorButton* b = gui->picker.color_buttons; b != NULL; b = b->next ) {
+        snapshot->button_colors[button_i++] = b->rgba;
+    }
+
+    memcpy(snapshot->brushes, milton->brushes, sizeof(snapshot->brushes));
+    memcpy(snapshot->brush_sizes, milton->brush_sizes, sizeof(snapshot->brush_sizes));
+
+    snapshot->history_count = history_count;
+    snapshot->history = arena_alloc_array(&snapshot->arena, history_count, HistoryElement);
+    if ( history_count > 0 ) {
+        memcpy(snapshot->history, canvas->history.data, history_count * sizeof(HistoryElement));
+    }
+
+    snapshot->compact_points = milton->persist->compact_points;
+
+    return snapshot;
+}
+
+static void
+snapshot_release(CanvasSnapshot* snapshot)
 {
+    Arena arena = snapshot->arena;  // The snapshot lives in its own arena.
+    arena_free(&arena);
+}
+
+// Write the snapshot to a temporary file and move it over the .mlt file.
+static u64
+write_snapshot(Milton* milton, SaveRequest* request)
+{
+    CanvasSnapshot* snapshot = request->snapshot;
+
     begin_data_tracking();
     // Declaring variables here to silence compiler warnings about GOTO jumping declarations.
     i32 history_count = 0;
     u32 milton_binary_version = 0;
+    i32 num_sections = 0;
+    u64 toc_offset = 0;
+    MltSection* sections = NULL;
+    u32 file_flags = 0;
+    u8* compact_scratch = NULL;
+    WriteBuffer wb = {};
+    b32 saved = false;
     milton->flags |= MiltonStateFlags_LAST_SAVE_FAILED;  // Assume failure. Remove flag on success.
 
     int pid = (int)getpid();
     PATH_CHAR tmp_fname[MAX_PATH] = {};
-    PATH_SNPRINTF(tmp_fname, MAX_PATH, TO_PATH_STR("%s.mlt_tmp_%d"), milton->persist->mlt_file_path, pid);
+    PATH_SNPRINTF(tmp_fname, MAX_PATH, TO_PATH_STR("%s.mlt_tmp_%d"), request->mlt_file_path, pid);
 
     FILE* fd = platform_fopen(tmp_fname, TO_PATH_STR("wb"));
 
     b32 could_write_milton_state = false;
 
     if ( fd ) {
+        write_buffer_init(&wb, fd);
+
         u32 milton_magic = MILTON_MAGIC_NUMBER;
 
-        if ( write_data(&milton_magic, sizeof(u32), 1, fd) ) {
-            milton_binary_version = milton->persist->mlt_binary_version;
-            i32 num_layers = layer::number_of_layers(milton->canvas->root_layer);
+        if ( write_data(&milton_magic, sizeof(u32), 1, &wb) ) {
+            milton_binary_version = request->mlt_binary_version;
+            i32 num_layers = snapshot->num_layers;
+
+            // Canvas, layers, picker, brushes and history.
+            num_sections = num_layers + 4;
+            sections = (MltSection*)mlt_calloc((size_t)num_sections, sizeof(MltSection), "Persist");
+            MltSection* layer_sections = sections + 1;
+            MltSection* tail_sections = sections + 1 + num_layers;
+
+            b32 could_write_header = write_data(&milton_binary_version, sizeof(u32), 1, &wb);
+            if ( could_write_header && milton_binary_version >= 11 ) {
+                if ( snapshot->compact_points ) {
+                    file_flags |= MltFileFlags_COMPACT_POINTS;
+                    compact_scratch = (u8*)mlt_calloc(STROKE_MAX_POINTS, COMPACT_POINT_MAX_BYTES + sizeof(u16), "Persist");
+                }
+                could_write_header = write_data(&file_flags, sizeof(u32), 1, &wb);
+            }
+            if ( could_write_header && milton_binary_version >= 10 ) {
+                // Placeholder. Written again at the end, when the offsets are known.
+                could_write_header = write_data(&num_sections, sizeof(i32), 1, &wb);
+                toc_offset = g_bytes_written;
+                could_write_header = could_write_header &&
+                                     write_data(sections, sizeof(MltSection), (size_t)num_sections, &wb);
+            }
 
-            mlt_assert(sizeof(CanvasView) == milton->view->size);
+            section_begin(&sections[0], MltSection_CANVAS);
 
-            if ( write_data(&milton_binary_version, sizeof(u32), 1, fd) &&
-                 write_data(milton->view, sizeof(CanvasView), 1, fd) &&
-                 write_data(&num_layers, sizeof(i32), 1, fd) &&
-                 write_data(&milton->canvas->layer_guid, sizeof(i32), 1, fd) ) {
+            if ( could_write_header &&
+                 write_data(&snapshot->view, sizeof(CanvasView), 1, &wb) &&
+                 write_data(&num_layers, sizeof(i32), 1, &wb) &&
+                 write_data(&snapshot->layer_guid, sizeof(i32), 1, &wb) ) {
+                section_end(&sections[0]);
 
                 //
                 // Layer contents
@@ -499,41 +1422,45 @@ milton_save(Milton* milton)
 
                 bool could_write_layer_contents = true;
 
-                for ( Layer* layer = milton->canvas->root_layer;
-                      could_write_layer_contents && layer;
-                      layer=layer->next  ) {
-                    if ( layer->strokes.count > INT_MAX ) {
-                        milton_die_gracefully("FATAL. Number of strokes in layer greater than can be stored in file format. ");
-                    }
-                    i32 num_strokes = (i32)layer->strokes.count;
+                MltSection* section = layer_sections;
+                for ( i32 layer_i = 0;
+                      could_write_layer_contents && layer_i < num_layers;
+                      ++layer_i, ++section  ) {
+                    SnapshotLayer* layer = &snapshot->layers[layer_i];
+                    i32 num_strokes = layer->num_strokes;
                     char* name = layer->name;
                     i32 len = (i32)(strlen(name) + 1);
 
+                    section_begin(section, MltSection_LAYER);
+                    section->layer_id = layer->id;
+                    section->num_strokes = num_strokes;
+                    section->bounds = rect_without_size();
+
                     bool could_write_strokes = true;
                     bool could_write_effects = true;
 
-                    if ( write_data(&len, sizeof(i32), 1, fd) &&
-                         write_data(name, sizeof(char), (size_t)len, fd) &&
-                         write_data(&layer->id, sizeof(i32), 1, fd) &&
-                         write_data(&layer->flags, sizeof(layer->flags), 1, fd) &&
-                         write_data(&num_strokes, sizeof(i32), 1, fd) ) {
+                    if ( write_data(&len, sizeof(i32), 1, &wb) &&
+                         write_data(name, sizeof(char), (size_t)len, &wb) &&
+                         write_data(&layer->id, sizeof(i32), 1, &wb) &&
+                         write_data(&layer->flags, sizeof(layer->flags), 1, &wb) &&
+                         write_data(&num_strokes, sizeof(i32), 1, &wb) ) {
                         for ( i32 stroke_i = 0;
                               could_write_strokes && stroke_i < num_strokes;
                               ++stroke_i ) {
-                            Stroke* stroke = get(&layer->strokes, stroke_i);
+                            Stroke* stroke = &layer->strokes[stroke_i];
                             mlt_assert(stroke->num_points > 0);
                             if ( stroke->num_points > 0 && stroke->num_points <= STROKE_MAX_POINTS ) {
                                 i32 size_of_brush = sizeof(Brush);
-                                if ( !write_data(&size_of_brush, sizeof(i32), 1, fd ) ||
-                                     !write_data(&stroke->brush, sizeof(Brush), 1, fd) ||
-                                     !write_data(&stroke->flags, sizeof(stroke->flags), 1, fd) ||
-                                     !write_data(&stroke->num_points, sizeof(i32), 1, fd) ||
-                                     !write_data(stroke->points, sizeof(v2l), (size_t)stroke->num_points, fd) ||
-                                     !write_data(stroke->pressures, sizeof(f32), (size_t)stroke->num_points, fd) ||
-                                     !write_data(&stroke->layer_id, sizeof(i32), 1, fd) ) {
+                                if ( !write_data(&size_of_brush, sizeof(i32), 1, &wb) ||
+                                     !write_data(&stroke->brush, sizeof(Brush), 1, &wb) ||
+                                     !write_data(&stroke->flags, sizeof(stroke->flags), 1, &wb) ||
+                                     !write_data(&stroke->num_points, sizeof(i32), 1, &wb) ||
+                                     !write_stroke_points(stroke, milton_binary_version, compact_scratch, &wb) ||
+                                     !write_data(&stroke->layer_id, sizeof(i32), 1, &wb) ) {
                                     could_write_strokes = false;
                                     break;
                                 }
+                                section->bounds = rect_union(section->bounds, stroke->bounding_rect);
                             } else {
                                 milton_log("WARNING: Trying to write a stroke of size %d\n", stroke->num_points);
                             }
@@ -550,14 +1477,14 @@ milton_save(Milton* milton)
                         for ( LayerEffect* e = layer->effects; e != NULL; e = e->next ) {
                             ++num_effects;
                         }
-                        if ( write_data(&num_effects, sizeof(num_effects), 1, fd) ) {
+                        if ( write_data(&num_effects, sizeof(num_effects), 1, &wb) ) {
                             for ( LayerEffect* e = layer->effects; e != NULL; e = e->next ) {
-                                if ( write_data(&e->type, sizeof(e->type), 1, fd) &&
-                                     write_data(&e->enabled, sizeof(e->enabled), 1, fd) ) {
+                                if ( write_data(&e->type, sizeof(e->type), 1, &wb) &&
+                                     write_data(&e->enabled, sizeof(e->enabled), 1, &wb) ) {
                                     switch (e->type) {
                                         case LayerEffectType_BLUR: {
-                                            if ( !write_data(&e->blur.original_scale, sizeof(e->blur.original_scale), 1, fd) ||
-                                                 !write_data(&e->blur.kernel_size, sizeof(e->blur.kernel_size), 1, fd) ) {
+                                            if ( !write_data(&e->blur.original_scale, sizeof(e->blur.original_scale), 1, &wb) ||
+                                                 !write_data(&e->blur.kernel_size, sizeof(e->blur.kernel_size), 1, &wb) ) {
                                                 could_write_effects = false;
                                             }
                                         } break;
@@ -569,19 +1496,24 @@ milton_save(Milton* milton)
                             }
                         }
                     }
+                    if ( could_write_effects && milton_binary_version >= 10 ) {
+                        could_write_effects = write_data(&layer->alpha, sizeof(layer->alpha), 1, &wb);
+                    }
                     if (!could_write_strokes || !could_write_effects) {
                         could_write_layer_contents = false;
                     }
+                    section_end(section);
                 }
 
                 if ( could_write_layer_contents ) {
+                    section_begin(&tail_sections[0], MltSection_PICKER);
+
                     b32 could_write_picker = true;
                     if ( milton_binary_version >= 5 ) {
-                        v3f rgb = gui_get_picker_rgb(milton->gui);
-                        could_write_picker = write_data(&rgb, sizeof(rgb), 1, fd);
+                        could_write_picker = write_data(&snapshot->picker_rgb, sizeof(v3f), 1, &wb);
                     }
                     else {
-                        could_write_picker = write_data(&milton->gui->picker.data, sizeof(PickerData), 1, fd);
+                        could_write_picker = write_data(&snapshot->picker_data, sizeof(PickerData), 1, &wb);
                     }
 
                     //
@@ -590,69 +1522,59 @@ milton_save(Milton* milton)
                     b32 could_write_buttons = true;
 
                     if ( could_write_picker ) {
-                        i32 button_count = 0;
-                        MiltonGui* gui = milton->gui;
-                        // Count buttons
-                        for (ColorButton* b = gui->picker.color_buttons; b!= NULL; b = b->next, button_count++) { }
-                        // Write
-                        could_write_buttons = write_data(&button_count, sizeof(i32), 1, fd);
-                        if ( could_write_buttons ) {
-                            for ( ColorButton* b = gui->picker.color_buttons;
-                                  could_write_buttons && b!= NULL;
-                                  b = b->next ) {
-                                could_write_buttons = write_data(&b->rgba, sizeof(v4f), 1, fd);
-                            }
-                        }
+                        could_write_buttons = write_data(&snapshot->num_buttons, sizeof(i32), 1, &wb) &&
+                                              write_data(snapshot->button_colors, sizeof(v4f), (size_t)snapshot->num_buttons, &wb);
                     }
                     else {
                         could_write_buttons = false;
                     }
 
                     if ( could_write_buttons ) {
+                        section_end(&tail_sections[0]);
 
                         //
                         // Brush
                         //
+                        section_begin(&tail_sections[1], MltSection_BRUSHES);
+
                         b32 could_write_brushes = true;
 
                         i32 size_of_brush = sizeof(Brush);
 
                         u16 num_brushes = 3;  // Brush, eraser, primitive.
-                        if ( !write_data(&num_brushes, sizeof(num_brushes), 1, fd) ||
-                             !write_data(&size_of_brush, sizeof(i32), 1, fd) ||
-                             !write_data(&milton->brushes, sizeof(Brush), num_brushes, fd) ||
-                             !write_data(&milton->brush_sizes, sizeof(i32), num_brushes, fd) ) {
+                        if ( !write_data(&num_brushes, sizeof(num_brushes), 1, &wb) ||
+                             !write_data(&size_of_brush, sizeof(i32), 1, &wb) ||
+                             !write_data(snapshot->brushes, sizeof(Brush), num_brushes, &wb) ||
+                             !write_data(snapshot->brush_sizes, sizeof(i32), num_brushes, &wb) ) {
                             could_write_brushes = false;
                         }
 
                         if ( could_write_brushes ) {
-                            history_count = (i32)milton->canvas->history.count;
-                            if ( milton->canvas->history.count > INT_MAX ) {
-                                history_count = 0;
-                            }
+                            section_end(&tail_sections[1]);
+                            section_begin(&tail_sections[2], MltSection_HISTORY);
+
+                            history_count = snapshot->history_count;
 
                             //
                             // Undo history
                             //
 
-                            if ( write_data(&history_count, sizeof(history_count), 1, fd) &&
-                                 write_data(milton->canvas->history.data, sizeof(*milton->canvas->history.data), (size_t)history_count, fd) ) {
+                            if ( write_data(&history_count, sizeof(history_count), 1, &wb) &&
+                                 write_data(snapshot->history, sizeof(HistoryElement), (size_t)history_count, &wb) ) {
+                                section_end(&tail_sections[2]);
 
                                 //
-                                // Layer alpha
+                                // Layer alpha. Part of the layer sections since MLT 10.
                                 //
                                 b32 could_write_layer_alpha = true;
 
-                                if ( milton_binary_version >= 3 ) {
-                                    Layer* l = milton->canvas->root_layer;
-                                    for ( i64 i = 0;
+                                if ( milton_binary_version >= 3 && milton_binary_version < 10 ) {
+                                    for ( i32 i = 0;
                                           could_write_layer_alpha && i < num_layers;
                                           ++i ) {
-                                        mlt_assert(l);
-                                        if ( !write_data(&l->alpha, sizeof(l->alpha), 1, fd) ) {
+                                        if ( !write_data(&snapshot->layers[i].alpha, sizeof(float), 1, &wb) ) {
                                             could_write_layer_alpha = false;
                                         }
-                                        l = l->next;
                                     }
                                 }
 
@@ -669,6 +1591,21 @@ milton_save(Milton* milton)
             }
         }
 
+        if ( !write_buffer_flush(&wb) ) {
+            could_write_milton_state = false;
+        }
+
+        u64 snapshot_bytes = g_bytes_written;
+
+        if ( could_write_milton_state && milton_binary_version >= 10 ) {
+            // Table of contents.
+            could_write_milton_state = seek_checked(fd, toc_offset) &&
+                                       write_data(sections, sizeof(MltSection), (size_t)num_sections, &wb) &&
+                                       write_buffer_flush(&wb) &&
+                                       fseek(fd, 0, SEEK_END) == 0;
+        }
+        write_buffer_release(&wb);
+
         int file_error = ferror(fd);
         if ( file_error == 0 ) {
             int close_ret = fclose(fd);
@@ -677,9 +1614,13 @@ milton_save(Milton* milton)
                     platform_dialog("Milton failed to write to the file!", "Save error.");
                 }
                 else {
-                    if ( platform_move_file(tmp_fname, milton->persist->mlt_file_path) ) {
+                    if ( platform_move_file(tmp_fname, request->mlt_file_path) ) {
                         //  \o/
-                        milton_save_postlude(milton);
+                        saved = true;
+                        milton_save_postlude(milton, request->num_strokes);
+#if MILTON_SAVE_JOURNAL
+                        journal_reset(milton, request, snapshot_bytes);
+#endif
                     }
                     else {
                         milton_log("Could not move file. Moving on. Avoiding this save.\n");
@@ -700,146 +1641,1433 @@ milton_save(Milton* milton)
     else {
         milton_die_gracefully("Could not create file for saving! ");
     }
+    if ( sections ) {
+        mlt_free(sections, "Persist");
+    }
+    if ( compact_scratch ) {
+        mlt_free(compact_scratch, "Persist");
+    }
+    if ( !saved ) {
+        journal_set_needs_snapshot(milton);
+    }
     u64 bytes_written = end_data_tracking();
     return bytes_written;
 }
 
-PATH_CHAR*
-milton_get_last_canvas_fname()
+//
+// Journal
+//
+// The .mlt file is a snapshot of the canvas. Changes committed after the
+// snapshot are appended to a journal file next to it: "<canvas>.mlt_journal".
+// The journal starts with a JournalHeader, followed by records that are a
+// JournalRecordHeader plus a payload. Loading replays the records on top of the
+// snapshot. A record that was not completely written invalidates the rest of
+// the journal, and the next save writes a full snapshot.
+//
+
+static void
+journal_fname(PATH_CHAR* fname, PATH_CHAR* mlt_path)
 {
-    PATH_CHAR* last_fname = (PATH_CHAR*)mlt_calloc(MAX_PATH, sizeof(PATH_CHAR), "Strings");
+    PATH_SNPRINTF(fname, MAX_PATH, TO_PATH_STR("%s_journal"), mlt_path);
+}
 
-    PATH_CHAR full[MAX_PATH] = {};
+// Guards the state shared by the main thread and the save thread.
+static void
+save_lock(Milton* milton)
+{
+#if MILTON_SAVE_ASYNC
+    // The mutex is created after the first load.
+    if ( milton->save_mutex ) { SDL_LockMutex(milton->save_mutex); }
+#endif
+}
 
-    PATH_STRCPY(full, TO_PATH_STR("saved_path"));
-    platform_fname_at_config(full, MAX_PATH);
-    FILE* fd = platform_fopen(full, TO_PATH_STR("rb+"));
+static void
+save_unlock(Milton* milton)
+{
+#if MILTON_SAVE_ASYNC
+    if ( milton->save_mutex ) { SDL_UnlockMutex(milton->save_mutex); }
+#endif
+}
 
-    if ( fd ) {
-        u64 len = 0;
-        fread(&len, sizeof(len), 1, fd);
-        if ( len < MAX_PATH ) {
-            fread(last_fname, sizeof(PATH_CHAR), len, fd);
-            // If the read fails, or if the file doesn't exist, milton_load
-            // will fail gracefully and load a default canvas.
-            fclose(fd);
-        }
-    } else {
-        mlt_free(last_fname, "Strings");
-    }
+static void
+journal_set_needs_snapshot(Milton* milton)
+{
+    save_lock(milton);
+    milton->persist->journal_needs_snapshot = true;
+    save_unlock(milton);
+}
 
-    return last_fname;
+static DArray<JournalEntry>
+journal_take_pending(Milton* milton)
+{
+    MiltonPersist* p = milton->persist;
+    save_lock(milton);
+    DArray<JournalEntry> entries = p->journal_pending;
+    p->journal_pending = {};
+    save_unlock(milton);
+    return entries;
+}
 
+void
+milton_journal_push(Milton* milton, JournalRecordType type, Stroke* stroke)
+{
+#if MILTON_SAVE_JOURNAL
+    MiltonPersist* p = milton->persist;
+    JournalEntry entry = {};
+    entry.type = type;
+    if ( stroke ) {
+        entry.stroke = *stroke;
+    }
+    save_lock(milton);
+    push(&p->journal_pending, entry);
+    save_unlock(milton);
+#endif
 }
 
 void
-milton_set_last_canvas_fname(PATH_CHAR* last_fname)
+milton_journal_discard(Milton* milton)
 {
-    //PATH_CHAR* full = (PATH_CHAR*)mlt_calloc(MAX_PATH, sizeof(char));
-    //wcscpy(full, "last_canvas_fname");
-    PATH_CHAR full[MAX_PATH] = { TO_PATH_STR("saved_path") };
-    platform_fname_at_config(full, MAX_PATH);
-    FILE* fd = platform_fopen(full, TO_PATH_STR("wb"));
-    if ( fd ) {
-        u64 len = PATH_STRLEN(last_fname)+1;
-        fwrite(&len, sizeof(len), 1, fd);
-        fwrite(last_fname, sizeof(*last_fname), len, fd);
-        fclose(fd);
+    DArray<JournalEntry> entries = journal_take_pending(milton);
+    release(&entries);
+    journal_set_needs_snapshot(milton);
+}
+
+static void
+append_bytes(DArray<u8>* buffer, void* data, size_t size)
+{
+    if ( buffer->capacity < buffer->count + (i64)size ) {
+        reserve(buffer, 2 * (buffer->count + (i64)size));
     }
+    memcpy(buffer->data + buffer->count, data, size);
+    buffer->count += (i64)size;
 }
 
-// Called by stb_image
 static void
-write_func(void* context, void* data, int size)
+journal_serialize_stroke(Stroke* stroke, DArray<u8>* buffer)
 {
-    FILE* fd = *(FILE**)context;
+    i32 size_of_brush = sizeof(Brush);
+    append_bytes(buffer, &size_of_brush, sizeof(i32));
+    append_bytes(buffer, &stroke->brush, sizeof(Brush));
+    append_bytes(buffer, &stroke->flags, sizeof(stroke->flags));
+    append_bytes(buffer, &stroke->num_points, sizeof(i32));
+    append_bytes(buffer, stroke->points, sizeof(v2l) * (size_t)stroke->num_points);
+    append_bytes(buffer, stroke->pressures, sizeof(f32) * (size_t)stroke->num_points);
+    append_bytes(buffer, &stroke->layer_id, sizeof(i32));
+}
 
-    if ( fd ) {
-        size_t written = fwrite(data, (size_t)size, 1, fd);
-        if ( written != 1 ) {
-            fclose(fd);
-            *(FILE**)context = NULL;
+// Everything about the layers except for their strokes.
+static void
+journal_serialize_layers(Milton* milton, DArray<u8>* buffer)
+{
+    CanvasState* canvas = milton->canvas;
+    i32 num_layers = layer::number_of_layers(canvas->root_layer);
+
+    append_bytes(buffer, &canvas->layer_guid, sizeof(i32));
+    append_bytes(buffer, &milton->view->working_layer_id, sizeof(i32));
+    append_bytes(buffer, &num_layers, sizeof(i32));
+
+    for ( Layer* layer = canvas->root_layer; layer != NULL; layer = layer->next ) {
+        i32 len = (i32)(strlen(layer->name) + 1);
+        append_bytes(buffer, &layer->id, sizeof(i32));
+        append_bytes(buffer, &len, sizeof(i32));
+        append_bytes(buffer, layer->name, (size_t)len);
+        append_bytes(buffer, &layer->flags, sizeof(layer->flags));
+        append_bytes(buffer, &layer->alpha, sizeof(layer->alpha));
+
+        i64 num_effects = 0;
+        for ( LayerEffect* e = layer->effects; e != NULL; e = e->next ) {
+            ++num_effects;
+        }
+        append_bytes(buffer, &num_effects, sizeof(num_effects));
+        for ( LayerEffect* e = layer->effects; e != NULL; e = e->next ) {
+            append_bytes(buffer, &e->type, sizeof(e->type));
+            append_bytes(buffer, &e->enabled, sizeof(e->enabled));
+            switch ( e->type ) {
+                case LayerEffectType_BLUR: {
+                    append_bytes(buffer, &e->blur.original_scale, sizeof(e->blur.original_scale));
+                    append_bytes(buffer, &e->blur.kernel_size, sizeof(e->blur.kernel_size));
+                } break;
+            }
         }
     }
 }
 
-void
-milton_save_buffer_to_file(PATH_CHAR* fname, u8* buffer, i32 w, i32 h)
+static u64
+journal_layers_hash(Milton* milton)
 {
-    int len = 0;
-    {
-        size_t sz = PATH_STRLEN(fname);
-        if ( sz > ((1u << 31) -1) ) {
-            milton_die_gracefully("A really, really long file name. This shouldn't happen.");
-        }
-        len = (int)sz;
+    DArray<u8> buffer = {};
+    journal_serialize_layers(milton, &buffer);
+    u64 h = hash((char*)buffer.data, (size_t)buffer.count);
+    release(&buffer);
+    return h;
+}
+
+static b32
+journal_write_record(WriteBuffer* wb, u32 type, DArray<u8>* payload)
+{
+    JournalRecordHeader header = { type, (u32)payload->count };
+    b32 ok = write_data(&header, sizeof(header), 1, wb);
+    if ( ok && payload->count > 0 ) {
+        ok = write_data(payload->data, (size_t)payload->count, 1, wb);
     }
-    size_t ext_sz = ( len+1 ) * sizeof(PATH_CHAR);
-    PATH_CHAR* fname_copy = (PATH_CHAR*)mlt_calloc(ext_sz, 1, "Strings");
-    fname_copy[0] = '\0';
-    PATH_STRCPY(fname_copy, fname);
+    return ok;
+}
 
-    // NOTE: This should work with unicode.
-    int ext_len = 0;
-    PATH_CHAR* ext = fname_copy + len;
-    b32 found = false;
-    {
-        int safety = len;
-        while ( *--ext != '.' ) {
-            if( safety-- == 0 ) {
-                break;
-            }
+// Start an empty journal for the snapshot that was just written.
+static void
+journal_reset(Milton* milton, SaveRequest* request, u64 snapshot_bytes)
+{
+    MiltonPersist* p = milton->persist;
+    PATH_CHAR fname[MAX_PATH] = {};
+    journal_fname(fname, request->mlt_file_path);
+
+    b32 ok = false;
+    FILE* fd = platform_fopen(fname, TO_PATH_STR("wb"));
+    if ( fd ) {
+        JournalHeader header = { MILTON_JOURNAL_MAGIC_NUMBER, request->mlt_binary_version, snapshot_bytes };
+        WriteBuffer wb = {};
+        write_buffer_init(&wb, fd);
+        ok = write_data(&header, sizeof(header), 1, &wb) && write_buffer_flush(&wb);
+        write_buffer_release(&wb);
+        if ( fclose(fd) != 0 ) {
+            ok = false;
         }
-        if ( safety > 0 ) {
-            found = true;
-            ext_len = len - safety;
-            ++ext;
+    }
+
+    if ( ok ) {
+        PATH_STRNCPY(p->journal_mlt_path, request->mlt_file_path, MAX_PATH);
+        p->journal_bytes = sizeof(JournalHeader);
+        p->snapshot_bytes = snapshot_bytes;
+        p->journal_layer_hash = hash((char*)request->layers.data, (size_t)request->layers.count);
+    }
+    else {
+        milton_log("Could not create journal file. Saving full snapshots.\n");
+        journal_set_needs_snapshot(milton);
+    }
+}
+
+// Append the request's records to the journal.
+static u64
+write_journal(Milton* milton, SaveRequest* request)
+{
+    MiltonPersist* p = milton->persist;
+
+    save_lock(milton);
+    b32 needs_snapshot = p->journal_needs_snapshot ||
+                         PATH_STRCMP(p->journal_mlt_path, request->mlt_file_path) != 0;
+    save_unlock(milton);
+
+    u64 layer_hash = hash((char*)request->layers.data, (size_t)request->layers.count);
+
+    if ( needs_snapshot ) {
+        // A snapshot in this request failed, and the failure was reported.
+        // Otherwise, the journal is missing or belongs to another file.
+        if ( !request->snapshot ) {
+            journal_set_needs_snapshot(milton);
+            request->wants_snapshot = true;
         }
+        return 0;
     }
 
-    if ( found ) {
-        for ( int i = 0; i < ext_len; ++i ) {
-            PATH_CHAR c = ext[i];
-            ext[i] = PATH_TOLOWER(c);
+    begin_data_tracking();
+
+    if ( request->entries.count > 0 || layer_hash != p->journal_layer_hash ) {
+        PATH_CHAR fname[MAX_PATH] = {};
+        journal_fname(fname, request->mlt_file_path);
+
+        FILE* fd = platform_fopen(fname, TO_PATH_STR("ab"));
+        b32 ok = fd != NULL;
+
+        WriteBuffer wb = {};
+        if ( ok ) {
+            write_buffer_init(&wb, fd);
         }
 
-        FILE* fd = NULL;
+        // Layers go first so that strokes find the layer they belong to.
+        if ( ok && layer_hash != p->journal_layer_hash ) {
+            ok = journal_write_record(&wb, JournalRecord_LAYERS, &request->layers);
+        }
 
-        fd = platform_fopen(fname, TO_PATH_STR("wb"));
+        DArray<u8> payload = {};
+        for ( i64 i = 0; ok && i < request->entries.count; ++i ) {
+            JournalEntry* entry = &request->entries.data[i];
+            reset(&payload);
+            if ( entry->type == JournalRecord_STROKE_ADD || entry->type == JournalRecord_STROKE_REDO ) {
+                journal_serialize_stroke(&entry->stroke, &payload);
+            }
+            ok = journal_write_record(&wb, (u32)entry->type, &payload);
+        }
+        release(&payload);
 
         if ( fd ) {
-            if ( !PATH_STRCMP(ext, TO_PATH_STR("png")) ) {
-                stbi_write_png_to_func(write_func, &fd, w, h, 4, buffer, 0);
+            if ( !write_buffer_flush(&wb) ) {
+                ok = false;
             }
-            else if ( !PATH_STRCMP(ext, TO_PATH_STR("jpg")) || !PATH_STRCMP(ext, TO_PATH_STR("jpeg")) ) {
-                tje_encode_with_func(write_func, &fd, 3, w, h, 4, buffer);
+            write_buffer_release(&wb);
+            if ( ferror(fd) || fclose(fd) != 0 ) {
+                ok = false;
             }
-            else {
-                platform_dialog("File extension not handled by Milton\n", "Info");
+        }
+
+        if ( ok ) {
+            p->journal_layer_hash = layer_hash;
+            p->journal_bytes += end_data_tracking();
+            milton_save_postlude(milton, request->num_strokes);
+        }
+        else {
+            milton_log("Could not append to the journal. Writing a full snapshot.\n");
+            needs_snapshot = true;
+        }
+    }
+
+    // Compaction. Fold the journal back into the snapshot once it gets big.
+    if ( p->journal_bytes > MILTON_JOURNAL_COMPACT_MIN_BYTES &&
+         p->journal_bytes > p->snapshot_bytes / MILTON_JOURNAL_COMPACT_RATIO ) {
+        needs_snapshot = true;
+    }
+
+    if ( needs_snapshot ) {
+        journal_set_needs_snapshot(milton);
+        request->wants_snapshot = true;
+    }
+
+    return end_data_tracking();
+}
+
+void
+milton_save_capture(Milton* milton, SaveRequest* request, b32 full)
+{
+    MiltonPersist* p = milton->persist;
+    *request = {};
+
+    save_lock(milton);
+    request->entries = p->journal_pending;
+    p->journal_pending = {};
+#if MILTON_SAVE_JOURNAL
+    full = full || p->journal_needs_snapshot;
+#else
+    full = true;
+#endif
+    if ( full ) {
+        // Requests captured from now on go after this snapshot. If writing it
+        // fails, the writer asks for another one.
+        p->journal_needs_snapshot = false;
+    }
+    save_unlock(milton);
+
+    PATH_STRNCPY(request->mlt_file_path, p->mlt_file_path, MAX_PATH);
+    request->mlt_binary_version = p->mlt_binary_version;
+    request->num_strokes = layer::count_strokes(milton->canvas->root_layer);
+    journal_serialize_layers(milton, &request->layers);
+
+    if ( full ) {
+        // The snapshot contains everything that was waiting to go into the journal.
+        release(&request->entries);
+        request->entries = {};
+        request->snapshot = snapshot_capture(milton);
+    }
+}
+
+void
+milton_save_request_merge(SaveRequest* dst, SaveRequest* src)
+{
+    if ( src->snapshot ) {
+        // The newer snapshot contains everything in the older request.
+        milton_save_request_release(dst);
+        *dst = *src;
+    }
+    else {
+        for ( i64 i = 0; i < src->entries.count; ++i ) {
+            push(&dst->entries, src->entries.data[i]);
+        }
+        release(&src->entries);
+        release(&dst->layers);
+        dst->layers = src->layers;
+        PATH_STRNCPY(dst->mlt_file_path, src->mlt_file_path, MAX_PATH);
+        dst->mlt_binary_version = src->mlt_binary_version;
+        dst->num_strokes = src->num_strokes;
+    }
+    *src = {};
+}
+
+u64
+milton_save_write(Milton* milton, SaveRequest* request)
+{
+    if ( !request->snapshot && request->layers.count == 0 ) {
+        return 0;  // Nothing was captured.
+    }
+    u64 bytes_written = 0;
+    if ( request->snapshot ) {
+        bytes_written += write_snapshot(milton, request);
+    }
+#if MILTON_SAVE_JOURNAL
+    bytes_written += write_journal(milton, request);
+#endif
+    return bytes_written;
+}
+
+void
+milton_save_request_release(SaveRequest* request)
+{
+    if ( request->snapshot ) {
+        snapshot_release(request->snapshot);
+    }
+    release(&request->entries);
+    release(&request->layers);
+    *request = {};
+}
+
+static void
+save_write_lock(Milton* milton)
+{
+#if MILTON_SAVE_ASYNC
+    if ( milton->save_write_mutex ) { SDL_LockMutex(milton->save_write_mutex); }
+#endif
+}
+
+static void
+save_write_unlock(Milton* milton)
+{
+#if MILTON_SAVE_ASYNC
+    if ( milton->save_write_mutex ) { SDL_UnlockMutex(milton->save_write_mutex); }
+#endif
+}
+
+// Take the request that is waiting for the save thread, so that synchronous
+// saves keep records in order.
+static void
+save_take_request(Milton* milton, SaveRequest* request)
+{
+    save_lock(milton);
+    *request = milton->persist->save_request;
+    milton->persist->save_request = {};
+    save_unlock(milton);
+}
+
+u64
+milton_save(Milton* milton)
+{
+    save_write_lock(milton);
+
+    SaveRequest request = {};
+    save_take_request(milton, &request);
+    SaveRequest snapshot = {};
+    milton_save_capture(milton, &snapshot, /*full*/true);
+    milton_save_request_merge(&request, &snapshot);
+
+    u64 bytes_written = milton_save_write(milton, &request);
+    milton_save_request_release(&request);
+
+    save_write_unlock(milton);
+    return bytes_written;
+}
+
+u64
+milton_journal_flush(Milton* milton)
+{
+    save_write_lock(milton);
+
+    SaveRequest request = {};
+    save_take_request(milton, &request);
+    SaveRequest latest = {};
+    milton_save_capture(milton, &latest, /*full*/false);
+    milton_save_request_merge(&request, &latest);
+
+    u64 bytes_written = milton_save_write(milton, &request);
+    b32 wants_snapshot = request.wants_snapshot;
+    milton_save_request_release(&request);
+
+    if ( wants_snapshot ) {
+        milton_save_capture(milton, &request, /*full*/true);
+        bytes_written += milton_save_write(milton, &request);
+        milton_save_request_release(&request);
+    }
+
+    save_write_unlock(milton);
+    return bytes_written;
+}
+
+static b32
+journal_read_stroke(Milton* milton, MltReader* r, Stroke* stroke)
+{
+    CanvasState* canvas = milton->canvas;
+
+    i32 size_of_brush = 0;
+    read_checked(r, &size_of_brush, sizeof(i32), 1);
+    if ( size_of_brush <= 0 || (size_t)size_of_brush > sizeof(Brush) ) {
+        r->ok = false;
+    }
+    stroke->brush = default_brush();
+    read_checked(r, &stroke->brush, (size_t)size_of_brush, 1);
+    read_checked(r, &stroke->flags, sizeof(stroke->flags), 1);
+    read_checked(r, &stroke->num_points, sizeof(i32), 1);
+    if ( stroke->num_points <= 0 || stroke->num_points > STROKE_MAX_POINTS ) {
+        r->ok = false;
+    }
+    if ( r->ok ) {
+        stroke->points = arena_alloc_array(&canvas->arena, stroke->num_points, v2l);
+        stroke->pressures = arena_alloc_array(&canvas->arena, stroke->num_points, f32);
+#if STROKE_DEBUG_VIZ
+        stroke->debug_flags = arena_alloc_array(&canvas->arena, stroke->num_points, int);
+#endif
+        read_checked(r, stroke->points, sizeof(v2l) * (size_t)stroke->num_points, 1);
+        read_checked(r, stroke->pressures, sizeof(f32) * (size_t)stroke->num_points, 1);
+        read_checked(r, &stroke->layer_id, sizeof(i32), 1);
+    }
+    if ( r->ok ) {
+        stroke->id = canvas->stroke_id_count++;
+        stroke->bounding_rect = bounding_box_for_stroke(stroke);
+    }
+    return r->ok;
+}
+
+static b32
+journal_read_layers(Milton* milton, MltReader* r)
+{
+    CanvasState* canvas = milton->canvas;
+
+    i32 layer_guid = 0;
+    i32 working_layer_id = 0;
+    i32 num_layers = 0;
+    read_checked(r, &layer_guid, sizeof(i32), 1);
+    read_checked(r, &working_layer_id, sizeof(i32), 1);
+    read_checked(r, &num_layers, sizeof(i32), 1);
+
+    if ( num_layers <= 0 || (size_t)num_layers > r->size ) {
+        r->ok = false;
+    }
+
+    Layer** ordered = NULL;
+    if ( r->ok ) {
+        ordered = (Layer**)mlt_calloc((size_t)num_layers, sizeof(Layer*), "Persist");
+    }
+
+    for ( i32 i = 0; r->ok && i < num_layers; ++i ) {
+        i32 id = 0;
+        i32 len = 0;
+        read_checked(r, &id, sizeof(i32), 1);
+        read_checked(r, &len, sizeof(i32), 1);
+        if ( len <= 0 || len > MAX_LAYER_NAME_LEN ) {
+            r->ok = false;
+            break;
+        }
+
+        Layer* layer = layer::get_by_id(canvas->root_layer, id);
+        for ( i32 j = 0; layer && j < i; ++j ) {
+            if ( ordered[j] == layer ) {
+                r->ok = false;  // Repeated id.
             }
+        }
+        if ( !r->ok ) {
+            break;
+        }
+        if ( layer == NULL ) {
+            milton_new_layer_with_id(milton, id);
+            layer = canvas->working_layer;
+        }
+        ordered[i] = layer;
 
-            // !! fd might have been set to NULL if write_func failed.
-            if ( fd ) {
-                if ( ferror(fd) ) {
-                    platform_dialog("Unknown error when writing to file :(", "Unknown error");
+        read_checked(r, layer->name, (size_t)len, 1);
+        layer->name[MAX_LAYER_NAME_LEN - 1] = '\0';
+        read_checked(r, &layer->flags, sizeof(layer->flags), 1);
+        read_checked(r, &layer->alpha, sizeof(layer->alpha), 1);
+
+        i64 num_effects = 0;
+        read_checked(r, &num_effects, sizeof(num_effects), 1);
+        if ( num_effects < 0 || (size_t)num_effects > r->size ) {
+            r->ok = false;
+        }
+        layer->effects = NULL;
+        LayerEffect** e = &layer->effects;
+        for ( i64 ei = 0; r->ok && ei < num_effects; ++ei ) {
+            *e = arena_alloc_elem(&canvas->arena, LayerEffect);
+            read_checked(r, &(*e)->type, sizeof((*e)->type), 1);
+            read_checked(r, &(*e)->enabled, sizeof((*e)->enabled), 1);
+            switch ( (*e)->type ) {
+                case LayerEffectType_BLUR: {
+                    read_checked(r, &(*e)->blur.original_scale, sizeof((*e)->blur.original_scale), 1);
+                    read_checked(r, &(*e)->blur.kernel_size, sizeof((*e)->blur.kernel_size), 1);
+                } break;
+            }
+            e = &(*e)->next;
+        }
+    }
+
+    if ( r->ok ) {
+        // Layers that are not in the record were deleted.
+        for ( i32 i = 0; i < num_layers; ++i ) {
+            ordered[i]->prev = i > 0 ? ordered[i - 1] : NULL;
+            ordered[i]->next = i < num_layers - 1 ? ordered[i + 1] : NULL;
+        }
+        canvas->root_layer = ordered[0];
+        canvas->layer_guid = layer_guid;
+
+        Layer* working = layer::get_by_id(canvas->root_layer, working_layer_id);
+        milton_set_working_layer(milton, working ? working : canvas->root_layer);
+    }
+
+    mlt_free(ordered, "Persist");
+
+    return r->ok;
+}
+
+static b32
+journal_replay(Milton* milton, u64 snapshot_bytes)
+{
+    MiltonPersist* p = milton->persist;
+    PATH_CHAR fname[MAX_PATH] = {};
+    journal_fname(fname, p->mlt_file_path);
+
+    FILE* fd = platform_fopen(fname, TO_PATH_STR("rb"));
+    if ( !fd ) {
+        return false;
+    }
+
+    JournalHeader header = {};
+    b32 valid = fread_checked(&header, sizeof(header), 1, fd) &&
+                header.magic == MILTON_JOURNAL_MAGIC_NUMBER &&
+                header.version == p->mlt_binary_version &&
+                header.snapshot_bytes == snapshot_bytes;
+
+    u64 journal_bytes = sizeof(JournalHeader);
+    i64 num_records = 0;
+    DArray<u8> payload = {};
+
+    while ( valid ) {
+        JournalRecordHeader rh = {};
+        if ( !fread_checked(&rh, sizeof(rh), 1, fd) ) {
+            // Either the end of the journal, or a record header that didn't make it to disk.
+            valid = feof(fd) && ftell(fd) == (long)journal_bytes;
+            break;
+        }
+        if ( rh.type >= JournalRecord_COUNT ) {
+            valid = false;
+            break;
+        }
+        reset(&payload);
+        reserve(&payload, (i64)rh.size);
+        if ( rh.size > 0 && !fread_checked(payload.data, rh.size, 1, fd) ) {
+            valid = false;
+            break;
+        }
+
+        MltReader r = { payload.data, rh.size, 0, true };
+        switch ( rh.type ) {
+            case JournalRecord_STROKE_ADD: {
+                Stroke stroke = {};
+                if ( journal_read_stroke(milton, &r, &stroke) ) {
+                    Layer* layer = layer::get_by_id(milton->canvas->root_layer, stroke.layer_id);
+                    if ( layer ) {
+                        milton_commit_stroke(milton, layer, stroke);
+                    }
                 }
-                else {
-                    platform_dialog("Image exported successfully!", "Success");
+            } break;
+            case JournalRecord_STROKE_REDO: {
+                Stroke stroke = {};
+                if ( journal_read_stroke(milton, &r, &stroke) ) {
+                    // The redo stack is not saved in the snapshot. Use the stroke in the record.
+                    if ( milton_redo(milton) == NULL ) {
+                        Layer* layer = layer::get_by_id(milton->canvas->root_layer, stroke.layer_id);
+                        if ( layer ) {
+                            HistoryElement h = { HistoryElement_STROKE_ADD, layer->id };
+                            layer::layer_push_stroke(layer, stroke);
+                            push(&milton->canvas->history, h);
+                        }
+                    }
                 }
-                fclose(fd);
+            } break;
+            case JournalRecord_UNDO: {
+                milton_undo(milton);
+            } break;
+            case JournalRecord_LAYERS: {
+                journal_read_layers(milton, &r);
+            } break;
+        }
+
+        if ( !r.ok ) {
+            valid = false;
+            break;
+        }
+        journal_bytes += sizeof(rh) + rh.size;
+        ++num_records;
+    }
+
+    release(&payload);
+    fclose(fd);
+
+    if ( num_records > 0 ) {
+        milton_log("Replayed %d journal records.\n", (int)num_records);
+    }
+
+    if ( valid ) {
+        // Keep appending to this journal.
+        PATH_STRNCPY(p->journal_mlt_path, p->mlt_file_path, MAX_PATH);
+        p->journal_bytes = journal_bytes;
+        p->snapshot_bytes = snapshot_bytes;
+        p->journal_layer_hash = journal_layers_hash(milton);
+        p->journal_needs_snapshot = false;
+    }
+    else {
+        milton_log("Journal does not match the canvas or is incomplete. It will be replaced by a new snapshot.\n");
+        p->journal_needs_snapshot = true;
+    }
+
+    return valid;
+}
+
+PATH_CHAR*
+milton_get_last_canvas_fname()
+{
+    PATH_CHAR* last_fname = (PATH_CHAR*)mlt_calloc(MAX_PATH, sizeof(PATH_CHAR), "Strings");
+
+    PATH_CHAR full[MAX_PATH] = {};
+
+    PATH_STRCPY(full, TO_PATH_STR("saved_path"));
+    platform_fname_at_config(full, MAX_PATH);
+    FILE* fd = platform_fopen(full, TO_PATH_STR("rb+"));
+
+    if ( fd ) {
+        u64 len = 0;
+        fread(&len, sizeof(len), 1, fd);
+        if ( len < MAX_PATH ) {
+            fread(last_fname, sizeof(PATH_CHAR), len, fd);
+            // If the read fails, or if the file doesn't exist, milton_load
+            // will fail gracefully and load a default canvas.
+            fclose(fd);
+        }
+    } else {
+        mlt_free(last_fname, "Strings");
+    }
+
+    return last_fname;
+
+}
+
+void
+milton_set_last_canvas_fname(PATH_CHAR* last_fname)
+{
+    //PATH_CHAR* full = (PATH_CHAR*)mlt_calloc(MAX_PATH, sizeof(char));
+    //wcscpy(full, "last_canvas_fname");
+    PATH_CHAR full[MAX_PATH] = { TO_PATH_STR("saved_path") };
+    platform_fname_at_config(full, MAX_PATH);
+    FILE* fd = platform_fopen(full, TO_PATH_STR("wb"));
+    if ( fd ) {
+        u64 len = PATH_STRLEN(last_fname)+1;
+        fwrite(&len, sizeof(len), 1, fd);
+        fwrite(last_fname, sizeof(*last_fname), len, fd);
+        fclose(fd);
+    }
+}
+
+enum ImageFormat
+{
+    ImageFormat_NO_EXTENSION,
+    ImageFormat_UNKNOWN,
+    ImageFormat_PNG,
+    ImageFormat_JPEG,
+};
+
+static ImageFormat
+image_format_from_fname(PATH_CHAR* fname)
+{
+    int len = 0;
+    {
+        size_t sz = PATH_STRLEN(fname);
+        if ( sz > ((1u << 31) -1) ) {
+            milton_die_gracefully("A really, really long file name. This shouldn't happen.");
+        }
+        len = (int)sz;
+    }
+    size_t ext_sz = ( len+1 ) * sizeof(PATH_CHAR);
+    PATH_CHAR* fname_copy = (PATH_CHAR*)mlt_calloc(ext_sz, 1, "Strings");
+    fname_copy[0] = '\0';
+    PATH_STRCPY(fname_copy, fname);
+
+    // NOTE: This should work with unicode.
+    int ext_len = 0;
+    PATH_CHAR* ext = fname_copy + len;
+    b32 found = false;
+    {
+        int safety = len;
+        while ( *--ext != '.' ) {
+            if( safety-- == 0 ) {
+                break;
             }
-            else {
-                platform_dialog("File created, but there was an error writing to it.", "Error");
+        }
+        if ( safety > 0 ) {
+            found = true;
+            ext_len = len - safety;
+            ++ext;
+        }
+    }
+
+    ImageFormat format = ImageFormat_NO_EXTENSION;
+    if ( found ) {
+        for ( int i = 0; i < ext_len; ++i ) {
+            PATH_CHAR c = ext[i];
+            ext[i] = PATH_TOLOWER(c);
+        }
+        if ( !PATH_STRCMP(ext, TO_PATH_STR("png")) ) {
+            format = ImageFormat_PNG;
+        }
+        else if ( !PATH_STRCMP(ext, TO_PATH_STR("jpg")) || !PATH_STRCMP(ext, TO_PATH_STR("jpeg")) ) {
+            format = ImageFormat_JPEG;
+        }
+        else {
+            format = ImageFormat_UNKNOWN;
+        }
+    }
+    mlt_free(fname_copy, "Strings");
+    return format;
+}
+
+//
+// Streaming image export
+//
+// Images get written a strip of rows at a time, so their size is not bound by
+// memory. JPEG strips go to tiny_jpeg. PNG strips are split into bands that
+// are compressed on their own, on the job threads: each one is a fixed-Huffman
+// deflate block ending on a byte boundary, and goes into its own IDAT chunk.
+//
+
+#define DEFLATE_WINDOW_SIZE     32768
+#define DEFLATE_HASH_BITS       15
+#define DEFLATE_MAX_CHAIN       32
+#define DEFLATE_MIN_MATCH       3
+#define DEFLATE_MAX_MATCH       258
+
+static const u16 g_deflate_length_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258,
+};
+static const u8 g_deflate_length_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0,
+};
+static const u16 g_deflate_dist_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577,
+};
+static const u8 g_deflate_dist_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13,
+};
+
+struct DeflateBits
+{
+    DArray<u8>* out;
+    u32         bits;
+    i32         count;
+};
+
+static void
+deflate_put_bits(DeflateBits* b, u32 value, i32 num_bits)
+{
+    b->bits |= value << b->count;
+    b->count += num_bits;
+    while ( b->count >= 8 ) {
+        push(b->out, (u8)(b->bits & 0xff));
+        b->bits >>= 8;
+        b->count -= 8;
+    }
+}
+
+// Huffman codes go most significant bit first.
+static void
+deflate_put_code(DeflateBits* b, u32 code, i32 num_bits)
+{
+    u32 reversed = 0;
+    for ( i32 i = 0; i < num_bits; ++i ) {
+        reversed = (reversed << 1) | ((code >> i) & 1);
+    }
+    deflate_put_bits(b, reversed, num_bits);
+}
+
+// Fixed Huffman code for the literal/length alphabet.
+static void
+deflate_put_symbol(DeflateBits* b, u32 symbol)
+{
+    if ( symbol <= 143 )      { deflate_put_code(b, 0x30 + symbol, 8); }
+    else if ( symbol <= 255 ) { deflate_put_code(b, 0x190 + symbol - 144, 9); }
+    else if ( symbol <= 279 ) { deflate_put_code(b, symbol - 256, 7); }
+    else                      { deflate_put_code(b, 0xc0 + symbol - 280, 8); }
+}
+
+static void
+deflate_put_match(DeflateBits* b, i32 length, i32 dist)
+{
+    i32 lc = 0;
+    while ( lc < 28 && g_deflate_length_base[lc + 1] <= length ) {
+        ++lc;
+    }
+    deflate_put_symbol(b, (u32)(257 + lc));
+    deflate_put_bits(b, (u32)(length - g_deflate_length_base[lc]), g_deflate_length_extra[lc]);
+
+    i32 dc = 0;
+    while ( dc < 29 && g_deflate_dist_base[dc + 1] <= dist ) {
+        ++dc;
+    }
+    deflate_put_code(b, (u32)dc, 5);
+    deflate_put_bits(b, (u32)(dist - g_deflate_dist_base[dc]), g_deflate_dist_extra[dc]);
+}
+
+static u32
+deflate_hash(u8* p)
+{
+    u32 v = ((u32)p[0] << 16) | ((u32)p[1] << 8) | p[2];
+    return (v * 2654435761u) >> (32 - DEFLATE_HASH_BITS);
+}
+
+// Hash chains for the match finder. One per thread compressing.
+struct DeflateTables
+{
+    i32* head;
+    i32* prev;
+};
+
+static void
+deflate_tables_init(DeflateTables* tables)
+{
+    tables->head = (i32*)mlt_calloc(1 << DEFLATE_HASH_BITS, sizeof(i32), "Bitmap");
+    tables->prev = (i32*)mlt_calloc(DEFLATE_WINDOW_SIZE, sizeof(i32), "Bitmap");
+}
+
+static void
+deflate_tables_release(DeflateTables* tables)
+{
+    mlt_free(tables->head, "Bitmap");
+    mlt_free(tables->prev, "Bitmap");
+}
+
+// Upper bound for the output of deflate_block. Literals take at most 9 bits.
+static i64
+deflate_bound(i64 size)
+{
+    return size + size / 8 + 16;
+}
+
+// Compress `data` as one block that ends on a byte boundary. Blocks that are
+// not the last one are followed by an empty stored block, like a zlib sync
+// flush. Blocks can then be concatenated into a single deflate stream.
+//
+// Does not allocate when `out` has room for deflate_bound(size) more bytes.
+static void
+deflate_block(DeflateTables* tables, u8* data, i64 size, b32 last, DArray<u8>* out)
+{
+    i32* head = tables->head;
+    i32* prev = tables->prev;
+    memset(head, 0xff, (1 << DEFLATE_HASH_BITS) * sizeof(i32));  // -1: No position.
+
+    DeflateBits b = {};
+    b.out = out;
+    deflate_put_bits(&b, last ? 1 : 0, 1);
+    deflate_put_bits(&b, 1, 2);  // Fixed Huffman codes.
+
+    i64 i = 0;
+    while ( i < size ) {
+        i32 best_len = 0;
+        i32 best_dist = 0;
+        if ( i + DEFLATE_MIN_MATCH <= size ) {
+            u32 h = deflate_hash(data + i);
+            i32 max_len = (i32)min((i64)DEFLATE_MAX_MATCH, size - i);
+            i64 candidate = head[h];
+            for ( i32 chain = 0;
+                  chain < DEFLATE_MAX_CHAIN && candidate >= 0 && i - candidate <= DEFLATE_WINDOW_SIZE;
+                  ++chain ) {
+                i32 len = 0;
+                while ( len < max_len && data[candidate + len] == data[i + len] ) {
+                    ++len;
+                }
+                if ( len > best_len ) {
+                    best_len = len;
+                    best_dist = (i32)(i - candidate);
+                    if ( len == max_len ) {
+                        break;
+                    }
+                }
+                candidate = prev[candidate & (DEFLATE_WINDOW_SIZE - 1)];
             }
+            prev[i & (DEFLATE_WINDOW_SIZE - 1)] = head[h];
+            head[h] = (i32)i;
+        }
+
+        if ( best_len >= DEFLATE_MIN_MATCH ) {
+            deflate_put_match(&b, best_len, best_dist);
+            // Later matches can start inside this one.
+            for ( i64 j = i + 1; j < i + best_len && j + DEFLATE_MIN_MATCH <= size; ++j ) {
+                u32 h = deflate_hash(data + j);
+                prev[j & (DEFLATE_WINDOW_SIZE - 1)] = head[h];
+                head[h] = (i32)j;
+            }
+            i += best_len;
         }
         else {
-            platform_dialog ( "Could not open file", "Error" );
+            deflate_put_symbol(&b, data[i]);
+            ++i;
         }
     }
-    else {
+
+    deflate_put_symbol(&b, 256);  // End of block.
+    if ( !last ) {
+        deflate_put_bits(&b, 0, 3);  // Stored block header.
+    }
+    if ( b.count > 0 ) {
+        deflate_put_bits(&b, 0, 8 - b.count);
+    }
+    if ( !last ) {
+        u8 empty[4] = { 0x00, 0x00, 0xff, 0xff };  // LEN and NLEN.
+        for ( i32 k = 0; k < 4; ++k ) {
+            push(out, empty[k]);
+        }
+    }
+}
+
+static u32
+adler32_update(u32 adler, u8* data, i64 size)
+{
+    u32 a = adler & 0xffff;
+    u32 b = adler >> 16;
+    while ( size > 0 ) {
+        i64 n = min(size, (i64)5552);  // Largest n that can't overflow before the modulo.
+        for ( i64 i = 0; i < n; ++i ) {
+            a += data[i];
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+        data += n;
+        size -= n;
+    }
+    return (b << 16) | a;
+}
+
+// Checksum of A followed by B, from the checksums of both and the size of B.
+static u32
+adler32_combine(u32 adler_a, u32 adler_b, i64 size_b)
+{
+    const u32 base = 65521;
+    u32 rem = (u32)(size_b % base);
+    u32 a = adler_a & 0xffff;
+    u32 b = (u32)(((u64)rem * a) % base);
+    a += (adler_b & 0xffff) + base - 1;
+    b += (adler_a >> 16) + (adler_b >> 16) + base - rem;
+    a %= base;
+    b %= base;
+    return (b << 16) | a;
+}
+
+static u32 g_crc32_table[256];
+
+// Called before any thread uses crc32_update.
+static void
+crc32_init()
+{
+    if ( g_crc32_table[1] == 0 ) {
+        for ( u32 n = 0; n < 256; ++n ) {
+            u32 c = n;
+            for ( int k = 0; k < 8; ++k ) {
+                c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            }
+            g_crc32_table[n] = c;
+        }
+    }
+}
+
+static u32
+crc32_update(u32 crc, u8* data, i64 size)
+{
+    crc = ~crc;
+    for ( i64 i = 0; i < size; ++i ) {
+        crc = g_crc32_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static u8
+png_paeth(i32 a, i32 b, i32 c)
+{
+    i32 p = a + b - c;
+    i32 pa = MLT_ABS(p - a);
+    i32 pb = MLT_ABS(p - b);
+    i32 pc = MLT_ABS(p - c);
+    if ( pa <= pb && pa <= pc ) { return (u8)a; }
+    if ( pb <= pc ) { return (u8)b; }
+    return (u8)c;
+}
+
+// Write the filter type followed by the filtered row. Picks the filter with
+// the smallest sum of absolute differences.
+static void
+png_filter_row(u8* row, u8* above, i32 row_size, u8* scratch, u8* out)
+{
+    i32 best_filter = 0;
+    i64 best_cost = -1;
+    for ( i32 filter = 0; filter < 5; ++filter ) {
+        i64 cost = 0;
+        for ( i32 i = 0; i < row_size; ++i ) {
+            i32 left = i >= 4 ? row[i - 4] : 0;
+            i32 up = above ? above[i] : 0;
+            i32 up_left = (above && i >= 4) ? above[i - 4] : 0;
+            u8 predicted = 0;
+            switch ( filter ) {
+                case 1: { predicted = (u8)left; } break;
+                case 2: { predicted = (u8)up; } break;
+                case 3: { predicted = (u8)((left + up) >> 1); } break;
+                case 4: { predicted = png_paeth(left, up, up_left); } break;
+            }
+            scratch[i] = (u8)(row[i] - predicted);
+            cost += MLT_ABS((i8)scratch[i]);
+        }
+        if ( best_cost < 0 || cost < best_cost ) {
+            best_cost = cost;
+            best_filter = filter;
+            memcpy(out + 1, scratch, (size_t)row_size);
+        }
+    }
+    out[0] = (u8)best_filter;
+}
+
+// Strips are split into bands of rows that get filtered and compressed in
+// parallel, each into its own IDAT chunk. Like pigz, bands do not look back
+// into each other for matches.
+struct PngBand
+{
+    u8*         rows;
+    u8*         above;      // NULL for the top row of the image.
+    i32         num_rows;
+    u8*         filtered;
+    i64         filtered_size;
+    b32         first;      // Starts the zlib stream.
+    b32         last;       // Ends the deflate stream.
+    u32         adler;      // Of the filtered rows.
+    u32         crc;        // Of the IDAT chunk.
+    DArray<u8>  compressed;
+};
+
+// Scratch memory for one of the threads compressing bands.
+struct PngWorker
+{
+    u8*             scratch;
+    DeflateTables   tables;
+};
+
+struct ImageWriter
+{
+    ImageFormat format;
+    FILE*       fd;
+    i32         width;
+    i32         height;
+    i32         next_row;
+    b32         ok;
+
+    TJEStream*  jpeg;
+
+    // PNG
+    u8*             last_row;  // Bottom row of the previous strip. Rows are filtered against the one above.
+    u32             adler;
+    DArray<u8>      filtered;
+    DArray<PngBand> bands;
+    i64             num_bands;  // In the current strip. Bands past it keep their buffers.
+    PngWorker*      workers;
+    i32             num_workers;
+};
+
+static void
+image_writer_write(ImageWriter* writer, const void* data, size_t size)
+{
+    if ( writer->ok && size > 0 && fwrite(data, size, 1, writer->fd) != 1 ) {
+        writer->ok = false;
+    }
+}
+
+static void
+image_writer_jpeg_func(void* context, void* data, int size)
+{
+    image_writer_write((ImageWriter*)context, data, (size_t)size);
+}
+
+static void
+png_put_u32(u8* dst, u32 value)
+{
+    dst[0] = (u8)(value >> 24);
+    dst[1] = (u8)(value >> 16);
+    dst[2] = (u8)(value >> 8);
+    dst[3] = (u8)value;
+}
+
+static void
+png_write_chunk_with_crc(ImageWriter* writer, const char* type, u8* data, u32 size, u32 crc)
+{
+    u8 length[4];
+    png_put_u32(length, size);
+    u8 crc_bytes[4];
+    png_put_u32(crc_bytes, crc);
+
+    image_writer_write(writer, length, 4);
+    image_writer_write(writer, type, 4);
+    image_writer_write(writer, data, size);
+    image_writer_write(writer, crc_bytes, 4);
+}
+
+static u32
+png_chunk_crc(const char* type, u8* data, u32 size)
+{
+    u32 crc = crc32_update(0, (u8*)type, 4);
+    return crc32_update(crc, data, size);
+}
+
+static void
+png_write_chunk(ImageWriter* writer, const char* type, u8* data, u32 size)
+{
+    png_write_chunk_with_crc(writer, type, data, size, png_chunk_crc(type, data, size));
+}
+
+// Each job is one worker, going through every num_workers-th band.
+static void
+png_band_job(void* data, i64 job_index)
+{
+    ImageWriter* writer = (ImageWriter*)data;
+    PngWorker* worker = &writer->workers[job_index];
+    i32 row_size = writer->width * 4;
+
+    for ( i64 bi = job_index; bi < writer->num_bands; bi += writer->num_workers ) {
+        PngBand* band = &writer->bands.data[bi];
+        for ( i32 j = 0; j < band->num_rows; ++j ) {
+            u8* row = band->rows + (size_t)j * row_size;
+            u8* above = j > 0 ? row - row_size : band->above;
+            png_filter_row(row, above, row_size, worker->scratch, band->filtered + (size_t)j * (row_size + 1));
+        }
+        band->adler = adler32_update(1, band->filtered, band->filtered_size);
+
+        reset(&band->compressed);
+        if ( band->first ) {
+            push(&band->compressed, (u8)0x78);  // zlib header. Deflate, 32K window.
+            push(&band->compressed, (u8)0x01);
+        }
+        deflate_block(&worker->tables, band->filtered, band->filtered_size, band->last, &band->compressed);
+        band->crc = png_chunk_crc("IDAT", band->compressed.data, (u32)band->compressed.count);
+    }
+}
+
+ImageWriter*
+image_writer_begin(PATH_CHAR* fname, i32 w, i32 h)
+{
+    ImageFormat format = image_format_from_fname(fname);
+    if ( format == ImageFormat_NO_EXTENSION ) {
         platform_dialog("File name missing extension!\n", "Error");
+        return NULL;
+    }
+    if ( format == ImageFormat_UNKNOWN ) {
+        platform_dialog("File extension not handled by Milton\n", "Info");
+        return NULL;
+    }
+    FILE* fd = platform_fopen(fname, TO_PATH_STR("wb"));
+    if ( !fd ) {
+        platform_dialog ( "Could not open file", "Error" );
+        return NULL;
+    }
+
+    ImageWriter* writer = (ImageWriter*)mlt_calloc(1, sizeof(ImageWriter), "Bitmap");
+    writer->format = format;
+    writer->fd = fd;
+    writer->width = w;
+    writer->height = h;
+    writer->ok = true;
+
+    if ( format == ImageFormat_JPEG ) {
+        writer->jpeg = tje_stream_begin(image_writer_jpeg_func, writer, 3, w, h, 4);
+        if ( !writer->jpeg ) {
+            platform_dialog("JPEG images can't be larger than 65535 pixels on a side. Try PNG.", "Error");
+            writer->ok = false;
+        }
+    }
+    else {
+        u8 signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+        image_writer_write(writer, signature, sizeof(signature));
+
+        u8 ihdr[13] = {};
+        png_put_u32(ihdr + 0, (u32)w);
+        png_put_u32(ihdr + 4, (u32)h);
+        ihdr[8] = 8;  // Bit depth.
+        ihdr[9] = 6;  // RGBA.
+        png_write_chunk(writer, "IHDR", ihdr, sizeof(ihdr));
+
+        size_t row_size = (size_t)w * 4;
+        writer->last_row = (u8*)mlt_calloc(row_size, 1, "Bitmap");
+        writer->adler = 1;
+
+        crc32_init();
+        writer->num_workers = jobs_num_threads();
+        writer->workers = (PngWorker*)mlt_calloc((size_t)writer->num_workers, sizeof(PngWorker), "Bitmap");
+        for ( i32 i = 0; i < writer->num_workers; ++i ) {
+            writer->workers[i].scratch = (u8*)mlt_calloc(row_size, 1, "Bitmap");
+            deflate_tables_init(&writer->workers[i].tables);
+        }
+    }
+    return writer;
+}
+
+b32
+image_writer_rows(ImageWriter* writer, u8* rows, i32 num_rows)
+{
+    if ( num_rows <= 0 || writer->next_row + num_rows > writer->height ) {
+        writer->ok = false;
+    }
+    if ( !writer->ok ) {
+        return false;
+    }
+
+    b32 first = writer->next_row == 0;
+    writer->next_row += num_rows;
+    b32 last = writer->next_row == writer->height;
+
+    if ( writer->format == ImageFormat_JPEG ) {
+        if ( !tje_stream_rows(writer->jpeg, rows, num_rows) ) {
+            writer->ok = false;
+        }
+    }
+    else {
+        i32 row_size = writer->width * 4;
+        i32 band_rows = max(1, IMAGE_EXPORT_PNG_BAND_BYTES / row_size);
+        i64 num_bands = (num_rows + band_rows - 1) / band_rows;
+
+        reset(&writer->filtered);
+        reserve(&writer->filtered, (i64)num_rows * (row_size + 1));
+        writer->filtered.count = (i64)num_rows * (row_size + 1);
+
+        // Bands keep their output buffers from strip to strip. Everything the
+        // jobs write to is allocated here, up front.
+        while ( writer->bands.count < num_bands ) {
+            push(&writer->bands, PngBand{});
+        }
+        writer->num_bands = num_bands;
+        for ( i64 bi = 0; bi < num_bands; ++bi ) {
+            PngBand* band = &writer->bands.data[bi];
+            i32 row = (i32)bi * band_rows;
+            band->rows = rows + (size_t)row * row_size;
+            band->above = row > 0 ? band->rows - row_size : (first ? NULL : writer->last_row);
+            band->num_rows = min(band_rows, num_rows - row);
+            band->filtered = writer->filtered.data + (size_t)row * (row_size + 1);
+            band->filtered_size = (i64)band->num_rows * (row_size + 1);
+            band->first = first && bi == 0;
+            band->last = last && bi == num_bands - 1;
+            reserve(&band->compressed, deflate_bound(band->filtered_size) + 2);
+        }
+
+        jobs_run(png_band_job, writer, min((i64)writer->num_workers, num_bands));
+
+        for ( i64 bi = 0; bi < num_bands; ++bi ) {
+            PngBand* band = &writer->bands.data[bi];
+            writer->adler = adler32_combine(writer->adler, band->adler, band->filtered_size);
+            png_write_chunk_with_crc(writer, "IDAT", band->compressed.data, (u32)band->compressed.count, band->crc);
+        }
+        if ( last ) {
+            u8 adler[4];
+            png_put_u32(adler, writer->adler);
+            png_write_chunk(writer, "IDAT", adler, 4);
+        }
+        memcpy(writer->last_row, rows + (size_t)(num_rows - 1) * row_size, (size_t)row_size);
+    }
+    return writer->ok;
+}
+
+b32
+image_writer_end(ImageWriter* writer)
+{
+    b32 ok = writer->ok && writer->next_row == writer->height;
+    if ( writer->jpeg ) {
+        if ( !tje_stream_end(writer->jpeg) ) {
+            ok = false;
+        }
+    }
+    if ( writer->format == ImageFormat_PNG ) {
+        if ( ok ) {
+            png_write_chunk(writer, "IEND", NULL, 0);
+            ok = writer->ok;
+        }
+        mlt_free(writer->last_row, "Bitmap");
+        for ( i32 i = 0; i < writer->num_workers; ++i ) {
+            mlt_free(writer->workers[i].scratch, "Bitmap");
+            deflate_tables_release(&writer->workers[i].tables);
+        }
+        mlt_free(writer->workers, "Bitmap");
+        for ( i64 bi = 0; bi < writer->bands.count; ++bi ) {
+            release(&writer->bands.data[bi].compressed);
+        }
+        release(&writer->filtered);
+        release(&writer->bands);
+    }
+    if ( ferror(writer->fd) ) {
+        ok = false;
+    }
+    if ( fclose(writer->fd) != 0 ) {
+        ok = false;
+    }
+    mlt_free(writer, "Bitmap");
+    return ok;
+}
+
+void
+milton_export_image(Milton* milton, PATH_CHAR* fname, i32 x, i32 y, i32 w, i32 h, i32 scale, f32 background_alpha)
+{
+    i32 image_w = w * scale;
+    i32 image_h = h * scale;
+
+    // Tiles fit in the GPU viewport. Strips are as tall as a tile, unless the
+    // image is so wide that a strip would take more than its memory budget.
+    float viewport_limits[2] = {};
+    gpu_get_viewport_limits(milton->renderer, viewport_limits);
+    i32 tile_w = min(IMAGE_EXPORT_TILE_SIZE, (i32)viewport_limits[0]);
+    i32 tile_h = min(IMAGE_EXPORT_TILE_SIZE, (i32)viewport_limits[1]);
+    // Edge tiles are rendered at full size, so tiles are no bigger than the image.
+    tile_w = min(tile_w, image_w);
+    tile_h = min(tile_h, image_h);
+    i64 strip_rows = IMAGE_EXPORT_STRIP_BYTES / ((i64)image_w * 4);
+    tile_h = (i32)max((i64)8, min((i64)tile_h, strip_rows)) & ~7;  // JPEG strips are a multiple of 8 rows.
+
+    ImageWriter* writer = image_writer_begin(fname, image_w, image_h);
+    if ( !writer ) {
+        return;
+    }
+
+    u8* tile = (u8*)mlt_calloc((size_t)tile_w * tile_h * 4, 1, "Bitmap");
+    u8* strip = (u8*)mlt_calloc((size_t)image_w * tile_h * 4, 1, "Bitmap");
+    b32 ok = tile != NULL && strip != NULL;
+    if ( !ok ) {
+        platform_dialog(loc(TXT_MSG_memerr_did_not_write), loc(TXT_error));
+    }
+
+    if ( ok ) {
+        gpu_render_to_buffer_begin(milton, scale, x, y, w, h, tile_w, tile_h);
+    }
+    for ( i32 strip_y = 0; ok && strip_y < image_h; strip_y += tile_h ) {
+        i32 rows = min(tile_h, image_h - strip_y);
+        for ( i32 tile_x = 0; tile_x < image_w; tile_x += tile_w ) {
+            i32 cols = min(tile_w, image_w - tile_x);
+            gpu_render_to_buffer_tile(milton, tile, tile_x, strip_y, cols, rows, background_alpha);
+            for ( i32 j = 0; j < rows; ++j ) {
+                memcpy(strip + ((size_t)j * image_w + tile_x) * 4, tile + (size_t)j * cols * 4, (size_t)cols * 4);
+            }
+        }
+        ok = image_writer_rows(writer, strip, rows);
+    }
+
+    b32 had_memory = tile != NULL && strip != NULL;
+    if ( had_memory ) {
+        gpu_render_to_buffer_end(milton);
+    }
+    if ( !image_writer_end(writer) ) {
+        ok = false;
+    }
+    if ( tile ) { mlt_free(tile, "Bitmap"); }
+    if ( strip ) { mlt_free(strip, "Bitmap"); }
+
+    if ( ok ) {
+        platform_dialog("Image exported successfully!", "Success");
+    }
+    else if ( had_memory ) {
+        platform_dialog("File created, but there was an error writing to it.", "Error");
     }
-    mlt_free(fname_copy, "Strings");
 }
 
 b32
@@ -903,8 +3131,10 @@ milton_settings_load(MiltonSettings* settings)
     if ( fd ) {
         u16 struct_size = 0;
         if ( fread(&struct_size, sizeof(u16), 1, fd) ) {
+            // Files from older versions are smaller. Fields they don't have
+            // keep their defaults.
             if (struct_size <= sizeof(*settings)) {
-                if ( fread(settings, sizeof(*settings), 1, fd) ) {
+                if ( fread(settings, struct_size, 1, fd) ) {
                     ok = true;
                 }
             }
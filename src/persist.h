@@ -4,10 +4,46 @@
 #pragma once
 
 #include "platform.h"
+#include "DArray.h"
+#include "stroke.h"
 
 struct Milton;
 struct MiltonSettings;
 
+// Records appended to the journal that lives next to the .mlt file.
+// See milton_journal_flush in persist.cc
+enum JournalRecordType
+{
+    JournalRecord_STROKE_ADD,
+    JournalRecord_STROKE_REDO,
+    JournalRecord_UNDO,
+    JournalRecord_LAYERS,  // Layer order, names, flags, alpha and effects.
+
+    JournalRecord_COUNT,
+};
+
+struct JournalEntry
+{
+    i32     type;  // JournalRecordType
+    Stroke  stroke;  // STROKE_ADD and STROKE_REDO. Points live in the canvas arena.
+};
+
+struct CanvasSnapshot;  // See persist.cc
+
+// What a save writes, captured on the main thread when the save is requested.
+// Writing it does not touch the canvas, so the user can keep drawing meanwhile.
+struct SaveRequest
+{
+    CanvasSnapshot*         snapshot;       // Full save. NULL when the journal is enough.
+    DArray<JournalEntry>    entries;        // Committed after the snapshot, or after the previous request.
+    DArray<u8>              layers;         // Layer state for the journal. See journal_serialize_layers.
+    PATH_CHAR               mlt_file_path[MAX_PATH];
+    u32                     mlt_binary_version;
+    i64                     num_strokes;
+
+    b32                     wants_snapshot; // Set when written. The journal could not take the entries.
+};
+
 struct MiltonPersist
 {
     // Persistence
@@ -19,16 +55,73 @@ struct MiltonPersist
                                         // Check that all the strokes are saved at quit time in case
                                         // the last MoveFileEx failed.
     float target_MB_per_sec;
+    b32   compact_points;  // Save with MltFileFlags_COMPACT_POINTS.
 
     sz bytes_to_last_block;
+
+    // Journal. Committed changes are appended to it instead of re-writing the
+    // whole .mlt file. The snapshot gets re-written when the journal grows too big.
+    DArray<JournalEntry>    journal_pending;        // Filled by the main thread, drained when saving.
+    PATH_CHAR               journal_mlt_path[MAX_PATH];  // The .mlt file the journal refers to.
+    u64                     journal_bytes;
+    u64                     snapshot_bytes;         // Size of the .mlt file the journal applies to.
+    u64                     journal_layer_hash;     // Last layer state written to the journal.
+    b32                     journal_needs_snapshot; // The next capture is a full snapshot.
+
+    // Captured by trigger_async_save, waiting for the save thread. Guarded by
+    // Milton::save_mutex.
+    SaveRequest             save_request;
+
+    // The loaded .mlt file, when the platform can map it. Points and
+    // pressures of loaded strokes point into it. Unmapped with the canvas.
+    u8*                     mlt_mapping;
+    u64                     mlt_mapping_size;
 };
 
 PATH_CHAR* milton_get_last_canvas_fname();
 
 void milton_load(Milton* milton);
+// Full snapshot, written synchronously.
 u64 milton_save(Milton* milton);
 
-void milton_save_buffer_to_file(PATH_CHAR* fname, u8* buffer, i32 w, i32 h);
+// Capture the canvas state that the next save writes. Main thread only. Pending
+// journal records are always taken. The canvas gets copied when `full` is set
+// or when the journal can't be used.
+void milton_save_capture(Milton* milton, SaveRequest* request, b32 full);
+// Fold a newer request into one that has not been written yet.
+void milton_save_request_merge(SaveRequest* dst, SaveRequest* src);
+// Write a captured request. Only touches milton->persist and milton->flags, so
+// it runs on the save thread. Callers hold Milton::save_write_mutex.
+u64  milton_save_write(Milton* milton, SaveRequest* request);
+void milton_save_request_release(SaveRequest* request);
+
+// Called from the main thread when a change gets committed to the canvas.
+void milton_journal_push(Milton* milton, JournalRecordType type, Stroke* stroke = NULL);
+// Appends pending records to the journal, synchronously. Falls back to a full
+// snapshot when the journal is missing, belongs to another file, or needs to be
+// compacted.
+u64 milton_journal_flush(Milton* milton);
+// Drop pending records. The next flush writes a full snapshot.
+void milton_journal_discard(Milton* milton);
+
+// Streaming image export. The format comes from the file extension. Rows are
+// RGBA, top to bottom, a strip at a time. JPEG strips must be a multiple of 8
+// rows tall, except for the last one.
+#define IMAGE_EXPORT_TILE_SIZE      1024                // Pixels on a side, at most.
+#define IMAGE_EXPORT_STRIP_BYTES    (64 * 1024 * 1024)  // Memory for one strip of tiles.
+#define IMAGE_EXPORT_MAX_SIDE       (1 << 17)           // Pixels.
+#define IMAGE_EXPORT_PNG_BAND_BYTES (512 * 1024)        // PNG rows compressed by one job.
+
+struct ImageWriter;
+
+ImageWriter* image_writer_begin(PATH_CHAR* fname, i32 w, i32 h);  // NULL on error.
+b32          image_writer_rows(ImageWriter* writer, u8* rows, i32 num_rows);
+b32          image_writer_end(ImageWriter* writer);  // Frees the writer. False if anything failed.
+
+// Render the screen rect (x, y, w, h), scaled up by `scale`, to an image file.
+// It gets rendered a tile at a time and written a strip of tiles at a time,
+// so neither the GPU viewport nor memory limit the size of the image.
+void milton_export_image(Milton* milton, PATH_CHAR* fname, i32 x, i32 y, i32 w, i32 h, i32 scale, f32 background_alpha);
 
 b32  platform_settings_load(PlatformSettings* prefs);
 void platform_settings_save(PlatformSettings* prefs);
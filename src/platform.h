@@ -197,6 +197,21 @@ void    platform_load_gl_func_pointers();
 void    platform_fname_at_exe(PATH_CHAR* fname, size_t len);
 b32     platform_move_file(PATH_CHAR* src, PATH_CHAR* dest);
 
+// Map a whole file into memory, copy-on-write. Returns NULL when the file
+// can't be mapped or when the platform does not support it.
+void*   platform_map_file(PATH_CHAR* fname, u64* out_size);
+void    platform_unmap_file(void* mapping, u64 size);
+
+struct PlatformWriteChunk
+{
+    void*   data;
+    u64     size;
+};
+
+// Write all chunks, in order, with as few system calls as possible. Chunks
+// can't be empty, and nothing may be pending in the FILE's own buffer.
+b32     platform_write_gather(FILE* fd, PlatformWriteChunk* chunks, i64 num_chunks);
+
 void str_to_path_char(char* str, PATH_CHAR* out, size_t out_sz);
 // void path_char_to_str(char* str, PATH_CHAR* out, size_t out_sz);
 
@@ -30,7 +30,7 @@ perf_counter()
         milton_log("Something went wrong with clock_gettime\n");
     }
 
-    return tp.tv_nsec;
+    return (u64)tp.tv_sec * 1000000000 + (u64)tp.tv_nsec;
 }
 
 void
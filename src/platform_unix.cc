@@ -99,6 +99,76 @@ platform_deallocate_internal(void** ptr)
     munmap(*ptr, size);
 }
 
+void*
+platform_map_file(PATH_CHAR* fname, u64* out_size)
+{
+    void* mapping = NULL;
+    int fd = open(fname, O_RDONLY);
+    if ( fd != -1 ) {
+        struct stat st = {};
+        if ( fstat(fd, &st) == 0 && st.st_size > 0 ) {
+            // Private and writable, so that nothing we do ends up in the file.
+            void* ptr = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+            if ( ptr != MAP_FAILED ) {
+                mapping = ptr;
+                *out_size = (u64)st.st_size;
+            }
+        }
+        // The mapping stays valid after closing the descriptor, and after the file gets replaced by a save.
+        close(fd);
+    }
+    return mapping;
+}
+
+void
+platform_unmap_file(void* mapping, u64 size)
+{
+    mlt_assert(mapping);
+    munmap(mapping, (size_t)size);
+}
+
+b32
+platform_write_gather(FILE* fd, PlatformWriteChunk* chunks, i64 num_chunks)
+{
+    // Both Linux and macOS accept at least this many buffers per call.
+    enum { MaxIov = 1024 };
+    struct iovec iov[MaxIov];
+
+    int fno = fileno(fd);
+    b32 ok = true;
+    i64 i = 0;
+    u64 done = 0;  // Bytes of chunks[i] that are already in the file.
+    while ( ok && i < num_chunks ) {
+        int count = 0;
+        for ( i64 j = i; j < num_chunks && count < MaxIov; ++j ) {
+            u64 skip = j == i ? done : 0;
+            iov[count].iov_base = (u8*)chunks[j].data + skip;
+            iov[count].iov_len = (size_t)(chunks[j].size - skip);
+            ++count;
+        }
+        ssize_t written = writev(fno, iov, count);
+        if ( written < 0 ) {
+            if ( errno != EINTR ) {
+                ok = false;
+            }
+        }
+        else if ( written == 0 ) {
+            ok = false;  // Chunks are never empty, so the disk is full.
+        }
+        else {
+            // Short writes are allowed. Skip whatever made it and try again.
+            u64 left = (u64)written;
+            while ( i < num_chunks && left >= chunks[i].size - done ) {
+                left -= chunks[i].size - done;
+                done = 0;
+                ++i;
+            }
+            done += left;
+        }
+    }
+    return ok;
+}
+
 void
 platform_cursor_hide()
 {
@@ -635,6 +635,29 @@ platform_move_file(PATH_CHAR* src, PATH_CHAR* dest)
     return ok;
 }
 
+// Not supported. MoveFileEx can't replace a file while a view of it is
+// mapped, which would break saving over the file we loaded from.
+void*
+platform_map_file(PATH_CHAR* fname, u64* out_size)
+{
+    return NULL;
+}
+
+void
+platform_unmap_file(void* mapping, u64 size)
+{
+}
+
+b32
+platform_write_gather(FILE* fd, PlatformWriteChunk* chunks, i64 num_chunks)
+{
+    b32 ok = true;
+    for ( i64 i = 0; ok && i < num_chunks; ++i ) {
+        ok = fwrite(chunks[i].data, 1, (size_t)chunks[i].size, fd) == chunks[i].size;
+    }
+    return ok;
+}
+
 void
 platform_fname_at_config(PATH_CHAR* fname, size_t len)
 {
@@ -7,6 +7,7 @@
 #include "gl_helpers.h"
 #include "gui.h"
 #include "milton.h"
+#include "residency.h"
 #include "vector.h"
 
 #define MAX_DEPTH_VALUE (1<<20)     // Strokes have MAX_DEPTH_VALUE different z values. 1/i for each i in [1, MAX_DEPTH_VALUE)
@@ -19,6 +20,149 @@
 
 #define RENDER_CHUNK_SIZE_LOG2 28
 
+#define COOK_BATCH_SEGMENTS (1<<14)  // Stroke segments per batch of cook_strokes.
+
+// Segments in a stroke page. Cooked strokes share pages, so that consecutive
+// strokes can be drawn with one call. Without instanced arrays a segment is
+// four vertices, and u16 indices reach the whole page.
+#define STROKE_PAGE_SEGMENTS (1<<14)
+
+// When at least this fraction of a layer's area is on screen, clipping scans
+// its buckets instead of querying its spatial index.
+#define CLIP_SCAN_MIN_VISIBLE_FRACTION 0.25
+
+// Side of the tiles in the raster tile cache, in pixels.
+#define RASTER_TILE_SIZE 128
+
+// Most texture samples taken per pixel by a pass of the blur shader.
+#define BLUR_MAX_SAMPLES 32
+// Bigger blur kernels are as wide as this. BLUR_MAX_SAMPLES^BLUR_MAX_PASSES reaches it.
+#define BLUR_MAX_KERNEL_SIZE (1<<28)
+#define BLUR_MAX_PASSES 6
+
+
+enum ClipJobType
+{
+    ClipJob_INDEX,      // Query the spatial index of a layer.
+    ClipJob_BUCKET,     // Cull one bucket.
+    ClipJob_FAR,        // Find the strokes in one bucket that are far away.
+};
+
+struct ClipJob
+{
+    ClipJobType     type;
+    StrokeList*     list;
+    StrokeBucket*   bucket;
+    i64             count;  // Strokes in the bucket.
+    Rect            rect;
+    u64*            masks;  // STROKELIST_MASK_WORDS per bucket.
+};
+
+// Clip results for one layer. They are kept until the next clip that can't
+// reuse them. See clip_cache_is_valid.
+struct ClipLayer
+{
+    Layer*  layer;
+    i32     id;
+    u64     version;    // Of the layer's StrokeList.
+
+    // Strokes in r->clip_cache_strokes
+    i64     first;
+    i64     count;
+
+    // Set by the last clip that filled the clip array.
+    i64     element;        // Index of the layer element in r->clip_array.
+    b32     blur_cached;    // The layer's strokes are not in the clip array.
+
+    // Only used while clipping.
+    i64     num_buckets;
+    u64*    visible;
+    u64*    far_away;   // NULL when not freeing far away strokes.
+};
+
+// A segment of a cooked stroke. The vertex shader builds the quad around it.
+// Color and radius are per segment, so that strokes with different brushes can
+// go in one draw call.
+struct StrokeSegment
+{
+    v3f     pointa;  // z is the pressure.
+    v3f     pointb;
+    v4f     color;
+    f32     radius;
+    f32     z;
+#if STROKE_DEBUG_VIZ
+    v3f     debug_color;
+#endif
+};
+
+// Without instanced arrays, each segment is repeated for the four corners of its quad.
+struct StrokeCornerVertex
+{
+    StrokeSegment   segment;
+    v2f             corner;  // See a_corner in stroke_raster.v.glsl
+};
+
+// Segments of a stroke, ready to upload. See stroke_geometry.
+struct StrokeGeometry
+{
+    StrokeSegment*  segments;
+    i64             num_segments;
+};
+
+struct RenderElement;
+
+// A GL buffer with the segments of many strokes.
+// Pages are what RenderBackend::residency tracks, since a page is the unit of
+// GPU memory that can be freed. Evicting a page frees all of its strokes.
+struct StrokePage
+{
+    GLuint  vbo;    // 0 when the page is free.
+    i64     used;   // Segments handed out, from the start of the page.
+    i64     live;   // Segments of strokes that are still cooked.
+    i32     index;  // In RenderBackend::stroke_pages.
+
+    DArray<RenderElement*> elements;  // Strokes that are still cooked. See RenderElement::page_slot.
+
+    ResidencyEntry residency;
+};
+
+struct CookJob
+{
+    Stroke*         stroke;
+    v2i             render_center;
+    i32             stroke_z;
+    StrokeGeometry  geometry;
+};
+
+// A slot in the tile atlas.
+struct RasterTile
+{
+    v2l     position;   // In tiles.
+    Rect    valid;      // Pixels of the tile that are in the atlas, in tile space.
+};
+
+// What the blurred contents of a layer depend on.
+struct BlurCacheKey
+{
+    u64     version;    // Of the layer's StrokeList.
+    u64     effects;    // See effects_hash.
+    i32     scale;
+    f32     angle;
+    v2l     pan_center;
+    v2i     zoom_center;
+    v2i     screen_size;
+};
+
+// The contents of a blurred layer after its effects, as drawn at the last
+// full redraw. Layers that don't change are not blurred again.
+struct BlurCache
+{
+    i32             layer_id;
+    GLuint          texture;    // 0 until first stored.
+    v2i             size;       // Of texture.
+    BlurCacheKey    key;
+    b32             valid;      // False while waiting for gpu_render_canvas to fill it.
+};
 
 enum ImmediateFlag
 {
@@ -33,34 +177,36 @@ enum RenderElementFlags
     RenderElementFlags_PRESSURE_TO_OPACITY  = 1<<1,
     RenderElementFlags_DISTANCE_TO_OPACITY  = 1<<2,
     RenderElementFlags_ERASER               = 1<<3,
+    RenderElementFlags_BLUR_CACHED          = 1<<4,  // Layer drawn from its BlurCache.
 };
 
 struct RenderElement
 {
-    GLuint  vbo_stroke;
-    GLuint  vbo_pointa;
-    GLuint  vbo_pointb;
-    GLuint  indices;
-#if STROKE_DEBUG_VIZ
-    GLuint vbo_debug;
-#endif
+    GLuint  vbo;            // Stroke segments. 0 when not cooked.
+    i32     page;           // In RenderBackend::stroke_pages, or -1 when vbo belongs to this element.
+    i64     first_segment;  // In vbo.
 
-    i64     count;
+    i64     count;          // Segments.
+
+    // Vertices are relative to the render center at the time of cooking,
+    // which can be an older one. See stroke_pass.
+    v2i     render_center;
 
     union {
         struct {  // For when element is a stroke.
-            v4f     color;
-            i32     radius;
             f32     min_opacity;
             f32     hardness;
         };
         struct {  // For when element is layer.
             f32          layer_alpha;
             LayerEffect* effects;
+            i32          blur_cache;  // In RenderBackend::blur_caches, or -1.
         };
     };
 
     int     flags;  // RenderElementFlags enum;
+
+    i64     page_slot;  // In StrokePage::elements, when page >= 0.
 };
 
 struct RenderBackend
@@ -68,6 +214,7 @@ struct RenderBackend
     f32 viewport_limits[2];  // OpenGL limits to the framebuffer size.
 
     v2i render_center;
+    v2l pan_center;
 
     // OpenGL programs.
 
@@ -124,6 +271,93 @@ struct RenderBackend
     i32 flags;  // RenderBackendFlags enum
 
     DArray<RenderElement> clip_array;
+    // Strokes within clip_cache_bounds at the last full clip, by layer and in
+    // paint order. While drawing, only the area around the working stroke is
+    // redrawn, so most frames just filter these.
+    DArray<ClipLayer> clip_layers;
+    DArray<Stroke*> clip_cache_strokes;
+    Rect clip_cache_bounds;
+    i64 clip_cache_scale;
+    b32 clip_cache_valid;
+
+    // clip_array has every stroke within clip_array_bounds, as of the last
+    // clip that filled it. See clip_array_reuse.
+    Rect clip_array_bounds;
+    v2i clip_array_render_center;
+    b32 clip_array_has_working_stroke;
+    i32 clip_array_working_layer;
+    i64 clip_array_working;  // Index of the working stroke's element, or -1.
+    b32 clip_array_valid;    // Cleared when a stroke is freed.
+
+    // Scratch space for gpu_clip_strokes_and_update.
+    DArray<ClipJob> clip_jobs;
+    DArray<u64> clip_masks;
+
+    // Scratch space for cook_strokes.
+    DArray<CookJob> cook_jobs;
+    DArray<u8> cook_memory;
+
+    // Shared vertex buffers for cooked strokes. Pages don't move, since
+    // their residency entries are linked to each other.
+    DArray<StrokePage*> stroke_pages;
+    DArray<i32> stroke_free_pages;
+    i32 stroke_page_current;  // Where new strokes go. -1 for none.
+
+    // Segments are instances of stroke_unit_quad when GLHelperFlags_INSTANCED_ARRAYS
+    // is set. Otherwise pages hold StrokeCornerVertex, drawn with stroke_quad_indices.
+    b32 instanced_strokes;
+    GLuint stroke_unit_quad;
+    GLuint stroke_quad_indices;  // Two triangles for every four vertices of a page.
+    DArray<StrokeCornerVertex> stroke_corners;  // Scratch space for uploads.
+
+    // Points of the working stroke that are in its buffer. See cook_working_stroke.
+    DArray<v2l> working_points;
+    DArray<f32> working_pressures;
+    Brush working_brush;
+    i32 working_z;
+
+    // Scratch space for batched draws in gpu_render_canvas.
+    DArray<GLsizei> draw_counts;
+    DArray<void*> draw_offsets;
+
+    // Screen bounds and scale the last time we freed far away strokes.
+    Rect free_strokes_bounds;
+    i64 free_strokes_scale;
+
+    // Progressive rendering. See ClipFlags_DRAW_ITERATIVELY.
+    f32 render_budget_ms;
+    b32 render_incomplete;
+    DArray<Stroke*> clip_uncooked;
+    DArray<Stroke*> clip_uncooked_sorted;
+
+    // Stroke pages, least recently drawn from first. Evicted when over the
+    // stroke memory budget.
+    Residency residency;
+
+    // Raster tile cache. Tile space is the screen at the time of the last
+    // gpu_tiles_reset; it moves with the canvas when panning. Tiles are kept
+    // in a toroidal atlas that is a bit bigger than the screen, so that every
+    // visible tile has its own slot.
+    GLuint tile_texture;
+    GLuint tile_fbo;
+    i32 tile_cols;
+    i32 tile_rows;
+    DArray<RasterTile> tiles;  // tile_cols * tile_rows slots.
+    DArray<Rect> tile_dirty;   // Screen rects to render, set by gpu_tiles_pan.
+    b32 tiles_enabled;
+    v2l tile_origin;           // Screen position of the origin of tile space.
+    v2l tile_pan_center;       // View at the last reset.
+    v2i tile_zoom_center;
+    v2i tile_screen_size;
+    i64 tile_scale;
+
+    // Set by gpu_render_to_buffer_begin.
+    CanvasView export_saved_view;  // Restored by gpu_render_to_buffer_end.
+    CanvasView export_view;        // Centered on the whole image. The screen is a tile.
+    v2i export_image_size;
+
+    // One for each visible layer with a blur.
+    DArray<BlurCache> blur_caches;
 
     // Screen size.
     i32 width;
@@ -141,7 +375,7 @@ struct RenderBackend
     // float current_radius;
 
 #if MILTON_ENABLE_PROFILING
-    u64 clipped_count;
+    u64 clipped_count;  // Strokes put in the clip array by the last clip.
 #endif
 };
 
@@ -230,10 +464,162 @@ get_render_element(RenderHandle handle)
     return e;
 }
 
+b32
+gpu_stroke_is_cooked(Stroke* stroke)
+{
+    RenderElement* re = get_render_element(stroke->render_handle);
+    return re && re->vbo != 0;
+}
+
+// Bytes of GPU memory for each segment of a stroke.
+static i64
+stroke_segment_bytes(RenderBackend* r)
+{
+    return r->instanced_strokes ? (i64)sizeof(StrokeSegment) : 4*(i64)sizeof(StrokeCornerVertex);
+}
+
+// Allocate space for num_segments in a stroke page.
+static void
+stroke_page_alloc(RenderBackend* r, i64 num_segments, i32* out_page, i64* out_first)
+{
+    mlt_assert(num_segments <= STROKE_PAGE_SEGMENTS);
+    StrokePage* page = NULL;
+    if ( r->stroke_page_current >= 0 ) {
+        page = r->stroke_pages.data[r->stroke_page_current];
+    }
+    if ( page == NULL || page->used + num_segments > STROKE_PAGE_SEGMENTS ) {
+        if ( r->stroke_free_pages.count > 0 ) {
+            r->stroke_page_current = pop(&r->stroke_free_pages);
+        }
+        else {
+            r->stroke_page_current = (i32)r->stroke_pages.count;
+            StrokePage* new_page = (StrokePage*)mlt_calloc(1, sizeof(StrokePage), "Renderer");
+            new_page->index = r->stroke_page_current;
+            push(&r->stroke_pages, new_page);
+        }
+        page = r->stroke_pages.data[r->stroke_page_current];
+        mlt_assert(page->vbo == 0 && page->live == 0 && page->elements.count == 0);
+        i64 page_bytes = STROKE_PAGE_SEGMENTS*stroke_segment_bytes(r);
+        glGenBuffers(1, &page->vbo);
+        DEBUG_gl_mark_buffer(page->vbo);
+        glBindBuffer(GL_ARRAY_BUFFER, page->vbo);
+        glBufferData(GL_ARRAY_BUFFER, (GLsizeiptr)page_bytes, NULL, GL_STATIC_DRAW);
+        page->used = 0;
+        residency_add(&r->residency, &page->residency, page, page_bytes);
+    }
+    *out_page = r->stroke_page_current;
+    *out_first = page->used;
+    page->used += num_segments;
+    page->live += num_segments;
+}
+
+static void
+stroke_page_delete(RenderBackend* r, StrokePage* page)
+{
+    mlt_assert(page->live == 0 && page->elements.count == 0);
+    if ( page->index == r->stroke_page_current ) {
+        r->stroke_page_current = -1;
+    }
+    residency_remove(&r->residency, &page->residency);
+    DEBUG_gl_unmark_buffer(page->vbo);
+    glDeleteBuffers(1, &page->vbo);
+    page->vbo = 0;
+    page->used = 0;
+    push(&r->stroke_free_pages, page->index);
+}
+
+// Pages are deleted when the last of their strokes is freed. Their space
+// is not reused before that, except in the current page, which starts over
+// while it is still resident.
+static void
+stroke_page_free(RenderBackend* r, RenderElement* re)
+{
+    StrokePage* page = r->stroke_pages.data[re->page];
+
+    RenderElement* last = pop(&page->elements);
+    if ( last != re ) {
+        page->elements.data[re->page_slot] = last;
+        last->page_slot = re->page_slot;
+    }
+
+    page->live -= re->count;
+    mlt_assert(page->live >= 0);
+    if ( page->live == 0 ) {
+        b32 resident = page->residency.prev != NULL;
+        if ( page->index == r->stroke_page_current && resident ) {
+            page->used = 0;
+        }
+        else {
+            stroke_page_delete(r, page);
+        }
+    }
+}
+
+// Write segments to the bound GL_ARRAY_BUFFER, starting at first_segment.
+static void
+upload_stroke_segments(RenderBackend* r, i64 first_segment, StrokeSegment* segments, i64 count)
+{
+    if ( r->instanced_strokes ) {
+        glBufferSubData(GL_ARRAY_BUFFER, (GLintptr)(first_segment*(i64)sizeof(StrokeSegment)),
+                        (GLsizeiptr)(count*(i64)sizeof(StrokeSegment)), segments);
+    }
+    else {
+        v2f corners[4] = { {0,0}, {0,1}, {1,1}, {1,0} };
+        DArray<StrokeCornerVertex>* vertices = &r->stroke_corners;
+        reset(vertices);
+        reserve(vertices, 4*count);
+        for ( i64 i = 0; i < count; ++i ) {
+            for ( int c = 0; c < 4; ++c ) {
+                push(vertices, StrokeCornerVertex{ segments[i], corners[c] });
+            }
+        }
+        glBufferSubData(GL_ARRAY_BUFFER, (GLintptr)(first_segment*stroke_segment_bytes(r)),
+                        (GLsizeiptr)(count*stroke_segment_bytes(r)), vertices->data);
+    }
+}
+
+static void
+free_render_element(RenderBackend* r, RenderElement* re)
+{
+    if ( re->vbo != 0 ) {
+        DEBUG_gl_validate_buffer(re->vbo);
+
+        if ( re->page >= 0 ) {
+            stroke_page_free(r, re);
+        }
+        else {
+            glDeleteBuffers(1, &re->vbo);
+            DEBUG_gl_unmark_buffer(re->vbo);
+        }
+
+        *re = {};
+
+        // The clip array may have a copy.
+        r->clip_array_valid = false;
+    }
+}
+
+// ResidencyReleaseFunc for evicted stroke pages. Freeing the last stroke
+// deletes the page. The current page may have none left.
+static void
+release_stroke_page(void* data, ResidencyEntry* entry)
+{
+    RenderBackend* r = (RenderBackend*)data;
+    StrokePage* page = (StrokePage*)entry->owner;
+    while ( page->elements.count > 0 ) {
+        free_render_element(r, page->elements.data[page->elements.count-1]);
+    }
+    if ( page->vbo != 0 ) {
+        stroke_page_delete(r, page);
+    }
+}
+
 RenderBackend*
 gpu_allocate_render_backend(Arena* arena)
 {
     RenderBackend* p = arena_alloc_elem(arena, RenderBackend);
+    p->stroke_page_current = -1;
+    residency_init(&p->residency, (i64)DEFAULT_STROKE_MEMORY_BUDGET_MB << 20, release_stroke_page, p);
     return p;
 }
 
@@ -700,6 +1086,43 @@ gpu_init(RenderBackend* r, CanvasView* view, ColorPicker* picker)
         print_framebuffer_status();
         glBindFramebufferEXT(GL_FRAMEBUFFER, 0);
     }
+    // Stroke segments are drawn as quads, instanced when possible.
+    r->instanced_strokes = gl::check_flags(GLHelperFlags_INSTANCED_ARRAYS);
+    milton_log("Instanced strokes: %s\n", r->instanced_strokes ? "yes" : "no");
+    if ( r->instanced_strokes ) {
+        // Corners of a segment's quad, as a triangle fan. Same order as in
+        // upload_stroke_segments.
+        GLfloat corners[] = {
+            0, 0,
+            0, 1,
+            1, 1,
+            1, 0,
+        };
+        glGenBuffers(1, &r->stroke_unit_quad);
+        glBindBuffer(GL_ARRAY_BUFFER, r->stroke_unit_quad);
+        DEBUG_gl_mark_buffer(r->stroke_unit_quad);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(corners), corners, GL_STATIC_DRAW);
+    }
+    else {
+        // Index pattern for stroke pages: two triangles per quad of four vertices.
+        i64 num_quads = STROKE_PAGE_SEGMENTS;
+        u16* indices = (u16*)mlt_calloc((size_t)num_quads*6, sizeof(u16), "Renderer");
+        for ( i64 q = 0; q < num_quads; ++q ) {
+            u16 v = (u16)(q*4);
+            u16* quad = indices + q*6;
+            quad[0] = v + 0;
+            quad[1] = v + 1;
+            quad[2] = v + 2;
+            quad[3] = v + 2;
+            quad[4] = v + 0;
+            quad[5] = v + 3;
+        }
+        glGenBuffers(1, &r->stroke_quad_indices);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, r->stroke_quad_indices);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, (GLsizeiptr)(num_quads*6*sizeof(u16)), indices, GL_STATIC_DRAW);
+        mlt_free(indices, "Renderer");
+    }
+
     // VBO for picker
     glGenBuffers(1, &r->vbo_picker);
     glGenBuffers(1, &r->vbo_picker_norm);
@@ -736,6 +1159,30 @@ gpu_reset_render_flags(RenderBackend* r, int flags)
     r->flags = flags;
 }
 
+void
+gpu_update_render_budget(RenderBackend* r, f32 budget_ms)
+{
+    r->render_budget_ms = budget_ms;
+}
+
+b32
+gpu_render_is_complete(RenderBackend* r)
+{
+    return !r->render_incomplete;
+}
+
+void
+gpu_update_stroke_memory_budget(RenderBackend* r, i32 budget_mb)
+{
+    residency_set_budget(&r->residency, (i64)budget_mb << 20);
+}
+
+ResidencyStats
+gpu_get_stroke_memory_stats(RenderBackend* r)
+{
+    return residency_stats(&r->residency);
+}
+
 void
 gpu_update_scale(RenderBackend* r, i32 scale)
 {
@@ -856,16 +1303,7 @@ gpu_get_num_clipped_strokes(Layer* root_layer)
 {
     i32 count = 0;
     #if MILTON_ENABLE_PROFILING
-    for ( Layer* l = root_layer; l != NULL; l = l->next ) {
-        StrokeList strokes = l->strokes;
-        for ( i64 si = 0; si < strokes.count; ++si ) {
-            Stroke* s = strokes[si];
-            RenderElement* re = get_render_element(s->render_handle);
-            if ( re && re->vbo_stroke != 0 ) {
-                ++count;
-            }
-        }
-    }
+    count = (i32)layer::count_clipped_strokes(root_layer, jobs_num_threads());
     #endif
     return count;
 }
@@ -895,24 +1333,33 @@ set_screen_size(RenderBackend* r, float* fscreen)
 
 static
 v2i
-relative_to_render_center(RenderBackend* r, v2l point)
+relative_to_center(v2i render_center, v2l point)
 {
-    v2i result = VEC2I(point - VEC2L(r->render_center*(1<<RENDER_CHUNK_SIZE_LOG2)));
+    v2i result = VEC2I(point - VEC2L(render_center)*((i64)1<<RENDER_CHUNK_SIZE_LOG2));
     return result;
 }
 
+static
+v2i
+relative_to_render_center(RenderBackend* r, v2l point)
+{
+    return relative_to_center(r->render_center, point);
+}
+
 void
 gpu_update_canvas(RenderBackend* r, CanvasState* canvas, CanvasView* view)
 {
     v2i center = view->zoom_center;
     v2l pan = view->pan_center;
 
+    // Strokes cooked for the old render center keep their vertices. They are
+    // drawn with the pan center relative to their own render center.
     v2i new_render_center = VEC2I(pan / (i64)(1<<RENDER_CHUNK_SIZE_LOG2));
     if ( new_render_center != r->render_center ) {
-        milton_log("Moving to new render center. %d, %d Clearing render data.\n", new_render_center.x, new_render_center.y);
+        milton_log("Moving to new render center. %d, %d\n", new_render_center.x, new_render_center.y);
         r->render_center = new_render_center;
-        gpu_free_strokes(r, canvas);
     }
+    r->pan_center = pan;
 
     GLuint ps[] = {
         r->stroke_program,
@@ -944,265 +1391,302 @@ gpu_update_canvas(RenderBackend* r, CanvasState* canvas, CanvasView* view)
     set_screen_size(r, fscreen);
 }
 
-void
-gpu_cook_stroke(Arena* arena, RenderBackend* r, Stroke* stroke, CookStrokeOpt cook_option)
+static i32
+next_stroke_z(RenderBackend* r)
+{
+    r->stroke_z = (r->stroke_z + 1) % (MAX_DEPTH_VALUE-1);
+    return r->stroke_z + 1;
+}
+
+// Single points are drawn as a segment from the point to itself.
+static i64
+stroke_num_segments(Stroke* stroke)
+{
+    return stroke->num_points > 1 ? stroke->num_points - 1 : 1;
+}
+
+// Bytes of memory that stroke_geometry_init needs for a stroke.
+static size_t
+stroke_geometry_size(Stroke* stroke)
+{
+    return (size_t)stroke_num_segments(stroke)*sizeof(StrokeSegment);
+}
+
+// Point the geometry arrays into `memory`, which has stroke_geometry_size bytes.
+static void
+stroke_geometry_init(StrokeGeometry* g, Stroke* stroke, u8* memory)
+{
+    *g = {};
+    g->segments = (StrokeSegment*)memory;
+}
+
+// Build segments [first, end) of a stroke into `out`.
+static void
+stroke_segments(Stroke* stroke, v2i render_center, i32 stroke_z, i64 first, i64 end, StrokeSegment* out)
 {
+    i64 npoints = stroke->num_points;
+    mlt_assert(npoints > 0);
+    mlt_assert(end <= stroke_num_segments(stroke));
+
+    Brush brush = stroke->brush;
+    v4f color = { brush.color.r, brush.color.g, brush.color.b, brush.color.a };
+
+    for ( i64 i = first; i < end; ++i ) {
+        i64 j = min(i + 1, npoints - 1);
+        v2i point_i = relative_to_center(render_center, stroke->points[i]);
+        v2i point_j = relative_to_center(render_center, stroke->points[j]);
+
+        StrokeSegment* segment = out + (i - first);
+        segment->pointa = { (float)point_i.x, (float)point_i.y, stroke->pressures[i] };
+        segment->pointb = { (float)point_j.x, (float)point_j.y, stroke->pressures[j] };
+        segment->color = color;
+        segment->radius = (f32)brush.radius;
+        segment->z = (f32)stroke_z;
+        #if STROKE_DEBUG_VIZ
+            if ( stroke->debug_flags[i] & Stroke::INTERPOLATED ) {
+                segment->debug_color = { 1.0f, 0.0f, 0.0f };
+            }
+            else {
+                segment->debug_color = { 0.0f, 1.0f, 0.0f };
+            }
+        #endif
+    }
+}
+
+// Build the segments of a stroke. It only reads the stroke, and doesn't call
+// GL, so it runs on the job threads. The quads around the segments are built
+// in stroke_raster.v.glsl
+static void
+stroke_geometry(Stroke* stroke, v2i render_center, i32 stroke_z, StrokeGeometry* g)
+{
+    i64 num_segments = stroke_num_segments(stroke);
+    mlt_assert (num_segments <= STROKE_PAGE_SEGMENTS);
+
+    stroke_segments(stroke, render_center, stroke_z, 0, num_segments, g->segments);
+    g->num_segments = num_segments;
+}
+
+// Fill in the render element of a cooked stroke.
+static void
+set_stroke_element(RenderBackend* r, RenderElement* re, Stroke* stroke, i64 num_segments)
+{
+    re->count = num_segments;
+    re->render_center = r->render_center;
+    re->min_opacity = stroke->brush.pressure_opacity_min;
+    re->hardness = stroke->brush.hardness;
+
+    re->flags = 0;
+    if (stroke->flags & StrokeFlag_ERASER) {
+        re->flags |= RenderElementFlags_ERASER;
+    }
+    if (stroke->flags & StrokeFlag_PRESSURE_TO_OPACITY) {
+        re->flags |= RenderElementFlags_PRESSURE_TO_OPACITY;
+    }
+    if (stroke->flags & StrokeFlag_DISTANCE_TO_OPACITY) {
+        re->flags |= RenderElementFlags_DISTANCE_TO_OPACITY;
+    }
+
+    mlt_assert(re->count > 0);
+}
+
+// Put a new stroke in a stroke page. The segments are uploaded by the caller.
+static void
+place_stroke_element(RenderBackend* r, RenderElement* re, Stroke* stroke, i64 num_segments)
+{
+    i32 page = 0;
+    i64 first = 0;
+    stroke_page_alloc(r, num_segments, &page, &first);
+    StrokePage* p = r->stroke_pages.data[page];
+    re->vbo = p->vbo;
+    re->page = page;
+    re->first_segment = first;
+    re->page_slot = p->elements.count;
+    push(&p->elements, re);
+    residency_touch(&r->residency, &p->residency);
+    set_stroke_element(r, re, stroke, num_segments);
+}
 
+static RenderElement*
+render_element_for_stroke(Arena* arena, Stroke* stroke)
+{
     RenderElement** p_render_element = reinterpret_cast<RenderElement**>(&stroke->render_handle);
     RenderElement* render_element = *p_render_element;
     if (render_element == NULL) {
         render_element = arena_alloc_elem(arena, RenderElement);
         *p_render_element = render_element;
     }
+    return render_element;
+}
 
-    r->stroke_z = (r->stroke_z + 1) % (MAX_DEPTH_VALUE-1);
-    const i32 stroke_z = r->stroke_z + 1;
-
-    if ( cook_option == CookStroke_NEW && render_element->vbo_stroke != 0 ) {
-        // We already have our data cooked
-        mlt_assert(render_element->vbo_pointa != 0);
-        mlt_assert(render_element->vbo_pointb != 0);
-    } else {
-        auto npoints = stroke->num_points;
-        if ( npoints == 1 ) {
-            // Create a 2-point stroke and recurse
-            Stroke duplicate = *stroke;
-            duplicate.num_points = 2;
-            Arena scratch_arena = arena_push(arena);
-            duplicate.points = arena_alloc_array(&scratch_arena, 2, v2l);
-            duplicate.pressures = arena_alloc_array(&scratch_arena, 2, f32);
-            duplicate.points[0] = stroke->points[0];  // It will be set relative to the center in the recursed call.
-            duplicate.points[1] = stroke->points[0];
-            duplicate.pressures[0] = stroke->pressures[0];
-            duplicate.pressures[1] = stroke->pressures[0];
-
-            gpu_cook_stroke(&scratch_arena, r, &duplicate, cook_option);
-
-            // Copy render element to stroke
-            stroke->render_handle = duplicate.render_handle;
-
-            arena_pop(&scratch_arena);
-        }
-        else if ( npoints > 1 ) {
-            // 3 (triangle) *
-            // 2 (two per segment) *
-            // N-1 (segments per stroke)
-            // Reduced to 4 by using indices
-            const size_t count_attribs = 4*((size_t)npoints-1);
-
-            // 6 (3 * 2 from count_attribs)
-            // N-1 (num segments)
-            const size_t count_indices = 6*((size_t)npoints-1);
-
-            size_t count_debug = 0;
-            v3f* bounds;
-            v3f* apoints;
-            v3f* bpoints;
-            v3f* debug = NULL;
-            u16* indices;
-            Arena scratch_arena = arena_push(arena,
-                                             count_attribs*sizeof(decltype(*bounds))  // Bounds
-                                             + 2*count_attribs*sizeof(decltype(*apoints)) // Attributes a,b
-                                             + count_debug*sizeof(decltype(*debug))    // Visualization
-                                             + count_indices*sizeof(decltype(*indices)));  // Interpolation points
-
-            bounds  = arena_alloc_array(&scratch_arena, count_attribs, v3f);
-            apoints = arena_alloc_array(&scratch_arena, count_attribs, v3f);
-            bpoints = arena_alloc_array(&scratch_arena, count_attribs, v3f);
-            indices = arena_alloc_array(&scratch_arena, count_indices, u16);
-#if STROKE_DEBUG_VIZ
-            debug = arena_alloc_array(&scratch_arena, count_debug, v3f);
-#endif
-
-            mlt_assert(r->scale > 0);
+// Number of leading points of a stroke that are equal to the given ones.
+static i64
+stroke_same_points(Stroke* stroke, v2l* points, f32* pressures, i64 count)
+{
+    i64 n = min((i64)stroke->num_points, count);
+    i64 same = 0;
+    while ( same < n &&
+            points[same] == stroke->points[same] &&
+            pressures[same] == stroke->pressures[same] ) {
+        ++same;
+    }
+    return same;
+}
 
-            size_t bounds_i = 0;
-            size_t apoints_i = 0;
-            size_t bpoints_i = 0;
-            size_t indices_i = 0;
-            size_t debug_i = 0;
-            for ( i64 i=0; i < npoints-1; ++i ) {
-                v2i point_i = relative_to_render_center(r, stroke->points[i]);
-                v2i point_j = relative_to_render_center(r, stroke->points[i+1]);
+// The working stroke has a buffer with room for STROKE_MAX_POINTS segments.
+// Points that are the same as in the last frame keep their segments, so while
+// drawing only the new segments are built and uploaded. Primitives move their
+// points around, and get rebuilt from the first point that moved.
+static void
+cook_working_stroke(Arena* arena, RenderBackend* r, Stroke* stroke)
+{
+    RenderElement* re = render_element_for_stroke(arena, stroke);
+
+    if ( re->vbo == 0 ) {
+        glGenBuffers(1, &re->vbo);
+        DEBUG_gl_mark_buffer(re->vbo);
+        glBindBuffer(GL_ARRAY_BUFFER, re->vbo);
+        glBufferData(GL_ARRAY_BUFFER, (GLsizeiptr)(STROKE_MAX_POINTS*stroke_segment_bytes(r)),
+                     NULL, GL_DYNAMIC_DRAW);
+        re->count = 0;
+    }
 
-                Brush brush = stroke->brush;
-                float radius_i = stroke->pressures[i]*brush.radius;
-                float radius_j = stroke->pressures[i+1]*brush.radius;
+    DArray<v2l>* points = &r->working_points;
+    DArray<f32>* pressures = &r->working_pressures;
 
-                u16 idx = (u16)bounds_i;
-                if ( point_i == point_j ) {
-                    i32 min_x = min(point_i.x - radius_i, point_j.x - radius_j);
-                    i32 min_y = min(point_i.y - radius_i, point_j.y - radius_j);
-                    i32 max_x = max(point_i.x + radius_i, point_j.x + radius_j);
-                    i32 max_y = max(point_i.y + radius_i, point_j.y + radius_j);
+    i64 same = 0;
+    if ( re->count > 0 &&
+         re->render_center == r->render_center &&
+         memcmp(&r->working_brush, &stroke->brush, sizeof(Brush)) == 0 ) {
+        same = stroke_same_points(stroke, points->data, pressures->data, points->count);
+    }
+    if ( same == 0 ) {
+        r->working_z = next_stroke_z(r);
+        r->working_brush = stroke->brush;
+    }
 
-                    // Bounding geometry and attributes
+    // Segment i goes from point i to point i+1.
+    i64 first = max(same - 1, (i64)0);
+    i64 num_segments = stroke_num_segments(stroke);
+    if ( first < num_segments ) {
+        i64 count = num_segments - first;
+        Arena scratch_arena = arena_push(arena, (size_t)count*sizeof(StrokeSegment));
+        StrokeSegment* segments = (StrokeSegment*)scratch_arena.ptr;
+        stroke_segments(stroke, r->render_center, r->working_z, first, num_segments, segments);
 
-                    mlt_assert (bounds_i < ((1<<16)-4));
+        glBindBuffer(GL_ARRAY_BUFFER, re->vbo);
+        upload_stroke_segments(r, first, segments, count);
 
-                    bounds[bounds_i++] = { (float)min_x, (float)min_y, (float)stroke_z };
-                    bounds[bounds_i++] = { (float)min_x, (float)max_y, (float)stroke_z };
-                    bounds[bounds_i++] = { (float)max_x, (float)max_y, (float)stroke_z };
-                    bounds[bounds_i++] = { (float)max_x, (float)min_y, (float)stroke_z };
-                } else {
-                    // Points are different. Do a coordinate change for a tighter box.
-                    v2f d = normalized(v2i_to_v2f(point_j - point_i));
-                    auto basis_change = [&d](v2f v) {
-                        v2f res = {
-                            v.x * d.x + v.y * d.y,
-                            v.x * d.y - v.y * d.x,
-                        };
-
-                        return res;
-                    };
-                    v2f a = basis_change(v2i_to_v2f(point_i));
-                    v2f b = basis_change(v2i_to_v2f(point_j));
-
-                    f32 rad = max(radius_i, radius_j);
-
-                    f32 min_x = min(a.x, b.x) - rad;
-                    f32 min_y = min(a.y, b.y) - rad;
-                    f32 max_x = max(a.x, b.x) + rad;
-                    f32 max_y = max(a.y, b.y) + rad;
-
-                    v2f A = basis_change(v2f{ min_x, min_y });
-                    v2f B = basis_change(v2f{ min_x, max_y });
-                    v2f C = basis_change(v2f{ max_x, max_y });
-                    v2f D = basis_change(v2f{ max_x, min_y });
-
-                    mlt_assert (bounds_i < ((1<<16)-4));
-
-                    bounds[bounds_i++] = { A.x, A.y, (float)stroke_z };
-                    bounds[bounds_i++] = { B.x, B.y, (float)stroke_z };
-                    bounds[bounds_i++] = { C.x, C.y, (float)stroke_z };
-                    bounds[bounds_i++] = { D.x, D.y, (float)stroke_z };
-                }
+        arena_pop(&scratch_arena);
+    }
 
-                indices[indices_i++] = (u16)(idx + 0);
-                indices[indices_i++] = (u16)(idx + 1);
-                indices[indices_i++] = (u16)(idx + 2);
+    reserve(points, STROKE_MAX_POINTS);
+    reserve(pressures, STROKE_MAX_POINTS);
+    memcpy(points->data + same, stroke->points + same, (size_t)(stroke->num_points - same)*sizeof(v2l));
+    memcpy(pressures->data + same, stroke->pressures + same, (size_t)(stroke->num_points - same)*sizeof(f32));
+    points->count = stroke->num_points;
+    pressures->count = stroke->num_points;
 
-                indices[indices_i++] = (u16)(idx + 2);
-                indices[indices_i++] = (u16)(idx + 0);
-                indices[indices_i++] = (u16)(idx + 3);
+    re->page = -1;
+    re->first_segment = 0;
+    set_stroke_element(r, re, stroke, num_segments);
+}
 
-                float pressure_a = stroke->pressures[i];
-                float pressure_b = stroke->pressures[i+1];
+void
+gpu_cook_stroke(Arena* arena, RenderBackend* r, Stroke* stroke, CookStrokeOpt cook_option)
+{
+    if ( cook_option == CookStroke_UPDATE_WORKING_STROKE ) {
+        if ( stroke->num_points > 0 ) {
+            cook_working_stroke(arena, r, stroke);
+        }
+        return;
+    }
 
-                // Add attributes for each new vertex.
-                for ( int repeat = 0; repeat < 4; ++repeat ) {
-                    apoints[apoints_i++] = { (float)point_i.x, (float)point_i.y, pressure_a };
-                    bpoints[bpoints_i++] = { (float)point_j.x, (float)point_j.y, pressure_b };
-                    #if STROKE_DEBUG_VIZ
-                        v3f debug_color;
+    RenderElement* render_element = render_element_for_stroke(arena, stroke);
 
-                        if ( stroke->debug_flags[i] & Stroke::INTERPOLATED ) {
-                            debug_color = { 1.0f, 0.0f, 0.0f };
-                        }
-                        else {
-                            debug_color = { 0.0f, 1.0f, 0.0f };
-                        }
-                        debug[debug_i++] = debug_color;
-                    #endif
-                }
-            }
+    const i32 stroke_z = next_stroke_z(r);
 
-            mlt_assert(bounds_i == count_attribs);
-            mlt_assert(apoints_i == bpoints_i);
-            mlt_assert(apoints_i == bounds_i);
+    if ( render_element->vbo != 0 ) {
+        // We already have our data cooked
+    } else if ( stroke->num_points > 0 ) {
+        Arena scratch_arena = arena_push(arena, stroke_geometry_size(stroke));
 
-            // TODO: check for GL_OUT_OF_MEMORY
+        StrokeGeometry geometry;
+        stroke_geometry_init(&geometry, stroke, scratch_arena.ptr);
+        stroke_geometry(stroke, r->render_center, stroke_z, &geometry);
 
-            GLuint vbo_stroke = 0;
-            GLuint vbo_pointa = 0;
-            GLuint vbo_pointb = 0;
-            GLuint indices_buffer = 0;
-            GLuint vbo_debug = 0;
+        // TODO: check for GL_OUT_OF_MEMORY
 
+        place_stroke_element(r, render_element, stroke, geometry.num_segments);
+        glBindBuffer(GL_ARRAY_BUFFER, render_element->vbo);
+        upload_stroke_segments(r, render_element->first_segment, geometry.segments, geometry.num_segments);
 
-            GLenum hint = GL_STATIC_DRAW;
-            if ( cook_option == CookStroke_UPDATE_WORKING_STROKE ) {
-                hint = GL_DYNAMIC_DRAW;
-            }
-            if ( render_element->vbo_stroke != 0 ) {
-                vbo_stroke = render_element->vbo_stroke;
-                vbo_pointa = render_element->vbo_pointa;
-                vbo_pointb = render_element->vbo_pointb;
-                indices_buffer = render_element->indices;
-                #if STROKE_DEBUG_VIZ
-                    vbo_debug = render_element->vbo_debug;
-                #endif
-
-                auto clear_array_buffer = [hint](GLint vbo, size_t size) {
-                    glBindBuffer(GL_ARRAY_BUFFER, vbo);
-                    glBufferData(GL_ARRAY_BUFFER, (GLsizeiptr)(size), NULL, hint);
-                };
-                clear_array_buffer(vbo_stroke, bounds_i*sizeof(decltype(*bounds)));
-                clear_array_buffer(vbo_pointa, bounds_i*sizeof(decltype(*apoints)));
-                clear_array_buffer(vbo_pointb, bounds_i*sizeof(decltype(*bpoints)));
-                clear_array_buffer(indices_buffer, indices_i*sizeof(decltype(*indices)));
-                #if STROKE_DEBUG_VIZ
-                    clear_array_buffer(vbo_debug, debug_i*sizeof(decltype(*debug)));
-                #endif
-            }
-            else {
-                glGenBuffers(1, &vbo_stroke);
-                glGenBuffers(1, &vbo_pointa);
-                glGenBuffers(1, &vbo_pointb);
-                glGenBuffers(1, &indices_buffer);
-                #if STROKE_DEBUG_VIZ
-                    glGenBuffers(1, &vbo_debug);
-                #endif
-
-                DEBUG_gl_mark_buffer(vbo_stroke);
-                DEBUG_gl_mark_buffer(vbo_pointa);
-                DEBUG_gl_mark_buffer(vbo_pointb);
-                DEBUG_gl_mark_buffer(indices_buffer);
-            }
+        arena_pop(&scratch_arena);
+    }
+}
 
-            /*Send data to GPU*/ {
-                auto send_buffer_data = [hint](GLint vbo, size_t size, void* data) {
-                    glBindBuffer(GL_ARRAY_BUFFER, vbo);
-                    glBufferData(GL_ARRAY_BUFFER, (GLsizeiptr)(size), data, hint);
-                };
+static void
+cook_job(void* data, i64 job_index)
+{
+    CookJob* job = (CookJob*)data + job_index;
+    stroke_geometry(job->stroke, job->render_center, job->stroke_z, &job->geometry);
+}
 
-                send_buffer_data(vbo_stroke, bounds_i*sizeof(decltype(*bounds)), bounds);
-                send_buffer_data(vbo_pointa, bounds_i*sizeof(decltype(*apoints)), apoints);
-                send_buffer_data(vbo_pointb, bounds_i*sizeof(decltype(*bpoints)), bpoints);
-                send_buffer_data(indices_buffer, indices_i*sizeof(decltype(*indices)), indices);
-                #if STROKE_DEBUG_VIZ
-                    send_buffer_data(vbo_debug, debug_i*sizeof(decltype(*debug)), debug);
-                #endif
-            }
+// Cook strokes that are not on the GPU. The geometry is built on the job
+// threads; only the uploads happen here.
+static void
+cook_strokes(Arena* arena, RenderBackend* r, Stroke** strokes, i64 count)
+{
+    DArray<CookJob>* jobs = &r->cook_jobs;
+    reset(jobs);
+    if ( count == 0 ) {
+        return;
+    }
 
-            RenderElement* re = get_render_element(stroke->render_handle);
-            re->vbo_stroke = vbo_stroke;
-            re->vbo_pointa = vbo_pointa;
-            re->vbo_pointb = vbo_pointb;
-            re->indices = indices_buffer;
-            #if STROKE_DEBUG_VIZ
-                re->vbo_debug = vbo_debug;
-            #endif
-            re->count = (i64)(indices_i);
-            re->color = { stroke->brush.color.r, stroke->brush.color.g, stroke->brush.color.b, stroke->brush.color.a };
-            re->radius = stroke->brush.radius;
-            re->min_opacity = stroke->brush.pressure_opacity_min;
-            re->hardness = stroke->brush.hardness;
-
-            re->flags = 0;
-            if (stroke->flags & StrokeFlag_ERASER) {
-                re->flags |= RenderElementFlags_ERASER;
-            }
-            if (stroke->flags & StrokeFlag_PRESSURE_TO_OPACITY) {
-                re->flags |= RenderElementFlags_PRESSURE_TO_OPACITY;
-            }
-            if (stroke->flags & StrokeFlag_DISTANCE_TO_OPACITY) {
-                re->flags |= RenderElementFlags_DISTANCE_TO_OPACITY;
-            }
+    size_t size = 0;
+    for ( i64 i = 0; i < count; ++i ) {
+        Stroke* s = strokes[i];
+        RenderElement* re = render_element_for_stroke(arena, s);
+        if ( re->vbo == 0 && s->num_points > 0 ) {
+            CookJob job = {};
+            job.stroke = s;
+            job.render_center = r->render_center;
+            job.stroke_z = next_stroke_z(r);
+            push(jobs, job);
+            size += stroke_geometry_size(s);
+        }
+    }
 
-            mlt_assert(re->count > 1);
+    reserve(&r->cook_memory, (i64)size);
+    u8* memory = r->cook_memory.data;
+    for ( i64 i = 0; i < jobs->count; ++i ) {
+        CookJob* job = &jobs->data[i];
+        stroke_geometry_init(&job->geometry, job->stroke, memory);
+        memory += stroke_geometry_size(job->stroke);
+    }
 
-            arena_pop(&scratch_arena);
+    jobs_run(cook_job, jobs->data, jobs->count);
+
+    // Strokes are placed in the order of the scratch memory, so strokes that
+    // land next to each other in a page are uploaded together.
+    i64 run_first = 0;
+    for ( i64 i = 0; i < jobs->count; ++i ) {
+        CookJob* job = &jobs->data[i];
+        RenderElement* re = get_render_element(job->stroke->render_handle);
+        place_stroke_element(r, re, job->stroke, job->geometry.num_segments);
+
+        b32 run_ends = true;
+        if ( i + 1 < jobs->count ) {
+            i64 next_segments = jobs->data[i+1].geometry.num_segments;
+            StrokePage* page = r->stroke_pages.data[re->page];
+            run_ends = page->used + next_segments > STROKE_PAGE_SEGMENTS;
+        }
+        if ( run_ends ) {
+            RenderElement* first = get_render_element(jobs->data[run_first].stroke->render_handle);
+            StrokeSegment* begin = jobs->data[run_first].geometry.segments;
+            StrokeSegment* end = job->geometry.segments + job->geometry.num_segments;
+            glBindBuffer(GL_ARRAY_BUFFER, first->vbo);
+            upload_stroke_segments(r, first->first_segment, begin, end - begin);
+            run_first = i + 1;
         }
     }
 }
@@ -1213,27 +1697,8 @@ gpu_free_strokes(Stroke* strokes, i64 count, RenderBackend* r)
     for ( i64 i = 0; i < count; ++i ) {
         Stroke* s = &strokes[i];
         RenderElement* re = get_render_element(s->render_handle);
-        if ( re && re->vbo_stroke != 0 ) {
-            mlt_assert(re->vbo_pointa != 0);
-            mlt_assert(re->vbo_pointb != 0);
-            mlt_assert(re->indices != 0);
-
-            DEBUG_gl_validate_buffer(re->vbo_stroke);
-            DEBUG_gl_validate_buffer(re->vbo_pointa);
-            DEBUG_gl_validate_buffer(re->vbo_pointb);
-            DEBUG_gl_validate_buffer(re->indices);
-
-            glDeleteBuffers(1, &re->vbo_stroke);
-            glDeleteBuffers(1, &re->vbo_pointa);
-            glDeleteBuffers(1, &re->vbo_pointb);
-            glDeleteBuffers(1, &re->indices);
-
-            DEBUG_gl_unmark_buffer(re->vbo_stroke);
-            DEBUG_gl_unmark_buffer(re->vbo_pointa);
-            DEBUG_gl_unmark_buffer(re->vbo_pointb);
-            DEBUG_gl_unmark_buffer(re->indices);
-
-            *re = {};
+        if ( re ) {
+            free_render_element(r, re);
         }
     }
 }
@@ -1241,6 +1706,7 @@ gpu_free_strokes(Stroke* strokes, i64 count, RenderBackend* r)
 void
 gpu_free_strokes(RenderBackend* r, CanvasState* canvas)
 {
+    r->clip_cache_valid = false;
     if ( canvas->root_layer != NULL ) {
         for ( Layer* l = canvas->root_layer;
               l != NULL;
@@ -1259,127 +1725,630 @@ gpu_free_strokes(RenderBackend* r, CanvasState* canvas)
             }
         }
     }
+    // Strokes that are not in a layer anymore, like the ones in the undo stack.
+    residency_release_all(&r->residency);
 }
 
-void
-gpu_clip_strokes_and_update(Arena* arena,
-                            RenderBackend* r,
-                            CanvasView* view,
-                            i64 scale,
-                            Layer* root_layer, Stroke* working_stroke,
-                            i32 x, i32 y, i32 w, i32 h, ClipFlags flags)
+static b32
+stroke_is_drawable(Stroke* s)
 {
-    DArray<RenderElement>* clip_array = &r->clip_array;
+    Rect bounds = s->bounding_rect;
+    i32 area = (bounds.right-bounds.left) * (bounds.bottom-bounds.top);
+    // Area might be 0 if the stroke is smaller than
+    // a pixel. We don't draw it in that case.
+    return area != 0;
+}
 
-    RenderElement layer_element = {};
-    layer_element.flags |= RenderElementFlags_LAYER;
+// Like gpu_stroke_is_cooked, but strokes cooked for a render center that is
+// not next to the current one are freed, to be cooked again. They are too far
+// away for 32 bit coordinates.
+static b32
+clip_stroke_is_cooked(RenderBackend* r, Stroke* s)
+{
+    RenderElement* re = get_render_element(s->render_handle);
+    if ( re && re->vbo != 0 ) {
+        v2i d = re->render_center - r->render_center;
+        if ( d.x < -1 || d.x > 1 || d.y < -1 || d.y > 1 ) {
+            free_render_element(r, re);
+        }
+    }
+    return gpu_stroke_is_cooked(s);
+}
 
-    Rect screen_bounds = raster_to_canvas_bounding_rect(view, x, y, w, h, scale);
+// Add a stroke that is on screen to the clip array. Strokes that are not on
+// the GPU yet are left out.
+static void
+clip_stroke(RenderBackend* r, Stroke* s)
+{
+    if ( stroke_is_drawable(s) ) {
+        if ( gpu_stroke_is_cooked(s) ) {
+            RenderElement* re = get_render_element(s->render_handle);
+            if ( re->page >= 0 ) {
+                residency_touch(&r->residency, &r->stroke_pages.data[re->page]->residency);
+            }
+            push(&r->clip_array, *re);
+            #if MILTON_ENABLE_PROFILING
+            r->clipped_count++;
+            #endif
+        }
+    }
+}
 
-    reset(clip_array);
+// Strokes are cooked by powers of two of their size, biggest first, so that
+// the shape of the painting shows up before its details.
+static i32
+stroke_size_class(Stroke* s)
+{
+    Rect b = s->bounding_rect;
+    i64 side = max(b.right - b.left, b.bottom - b.top);
+    return side > 0 ? highest_set_bit((u64)side) : 0;
+}
 
-    if (screen_bounds.left != screen_bounds.right &&
-        screen_bounds.top != screen_bounds.bottom) {
-        #if MILTON_ENABLE_PROFILING
-        {
-            r->clipped_count = 0;
+// Cook the strokes within screen_bounds that are not on the GPU yet. With
+// use_budget, stop when the time budget runs out. Returns false if some were
+// left for later frames.
+static b32
+clip_cook_visible(Arena* arena, RenderBackend* r, Rect screen_bounds, u64 start, b32 use_budget)
+{
+    DArray<Stroke*>* uncooked = &r->clip_uncooked;
+    reset(uncooked);
+
+    i64 class_count[64] = {};
+    for ( i64 li = 0; li < r->clip_layers.count; ++li ) {
+        ClipLayer* cl = &r->clip_layers.data[li];
+        Stroke** strokes = r->clip_cache_strokes.data + cl->first;
+        for ( i64 i = 0; i < cl->count; ++i ) {
+            Stroke* s = strokes[i];
+            if ( rect_intersects_rect(s->bounding_rect, screen_bounds) &&
+                 stroke_is_drawable(s) && !clip_stroke_is_cooked(r, s) ) {
+                push(uncooked, s);
+                ++class_count[stroke_size_class(s)];
+            }
         }
-        #endif
-        for ( Layer* l = root_layer;
-              l != NULL;
-              l = l->next ) {
-            if ( !(l->flags & LayerFlags_VISIBLE) ) {
-                // Skip invisible layers.
-                continue;
+    }
+    if ( uncooked->count == 0 ) {
+        return true;
+    }
+
+    // Counting sort, biggest class first.
+    i64 class_first[64];
+    i64 first = 0;
+    for ( i32 c = 63; c >= 0; --c ) {
+        class_first[c] = first;
+        first += class_count[c];
+    }
+    DArray<Stroke*>* sorted = &r->clip_uncooked_sorted;
+    reserve(sorted, uncooked->count);
+    sorted->count = uncooked->count;
+    for ( i64 i = 0; i < uncooked->count; ++i ) {
+        Stroke* s = uncooked->data[i];
+        sorted->data[class_first[stroke_size_class(s)]++] = s;
+    }
+
+    // Cook in batches, so that the job threads have enough work and the
+    // budget is checked often enough.
+    i64 next = 0;
+    while ( next < sorted->count ) {
+        // Cook at least one batch, so that every frame makes progress.
+        if ( use_budget && next > 0 &&
+             perf_count_to_sec(perf_counter() - start) * 1000.0f > r->render_budget_ms ) {
+            return false;
+        }
+        i64 end = next;
+        i64 segments = 0;
+        while ( end < sorted->count && segments < COOK_BATCH_SEGMENTS ) {
+            segments += stroke_num_segments(sorted->data[end++]);
+        }
+        cook_strokes(arena, r, sorted->data + next, end - next);
+        next = end;
+    }
+    return true;
+}
+
+// The index query costs more per stroke than a bucket scan, and has to sort its
+// results. Use it when only part of the layer is on screen.
+static b32
+clip_with_index(StrokeList* list, Rect screen_bounds)
+{
+    Rect layer_bounds = rect_without_size();
+    i64 first = 0;
+    for ( StrokeBucket* bucket = &list->root;
+          bucket && first < list->count;
+          bucket = bucket->next, first += STROKELIST_BUCKET_COUNT ) {
+        layer_bounds = rect_union(layer_bounds, bucket->bounding_rect);
+    }
+
+    double layer_w = (double)layer_bounds.right - (double)layer_bounds.left;
+    double layer_h = (double)layer_bounds.bottom - (double)layer_bounds.top;
+    double visible_w = (double)min(layer_bounds.right, screen_bounds.right) - (double)max(layer_bounds.left, screen_bounds.left);
+    double visible_h = (double)min(layer_bounds.bottom, screen_bounds.bottom) - (double)max(layer_bounds.top, screen_bounds.top);
+
+    b32 use_index = true;
+    if ( layer_w > 0 && layer_h > 0 && visible_w > 0 && visible_h > 0 ) {
+        use_index = (visible_w * visible_h) / (layer_w * layer_h) < CLIP_SCAN_MIN_VISIBLE_FRACTION;
+    }
+    return use_index;
+}
+
+// Only reads the canvas and writes to the job's own masks. Cooking and freeing
+// strokes calls GL, so that is left to the main thread.
+static void
+clip_job(void* data, i64 job_index)
+{
+    ClipJob* job = (ClipJob*)data + job_index;
+    switch ( job->type ) {
+        case ClipJob_INDEX: {
+            strokelist_mark(job->list, job->rect, job->masks);
+        } break;
+        case ClipJob_BUCKET: {
+            strokelist_cull_bucket(job->bucket, job->count, job->rect, job->masks);
+        } break;
+        case ClipJob_FAR: {
+            strokelist_cull_bucket(job->bucket, job->count, job->rect, job->masks);
+            for ( i64 wi = 0; wi < STROKELIST_MASK_WORDS; ++wi ) {
+                i64 valid = min(max(job->count - wi*64, (i64)0), (i64)64);
+                u64 valid_bits = valid == 64 ? ~0ULL : (1ULL << valid) - 1;
+                job->masks[wi] = ~job->masks[wi] & valid_bits;
             }
+        } break;
+    }
+}
+
+// The cache holds for the same visible layers with the same strokes, when the
+// rect is within the cached one at the same scale.
+static b32
+clip_cache_is_valid(RenderBackend* r, Layer* root_layer, Rect bounds, i64 scale)
+{
+    b32 valid =    r->clip_cache_valid
+                && r->clip_cache_scale == scale
+                && is_rect_within_rect(bounds, r->clip_cache_bounds);
+
+    i64 li = 0;
+    for ( Layer* l = root_layer; valid && l != NULL; l = l->next ) {
+        if ( l->flags & LayerFlags_VISIBLE ) {
+            ClipLayer* cl = li < r->clip_layers.count ? &r->clip_layers.data[li] : NULL;
+            valid = cl && cl->layer == l && cl->id == l->id && cl->version == l->strokes.version;
+            ++li;
+        }
+    }
+    return valid && li == r->clip_layers.count;
+}
 
-            StrokeBucket* bucket = &l->strokes.root;
-            i64 bucket_i = 0;
+// Find the strokes within `bounds` on every visible layer, and put them in the
+// clip cache. With `keep_bounds`, also free the strokes outside of it.
+static void
+clip_update_cache(RenderBackend* r, Layer* root_layer, Rect bounds, Rect* keep_bounds)
+{
+    b32 free_far_strokes = keep_bounds != NULL;
+
+    // Lay out the masks for every visible layer. Jobs write to them
+    // directly, so size them before making any job.
+    reset(&r->clip_layers);
+    reset(&r->clip_cache_strokes);
+    reset(&r->clip_jobs);
+    i64 num_words = 0;
+    for ( Layer* l = root_layer;
+          l != NULL;
+          l = l->next ) {
+        if ( !(l->flags & LayerFlags_VISIBLE) ) {
+            // Skip invisible layers.
+            continue;
+        }
+        ClipLayer cl = {};
+        cl.layer = l;
+        cl.id = l->id;
+        cl.version = l->strokes.version;
+        cl.num_buckets = (l->strokes.count + STROKELIST_BUCKET_COUNT - 1) / STROKELIST_BUCKET_COUNT;
+        num_words += cl.num_buckets * STROKELIST_MASK_WORDS * (free_far_strokes ? 2 : 1);
+        push(&r->clip_layers, cl);
+    }
+    reserve(&r->clip_masks, num_words);
+    r->clip_masks.count = num_words;
+    if ( num_words ) {
+        memset(r->clip_masks.data, 0, (size_t)num_words * sizeof(u64));
+    }
 
-            while ( bucket ) {
-                i64 count = 0;
-                if ( l->strokes.count < bucket_i * STROKELIST_BUCKET_COUNT ) {
-                    // There is an allocated bucket but we have already iterated
-                    // through all the actual strokes.
-                    break;
+    u64* masks = r->clip_masks.data;
+    for ( i64 li = 0; li < r->clip_layers.count; ++li ) {
+        ClipLayer* cl = &r->clip_layers.data[li];
+        StrokeList* list = &cl->layer->strokes;
+        i64 layer_words = cl->num_buckets * STROKELIST_MASK_WORDS;
+        if ( layer_words == 0 ) {
+            continue;
+        }
+        cl->visible = masks;
+        masks += layer_words;
+        if ( free_far_strokes ) {
+            cl->far_away = masks;
+            masks += layer_words;
+        }
+
+        b32 use_index = clip_with_index(list, bounds);
+        if ( use_index ) {
+            ClipJob job = {};
+            job.type = ClipJob_INDEX;
+            job.list = list;
+            job.rect = bounds;
+            job.masks = cl->visible;
+            push(&r->clip_jobs, job);
+        }
+        StrokeBucket* bucket = &list->root;
+        for ( i64 bi = 0; bi < cl->num_buckets; ++bi, bucket = bucket->next ) {
+            i64 count = min(list->count - bi*STROKELIST_BUCKET_COUNT, (i64)STROKELIST_BUCKET_COUNT);
+            if ( !use_index && rect_intersects_rect(bucket->bounding_rect, bounds) ) {
+                // Most of the layer is on screen. Cull whole buckets,
+                // which keeps paint order without sorting.
+                ClipJob job = {};
+                job.type = ClipJob_BUCKET;
+                job.bucket = bucket;
+                job.count = count;
+                job.rect = bounds;
+                job.masks = cl->visible + bi*STROKELIST_MASK_WORDS;
+                push(&r->clip_jobs, job);
+            }
+            if ( cl->far_away ) {
+                ClipJob job = {};
+                job.type = ClipJob_FAR;
+                job.bucket = bucket;
+                job.count = count;
+                job.rect = *keep_bounds;
+                job.masks = cl->far_away + bi*STROKELIST_MASK_WORDS;
+                push(&r->clip_jobs, job);
+            }
+        }
+    }
+
+    jobs_run(clip_job, r->clip_jobs.data, r->clip_jobs.count);
+
+    // Collect the results in layer and paint order. Freeing calls GL, so
+    // it happens here too.
+    for ( i64 li = 0; li < r->clip_layers.count; ++li ) {
+        ClipLayer* cl = &r->clip_layers.data[li];
+        StrokeBucket* bucket = &cl->layer->strokes.root;
+        cl->first = r->clip_cache_strokes.count;
+        for ( i64 bi = 0; bi < cl->num_buckets; ++bi, bucket = bucket->next ) {
+            u64* visible = cl->visible + bi*STROKELIST_MASK_WORDS;
+            for ( i64 wi = 0; wi < STROKELIST_MASK_WORDS; ++wi ) {
+                for ( u64 bits = visible[wi]; bits != 0; bits &= bits - 1 ) {
+                    push(&r->clip_cache_strokes, &bucket->data[wi*64 + lowest_set_bit(bits)]);
                 }
-                if ( l->strokes.count - bucket_i*STROKELIST_BUCKET_COUNT >= STROKELIST_BUCKET_COUNT ) {
-                    count = STROKELIST_BUCKET_COUNT;
-                } else {
-                    count = l->strokes.count % STROKELIST_BUCKET_COUNT;
+            }
+            if ( cl->far_away ) {
+                // If it is far away, delete.
+                u64* far_away = cl->far_away + bi*STROKELIST_MASK_WORDS;
+                for ( i64 wi = 0; wi < STROKELIST_MASK_WORDS; ++wi ) {
+                    for ( u64 bits = far_away[wi]; bits != 0; bits &= bits - 1 ) {
+                        gpu_free_strokes(&bucket->data[wi*64 + lowest_set_bit(bits)], 1, r);
+                    }
                 }
+            }
+        }
+        cl->count = r->clip_cache_strokes.count - cl->first;
+        cl->visible = NULL;
+        cl->far_away = NULL;
+    }
+}
 
-                Rect bbox = bucket->bounding_rect;
+// Changes when any enabled effect of the list changes.
+static u64
+effects_hash(LayerEffect* effects)
+{
+    u64 hash = 14695981039346656037ull;  // FNV-1a
+    for ( LayerEffect* e = effects; e != NULL; e = e->next ) {
+        if ( !e->enabled ) { continue; }
+        i32 fields[] = { e->type, e->blur.original_scale, e->blur.kernel_size };
+        for ( sz i = 0; i < array_count(fields); ++i ) {
+            hash = (hash ^ (u32)fields[i]) * 1099511628211ull;
+        }
+    }
+    return hash;
+}
 
-                b32 bucket_outside =   screen_bounds.left   > bbox.right
-                                    || screen_bounds.top    > bbox.bottom
-                                    || screen_bounds.right  < bbox.left
-                                    || screen_bounds.bottom < bbox.top;
+static BlurCacheKey
+blur_cache_key(CanvasView* view, Layer* layer)
+{
+    BlurCacheKey key = {};
+    key.version = layer->strokes.version;
+    key.effects = effects_hash(layer->effects);
+    key.scale = view->scale;
+    key.angle = view->angle;
+    key.pan_center = view->pan_center;
+    key.zoom_center = view->zoom_center;
+    key.screen_size = view->screen_size;
+    return key;
+}
 
-                if ( !bucket_outside ) {
-                    for ( i64 i = 0; i < count; ++i ) {
-                        Stroke* s = &bucket->data[i];
+static b32
+blur_cache_key_equal(BlurCacheKey a, BlurCacheKey b)
+{
+    return a.version == b.version &&
+           a.effects == b.effects &&
+           a.scale == b.scale &&
+           a.angle == b.angle &&
+           a.pan_center == b.pan_center &&
+           a.zoom_center == b.zoom_center &&
+           a.screen_size == b.screen_size;
+}
 
-                        if ( s != NULL ) {
-                            Rect bounds = s->bounding_rect;
+static i64
+blur_cache_find(RenderBackend* r, i32 layer_id)
+{
+    for ( i64 i = 0; i < r->blur_caches.count; ++i ) {
+        if ( r->blur_caches.data[i].layer_id == layer_id ) {
+            return i;
+        }
+    }
+    return -1;
+}
 
-                            b32 stroke_outside =   screen_bounds.left   > bounds.right
-                                                || screen_bounds.top    > bounds.bottom
-                                                || screen_bounds.right  < bounds.left
-                                                || screen_bounds.bottom < bounds.top;
+// Free the caches of layers that are no longer visible or blurred.
+static void
+blur_caches_prune(RenderBackend* r)
+{
+    for ( i64 i = 0; i < r->blur_caches.count; ) {
+        BlurCache* c = &r->blur_caches.data[i];
+        b32 keep = false;
+        for ( i64 li = 0; li < r->clip_layers.count; ++li ) {
+            Layer* l = r->clip_layers.data[li].layer;
+            if ( l->id == c->layer_id ) {
+                keep = layer::layer_has_blur_effect(l);
+                break;
+            }
+        }
+        if ( keep ) {
+            ++i;
+        }
+        else {
+            if ( c->texture ) {
+                glDeleteTextures(1, &c->texture);
+            }
+            *c = r->blur_caches.data[r->blur_caches.count - 1];
+            pop(&r->blur_caches);
+        }
+    }
+}
 
-                            i32 area = (bounds.right-bounds.left) * (bounds.bottom-bounds.top);
-                            // Area might be 0 if the stroke is smaller than
-                            // a pixel. We don't draw it in that case.
-                            if ( !stroke_outside && area!=0 ) {
-                                gpu_cook_stroke(arena, r, s);
-                                push(clip_array, *get_render_element(s->render_handle));
-                            }
-                            else if ( stroke_outside && ( flags & ClipFlags_UPDATE_GPU_DATA ) ) {
-                                // If it is far away, delete.
-                                i32 distance = MLT_ABS(bounds.left - x + bounds.top - y);
-                                const i32 min_number_of_screens = 4;
-                                if (    bounds.top    < y - min_number_of_screens*h
-                                     || bounds.bottom > y+h + min_number_of_screens*h
-                                     || bounds.left   > x+w + min_number_of_screens*w
-                                     || bounds.right  < x - min_number_of_screens*w ) {
-                                    gpu_free_strokes(s, 1, r);
-                                }
-                            }
-                        }
-                    }
-                }
-                else if ( flags & ClipFlags_UPDATE_GPU_DATA ) {
-                    gpu_free_strokes(bucket->data, count, r);
-                }
-                #if MILTON_ENABLE_PROFILING
-                {
-                    for ( i64 i = 0; i < count; ++i ) {
-                        Stroke* s = &bucket->data[i];
-                        RenderElement* re = get_render_element(s->render_handle);
-                        if ( re && re->vbo_stroke != 0 ) {
-                            r->clipped_count++;
-                        }
+b32
+gpu_blur_caches_valid(RenderBackend* r, CanvasView* view, Layer* root_layer, Stroke* working_stroke)
+{
+    for ( Layer* l = root_layer; l != NULL; l = l->next ) {
+        if ( !(l->flags & LayerFlags_VISIBLE) || !layer::layer_has_blur_effect(l) ) {
+            continue;
+        }
+        if ( working_stroke->layer_id == l->id && working_stroke->num_points > 0 ) {
+            return false;
+        }
+        i64 ci = blur_cache_find(r, l->id);
+        if ( ci < 0 ||
+             !r->blur_caches.data[ci].valid ||
+             !blur_cache_key_equal(r->blur_caches.data[ci].key, blur_cache_key(view, l)) ) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Whether a layer is drawn from its blur cache. When it isn't and full_render
+// is set, out_blur_cache is the cache that gpu_render_canvas fills, or -1.
+static b32
+clip_layer_blur(RenderBackend* r, CanvasView* view, Layer* l, b32 has_working_stroke,
+                b32 full_render, i64* out_blur_cache)
+{
+    i64 blur_cache = -1;
+    b32 blur_cached = false;
+    if ( !has_working_stroke && layer::layer_has_blur_effect(l) ) {
+        BlurCacheKey key = blur_cache_key(view, l);
+        blur_cache = blur_cache_find(r, l->id);
+        if ( blur_cache >= 0 &&
+             r->blur_caches.data[blur_cache].valid &&
+             blur_cache_key_equal(r->blur_caches.data[blur_cache].key, key) ) {
+            blur_cached = true;
+        }
+        else if ( full_render ) {
+            if ( blur_cache < 0 ) {
+                BlurCache c = {};
+                c.layer_id = l->id;
+                push(&r->blur_caches, c);
+                blur_cache = r->blur_caches.count - 1;
+            }
+            // Filled in by gpu_render_canvas.
+            r->blur_caches.data[blur_cache].key = key;
+            r->blur_caches.data[blur_cache].valid = false;
+        }
+        else {
+            blur_cache = -1;
+        }
+    }
+    *out_blur_cache = blur_cache;
+    return blur_cached;
+}
+
+// The clip array of the last clip has every stroke within clip_array_bounds.
+// When nothing else changed, a clip within those bounds keeps it and only
+// updates the working stroke and the layer elements, so while drawing the
+// cost of a frame does not grow with the number of strokes on screen.
+static b32
+clip_array_reuse(Arena* arena, RenderBackend* r, CanvasView* view, Rect screen_bounds,
+                 Stroke* working_stroke, b32 full_render)
+{
+    b32 has_working_stroke = working_stroke->num_points > 0;
+    if (    !r->clip_array_valid
+         || !is_rect_within_rect(screen_bounds, r->clip_array_bounds)
+         || !(r->clip_array_render_center == r->render_center)
+         || has_working_stroke != r->clip_array_has_working_stroke
+         || (has_working_stroke && working_stroke->layer_id != r->clip_array_working_layer) ) {
+        return false;
+    }
+
+    for ( i64 li = 0; li < r->clip_layers.count; ++li ) {
+        ClipLayer* cl = &r->clip_layers.data[li];
+        Layer* l = cl->layer;
+        i64 blur_cache = -1;
+        b32 blur_cached = clip_layer_blur(r, view, l, has_working_stroke && working_stroke->layer_id == l->id,
+                                          full_render, &blur_cache);
+        // Layers drawn from their blur cache have no strokes in the array.
+        if ( blur_cached != cl->blur_cached ) {
+            return false;
+        }
+        RenderElement* p = &r->clip_array.data[cl->element];
+        p->layer_alpha = l->alpha;
+        p->effects = l->effects;
+        p->blur_cache = (i32)blur_cache;
+    }
+
+    if ( r->clip_array_working >= 0 ) {
+        gpu_cook_stroke(arena, r, working_stroke, CookStroke_UPDATE_WORKING_STROKE);
+        r->clip_array.data[r->clip_array_working] = *get_render_element(working_stroke->render_handle);
+    }
+    return true;
+}
+
+void
+gpu_clip_strokes_and_update(Arena* arena,
+                            RenderBackend* r,
+                            CanvasView* view,
+                            i64 scale,
+                            Layer* root_layer, Stroke* working_stroke,
+                            i32 x, i32 y, i32 w, i32 h, ClipFlags flags)
+{
+    DArray<RenderElement>* clip_array = &r->clip_array;
+
+    RenderElement layer_element = {};
+    layer_element.flags |= RenderElementFlags_LAYER;
+
+    u64 start = perf_counter();
+
+    Rect screen_bounds = raster_to_canvas_bounding_rect(view, x, y, w, h, scale);
+
+    if (screen_bounds.left != screen_bounds.right &&
+        screen_bounds.top != screen_bounds.bottom) {
+        i64 screen_w = screen_bounds.right - screen_bounds.left;
+        i64 screen_h = screen_bounds.bottom - screen_bounds.top;
+
+        // Strokes further than this many screens away get freed from GPU memory.
+        const i64 min_number_of_screens = 4;
+        Rect keep_bounds = screen_bounds;
+        keep_bounds.left   -= min_number_of_screens*screen_w;
+        keep_bounds.right  += min_number_of_screens*screen_w;
+        keep_bounds.top    -= min_number_of_screens*screen_h;
+        keep_bounds.bottom += min_number_of_screens*screen_h;
+
+        // Looking for far away strokes visits every stroke outside of the
+        // screen, so only do it after the view has moved a screen away from
+        // where we last did it, or the zoom changed.
+        b32 free_far_strokes = false;
+        if ( flags & ClipFlags_UPDATE_GPU_DATA ) {
+            Rect last = r->free_strokes_bounds;
+            i64 last_w = last.right - last.left;
+            i64 last_h = last.bottom - last.top;
+            if (    scale != r->free_strokes_scale
+                 || screen_bounds.left   < last.left   - last_w
+                 || screen_bounds.right  > last.right  + last_w
+                 || screen_bounds.top    < last.top    - last_h
+                 || screen_bounds.bottom > last.bottom + last_h ) {
+                free_far_strokes = true;
+                r->free_strokes_bounds = screen_bounds;
+                r->free_strokes_scale = scale;
+            }
+        }
+
+        if ( free_far_strokes || !clip_cache_is_valid(r, root_layer, screen_bounds, scale) ) {
+            // Clip the whole screen, so that redrawing parts of it can use the
+            // cache until something changes.
+            Rect cache_bounds = rect_union(screen_bounds,
+                                           raster_to_canvas_bounding_rect(view, 0, 0, r->width, r->height, scale));
+            clip_update_cache(r, root_layer, cache_bounds, free_far_strokes ? &keep_bounds : NULL);
+            r->clip_cache_bounds = cache_bounds;
+            r->clip_cache_scale = scale;
+            r->clip_cache_valid = true;
+            r->clip_array_valid = false;
+        }
+
+        // Blurs are only stored when the whole screen is drawn with every stroke in it.
+        b32 full_screen = x == 0 && y == 0 &&
+                          w == view->screen_size.w && h == view->screen_size.h;
+
+        if ( clip_array_reuse(arena, r, view, screen_bounds, working_stroke, full_screen) ) {
+            return;
+        }
+
+        reset(clip_array);
+        r->render_incomplete = false;
+        #if MILTON_ENABLE_PROFILING
+        r->clipped_count = 0;
+        #endif
+        residency_begin_frame(&r->residency);
+
+        // Partial redraws follow the working stroke around. Take the strokes
+        // around the rect too, so that the next few frames can reuse them.
+        Rect clip_bounds = screen_bounds;
+        clip_bounds.left   -= screen_w;
+        clip_bounds.right  += screen_w;
+        clip_bounds.top    -= screen_h;
+        clip_bounds.bottom += screen_h;
+        clip_bounds = rect_intersect(clip_bounds, r->clip_cache_bounds);
+
+        b32 use_budget = (flags & ClipFlags_DRAW_ITERATIVELY) != 0;
+        r->render_incomplete = !clip_cook_visible(arena, r, clip_bounds, start, use_budget);
+
+        b32 full_render = full_screen && !r->render_incomplete;
+
+        blur_caches_prune(r);
+
+        b32 has_working_stroke = working_stroke->num_points > 0;
+        r->clip_array_working = -1;
+
+        // Fill the clip array in layer and paint order.
+        for ( i64 li = 0; li < r->clip_layers.count; ++li ) {
+            ClipLayer* cl = &r->clip_layers.data[li];
+            Layer* l = cl->layer;
+            b32 on_layer = has_working_stroke && working_stroke->layer_id == l->id;
+
+            i64 blur_cache = -1;
+            b32 blur_cached = clip_layer_blur(r, view, l, on_layer, full_render, &blur_cache);
+
+            if ( !blur_cached ) {
+                Stroke** strokes = r->clip_cache_strokes.data + cl->first;
+                for ( i64 i = 0; i < cl->count; ++i ) {
+                    if ( rect_intersects_rect(strokes[i]->bounding_rect, clip_bounds) ) {
+                        clip_stroke(r, strokes[i]);
                     }
                 }
-                #endif
-                bucket = bucket->next;
-                bucket_i += 1;
             }
 
             // Add the working stroke on the current layer.
-            if ( working_stroke->layer_id == l->id ) {
-                if ( working_stroke->num_points > 0 ) {
-                    gpu_cook_stroke(arena, r, working_stroke, CookStroke_UPDATE_WORKING_STROKE);
+            if ( on_layer ) {
+                gpu_cook_stroke(arena, r, working_stroke, CookStroke_UPDATE_WORKING_STROKE);
 
-                    push(clip_array, *get_render_element(working_stroke->render_handle));
-                }
+                r->clip_array_working = clip_array->count;
+                push(clip_array, *get_render_element(working_stroke->render_handle));
             }
 
+            cl->element = clip_array->count;
+            cl->blur_cached = blur_cached;
             auto* p = push(clip_array, layer_element);
             p->layer_alpha = l->alpha;
             p->effects = l->effects;
+            p->blur_cache = (i32)blur_cache;
+            if ( blur_cached ) {
+                p->flags |= RenderElementFlags_BLUR_CACHED;
+            }
         }
+
+        // Strokes in the clip array were used in this frame, so they stay.
+        residency_trim(&r->residency);
+
+        // Freeing strokes clears this, so set it after the trim.
+        r->clip_array_valid = !r->render_incomplete;
+        r->clip_array_bounds = clip_bounds;
+        r->clip_array_render_center = r->render_center;
+        r->clip_array_has_working_stroke = has_working_stroke;
+        r->clip_array_working_layer = working_stroke->layer_id;
+    }
+    else {
+        reset(clip_array);
+        r->render_incomplete = false;
+        r->clip_array_valid = false;
     }
 }
 
@@ -1390,7 +2359,7 @@ gpu_fill_with_texture(RenderBackend* r, float alpha = 1.0f)
     gl::use_program(r->texture_fill_program);
     gl::set_uniform_f(r->texture_fill_program, "u_alpha", alpha);
     {
-        GLint t_loc = glGetAttribLocation(r->texture_fill_program, "a_position");
+        GLint t_loc = gl::attrib_location(r->texture_fill_program, "a_position");
         if ( t_loc >= 0 ) {
             glBindBuffer(GL_ARRAY_BUFFER, r->vbo_screen_quad);
             glEnableVertexAttribArray((GLuint)t_loc);
@@ -1408,11 +2377,12 @@ enum BoxFilterPass
     BoxFilterPass_HORIZONTAL = 1,
 };
 static void
-box_filter_pass(RenderBackend* r, int kernel_size, int direction)
+box_filter_pass(RenderBackend* r, int num_samples, int step, int direction)
 {
     gl::use_program(r->blur_program);
-    gl::set_uniform_i(r->blur_program, "u_kernel_size", kernel_size);
-    GLint t_loc = glGetAttribLocation(r->blur_program, "a_position");
+    gl::set_uniform_i(r->blur_program, "u_kernel_size", num_samples);
+    gl::set_uniform_i(r->blur_program, "u_step", step);
+    GLint t_loc = gl::attrib_location(r->blur_program, "a_position");
     if ( t_loc >= 0 ) {
         gl::set_uniform_i(r->blur_program, "u_direction", direction);
         {
@@ -1426,6 +2396,155 @@ box_filter_pass(RenderBackend* r, int kernel_size, int direction)
     }
 }
 
+struct BlurPass
+{
+    i32 samples;
+    i32 step;  // Pixels between samples.
+};
+
+// A box filter of kernel_size samples two pixels apart is the same as a box
+// of n0 samples, followed by a box of n1 samples 2*n0 pixels apart, followed
+// by one of n2 samples 2*n0*n1 pixels apart, and so on. Big kernels are split
+// so that no pass takes more than BLUR_MAX_SAMPLES samples per pixel, however
+// far the view is zoomed in. The product of the passes is within a tenth of
+// kernel_size. Returns the number of passes.
+static i32
+box_filter_split(i32 kernel_size, BlurPass* passes)
+{
+    // Wider than any texture. Keeps the steps in range.
+    kernel_size = min(kernel_size, BLUR_MAX_KERNEL_SIZE);
+
+    i32 num_passes = 1;
+    if ( kernel_size > BLUR_MAX_SAMPLES ) {
+        num_passes = 2;
+        for ( i64 reach = BLUR_MAX_SAMPLES*BLUR_MAX_SAMPLES; reach < kernel_size; reach *= BLUR_MAX_SAMPLES ) {
+            num_passes++;
+        }
+    }
+    mlt_assert(num_passes <= BLUR_MAX_PASSES);
+
+    // Spread what is left evenly over the remaining passes.
+    double remaining = (double)kernel_size;
+    i32 step = 2;
+    for ( i32 i = 0; i < num_passes; ++i ) {
+        i32 samples = 0;
+        if ( i < num_passes - 1 ) {
+            samples = min((i32)ceil(pow(remaining, 1.0 / (num_passes - i))), BLUR_MAX_SAMPLES);
+        }
+        else {
+            samples = min(max((i32)(remaining + 0.5), 1), BLUR_MAX_SAMPLES);
+        }
+        passes[i].samples = samples;
+        passes[i].step = step;
+        remaining /= samples;
+        step *= samples;
+    }
+    return num_passes;
+}
+
+// Copy the contents of a layer after its effects to its cache.
+// Expects blending and depth testing to be disabled.
+static void
+store_blur_cache(RenderBackend* r, BlurCache* c, GLuint texture, GLenum texture_target)
+{
+    v2i size = { r->width, r->height };
+    b32 multisample = gl::check_flags(GLHelperFlags_TEXTURE_MULTISAMPLE);
+    if ( c->texture == 0 ) {
+        c->texture = multisample ? gl::new_color_texture_multisample(size.w, size.h)
+                                 : gl::new_color_texture(size.w, size.h);
+    }
+    else if ( !(c->size == size) ) {
+        if ( multisample ) {
+            gl::resize_color_texture_multisample(c->texture, size.w, size.h);
+        } else {
+            gl::resize_color_texture(c->texture, size.w, size.h);
+        }
+    }
+    c->size = size;
+
+    glFramebufferTexture2DEXT(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                              texture_target, c->texture, 0);
+    glBindTexture(texture_target, texture);
+    gpu_fill_with_texture(r);
+    c->valid = true;
+}
+
+// Point the stroke attributes at the segments of a stroke page, starting at first_segment.
+static void
+bind_stroke_segments(RenderBackend* r, GLuint program, GLuint vbo, i64 first_segment)
+{
+    DEBUG_gl_validate_buffer(vbo);
+
+    i32 stride = 0;
+    size_t base = 0;
+    if ( r->instanced_strokes ) {
+        gl::vertex_attrib_f(program, "a_corner", r->stroke_unit_quad, 2, 0, 0);
+        stride = (i32)sizeof(StrokeSegment);
+        base = (size_t)first_segment*sizeof(StrokeSegment);
+    }
+    else {
+        stride = (i32)sizeof(StrokeCornerVertex);
+        base = (size_t)(first_segment*stroke_segment_bytes(r));
+        gl::vertex_attrib_f(program, "a_corner", vbo, 2, stride, base + offsetof(StrokeCornerVertex, corner));
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, r->stroke_quad_indices);
+    }
+    gl::vertex_attrib_f(program, "a_pointa", vbo, 3, stride, base + offsetof(StrokeSegment, pointa));
+    gl::vertex_attrib_f(program, "a_pointb", vbo, 3, stride, base + offsetof(StrokeSegment, pointb));
+    gl::vertex_attrib_f(program, "a_color", vbo, 4, stride, base + offsetof(StrokeSegment, color));
+    gl::vertex_attrib_f(program, "a_radius", vbo, 1, stride, base + offsetof(StrokeSegment, radius));
+    gl::vertex_attrib_f(program, "a_z", vbo, 1, stride, base + offsetof(StrokeSegment, z));
+#if STROKE_DEBUG_VIZ
+    gl::vertex_attrib_f(program, "a_debug_color", vbo, 3, stride, base + offsetof(StrokeSegment, debug_color));
+#endif
+}
+
+// Draw `count` segments from the ones bound with bind_stroke_segments.
+static void
+draw_stroke_segments(RenderBackend* r, GLuint program, i64 count)
+{
+    if ( r->instanced_strokes ) {
+        char* per_segment[] = {
+            "a_pointa", "a_pointb", "a_color", "a_radius", "a_z",
+        #if STROKE_DEBUG_VIZ
+            "a_debug_color",
+        #endif
+        };
+        for ( sz i = 0; i < array_count(per_segment); ++i ) {
+            gl::vertex_attrib_divisor(program, per_segment[i], 1);
+        }
+        glDrawArraysInstancedARB(GL_TRIANGLE_FAN, 0, 4, (GLsizei)count);
+        // Other programs may use the same attribute locations.
+        for ( sz i = 0; i < array_count(per_segment); ++i ) {
+            gl::vertex_attrib_divisor(program, per_segment[i], 0);
+        }
+    }
+    else {
+        glDrawElements(GL_TRIANGLES, (GLsizei)(count*6), GL_UNSIGNED_SHORT, 0);
+    }
+}
+
+// Strokes cooked before the render center moved need the pan center relative
+// to their own render center.
+static void
+set_stroke_pan_center(RenderBackend* r, GLuint program, v2i render_center)
+{
+    gl::set_uniform_vec2i(program, "u_pan_center", 1,
+                          relative_to_center(render_center, r->pan_center).d);
+}
+
+// Whether `next` can be drawn in the same call as `re`, with the plain stroke program.
+static b32
+stroke_can_batch(RenderElement* re, RenderElement* next)
+{
+    int special = RenderElementFlags_LAYER | RenderElementFlags_ERASER |
+                  RenderElementFlags_PRESSURE_TO_OPACITY | RenderElementFlags_DISTANCE_TO_OPACITY;
+    return re->page >= 0 &&
+           !(next->flags & special) &&
+           next->count > 0 &&
+           next->vbo == re->vbo &&
+           next->render_center == re->render_center;
+}
+
 static void
 gpu_render_canvas(RenderBackend* r, i32 view_x, i32 view_y,
                   i32 view_width, i32 view_height, float background_alpha=1.0f)
@@ -1498,7 +2617,12 @@ gpu_render_canvas(RenderBackend* r, i32 view_x, i32 view_y,
             // layer_texture, we apply all layer effects.
 
             GLuint layer_post_effects = layer_texture;
-            {
+            if ( re->flags & RenderElementFlags_BLUR_CACHED ) {
+                // The layer's strokes were not drawn. Its blurred contents are
+                // the same as the last time.
+                layer_post_effects = r->blur_caches.data[re->blur_cache].texture;
+            }
+            else {
                 // eraser_texture will be rewritten below with the
                 // contents of canvas_texture. We use it here for
                 // the layer effects.
@@ -1506,6 +2630,16 @@ gpu_render_canvas(RenderBackend* r, i32 view_x, i32 view_y,
                 GLuint in_texture  = layer_texture;
                 glDisable(GL_BLEND);
                 glDisable(GL_DEPTH_TEST);
+
+                // Filter from in_texture to out_texture, then make the result the next input.
+                auto blur_pass = [&](int num_samples, int step, int direction) {
+                    box_filter_pass(r, num_samples, step, direction);
+                    swap(out_texture, in_texture);
+                    glBindTexture(texture_target, in_texture);
+                    glFramebufferTexture2DEXT(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                                              texture_target, out_texture, 0);
+                };
+
                 for ( LayerEffect* e = re->effects; e != NULL; e = e->next ) {
                     if ( e->enabled == false ) { continue; }
 
@@ -1514,24 +2648,19 @@ gpu_render_canvas(RenderBackend* r, i32 view_x, i32 view_y,
                         glFramebufferTexture2DEXT(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
                                                   texture_target, out_texture, 0);
 
+                        int kernel_size = e->blur.kernel_size * e->blur.original_scale / r->scale;
+                        BlurPass passes[BLUR_MAX_PASSES];
+                        i32 num_passes = box_filter_split(kernel_size, passes);
+
                         // Three box filter iterations approximate a Gaussian blur
                         for (int blur_iter = 0; blur_iter < 3; ++blur_iter) {
                             // Box filter implementation uses the separable property.
                             // Apply horizontal pass and then vertical pass.
-                            int kernel_size = e->blur.kernel_size * e->blur.original_scale / r->scale;
-                            box_filter_pass(r, kernel_size, BoxFilterPass_VERTICAL);
-                            swap(out_texture, in_texture);
-                            glBindTexture(texture_target, in_texture);
-                            glFramebufferTexture2DEXT(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
-                                                      texture_target, out_texture, 0);
-
-
-                            box_filter_pass(r, kernel_size, BoxFilterPass_HORIZONTAL);
-                            swap(out_texture, in_texture);
-                            glBindTexture(texture_target, in_texture);
-                            glFramebufferTexture2DEXT(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
-                                                      texture_target, out_texture, 0);
-
+                            for ( int direction = BoxFilterPass_VERTICAL; direction <= BoxFilterPass_HORIZONTAL; ++direction ) {
+                                for ( i32 pi = 0; pi < num_passes; ++pi ) {
+                                    blur_pass(passes[pi].samples, passes[pi].step, direction);
+                                }
+                            }
                         }
                         swap(out_texture, in_texture);
                         glBindTexture(texture_target, in_texture);
@@ -1540,6 +2669,11 @@ gpu_render_canvas(RenderBackend* r, i32 view_x, i32 view_y,
                         layer_post_effects = out_texture;
                     }
                 }
+
+                if ( re->blur_cache >= 0 ) {
+                    store_blur_cache(r, &r->blur_caches.data[re->blur_cache], layer_post_effects, texture_target);
+                }
+
                 glEnable(GL_BLEND);
                 glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
                 glEnable(GL_DEPTH_TEST);
@@ -1588,21 +2722,18 @@ gpu_render_canvas(RenderBackend* r, i32 view_x, i32 view_y,
             auto stroke_pass = [r, texture_target](RenderElement* re, GLuint program_for_stroke) {
                 i64 count = re->count;
                 gl::use_program(program_for_stroke);
-                gl::set_uniform_vec4(program_for_stroke, "u_brush_color", 1, re->color.d);
-                gl::set_uniform_i(program_for_stroke, "u_radius", re->radius);
-
-                DEBUG_gl_validate_buffer(re->vbo_stroke);
-                DEBUG_gl_validate_buffer(re->vbo_pointa);
-                DEBUG_gl_validate_buffer(re->vbo_pointb);
-                DEBUG_gl_validate_buffer(re->indices);
+                b32 other_center = re->render_center != r->render_center;
+                if ( other_center ) {
+                    set_stroke_pan_center(r, program_for_stroke, re->render_center);
+                }
 
-                gl::vertex_attrib_v3f(program_for_stroke, "a_pointa", re->vbo_pointa);
-                gl::vertex_attrib_v3f(program_for_stroke, "a_pointb", re->vbo_pointb);
-                gl::vertex_attrib_v3f(program_for_stroke, "a_position", re->vbo_stroke);
+                bind_stroke_segments(r, program_for_stroke, re->vbo, re->first_segment);
 
-                glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, re->indices);
+                draw_stroke_segments(r, program_for_stroke, count);
 
-                glDrawElements(GL_TRIANGLES, count, GL_UNSIGNED_SHORT, 0);
+                if ( other_center ) {
+                    set_stroke_pan_center(r, program_for_stroke, r->render_center);
+                }
             };
 
             if ( re->count > 0 ) {
@@ -1652,8 +2783,52 @@ gpu_render_canvas(RenderBackend* r, i32 view_x, i32 view_y,
                     }
                 }
                 else {
-                    // Fast path
-                    stroke_pass(re, r->stroke_program);
+                    // Fast path. Following strokes in the same page are drawn
+                    // with the same call.
+                    i64 last = i;
+                    while ( last + 1 < (i64)clip_array->count &&
+                            stroke_can_batch(re, &clip_array->data[last + 1]) ) {
+                        ++last;
+                    }
+                    if ( last == i ) {
+                        stroke_pass(re, r->stroke_program);
+                    }
+                    else {
+                        gl::use_program(r->stroke_program);
+                        b32 other_center = re->render_center != r->render_center;
+                        if ( other_center ) {
+                            set_stroke_pan_center(r, r->stroke_program, re->render_center);
+                        }
+                        if ( r->instanced_strokes ) {
+                            // Strokes that follow each other in the page are one range of instances.
+                            for ( i64 run = i; run <= last; ++run ) {
+                                RenderElement* first = &clip_array->data[run];
+                                i64 segments = first->count;
+                                while ( run < last &&
+                                        clip_array->data[run + 1].first_segment == first->first_segment + segments ) {
+                                    segments += clip_array->data[++run].count;
+                                }
+                                bind_stroke_segments(r, r->stroke_program, first->vbo, first->first_segment);
+                                draw_stroke_segments(r, r->stroke_program, segments);
+                            }
+                        }
+                        else {
+                            reset(&r->draw_counts);
+                            reset(&r->draw_offsets);
+                            for ( i64 bi = i; bi <= last; ++bi ) {
+                                RenderElement* be = &clip_array->data[bi];
+                                push(&r->draw_counts, (GLsizei)(be->count*6));
+                                push(&r->draw_offsets, (void*)(be->first_segment*6*sizeof(u16)));
+                            }
+                            bind_stroke_segments(r, r->stroke_program, re->vbo, 0);
+                            glMultiDrawElements(GL_TRIANGLES, r->draw_counts.data, GL_UNSIGNED_SHORT,
+                                                r->draw_offsets.data, (GLsizei)r->draw_counts.count);
+                        }
+                        if ( other_center ) {
+                            set_stroke_pan_center(r, r->stroke_program, r->render_center);
+                        }
+                        i = last;
+                    }
                 }
             } else {
                 static int n = 0;
@@ -1668,6 +2843,306 @@ gpu_render_canvas(RenderBackend* r, i32 view_x, i32 view_y,
     POP_GRAPHICS_GROUP();  // render_canvas
 }
 
+static i64
+floor_div(i64 a, i64 b)
+{
+    i64 q = a / b;
+    if ( (a % b) != 0 && ((a < 0) != (b < 0)) ) {
+        --q;
+    }
+    return q;
+}
+
+// Tile space rect of a tile.
+static Rect
+tile_rect(i64 tx, i64 ty)
+{
+    Rect rect;
+    rect.left   = tx * RASTER_TILE_SIZE;
+    rect.top    = ty * RASTER_TILE_SIZE;
+    rect.right  = rect.left + RASTER_TILE_SIZE;
+    rect.bottom = rect.top + RASTER_TILE_SIZE;
+    return rect;
+}
+
+// Tile space rect of the screen.
+static Rect
+tiles_screen_rect(RenderBackend* r)
+{
+    Rect rect;
+    rect.left   = -r->tile_origin.x;
+    rect.top    = -r->tile_origin.y;
+    rect.right  = r->width - r->tile_origin.x;
+    rect.bottom = r->height - r->tile_origin.y;
+    return rect;
+}
+
+// Range of tiles that are on screen. Inclusive.
+static Rect
+tiles_on_screen(RenderBackend* r)
+{
+    Rect screen = tiles_screen_rect(r);
+    Rect range;
+    range.left   = floor_div(screen.left, RASTER_TILE_SIZE);
+    range.top    = floor_div(screen.top, RASTER_TILE_SIZE);
+    range.right  = floor_div(screen.right - 1, RASTER_TILE_SIZE);
+    range.bottom = floor_div(screen.bottom - 1, RASTER_TILE_SIZE);
+    return range;
+}
+
+// Atlas slot for a tile. The atlas is upside down like the screen, so rows go
+// the other way. Copies between a tile and the screen are then translations.
+static RasterTile*
+tile_slot(RenderBackend* r, i64 tx, i64 ty, v2l* out_slot)
+{
+    i64 sx = tx - floor_div(tx, r->tile_cols) * r->tile_cols;
+    i64 sy = (-ty - 1) - floor_div(-ty - 1, r->tile_rows) * r->tile_rows;
+    *out_slot = v2l{ sx, sy };
+    return &r->tiles.data[sy * r->tile_cols + sx];
+}
+
+// Offset from screen pixels to atlas pixels for a tile, in GL coordinates.
+static v2l
+tile_atlas_offset(RenderBackend* r, i64 tx, i64 ty, v2l slot)
+{
+    v2l offset = {
+        (slot.x - tx) * RASTER_TILE_SIZE - r->tile_origin.x,
+        (slot.y + ty + 1) * RASTER_TILE_SIZE - r->height + r->tile_origin.y,
+    };
+    return offset;
+}
+
+// Fill a screen rect of the current framebuffer with the texels of the bound
+// texture that are `offset` pixels away. GL coordinates.
+static void
+copy_texture_rect(RenderBackend* r, i64 x, i64 y, i64 w, i64 h, v2l offset)
+{
+    glScissor((GLint)x, (GLint)y, (GLsizei)w, (GLsizei)h);
+    gl::set_uniform_vec2(r->texture_fill_program, "u_texel_offset", (f32)offset.x, (f32)offset.y);
+    gpu_fill_with_texture(r);
+}
+
+void
+gpu_tiles_reset(RenderBackend* r, CanvasView* view, b32 enabled)
+{
+    // Pans of rotated views are not a whole number of pixels.
+    r->tiles_enabled = enabled && view->angle == 0.0f;
+    r->tile_origin = {};
+    r->tile_pan_center = view->pan_center;
+    r->tile_zoom_center = view->zoom_center;
+    r->tile_screen_size = v2i{ r->width, r->height };
+    r->tile_scale = view->scale;
+
+    if ( !r->tiles_enabled ) {
+        return;
+    }
+
+    // Every tile that is partly on screen needs a slot.
+    i32 cols = (r->width + RASTER_TILE_SIZE - 1) / RASTER_TILE_SIZE + 1;
+    i32 rows = (r->height + RASTER_TILE_SIZE - 1) / RASTER_TILE_SIZE + 1;
+
+    if ( r->tile_texture == 0 ) {
+        GLenum texture_target;
+        if ( gl::check_flags(GLHelperFlags_TEXTURE_MULTISAMPLE) ) {
+            texture_target = GL_TEXTURE_2D_MULTISAMPLE;
+            r->tile_texture = gl::new_color_texture_multisample(cols * RASTER_TILE_SIZE, rows * RASTER_TILE_SIZE);
+        } else {
+            texture_target = GL_TEXTURE_2D;
+            r->tile_texture = gl::new_color_texture(cols * RASTER_TILE_SIZE, rows * RASTER_TILE_SIZE);
+        }
+        // No depth attachment. It would limit the render area to the size of the screen.
+        r->tile_fbo = gl::new_fbo(r->tile_texture, 0, texture_target);
+    }
+    else if ( cols != r->tile_cols || rows != r->tile_rows ) {
+        if ( gl::check_flags(GLHelperFlags_TEXTURE_MULTISAMPLE) ) {
+            gl::resize_color_texture_multisample(r->tile_texture, cols * RASTER_TILE_SIZE, rows * RASTER_TILE_SIZE);
+        } else {
+            gl::resize_color_texture(r->tile_texture, cols * RASTER_TILE_SIZE, rows * RASTER_TILE_SIZE);
+        }
+    }
+    r->tile_cols = cols;
+    r->tile_rows = rows;
+
+    reset(&r->tiles);
+    reserve(&r->tiles, (i64)cols * rows);
+    for ( i64 i = 0; i < (i64)cols * rows; ++i ) {
+        RasterTile tile = {};
+        tile.valid = rect_without_size();
+        push(&r->tiles, tile);
+    }
+}
+
+void
+gpu_tiles_invalidate(RenderBackend* r, Rect raster_rect)
+{
+    if ( !r->tiles_enabled ) {
+        return;
+    }
+    Rect rect;
+    rect.left   = raster_rect.left - r->tile_origin.x;
+    rect.top    = raster_rect.top - r->tile_origin.y;
+    rect.right  = raster_rect.right - r->tile_origin.x;
+    rect.bottom = raster_rect.bottom - r->tile_origin.y;
+    for ( i64 i = 0; i < r->tiles.count; ++i ) {
+        RasterTile* tile = &r->tiles.data[i];
+        if ( rect_intersects_rect(tile->valid, rect) ) {
+            tile->valid = rect_without_size();
+        }
+    }
+}
+
+// Extend a rect of the dirty list downwards when the new one continues it.
+static void
+tiles_push_dirty(RenderBackend* r, Rect rect)
+{
+    for ( i64 i = 0; i < r->tile_dirty.count; ++i ) {
+        Rect* d = &r->tile_dirty.data[i];
+        if ( d->left == rect.left && d->right == rect.right && d->bottom == rect.top ) {
+            d->bottom = rect.bottom;
+            return;
+        }
+    }
+    push(&r->tile_dirty, rect);
+}
+
+b32
+gpu_tiles_pan(RenderBackend* r, CanvasView* view, Rect* out_bounds)
+{
+    if ( !r->tiles_enabled ||
+         view->scale != r->tile_scale ||
+         view->angle != 0.0f ||
+         !(view->zoom_center == r->tile_zoom_center) ||
+         !(r->tile_screen_size == v2i{ r->width, r->height }) ) {
+        return false;
+    }
+    v2l delta = r->tile_pan_center - view->pan_center;
+    if ( delta.x % view->scale != 0 || delta.y % view->scale != 0 ) {
+        return false;
+    }
+    r->tile_origin = v2l{ delta.x / view->scale, delta.y / view->scale };
+
+    PUSH_GRAPHICS_GROUP("tiles pan");
+
+    GLenum texture_target;
+    if ( gl::check_flags(GLHelperFlags_TEXTURE_MULTISAMPLE) ) {
+        texture_target = GL_TEXTURE_2D_MULTISAMPLE;
+    } else {
+        texture_target = GL_TEXTURE_2D;
+    }
+
+    glBindFramebufferEXT(GL_FRAMEBUFFER, r->fbo);
+    glFramebufferTexture2DEXT(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, texture_target,
+                              r->canvas_texture, 0);
+    glViewport(0, 0, r->width, r->height);
+    glDisable(GL_BLEND);
+    glDisable(GL_DEPTH_TEST);
+    glBindTexture(texture_target, r->tile_texture);
+    gl::set_uniform_vec2(r->texture_fill_program, "u_screen_size",
+                         (f32)(r->tile_cols * RASTER_TILE_SIZE), (f32)(r->tile_rows * RASTER_TILE_SIZE));
+
+    reset(&r->tile_dirty);
+
+    Rect screen = tiles_screen_rect(r);
+    Rect range = tiles_on_screen(r);
+    for ( i64 ty = range.top; ty <= range.bottom; ++ty ) {
+        Rect run = rect_without_size();
+        for ( i64 tx = range.left; tx <= range.right; ++tx ) {
+            Rect needed = rect_intersect(tile_rect(tx, ty), screen);
+            v2l slot;
+            RasterTile* tile = tile_slot(r, tx, ty, &slot);
+            if ( tile->position == v2l{ tx, ty } && is_rect_within_rect(needed, tile->valid) ) {
+                v2l offset = tile_atlas_offset(r, tx, ty, slot);
+                copy_texture_rect(r,
+                                  needed.left + r->tile_origin.x,
+                                  r->height - (needed.bottom + r->tile_origin.y),
+                                  needed.right - needed.left, needed.bottom - needed.top,
+                                  offset);
+                if ( rect_is_valid(run) ) {
+                    tiles_push_dirty(r, run);
+                    run = rect_without_size();
+                }
+            } else {
+                Rect on_screen;
+                on_screen.left   = needed.left + r->tile_origin.x;
+                on_screen.top    = needed.top + r->tile_origin.y;
+                on_screen.right  = needed.right + r->tile_origin.x;
+                on_screen.bottom = needed.bottom + r->tile_origin.y;
+                run = rect_union(run, on_screen);
+            }
+        }
+        if ( rect_is_valid(run) ) {
+            tiles_push_dirty(r, run);
+        }
+    }
+
+    gl::set_uniform_vec2(r->texture_fill_program, "u_screen_size", (f32)r->width, (f32)r->height);
+    gl::set_uniform_vec2(r->texture_fill_program, "u_texel_offset", 0.0f, 0.0f);
+    glViewport(0, 0, r->width, r->height);
+    glScissor(0, 0, r->width, r->height);
+    glEnable(GL_BLEND);
+    glBindFramebufferEXT(GL_FRAMEBUFFER, 0);
+
+    POP_GRAPHICS_GROUP();
+
+    Rect bounds = {};
+    for ( i64 i = 0; i < r->tile_dirty.count; ++i ) {
+        bounds = i == 0 ? r->tile_dirty.data[i] : rect_union(bounds, r->tile_dirty.data[i]);
+    }
+    *out_bounds = bounds;
+
+    return true;
+}
+
+// Copy the tiles on screen to the atlas, unless the atlas already has them.
+// Leaves r->fbo bound.
+static void
+tiles_store(RenderBackend* r)
+{
+    PUSH_GRAPHICS_GROUP("tiles store");
+
+    GLenum texture_target;
+    if ( gl::check_flags(GLHelperFlags_TEXTURE_MULTISAMPLE) ) {
+        texture_target = GL_TEXTURE_2D_MULTISAMPLE;
+    } else {
+        texture_target = GL_TEXTURE_2D;
+    }
+
+    glBindFramebufferEXT(GL_FRAMEBUFFER, r->tile_fbo);
+    glViewport(0, 0, r->tile_cols * RASTER_TILE_SIZE, r->tile_rows * RASTER_TILE_SIZE);
+    glDisable(GL_BLEND);
+    glDisable(GL_DEPTH_TEST);
+    glBindTexture(texture_target, r->canvas_texture);
+
+    Rect screen = tiles_screen_rect(r);
+    Rect range = tiles_on_screen(r);
+    for ( i64 ty = range.top; ty <= range.bottom; ++ty ) {
+        for ( i64 tx = range.left; tx <= range.right; ++tx ) {
+            Rect needed = rect_intersect(tile_rect(tx, ty), screen);
+            v2l slot;
+            RasterTile* tile = tile_slot(r, tx, ty, &slot);
+            if ( tile->position == v2l{ tx, ty } && is_rect_within_rect(needed, tile->valid) ) {
+                continue;
+            }
+            v2l offset = tile_atlas_offset(r, tx, ty, slot);
+            copy_texture_rect(r,
+                              needed.left + r->tile_origin.x + offset.x,
+                              r->height - (needed.bottom + r->tile_origin.y) + offset.y,
+                              needed.right - needed.left, needed.bottom - needed.top,
+                              v2l{ -offset.x, -offset.y });
+            tile->position = v2l{ tx, ty };
+            tile->valid = needed;
+        }
+    }
+
+    gl::set_uniform_vec2(r->texture_fill_program, "u_texel_offset", 0.0f, 0.0f);
+    glBindFramebufferEXT(GL_FRAMEBUFFER, r->fbo);
+    glViewport(0, 0, r->width, r->height);
+    glScissor(0, 0, r->width, r->height);
+    glEnable(GL_BLEND);
+
+    POP_GRAPHICS_GROUP();
+}
+
 void
 gpu_render(RenderBackend* r,  i32 view_x, i32 view_y, i32 view_width, i32 view_height)
 {
@@ -1680,7 +3155,24 @@ gpu_render(RenderBackend* r,  i32 view_x, i32 view_y, i32 view_width, i32 view_h
     print_framebuffer_status();
 
     // TODO: Do less work when idling
-    gpu_render_canvas(r, view_x, view_y, view_width, view_height);
+    if ( r->tile_dirty.count > 0 ) {
+        // Panning. Render what the tile cache didn't have.
+        for ( i64 i = 0; i < r->tile_dirty.count; ++i ) {
+            Rect d = r->tile_dirty.data[i];
+            gpu_render_canvas(r, (i32)d.left, (i32)d.top, (i32)(d.right - d.left), (i32)(d.bottom - d.top));
+        }
+        reset(&r->tile_dirty);
+    } else {
+        gpu_render_canvas(r, view_x, view_y, view_width, view_height);
+    }
+
+    if ( r->tiles_enabled ) {
+        if ( (r->flags & RenderBackendFlags_WORKING_STROKE) || r->render_incomplete ) {
+            gpu_tiles_invalidate(r, rect_from_xywh(view_x, view_y, view_width, view_height));
+        } else {
+            tiles_store(r);
+        }
+    }
 
     GLenum texture_target;
     if ( gl::check_flags(GLHelperFlags_TEXTURE_MULTISAMPLE) ) {
@@ -1721,7 +3213,7 @@ gpu_render(RenderBackend* r,  i32 view_x, i32 view_y, i32 view_width, i32 view_h
     if ( r->flags & RenderBackendFlags_GUI_VISIBLE ) {
         // Render picker
         gl::use_program(r->picker_program);
-        GLint loc = glGetAttribLocation(r->picker_program, "a_position");
+        GLint loc = gl::attrib_location(r->picker_program, "a_position");
 
         if ( loc >= 0 ) {
             DEBUG_gl_validate_buffer(r->vbo_picker);
@@ -1730,7 +3222,7 @@ gpu_render(RenderBackend* r,  i32 view_x, i32 view_y, i32 view_width, i32 view_h
                                   /*size*/2, GL_FLOAT, /*normalize*/GL_FALSE,
                                   /*stride*/0, /*ptr*/0);
             glEnableVertexAttribArray((GLuint)loc);
-            GLint loc_norm = glGetAttribLocation(r->picker_program, "a_norm");
+            GLint loc_norm = gl::attrib_location(r->picker_program, "a_norm");
 
             if ( loc_norm >= 0 ) {
                 DEBUG_gl_validate_buffer(r->vbo_picker_norm);
@@ -1758,7 +3250,7 @@ gpu_render(RenderBackend* r,  i32 view_x, i32 view_y, i32 view_width, i32 view_h
 
         gl::use_program(r->postproc_program);
 
-        GLint loc = glGetAttribLocation(r->postproc_program, "a_position");
+        GLint loc = gl::attrib_location(r->postproc_program, "a_position");
         if ( loc >= 0 ) {
             DEBUG_gl_validate_buffer(r->vbo_screen_quad);
             glBindBuffer(GL_ARRAY_BUFFER, r->vbo_screen_quad);
@@ -1785,7 +3277,7 @@ gpu_render(RenderBackend* r,  i32 view_x, i32 view_y, i32 view_width, i32 view_h
     // Brush outline
     {
         gl::use_program(r->outline_program);
-        GLint loc = glGetAttribLocation(r->outline_program, "a_position");
+        GLint loc = gl::attrib_location(r->outline_program, "a_position");
         if ( loc >= 0 ) {
             DEBUG_gl_validate_buffer(r->vbo_outline);
             glBindBuffer(GL_ARRAY_BUFFER, r->vbo_outline);
@@ -1794,7 +3286,7 @@ gpu_render(RenderBackend* r,  i32 view_x, i32 view_y, i32 view_width, i32 view_h
                                   /*size*/2, GL_FLOAT, /*normalize*/GL_FALSE,
                                   /*stride*/0, /*ptr*/0);
             glEnableVertexAttribArray((GLuint)loc);
-            GLint loc_s = glGetAttribLocation(r->outline_program, "a_sizes");
+            GLint loc_s = gl::attrib_location(r->outline_program, "a_sizes");
             if ( loc_s >= 0 ) {
                 DEBUG_gl_validate_buffer(r->vbo_outline_sizes);
                 glBindBuffer(GL_ARRAY_BUFFER, r->vbo_outline_sizes);
@@ -1813,7 +3305,7 @@ gpu_render(RenderBackend* r,  i32 view_x, i32 view_y, i32 view_width, i32 view_h
         // Update data if rect is not degenerate.
         // Draw outline.
         gl::use_program(r->exporter_program);
-        GLint loc = glGetAttribLocation(r->exporter_program, "a_position");
+        GLint loc = gl::attrib_location(r->exporter_program, "a_position");
         if ( loc>=0 && r->vbo_exporter > 0 ) {
             DEBUG_gl_validate_buffer(r->vbo_exporter);
             gl::vertex_attrib_v2f(r->exporter_program, "a_position", r->vbo_exporter);
@@ -1832,46 +3324,69 @@ gpu_render(RenderBackend* r,  i32 view_x, i32 view_y, i32 view_width, i32 view_h
 void
 gpu_render_to_buffer(Milton* milton, u8* buffer, i32 scale, i32 x, i32 y, i32 w, i32 h, f32 background_alpha)
 {
-    CanvasView saved_view = *milton->view;
+    gpu_render_to_buffer_begin(milton, scale, x, y, w, h, w * scale, h * scale);
+    gpu_render_to_buffer_tile(milton, buffer, 0, 0, w * scale, h * scale, background_alpha);
+    gpu_render_to_buffer_end(milton);
+}
+
+void
+gpu_render_to_buffer_begin(Milton* milton, i32 scale, i32 x, i32 y, i32 w, i32 h, i32 tile_w, i32 tile_h)
+{
     RenderBackend* r = milton->renderer;
     CanvasView* view = milton->view;
 
-    i32 saved_width = r->width;
-    i32 saved_height = r->height;
-    GLuint saved_fbo = r->fbo;
+    r->export_saved_view = *view;
+    r->export_image_size = v2i{w * scale, h * scale};
 
-    i32 buf_w = w * scale;
-    i32 buf_h = h * scale;
-
-    v2i center = milton->view->screen_size / 2;
+    v2i center = view->screen_size / 2;
     v2i pan_delta = v2i{x + (w / 2), y + (h / 2)} - center;
 
     milton_set_zoom_at_point(milton, center);
 
-    f32 cos_angle = cosf(milton->view->angle);
-    f32 sin_angle = sinf(milton->view->angle);
+    f32 cos_angle = cosf(view->angle);
+    f32 sin_angle = sinf(view->angle);
 
     v2f pan_delta_rotated = v2f{pan_delta.x * cos_angle - pan_delta.y * sin_angle, pan_delta.y * cos_angle + pan_delta.x * sin_angle };
 
-    milton->view->pan_center =
-        milton->view->pan_center + v2f_to_v2l(pan_delta_rotated)*milton->view->scale;
+    view->pan_center = view->pan_center + v2f_to_v2l(pan_delta_rotated)*view->scale;
 
-    milton->view->screen_size = v2i{buf_w, buf_h};
-    r->width = buf_w;
-    r->height = buf_h;
-
-    milton->view->zoom_center = milton->view->screen_size / 2;
+    view->screen_size = v2i{tile_w, tile_h};
+    view->zoom_center = view->screen_size / 2;
     if ( scale > 1 ) {
-        milton->view->scale = (i32)ceill(((f32)milton->view->scale / (f32)scale));
+        view->scale = (i32)ceill(((f32)view->scale / (f32)scale));
     }
+    r->export_view = *view;
 
+    // Every tile is rendered at the same size, so the render targets are only resized once.
+    // TODO: Check for out-of-memory errors.
     gpu_resize(r, view);
-    gpu_update_canvas(r, milton->canvas, view);
+}
 
-    // TODO: Check for out-of-memory errors.
+void
+gpu_render_to_buffer_tile(Milton* milton, u8* buffer, i32 tile_x, i32 tile_y, i32 tile_w, i32 tile_h,
+                          f32 background_alpha)
+{
+    RenderBackend* r = milton->renderer;
+    CanvasView* view = milton->view;
 
-    mlt_assert(buf_w == r->width);
-    mlt_assert(buf_h == r->height);
+    // Tiles at the right and bottom edges of the image can be smaller. They
+    // are rendered at full size and read back in part.
+    i32 buf_w = r->width;
+    i32 buf_h = r->height;
+    mlt_assert(tile_w <= buf_w && tile_h <= buf_h);
+
+    *view = r->export_view;
+
+    // Move from the center of the whole image to the center of the tile.
+    v2i tile_delta = v2i{tile_x + (buf_w / 2), tile_y + (buf_h / 2)} - r->export_image_size / 2;
+    if ( tile_delta.x != 0 || tile_delta.y != 0 ) {
+        f32 cos_angle = cosf(view->angle);
+        f32 sin_angle = sinf(view->angle);
+        v2f tile_delta_rotated = v2f{tile_delta.x * cos_angle - tile_delta.y * sin_angle, tile_delta.y * cos_angle + tile_delta.x * sin_angle };
+        view->pan_center = view->pan_center + v2f_to_v2l(tile_delta_rotated * (f32)view->scale);
+    }
+
+    gpu_update_canvas(r, milton->canvas, view);
 
     glViewport(0, 0, buf_w, buf_h);
     glScissor(0, 0, buf_w, buf_h);
@@ -1885,7 +3400,7 @@ gpu_render_to_buffer(Milton* milton, u8* buffer, i32 scale, i32 x, i32 y, i32 w,
         gl::use_program(r->postproc_program);
         glBindTexture(GL_TEXTURE_2D, r->canvas_texture);
 
-        GLint loc = glGetAttribLocation(r->postproc_program, "a_position");
+        GLint loc = gl::attrib_location(r->postproc_program, "a_position");
         if ( loc >= 0 ) {
             DEBUG_gl_validate_buffer(r->vbo_screen_quad);
             glBindBuffer(GL_ARRAY_BUFFER, r->vbo_screen_quad);
@@ -1904,34 +3419,36 @@ gpu_render_to_buffer(Milton* milton, u8* buffer, i32 scale, i32 x, i32 y, i32 w,
 
     glEnable(GL_DEPTH_TEST);
 
-    // Read onto buffer
-    glReadPixels(0,0,
-                 buf_w, buf_h,
+    // Read onto buffer. The tile is at the top left, and GL is bottom-left.
+    glReadPixels(0, buf_h - tile_h,
+                 tile_w, tile_h,
                  GL_RGBA,
                  GL_UNSIGNED_BYTE,
                  (GLvoid*)buffer);
 
-    {  // Flip texture
-        u32* pixels = (u32*)buffer;
-        for ( i64 j = 0; j < buf_h / 2; ++j ) {
-            for ( i64 i = 0; i < buf_w; ++i ) {
-                i64 idx_up = j * buf_w + i;
-                i64 j_down = buf_h - 1 - j;
-                i64 idx_down = j_down * buf_w + i;
-                // Swap
-                u32 pixel = pixels[idx_down];
-                pixels[idx_down] = pixels[idx_up];
-                pixels[idx_up] = pixel;
+    {  // Flip texture, a row at a time.
+        size_t row_size = (size_t)tile_w * 4;
+        u8* row = (u8*)mlt_calloc(row_size, 1, "Bitmap");
+        if ( row ) {
+            for ( i64 j = 0; j < tile_h / 2; ++j ) {
+                u8* up = buffer + j * row_size;
+                u8* down = buffer + (tile_h - 1 - j) * row_size;
+                memcpy(row, up, row_size);
+                memcpy(up, down, row_size);
+                memcpy(down, row, row_size);
             }
+            mlt_free(row, "Bitmap");
         }
     }
+}
 
-    // Cleanup.
+void
+gpu_render_to_buffer_end(Milton* milton)
+{
+    RenderBackend* r = milton->renderer;
+    CanvasView* view = milton->view;
 
-    r->fbo = saved_fbo;
-    *milton->view = saved_view;
-    r->width = saved_width;
-    r->height = saved_height;
+    *view = r->export_saved_view;
 
     glBindFramebufferEXT(GL_FRAMEBUFFER, r->fbo);
 
@@ -1950,6 +3467,28 @@ void
 gpu_release_data(RenderBackend* r)
 {
     release(&r->clip_array);
+    release(&r->clip_layers);
+    release(&r->clip_cache_strokes);
+    release(&r->clip_jobs);
+    release(&r->clip_masks);
+    release(&r->tiles);
+    release(&r->tile_dirty);
+    release(&r->blur_caches);
+    release(&r->clip_uncooked);
+    release(&r->clip_uncooked_sorted);
+    release(&r->cook_jobs);
+    release(&r->cook_memory);
+    for ( i64 i = 0; i < r->stroke_pages.count; ++i ) {
+        release(&r->stroke_pages.data[i]->elements);
+        mlt_free(r->stroke_pages.data[i], "Renderer");
+    }
+    release(&r->stroke_pages);
+    release(&r->stroke_free_pages);
+    release(&r->draw_counts);
+    release(&r->draw_offsets);
+    release(&r->stroke_corners);
+    release(&r->working_points);
+    release(&r->working_pressures);
 }
 
 
@@ -4,8 +4,10 @@
 #pragma once
 
 #include "common.h"
+#include "residency.h"
 #include "system_includes.h"
 #include "vector.h"
+#include "utils.h"
 
 struct LayerEffect;
 
@@ -14,6 +16,7 @@ enum RenderBackendFlags
     RenderBackendFlags_NONE = 0,
 
     RenderBackendFlags_GUI_VISIBLE        = 1<<0,
+    RenderBackendFlags_WORKING_STROKE     = 1<<1,  // Don't put the canvas in the tile cache.
 };
 
 typedef u64 RenderHandle;
@@ -59,6 +62,7 @@ void gpu_update_background(RenderBackend* renderer, v3f background_color);
 void gpu_update_canvas(RenderBackend* renderer, CanvasState* canvas, CanvasView* view);
 
 void gpu_get_viewport_limits(RenderBackend* renderer, float* out_viewport_limits);
+// Strokes with data in GPU memory. Visits every stroke, so it is only for the profiler window.
 i32  gpu_get_num_clipped_strokes(Layer* root_layer);
 
 
@@ -74,6 +78,9 @@ void gpu_cook_stroke(Arena* arena, RenderBackend* renderer, Stroke* stroke,
 
 void gpu_free_strokes(RenderBackend* renderer, CanvasState* canvas);
 
+// True when the stroke has data in GPU memory.
+b32 gpu_stroke_is_cooked(Stroke* stroke);
+
 
 // Creates OpenGL objects for strokes that are in view but are not loaded on the GPU. Deletes
 // content for strokes that are far away.
@@ -81,6 +88,10 @@ enum ClipFlags
 {
     ClipFlags_UPDATE_GPU_DATA   = 1<<0,  // Free all strokes that are far away.
     ClipFlags_JUST_CLIP         = 1<<1,
+    // Only cook strokes for as long as the render budget allows, largest
+    // first. Strokes that don't make it are left for the next frames. See
+    // gpu_render_is_complete.
+    ClipFlags_DRAW_ITERATIVELY  = 1<<2,
 };
 void gpu_clip_strokes_and_update(Arena* arena,
                                  RenderBackend* renderer,
@@ -90,8 +101,47 @@ void gpu_clip_strokes_and_update(Arena* arena,
 
 void gpu_reset_render_flags(RenderBackend* renderer, int flags);
 
+// Milliseconds per frame to spend cooking strokes with ClipFlags_DRAW_ITERATIVELY.
+void gpu_update_render_budget(RenderBackend* renderer, f32 budget_ms);
+// False when the last clip left visible strokes out. Keep rendering frames until it is true.
+b32  gpu_render_is_complete(RenderBackend* renderer);
+
+// Cooked strokes share pages of GPU memory. Pages that were not drawn from recently are freed,
+// with their strokes, when they go over the budget.
+void gpu_update_stroke_memory_budget(RenderBackend* renderer, i32 budget_mb);
+ResidencyStats gpu_get_stroke_memory_stats(RenderBackend* renderer);
+
+// Visible layers with a blur keep their blurred contents from the last full
+// redraw, and are not drawn again while they and the view stay the same.
+// False when some of them has to be blurred again, which needs a full redraw.
+b32  gpu_blur_caches_valid(RenderBackend* renderer, CanvasView* view, Layer* root_layer, Stroke* working_stroke);
+
+// Raster tile cache. Keeps tiles of the rendered canvas at the current scale
+// and angle, so that panning copies what was already rendered and only renders
+// what comes into view. gpu_render stores the tiles it draws.
+
+// Forget all tiles. Called on full redraws.
+void gpu_tiles_reset(RenderBackend* renderer, CanvasView* view, b32 enabled);
+// Forget the tiles that overlap a rect of the screen.
+void gpu_tiles_invalidate(RenderBackend* renderer, Rect raster_rect);
+// Copies cached tiles to the canvas for the current view. Returns false when
+// the cache can't be used and the screen needs a full redraw. Otherwise,
+// out_bounds is set to the bounds of what is left to render.
+b32  gpu_tiles_pan(RenderBackend* renderer, CanvasView* view, Rect* out_bounds);
+
 void gpu_render(RenderBackend* renderer,  i32 view_x, i32 view_y, i32 view_width, i32 view_height);
 void gpu_render_to_buffer(Milton* milton, u8* buffer, i32 scale, i32 x, i32 y, i32 w, i32 h, f32 background_alpha);
 
+// Render the image that gpu_render_to_buffer would produce a tile at a time.
+// begin sets up the view and render targets for tiles of tile_w by tile_h
+// pixels, which must fit in the viewport limits. end restores the view and
+// redraws the screen.
+void gpu_render_to_buffer_begin(Milton* milton, i32 scale, i32 x, i32 y, i32 w, i32 h, i32 tile_w, i32 tile_h);
+// Render the rect (tile_x, tile_y, tile_w, tile_h) of the image to buffer. It
+// can be smaller than the tile size given to begin, at the edges of the image.
+void gpu_render_to_buffer_tile(Milton* milton, u8* buffer, i32 tile_x, i32 tile_y, i32 tile_w, i32 tile_h,
+                               f32 background_alpha);
+void gpu_render_to_buffer_end(Milton* milton);
+
 void gpu_release_data(RenderBackend* renderer);
 
@@ -0,0 +1,121 @@
+// Copyright (c) 2015 Sergio Gonzalez. All rights reserved.
+// License: https://github.com/serge-rgb/milton#license
+
+#include "residency.h"
+
+static void
+residency_unlink(Residency* res, ResidencyEntry* entry)
+{
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+    entry->prev = NULL;
+    entry->next = NULL;
+    res->bytes -= entry->bytes;
+    res->count -= 1;
+}
+
+// Link at the most recently used end.
+static void
+residency_link(Residency* res, ResidencyEntry* entry)
+{
+    entry->prev = res->lru.prev;
+    entry->next = &res->lru;
+    res->lru.prev->next = entry;
+    res->lru.prev = entry;
+    res->bytes += entry->bytes;
+    res->count += 1;
+}
+
+static void
+residency_evict(Residency* res, ResidencyEntry* entry)
+{
+    residency_unlink(res, entry);
+    res->frame_evictions += 1;
+    res->release(res->release_data, entry);
+}
+
+void
+residency_init(Residency* res, i64 budget_bytes, ResidencyReleaseFunc* release, void* release_data)
+{
+    *res = {};
+    res->lru.prev = &res->lru;
+    res->lru.next = &res->lru;
+    res->budget_bytes = budget_bytes;
+    res->release = release;
+    res->release_data = release_data;
+}
+
+void
+residency_set_budget(Residency* res, i64 budget_bytes)
+{
+    res->budget_bytes = budget_bytes;
+}
+
+void
+residency_begin_frame(Residency* res)
+{
+    res->frame += 1;
+    res->frame_evictions = 0;
+}
+
+void
+residency_add(Residency* res, ResidencyEntry* entry, void* owner, i64 bytes)
+{
+    residency_remove(res, entry);
+    entry->owner = owner;
+    entry->bytes = bytes;
+    entry->last_used = res->frame;
+    residency_link(res, entry);
+}
+
+void
+residency_touch(Residency* res, ResidencyEntry* entry)
+{
+    if ( entry->prev != NULL && entry->last_used != res->frame ) {
+        entry->last_used = res->frame;
+        residency_unlink(res, entry);
+        residency_link(res, entry);
+    }
+}
+
+void
+residency_remove(Residency* res, ResidencyEntry* entry)
+{
+    if ( entry->prev != NULL ) {
+        residency_unlink(res, entry);
+    }
+}
+
+void
+residency_trim(Residency* res)
+{
+    // Entries used in this frame are all at the recent end, so stop at the first one.
+    while ( res->bytes > res->budget_bytes && res->lru.next != &res->lru ) {
+        ResidencyEntry* oldest = res->lru.next;
+        if ( oldest->last_used == res->frame ) {
+            break;
+        }
+        residency_evict(res, oldest);
+    }
+}
+
+void
+residency_release_all(Residency* res)
+{
+    while ( res->lru.next != &res->lru ) {
+        ResidencyEntry* entry = res->lru.next;
+        residency_unlink(res, entry);
+        res->release(res->release_data, entry);
+    }
+}
+
+ResidencyStats
+residency_stats(Residency* res)
+{
+    ResidencyStats stats = {};
+    stats.resident_count = res->count;
+    stats.resident_bytes = res->bytes;
+    stats.budget_bytes = res->budget_bytes;
+    stats.evictions = res->frame_evictions;
+    return stats;
+}
@@ -0,0 +1,73 @@
+// Copyright (c) 2015 Sergio Gonzalez. All rights reserved.
+// License: https://github.com/serge-rgb/milton#license
+
+#pragma once
+
+#include "common.h"
+
+// Residency
+//
+// Keeps track of what is in GPU memory and keeps it under a byte budget.
+// Entries are kept in least-recently-used order. residency_trim releases the
+// oldest ones until the total fits, through a callback, so the policy does not
+// know about OpenGL.
+//
+// Entries used since residency_begin_frame are never released: the frame
+// still has to draw them. If they alone go over the budget, the budget is
+// exceeded until they fall out of view.
+
+struct ResidencyEntry
+{
+    ResidencyEntry* prev;  // NULL when not resident.
+    ResidencyEntry* next;
+    void*           owner;  // Passed back to the release callback.
+    i64             bytes;
+    u64             last_used;  // Frame number.
+};
+
+// Frees the GPU data of entry->owner. The entry is no longer resident when it is called.
+typedef void ResidencyReleaseFunc(void* data, ResidencyEntry* entry);
+
+struct Residency
+{
+    ResidencyEntry          lru;  // lru.next is the least recently used entry; lru.prev the most recent.
+    i64                     budget_bytes;
+    i64                     bytes;
+    i64                     count;
+    u64                     frame;
+    i64                     frame_evictions;
+
+    ResidencyReleaseFunc*   release;
+    void*                   release_data;
+};
+
+struct ResidencyStats
+{
+    i64 resident_count;
+    i64 resident_bytes;
+    i64 budget_bytes;
+    i64 evictions;  // Since the start of the frame.
+};
+
+void residency_init(Residency* res, i64 budget_bytes, ResidencyReleaseFunc* release, void* release_data);
+
+void residency_set_budget(Residency* res, i64 budget_bytes);
+
+void residency_begin_frame(Residency* res);
+
+// Start tracking an entry. It counts as used in this frame.
+void residency_add(Residency* res, ResidencyEntry* entry, void* owner, i64 bytes);
+
+// Mark the entry as used in this frame. Does nothing if it is not resident.
+void residency_touch(Residency* res, ResidencyEntry* entry);
+
+// Stop tracking an entry whose data was freed elsewhere. Does nothing if it is not resident.
+void residency_remove(Residency* res, ResidencyEntry* entry);
+
+// Release least recently used entries until the total fits in the budget.
+void residency_trim(Residency* res);
+
+// Release every entry, even the ones in use.
+void residency_release_all(Residency* res);
+
+ResidencyStats residency_stats(Residency* res);
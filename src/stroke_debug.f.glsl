@@ -3,6 +3,7 @@
 
 in vec3 v_pointa;
 in vec3 v_pointb;
+in float v_radius;
 
 uniform sampler2D u_canvas;
 
@@ -26,7 +27,7 @@ main()
     vec2 stroke_point = mix(a, b, t);
     float pressure = mix(v_pointa.z, v_pointb.z, t);
 
-    if ( distance(canvas_point, a) < u_radius*0.1 ) {
+    if ( distance(canvas_point, a) < v_radius*0.1 ) {
         out_color = vec4(v_debug_color, 1.0);
     } else {
         discard;
@@ -3,6 +3,8 @@
 
 in vec3 v_pointa;
 in vec3 v_pointb;
+in vec4 v_color;
+in float v_radius;
 
 uniform sampler2D u_canvas;
 
@@ -25,7 +27,7 @@ main()
     float pressure = mix(v_pointa.z, v_pointb.z, t);
 
     // Distance between fragment and stroke
-    float dist = distance(stroke_point, canvas_point) - u_radius*pressure;
+    float dist = distance(stroke_point, canvas_point) - v_radius*pressure;
 
     if ( dist < 0 ) {
         vec2 coord = gl_FragCoord.xy / u_screen_size;
@@ -1,6 +1,8 @@
 // Copyright (c) 2015 Sergio Gonzalez. All rights reserved.
 // License: https://github.com/serge-rgb/milton#license
 
+in vec4 v_color;
+
 uniform float u_opacity_min;
 uniform float u_hardness;
 uniform sampler2D u_info;
@@ -20,7 +22,7 @@ main()
     vec2 stroke_info = texture(u_info, coord).ra;
     float pressure = stroke_info.y;
     if ( stroke_info.x < 1.0f  ) {
-        out_color = u_brush_color;
+        out_color = v_color;
         #if PRESSURE_TO_OPACITY
             out_color *= (1.0f - u_opacity_min) * pressure + u_opacity_min;
         #endif
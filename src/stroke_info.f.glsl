@@ -3,6 +3,8 @@
 
 in vec3 v_pointa;
 in vec3 v_pointb;
+in vec4 v_color;
+in float v_radius;
 
 void
 main()
@@ -25,7 +27,7 @@ main()
     // Distance between fragment and stroke
     float dist = distance(stroke_point, canvas_point);
 
-    float rad = u_radius * pressure;
+    float rad = v_radius * pressure;
     out_color.r = dist / rad;
     out_color.a = 0.0f;
     if (dist < rad) {
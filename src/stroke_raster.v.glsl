@@ -1,12 +1,19 @@
 // Copyright (c) 2015 Sergio Gonzalez. All rights reserved.
 // License: https://github.com/serge-rgb/milton#license
 
-in vec3 a_position;
+// One instance per stroke segment. Without instanced arrays the segment
+// attributes are repeated for each corner.
+in vec2 a_corner;  // Corner of the segment's box. 0 is the min side, 1 the max side.
 in vec3 a_pointa;
 in vec3 a_pointb;
+in vec4 a_color;
+in float a_radius;
+in float a_z;
 
 out vec3 v_pointa;
 out vec3 v_pointb;
+out vec4 v_color;
+out float v_radius;
 
 #if STROKE_DEBUG_VIZ
 in vec3 a_debug_color;
@@ -21,13 +28,31 @@ main()
 {
     v_pointa = a_pointa;
     v_pointb = a_pointb;
+    v_color = a_color;
+    v_radius = a_radius;
 
 #if STROKE_DEBUG_VIZ
     v_debug_color = a_debug_color;
 #endif
-    gl_Position.xy = canvas_to_raster_gl(a_position.xy);
+
+    // Box around the segment, aligned with it.
+    vec2 a = a_pointa.xy;
+    vec2 b = a_pointb.xy;
+    vec2 d = vec2(1, 0);
+    if ( a != b ) {
+        d = normalize(b - a);
+    }
+    // Change of basis. It is its own inverse.
+    mat2 basis = mat2(d.x, d.y, d.y, -d.x);
+    vec2 la = basis * a;
+    vec2 lb = basis * b;
+    float rad = a_radius * max(a_pointa.z, a_pointb.z);
+    vec2 box_min = min(la, lb) - rad;
+    vec2 box_max = max(la, lb) + rad;
+    vec2 position = basis * mix(box_min, box_max, a_corner);
+
+    gl_Position.xy = canvas_to_raster_gl(position);
     gl_Position.w = 1;
 
-    gl_Position.z = a_position.z / MAX_DEPTH_VALUE;
+    gl_Position.z = a_z / MAX_DEPTH_VALUE;
 }
-
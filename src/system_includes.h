@@ -43,6 +43,10 @@
 
 #include <xmmintrin.h>
 #include <emmintrin.h>
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>  // __cpuid
+#endif
 
 #if defined(_WIN32)
 
@@ -1,5 +1,11 @@
 #undef main // SDL does things we don't want
 
+#include "stb_image.h"
+#include "stb_image_write.h"
+
+// Benchmarks are slow. They print their timings to the log.
+#define RUN_BENCHMARKS 0
+
 #define INVALIDATE_COUNT(ptr, count) memset((u8*)(ptr), -1, sizeof(*(ptr)) * (count))
 
 #define INVALIDATE(ptr) INVALIDATE_COUNT(ptr, 1)
@@ -71,9 +77,1088 @@ test_save_load()
     EXPECT_TRUE( COMPARE_BYTES_COUNT(milton.brush_sizes, loaded_milton.brush_sizes, BrushEnum_COUNT) );
 }
 
+static Stroke
+test_stroke(Arena* arena, i32 layer_id, i64 x)
+{
+    Stroke stroke = {};
+    stroke.brush = default_brush();
+    stroke.num_points = 2;
+    stroke.points = arena_alloc_array(arena, stroke.num_points, v2l);
+    stroke.pressures = arena_alloc_array(arena, stroke.num_points, f32);
+    stroke.points[0] = { x, 0 };
+    stroke.points[1] = { x + 10, 10 };
+    stroke.pressures[0] = 0.5f;
+    stroke.pressures[1] = 1.0f;
+    stroke.layer_id = layer_id;
+    stroke.bounding_rect = bounding_box_for_stroke(&stroke);
+    return stroke;
+}
+
+static void
+test_commit_stroke(Milton* milton, i64 x)
+{
+    Stroke stroke = test_stroke(&milton->canvas->arena, milton->canvas->working_layer->id, x);
+    Stroke* committed = milton_commit_stroke(milton, milton->canvas->working_layer, stroke);
+    milton_journal_push(milton, JournalRecord_STROKE_ADD, committed);
+}
+
+void
+test_layer_sections()
+{
+    Milton milton = {};
+
+    PATH_CHAR* path = TO_PATH_STR("TEST_sections.mlt");
+
+    milton_init(&milton, 0, 0, 1, path, MiltonInit_FOR_TEST);
+    milton_reset_canvas_and_set_default(&milton);
+    milton.persist->mlt_file_path = path;
+    milton.persist->compact_points = false;
+
+    test_commit_stroke(&milton, 0);
+    milton_new_layer(&milton);
+    milton.canvas->working_layer->alpha = 0.25f;
+    test_commit_stroke(&milton, 100);
+    test_commit_stroke(&milton, 200);
+    milton_save(&milton);
+
+    Milton loaded_milton = {};
+
+    milton_init(&loaded_milton, 0, 0, 1, path, MiltonInit_FOR_TEST);
+    milton_load(&loaded_milton);
+
+    Layer* root = loaded_milton.canvas->root_layer;
+    EXPECT_TRUE( layer::number_of_layers(root) == 2 );
+    EXPECT_TRUE( root->strokes.count == 1 );
+    EXPECT_TRUE( root->next && root->next->strokes.count == 2 );
+    EXPECT_TRUE( root->next && root->next->alpha == 0.25f );
+    EXPECT_TRUE( loaded_milton.persist->mlt_binary_version == MILTON_MINOR_VERSION );
+
+    // Point data is aligned. When the file is mapped, strokes use it in place.
+    Stroke* stroke = get(&root->strokes, 0);
+    EXPECT_TRUE( ((uintptr_t)stroke->points % 8) == 0 );
+    EXPECT_TRUE( stroke->points[1].x == 10 && stroke->pressures[1] == 1.0f );
+    MiltonPersist* p = loaded_milton.persist;
+    if ( p->mlt_mapping ) {
+        EXPECT_TRUE( (u8*)stroke->points >= p->mlt_mapping &&
+                     (u8*)stroke->pressures < p->mlt_mapping + p->mlt_mapping_size );
+    }
+}
+
+void
+test_compact_points()
+{
+    Milton milton = {};
+
+    PATH_CHAR* path = TO_PATH_STR("TEST_compact.mlt");
+
+    milton_init(&milton, 0, 0, 1, path, MiltonInit_FOR_TEST);
+    milton_reset_canvas_and_set_default(&milton);
+    milton.persist->mlt_file_path = path;
+    milton.persist->compact_points = true;
+
+    // Small steps, big jumps and the extremes of the canvas.
+    Stroke stroke = test_stroke(&milton.canvas->arena, milton.canvas->working_layer->id, 0);
+    stroke.num_points = 11;
+    stroke.points = arena_alloc_array(&milton.canvas->arena, stroke.num_points, v2l);
+    stroke.pressures = arena_alloc_array(&milton.canvas->arena, stroke.num_points, f32);
+    v2l points[] = {
+        { 0, 0 }, { 1, -1 }, { 2, -2 }, { 3, -3 }, { 4, -4 }, { -60, 70 },
+        { 100000, -100000 }, { INT64_MAX, INT64_MIN }, { INT64_MIN, INT64_MAX }, { 7, 7 }, { 7, 7 },
+    };
+    for ( i32 i = 0; i < stroke.num_points; ++i ) {
+        stroke.points[i] = points[i];
+        stroke.pressures[i] = i / 10.0f;
+    }
+    stroke.bounding_rect = bounding_box_for_stroke(&stroke);
+    milton_commit_stroke(&milton, milton.canvas->working_layer, stroke);
+    u64 compact_bytes = milton_save(&milton);
+
+    Milton loaded_milton = {};
+
+    milton_init(&loaded_milton, 0, 0, 1, path, MiltonInit_FOR_TEST);
+    milton_load(&loaded_milton);
+
+    Layer* root = loaded_milton.canvas->root_layer;
+    EXPECT_TRUE( root->strokes.count == 1 );
+    if ( root->strokes.count == 1 ) {
+        Stroke* loaded = get(&root->strokes, 0);
+        EXPECT_TRUE( loaded->num_points == stroke.num_points );
+        EXPECT_TRUE( COMPARE_BYTES_COUNT(loaded->points, stroke.points, stroke.num_points) );
+        for ( i32 i = 0; i < stroke.num_points; ++i ) {
+            EXPECT_TRUE( fabs(loaded->pressures[i] - stroke.pressures[i]) <= 1.0f / 65535 );
+        }
+    }
+
+    milton.persist->compact_points = false;
+    u64 raw_bytes = milton_save(&milton);
+    EXPECT_TRUE( compact_bytes < raw_bytes );
+}
+
+// Enough strokes to span several StrokeList buckets and load chunks.
+void
+test_load_many_strokes()
+{
+    Milton milton = {};
+
+    PATH_CHAR* path = TO_PATH_STR("TEST_many.mlt");
+
+    milton_init(&milton, 0, 0, 1, path, MiltonInit_FOR_TEST);
+    milton_reset_canvas_and_set_default(&milton);
+    milton.persist->mlt_file_path = path;
+
+    i64 num_strokes = 2 * STROKELIST_BUCKET_COUNT + 100;
+    for ( i64 i = 0; i < num_strokes; ++i ) {
+        test_commit_stroke(&milton, i);
+    }
+    milton_new_layer(&milton);
+    test_commit_stroke(&milton, -1);
+    milton_save(&milton);
+
+    Milton loaded_milton = {};
+
+    milton_init(&loaded_milton, 0, 0, 1, path, MiltonInit_FOR_TEST);
+    milton_load(&loaded_milton);
+
+    Layer* root = loaded_milton.canvas->root_layer;
+    EXPECT_TRUE( root->strokes.count == num_strokes );
+    EXPECT_TRUE( root->next && root->next->strokes.count == 1 );
+
+    b32 in_order = true;
+    StrokeIterator iter = {};
+    i64 i = 0;
+    for ( Stroke* s = stroke_iter_init(&root->strokes, &iter); s; s = stroke_iter_next(&iter), ++i ) {
+        if ( s->points[0].x != i || s->id != i ) {
+            in_order = false;
+        }
+    }
+    EXPECT_TRUE( in_order && i == num_strokes );
+
+    Rect saved_bounds = milton.canvas->root_layer->strokes.root.next->next->bounding_rect;
+    Rect loaded_bounds = root->strokes.root.next->next->bounding_rect;
+    EXPECT_TRUE( COMPARE_BYTES(&saved_bounds, &loaded_bounds) );
+}
+
+static Stroke
+test_indexed_stroke(u32* seed)
+{
+    // Mostly small strokes spread over a large canvas, with a few big ones.
+    *seed = *seed * 1103515245 + 12345;
+    i64 x = (i64)(*seed % 2000000) - 1000000;
+    *seed = *seed * 1103515245 + 12345;
+    i64 y = (i64)(*seed % 2000000) - 1000000;
+    *seed = *seed * 1103515245 + 12345;
+    i64 size = (*seed % 16 == 0) ? (i64)(*seed % 500000) : (i64)(*seed % 1000);
+
+    Stroke stroke = {};
+    stroke.bounding_rect = { x, y, x + size, y + size };
+    return stroke;
+}
+
+static b32
+test_index_matches(StrokeList* list, Rect rect)
+{
+    DArray<StrokeIndexEntry> found = {};
+    strokelist_query(list, rect, &found);
+
+    i64 num_buckets = list->count / STROKELIST_BUCKET_COUNT + 1;
+    u64* masks = (u64*)mlt_calloc((size_t)(num_buckets * STROKELIST_MASK_WORDS), sizeof(u64), "Test");
+    strokelist_mark(list, rect, masks);
+
+    b32 matches = true;
+    i64 fi = 0;
+    for ( i64 i = 0; i < list->count; ++i ) {
+        Stroke* s = get(list, i);
+        i64 bi = i % STROKELIST_BUCKET_COUNT;
+        u64* mask = masks + (i / STROKELIST_BUCKET_COUNT) * STROKELIST_MASK_WORDS;
+        b32 marked = (mask[bi / 64] >> (bi % 64)) & 1;
+        if ( rect_intersects_rect(s->bounding_rect, rect) ) {
+            if ( fi >= found.count || found.data[fi].stroke != s || found.data[fi].index != i || !marked ) {
+                matches = false;
+            }
+            ++fi;
+        }
+        else if ( marked ) {
+            matches = false;
+        }
+    }
+    matches = matches && fi == found.count;
+
+    mlt_free(masks, "Test");
+    release(&found);
+    return matches;
+}
+
+void
+test_stroke_index()
+{
+    Arena arena = arena_init();
+    StrokeList list = {};
+    list.arena = &arena;
+    strokelist_init_bucket(&list.root);
+
+    u32 seed = 1;
+    for ( i64 i = 0; i < 2 * STROKELIST_BUCKET_COUNT + 100; ++i ) {
+        push(&list, test_indexed_stroke(&seed));
+    }
+
+    Rect zoomed_in = { -20000, -20000, 20000, 20000 };
+    Rect everything = { -2000000, -2000000, 2000000, 2000000 };
+    Rect off_canvas = { 5000000, 5000000, 5000100, 5000100 };
+    EXPECT_TRUE( test_index_matches(&list, zoomed_in) );
+    EXPECT_TRUE( test_index_matches(&list, everything) );
+    EXPECT_TRUE( test_index_matches(&list, off_canvas) );
+
+    // Undo pops strokes off the index.
+    u64 version = list.version;
+    for ( i64 i = 0; i < STROKELIST_BUCKET_COUNT; ++i ) {
+        pop(&list);
+    }
+    EXPECT_TRUE( list.version != version );
+    EXPECT_TRUE( test_index_matches(&list, zoomed_in) );
+    EXPECT_TRUE( test_index_matches(&list, everything) );
+
+    // Loading fills the strokes in place and rebuilds the index.
+    i64 loaded_count = list.count + 50;
+    resize(&list, loaded_count);
+    for ( i64 i = 0; i < loaded_count; ++i ) {
+        *get(&list, i) = test_indexed_stroke(&seed);
+    }
+    strokelist_update_bounds(&list);
+    EXPECT_TRUE( test_index_matches(&list, zoomed_in) );
+    EXPECT_TRUE( test_index_matches(&list, everything) );
+
+    arena_free(&arena);
+}
+
+// The culling kernel agrees with rect_intersects_rect, including partly
+// filled buckets and strokes without bounds.
+void
+test_cull_bucket()
+{
+    Arena arena = arena_init();
+    StrokeList list = {};
+    list.arena = &arena;
+    strokelist_init_bucket(&list.root);
+
+    u32 seed = 2;
+    for ( i64 i = 0; i < STROKELIST_BUCKET_COUNT + 1001; ++i ) {
+        Stroke stroke = test_indexed_stroke(&seed);
+        if ( i % 97 == 0 ) {
+            stroke.bounding_rect = rect_without_size();
+        }
+        push(&list, stroke);
+    }
+
+    Rect rects[] = {
+        { -20000, -20000, 20000, 20000 },
+        { -2000000, -2000000, 2000000, 2000000 },
+        { 5000000, 5000000, 5000100, 5000100 },
+    };
+    b32 matches = true;
+    i64 first = 0;
+    for ( StrokeBucket* bucket = &list.root; bucket; bucket = bucket->next, first += STROKELIST_BUCKET_COUNT ) {
+        i64 count = min(list.count - first, (i64)STROKELIST_BUCKET_COUNT);
+        for ( sz ri = 0; ri < array_count(rects); ++ri ) {
+            u64 mask[STROKELIST_MASK_WORDS];
+            strokelist_cull_bucket(bucket, count, rects[ri], mask);
+            for ( i64 i = 0; i < STROKELIST_MASK_WORDS * 64; ++i ) {
+                b32 bit = (mask[i / 64] >> (i % 64)) & 1;
+                b32 expected = i < count && rect_intersects_rect(bucket->data[i].bounding_rect, rects[ri]);
+                matches = matches && bit == expected;
+            }
+        }
+    }
+    EXPECT_TRUE( matches );
+
+    arena_free(&arena);
+}
+
+// Stands in for GL buffers, so that eviction can be tested without a GPU.
+struct FakeBuffers
+{
+    i64 live_bytes;
+    i64 num_released;
+};
+
+static void
+fake_buffers_release(void* data, ResidencyEntry* entry)
+{
+    FakeBuffers* buffers = (FakeBuffers*)data;
+    buffers->live_bytes -= entry->bytes;
+    buffers->num_released += 1;
+    entry->owner = NULL;
+}
+
+static void
+fake_buffers_cook(Residency* res, FakeBuffers* buffers, ResidencyEntry* entry, i64 bytes)
+{
+    buffers->live_bytes += bytes;
+    residency_add(res, entry, buffers, bytes);
+}
+
+// Strokes that were drawn least recently are evicted first, but never the
+// ones drawn in the current frame.
+void
+test_residency()
+{
+    FakeBuffers buffers = {};
+    Residency res;
+    residency_init(&res, 100, fake_buffers_release, &buffers);
+    ResidencyEntry a = {}, b = {}, c = {}, d = {};
+
+    residency_begin_frame(&res);
+    fake_buffers_cook(&res, &buffers, &a, 40);
+    fake_buffers_cook(&res, &buffers, &b, 40);
+    residency_trim(&res);
+    EXPECT_TRUE( buffers.num_released == 0 );
+
+    residency_begin_frame(&res);
+    residency_touch(&res, &a);
+    fake_buffers_cook(&res, &buffers, &c, 40);
+    residency_trim(&res);
+    EXPECT_TRUE( b.owner == NULL && b.prev == NULL );
+    EXPECT_TRUE( residency_stats(&res).evictions == 1 );
+    EXPECT_TRUE( residency_stats(&res).resident_bytes == 80 );
+
+    // Everything is in use, so the budget is exceeded.
+    residency_begin_frame(&res);
+    residency_touch(&res, &a);
+    residency_touch(&res, &c);
+    fake_buffers_cook(&res, &buffers, &d, 40);
+    residency_trim(&res);
+    EXPECT_TRUE( residency_stats(&res).evictions == 0 );
+    EXPECT_TRUE( residency_stats(&res).resident_bytes == 120 );
+
+    residency_begin_frame(&res);
+    residency_touch(&res, &c);
+    residency_trim(&res);
+    EXPECT_TRUE( a.owner == NULL );
+    EXPECT_TRUE( d.owner != NULL );
+    EXPECT_TRUE( residency_stats(&res).resident_count == 2 );
+
+    // Freed outside of the residency, e.g. a stroke that went far away.
+    residency_remove(&res, &c);
+    buffers.live_bytes -= c.bytes;
+    EXPECT_TRUE( residency_stats(&res).resident_bytes == 40 );
+
+    residency_release_all(&res);
+    EXPECT_TRUE( residency_stats(&res).resident_count == 0 );
+    EXPECT_TRUE( buffers.live_bytes == 0 );
+    EXPECT_TRUE( buffers.num_released == 3 );
+}
+
+// Stroke geometry is built without a GL context: one record per segment,
+// relative to the render center.
+void
+test_stroke_geometry()
+{
+    Arena arena = arena_init();
+
+    Stroke stroke = {};
+    stroke.brush = default_brush();
+    stroke.brush.radius = 10;
+    stroke.num_points = 3;
+    stroke.points = arena_alloc_array(&arena, stroke.num_points, v2l);
+    stroke.pressures = arena_alloc_array(&arena, stroke.num_points, f32);
+    stroke.points[0] = { 0, 0 };
+    stroke.points[1] = { 100, 0 };
+    stroke.points[2] = { 100, 100 };
+    for ( i64 i = 0; i < stroke.num_points; ++i ) {
+        stroke.pressures[i] = 1.0f;
+    }
+
+    StrokeGeometry g;
+    stroke_geometry_init(&g, &stroke, arena_alloc_array(&arena, stroke_geometry_size(&stroke), u8));
+    stroke_geometry(&stroke, v2i{}, 5, &g);
+    EXPECT_TRUE( g.num_segments == 2 );
+    StrokeSegment* second = &g.segments[1];
+    EXPECT_TRUE( second->pointa.x == 100.0f && second->pointa.y == 0.0f && second->pointa.z == 1.0f );
+    EXPECT_TRUE( second->pointb.x == 100.0f && second->pointb.y == 100.0f );
+    EXPECT_TRUE( second->z == 5.0f && second->radius == 10.0f );
+    EXPECT_TRUE( second->color.a == stroke.brush.color.a );
+
+    // A single point is a segment to itself, relative to the render center.
+    stroke.num_points = 1;
+    stroke.points[0] = { 1000, 2000 };
+    stroke_geometry_init(&g, &stroke, arena_alloc_array(&arena, stroke_geometry_size(&stroke), u8));
+    stroke_geometry(&stroke, v2i{ 1, 0 }, 5, &g);
+    EXPECT_TRUE( g.num_segments == 1 );
+    EXPECT_TRUE( g.segments[0].pointa.x == (float)(1000 - (1<<RENDER_CHUNK_SIZE_LOG2)) );
+    EXPECT_TRUE( g.segments[0].pointb.x == g.segments[0].pointa.x && g.segments[0].pointb.y == 2000.0f );
+
+    arena_free(&arena);
+}
+
+// The working stroke is rebuilt from the first point that is not in its buffer.
+void
+test_stroke_same_points()
+{
+    v2l points[4] = { {0,0}, {10,0}, {20,0}, {30,0} };
+    f32 pressures[4] = { 1, 1, 1, 1 };
+    v2l uploaded_points[4];
+    f32 uploaded_pressures[4];
+    memcpy(uploaded_points, points, sizeof(points));
+    memcpy(uploaded_pressures, pressures, sizeof(pressures));
+
+    Stroke stroke = {};
+    stroke.points = points;
+    stroke.pressures = pressures;
+
+    // New points are appended.
+    stroke.num_points = 4;
+    EXPECT_TRUE( stroke_same_points(&stroke, uploaded_points, uploaded_pressures, 2) == 2 );
+
+    // A primitive moves its last point.
+    points[3] = { 30, 5 };
+    EXPECT_TRUE( stroke_same_points(&stroke, uploaded_points, uploaded_pressures, 4) == 3 );
+
+    // Pressure changes count too.
+    pressures[1] = 0.5f;
+    EXPECT_TRUE( stroke_same_points(&stroke, uploaded_points, uploaded_pressures, 4) == 1 );
+
+    // The stroke got shorter.
+    stroke.num_points = 1;
+    EXPECT_TRUE( stroke_same_points(&stroke, uploaded_points, uploaded_pressures, 4) == 1 );
+}
+
+// A fake driver for the gl helpers: one program with two uniforms and an attribute.
+static char* g_fake_uniforms[] = { "u_scale", "u_colors[0]" };
+static char* g_fake_attributes[] = { "a_position" };
+static int g_fake_uniform_calls;
+static int g_fake_program_switches;
+static int g_fake_location_queries;
+
+static void
+fake_glGetProgramiv(GLuint program, GLenum pname, GLint* params)
+{
+    *params = pname == GL_ACTIVE_UNIFORMS ? (GLint)array_count(g_fake_uniforms)
+            : pname == GL_ACTIVE_ATTRIBUTES ? (GLint)array_count(g_fake_attributes)
+            : 1;
+}
+
+static void
+fake_glGetActiveUniform(GLuint program, GLuint index, GLsizei buf_size, GLsizei* length, GLint* size, GLenum* type, GLchar* name)
+{
+    strncpy(name, g_fake_uniforms[index], (size_t)buf_size);
+}
+
+static void
+fake_glGetActiveAttrib(GLuint program, GLuint index, GLsizei buf_size, GLsizei* length, GLint* size, GLenum* type, GLchar* name)
+{
+    strncpy(name, g_fake_attributes[index], (size_t)buf_size);
+}
+
+static GLint
+fake_glGetLocation(GLuint program, GLchar* name)
+{
+    g_fake_location_queries += 1;
+    return strcmp(name, "u_scale") == 0 ? 3 : strcmp(name, "u_colors") == 0 ? 4 : 7;
+}
+
+static void
+fake_glUseProgram(GLuint program)
+{
+    g_fake_program_switches += 1;
+}
+
+static void
+fake_glUniform1i(GLint location, GLint v)
+{
+    g_fake_uniform_calls += 1;
+}
+
+// Locations are looked up once per program, and uniforms that already have
+// a value are not set again.
+void
+test_gl_program_reflection()
+{
+    auto saved_getprogramiv = glGetProgramiv;
+    auto saved_getactiveuniform = glGetActiveUniform;
+    auto saved_getactiveattrib = glGetActiveAttrib;
+    auto saved_getuniformlocation = glGetUniformLocation;
+    auto saved_getattriblocation = glGetAttribLocation;
+    auto saved_useprogram = glUseProgram;
+    auto saved_uniform1i = glUniform1i;
+
+    glGetProgramiv = fake_glGetProgramiv;
+    glGetActiveUniform = fake_glGetActiveUniform;
+    glGetActiveAttrib = fake_glGetActiveAttrib;
+    glGetUniformLocation = fake_glGetLocation;
+    glGetAttribLocation = fake_glGetLocation;
+    glUseProgram = fake_glUseProgram;
+    glUniform1i = fake_glUniform1i;
+
+    GLuint program = 1000;
+    gl::reflect_program(program);
+    int queries_at_link = g_fake_location_queries;
+    EXPECT_TRUE( queries_at_link == 3 );
+
+    gl::reset_stats();
+    EXPECT_TRUE( gl::set_uniform_i(program, "u_scale", 2) );
+    EXPECT_TRUE( gl::set_uniform_i(program, "u_scale", 2) );
+    EXPECT_TRUE( gl::set_uniform_i(program, "u_scale", 3) );
+    EXPECT_TRUE( gl::set_uniform_i(program, "u_colors", 1) );
+    EXPECT_TRUE( !gl::set_uniform_i(program, "u_missing", 1) );
+    EXPECT_TRUE( gl::attrib_location(program, "a_position") == 7 );
+    EXPECT_TRUE( gl::attrib_location(program, "a_missing") == -1 );
+
+    GLHelperStats stats = gl::get_stats();
+    EXPECT_TRUE( g_fake_uniform_calls == 3 );
+    EXPECT_TRUE( stats.uniforms_set == 3 && stats.uniforms_skipped == 1 );
+    EXPECT_TRUE( g_fake_location_queries == queries_at_link && stats.location_queries == 0 );
+    // Switch to the program and back for each uniform that is set.
+    EXPECT_TRUE( g_fake_program_switches == 6 );
+
+    glGetProgramiv = saved_getprogramiv;
+    glGetActiveUniform = saved_getactiveuniform;
+    glGetActiveAttrib = saved_getactiveattrib;
+    glGetUniformLocation = saved_getuniformlocation;
+    glGetAttribLocation = saved_getattriblocation;
+    glUseProgram = saved_useprogram;
+    glUniform1i = saved_uniform1i;
+}
+
+// Blur passes and the keys of the blurred layer cache.
+void
+test_blur()
+{
+    // Big kernels are split into passes with a bounded number of samples,
+    // which together are about as wide as the kernel.
+    i32 kernel_sizes[] = { 1, 2, 16, 32, 33, 100, 1024, 1025, 5000, 40000, 1 << 20, 12345678, BLUR_MAX_KERNEL_SIZE };
+    for ( sz ki = 0; ki < array_count(kernel_sizes); ++ki ) {
+        i32 kernel_size = kernel_sizes[ki];
+        BlurPass passes[BLUR_MAX_PASSES];
+        i32 num_passes = box_filter_split(kernel_size, passes);
+        EXPECT_TRUE( num_passes >= 1 && num_passes <= BLUR_MAX_PASSES );
+        i64 width = 1;
+        i32 step = 2;
+        for ( i32 i = 0; i < num_passes; ++i ) {
+            EXPECT_TRUE( passes[i].samples >= 1 && passes[i].samples <= BLUR_MAX_SAMPLES );
+            EXPECT_TRUE( passes[i].step == step );
+            width *= passes[i].samples;
+            step *= passes[i].samples;
+        }
+        EXPECT_TRUE( llabs(width - kernel_size) <= kernel_size / 10 );
+    }
+    // Kernels that fit in one pass are exact.
+    BlurPass pass[BLUR_MAX_PASSES];
+    EXPECT_TRUE( box_filter_split(BLUR_MAX_SAMPLES, pass) == 1 && pass[0].samples == BLUR_MAX_SAMPLES );
+
+    // The cache key changes with the layer and with the view.
+    LayerEffect blur = {};
+    blur.type = LayerEffectType_BLUR;
+    blur.enabled = true;
+    blur.blur.original_scale = 1;
+    blur.blur.kernel_size = 10;
+
+    Layer layer = {};
+    layer.strokes.version = 1;
+    layer.effects = &blur;
+
+    CanvasView view = {};
+    view.scale = 4;
+    view.screen_size = { 640, 480 };
+    view.zoom_center = view.screen_size / 2;
+
+    BlurCacheKey key = blur_cache_key(&view, &layer);
+    EXPECT_TRUE( blur_cache_key_equal(key, blur_cache_key(&view, &layer)) );
+
+    layer.strokes.version = 2;
+    EXPECT_TRUE( !blur_cache_key_equal(key, blur_cache_key(&view, &layer)) );
+    layer.strokes.version = 1;
+
+    blur.blur.kernel_size = 11;
+    EXPECT_TRUE( !blur_cache_key_equal(key, blur_cache_key(&view, &layer)) );
+    blur.blur.kernel_size = 10;
+
+    // Disabled effects are not drawn.
+    LayerEffect disabled = blur;
+    disabled.enabled = false;
+    disabled.blur.kernel_size = 3;
+    blur.next = &disabled;
+    EXPECT_TRUE( blur_cache_key_equal(key, blur_cache_key(&view, &layer)) );
+    blur.next = NULL;
+
+    view.pan_center = { 1, 0 };
+    EXPECT_TRUE( !blur_cache_key_equal(key, blur_cache_key(&view, &layer)) );
+    view.pan_center = {};
+
+    view.angle = 0.5f;
+    EXPECT_TRUE( !blur_cache_key_equal(key, blur_cache_key(&view, &layer)) );
+}
+
+// Files written by older versions use the linear layout, without sections.
+void
+test_load_v9()
+{
+    Milton milton = {};
+
+    PATH_CHAR* path = TO_PATH_STR("TEST_v9.mlt");
+
+    milton_init(&milton, 0, 0, 1, path, MiltonInit_FOR_TEST);
+    milton_reset_canvas_and_set_default(&milton);
+    milton.persist->mlt_file_path = path;
+    milton.persist->mlt_binary_version = 9;
+
+    test_commit_stroke(&milton, 0);
+    milton.canvas->working_layer->alpha = 0.5f;
+    milton_new_layer(&milton);
+    test_commit_stroke(&milton, 100);
+    milton_save(&milton);
+
+    Milton loaded_milton = {};
+
+    milton_init(&loaded_milton, 0, 0, 1, path, MiltonInit_FOR_TEST);
+    milton_load(&loaded_milton);
+
+    Layer* root = loaded_milton.canvas->root_layer;
+    EXPECT_TRUE( layer::number_of_layers(root) == 2 );
+    EXPECT_TRUE( layer::count_strokes(root) == 2 );
+    EXPECT_TRUE( root->alpha == 0.5f );
+    EXPECT_TRUE( root->next && get(&root->next->strokes, 0)->points[0].x == 100 );
+    EXPECT_TRUE( loaded_milton.persist->mlt_binary_version == MILTON_MINOR_VERSION );
+}
+
+void
+test_journal()
+{
+    Milton milton = {};
+
+    PATH_CHAR* path = TO_PATH_STR("TEST_journal.mlt");
+
+    milton_init(&milton, 0, 0, 1, path, MiltonInit_FOR_TEST);
+    milton_reset_canvas_and_set_default(&milton);
+    milton.persist->mlt_file_path = path;
+
+    test_commit_stroke(&milton, 0);
+    test_commit_stroke(&milton, 100);
+    milton_save(&milton);
+
+    EXPECT_TRUE( !milton.persist->journal_needs_snapshot );
+    u64 snapshot_bytes = milton.persist->snapshot_bytes;
+
+    // Changes after the snapshot only go to the journal.
+    test_commit_stroke(&milton, 200);
+    if ( milton_undo(&milton) ) { milton_journal_push(&milton, JournalRecord_UNDO); }
+    Stroke* redone = milton_redo(&milton);
+    EXPECT_TRUE( redone != NULL );
+    milton_journal_push(&milton, JournalRecord_STROKE_REDO, redone);
+
+    milton_new_layer(&milton);
+    strcpy(milton.canvas->working_layer->name, "Journal layer");
+    test_commit_stroke(&milton, 300);
+    if ( milton_undo(&milton) ) { milton_journal_push(&milton, JournalRecord_UNDO); }
+
+    milton_journal_flush(&milton);
+
+    EXPECT_TRUE( milton.persist->snapshot_bytes == snapshot_bytes );
+
+    Milton loaded_milton = {};
+
+    milton_init(&loaded_milton, 0, 0, 1, path, MiltonInit_FOR_TEST);
+    milton_load(&loaded_milton);
+
+    CanvasState* canvas = loaded_milton.canvas;
+    EXPECT_TRUE( layer::number_of_layers(canvas->root_layer) == 2 );
+    EXPECT_TRUE( layer::count_strokes(canvas->root_layer) == 3 );
+    EXPECT_TRUE( canvas->history.count == milton.canvas->history.count );
+    EXPECT_TRUE( canvas->working_layer->id == milton.canvas->working_layer->id );
+    EXPECT_TRUE( strcmp(canvas->working_layer->name, "Journal layer") == 0 );
+
+    // The undone stroke can be redone after loading.
+    Stroke* stroke = milton_redo(&loaded_milton);
+    EXPECT_TRUE( stroke != NULL );
+    if ( stroke ) {
+        EXPECT_TRUE( stroke->num_points == 2 );
+        EXPECT_TRUE( stroke->points[0].x == 300 );
+    }
+}
+
+void
+test_save_snapshot()
+{
+    Milton milton = {};
+
+    PATH_CHAR* path = TO_PATH_STR("TEST_snapshot.mlt");
+
+    milton_init(&milton, 0, 0, 1, path, MiltonInit_FOR_TEST);
+    milton_reset_canvas_and_set_default(&milton);
+    milton.persist->mlt_file_path = path;
+
+    test_commit_stroke(&milton, 0);
+    test_commit_stroke(&milton, 100);
+
+    SaveRequest request = {};
+    milton_save_capture(&milton, &request, /*full*/true);
+
+    // Keep drawing while the request waits for the save thread.
+    if ( milton_undo(&milton) ) { milton_journal_push(&milton, JournalRecord_UNDO); }
+    test_commit_stroke(&milton, 200);
+    test_commit_stroke(&milton, 300);
+    milton_new_layer(&milton);
+    strcpy(milton.canvas->working_layer->name, "After capture");
+
+    milton_save_write(&milton, &request);
+    milton_save_request_release(&request);
+
+    Milton loaded_milton = {};
+
+    milton_init(&loaded_milton, 0, 0, 1, path, MiltonInit_FOR_TEST);
+    milton_load(&loaded_milton);
+
+    // The file has the canvas as it was at capture time.
+    CanvasState* canvas = loaded_milton.canvas;
+    EXPECT_TRUE( layer::number_of_layers(canvas->root_layer) == 1 );
+    EXPECT_TRUE( layer::count_strokes(canvas->root_layer) == 2 );
+    EXPECT_TRUE( canvas->history.count == 2 );
+    Stroke* stroke = get(&canvas->root_layer->strokes, 1);
+    EXPECT_TRUE( stroke->num_points == 2 && stroke->points[0].x == 100 );
+}
+
+static b32
+test_files_equal(const char* a, const char* b)
+{
+    FILE* fa = fopen(a, "rb");
+    FILE* fb = fopen(b, "rb");
+    b32 equal = fa && fb;
+    while ( equal ) {
+        int ca = fgetc(fa);
+        int cb = fgetc(fb);
+        equal = ca == cb;
+        if ( ca == EOF ) {
+            break;
+        }
+    }
+    if ( fa ) { fclose(fa); }
+    if ( fb ) { fclose(fb); }
+    return equal;
+}
+
+void
+test_image_writer()
+{
+    i32 w = 301;
+    i32 h = 77;
+    u8* pixels = (u8*)mlt_calloc((size_t)w * h, 4, "Bitmap");
+    u32 seed = 1;
+    for ( i32 i = 0; i < w * h * 4; ++i ) {
+        // Flat areas with some noise, like an exported canvas.
+        seed = seed * 1103515245 + 12345;
+        pixels[i] = (u8)((i / 4) % w < 150 ? 255 : ((seed >> 16) & 0x3));
+    }
+
+    // PNG, in strips. Read it back.
+    ImageWriter* png = image_writer_begin(TO_PATH_STR("TEST_strips.png"), w, h);
+    EXPECT_TRUE( png != NULL );
+    if ( png ) {
+        for ( i32 row = 0; row < h; row += 16 ) {
+            EXPECT_TRUE( image_writer_rows(png, pixels + (size_t)row * w * 4, min(16, h - row)) );
+        }
+        EXPECT_TRUE( image_writer_end(png) );
+
+        int lw = 0, lh = 0, lc = 0;
+        u8* loaded = stbi_load("TEST_strips.png", &lw, &lh, &lc, 4);
+        EXPECT_TRUE( loaded != NULL && lw == w && lh == h );
+        if ( loaded ) {
+            EXPECT_TRUE( memcmp(loaded, pixels, (size_t)w * h * 4) == 0 );
+            stbi_image_free(loaded);
+        }
+    }
+
+    // PNG, wide enough to be split into several bands per strip.
+    {
+        i32 bw = 1024;
+        i32 bh = 700;
+        u8* big = (u8*)mlt_calloc((size_t)bw * bh, 4, "Bitmap");
+        for ( i32 i = 0; i < bw * bh * 4; ++i ) {
+            seed = seed * 1103515245 + 12345;
+            big[i] = (u8)((i / 4) % bw < 500 ? (i / (4 * bw)) : ((seed >> 16) & 0xff));
+        }
+        ImageWriter* banded = image_writer_begin(TO_PATH_STR("TEST_bands.png"), bw, bh);
+        EXPECT_TRUE( banded != NULL );
+        if ( banded ) {
+            EXPECT_TRUE( image_writer_rows(banded, big, 400) );
+            EXPECT_TRUE( image_writer_rows(banded, big + (size_t)400 * bw * 4, bh - 400) );
+            EXPECT_TRUE( image_writer_end(banded) );
+
+            int lw = 0, lh = 0, lc = 0;
+            u8* loaded = stbi_load("TEST_bands.png", &lw, &lh, &lc, 4);
+            EXPECT_TRUE( loaded != NULL && lw == bw && lh == bh );
+            if ( loaded ) {
+                EXPECT_TRUE( memcmp(loaded, big, (size_t)bw * bh * 4) == 0 );
+                stbi_image_free(loaded);
+            }
+        }
+        mlt_free(big, "Bitmap");
+    }
+
+    // JPEG, in strips. Same bytes as encoding the whole image at once.
+    ImageWriter* jpeg = image_writer_begin(TO_PATH_STR("TEST_strips.jpg"), w, h);
+    EXPECT_TRUE( jpeg != NULL );
+    if ( jpeg ) {
+        for ( i32 row = 0; row < h; row += 16 ) {
+            EXPECT_TRUE( image_writer_rows(jpeg, pixels + (size_t)row * w * 4, min(16, h - row)) );
+        }
+        EXPECT_TRUE( image_writer_end(jpeg) );
+    }
+    tje_encode_to_file("TEST_whole.jpg", w, h, 4, pixels);
+    EXPECT_TRUE( test_files_equal("TEST_strips.jpg", "TEST_whole.jpg") );
+
+    mlt_free(pixels, "Bitmap");
+}
+
+#if RUN_BENCHMARKS
+void
+benchmark_save_load()
+{
+    Milton milton = {};
+
+    PATH_CHAR* path = TO_PATH_STR("BENCHMARK_load.mlt");
+
+    milton_init(&milton, 0, 0, 1, path, MiltonInit_FOR_TEST);
+    milton_reset_canvas_and_set_default(&milton);
+    milton.persist->mlt_file_path = path;
+
+    // Points a few pixels apart at the default zoom level.
+    i32 num_strokes = 200000;
+    i32 num_points = 32;
+    for ( i32 i = 0; i < num_strokes; ++i ) {
+        Stroke stroke = test_stroke(&milton.canvas->arena, milton.canvas->working_layer->id, i);
+        stroke.num_points = num_points;
+        stroke.points = arena_alloc_array(&milton.canvas->arena, num_points, v2l);
+        stroke.pressures = arena_alloc_array(&milton.canvas->arena, num_points, f32);
+        for ( i32 pi = 0; pi < num_points; ++pi ) {
+            stroke.points[pi] = { i * 4096 + pi * 3000, (i % 1000) * 4096 + pi * (pi % 7) * 400 };
+            stroke.pressures[pi] = pi / (f32)num_points;
+        }
+        stroke.bounding_rect = bounding_box_for_stroke(&stroke);
+        milton_commit_stroke(&milton, milton.canvas->working_layer, stroke);
+    }
+    const int runs = 5;
+
+    for ( int compact = 0; compact < 2; ++compact ) {
+        milton.persist->compact_points = compact;
+
+        u64 bytes = 0;
+        f32 best_save_ms = 0;
+        for ( int run = 0; run < runs; ++run ) {
+            u64 begin = perf_counter();
+            bytes = milton_save(&milton);
+            f32 ms = perf_count_to_sec(perf_counter() - begin) * 1000.0f;
+            if ( run == 0 || ms < best_save_ms ) {
+                best_save_ms = ms;
+            }
+        }
+
+        Milton loaded_milton = {};
+        milton_init(&loaded_milton, 0, 0, 1, path, MiltonInit_FOR_TEST);
+
+        f32 best_load_ms = 0;
+        for ( int run = 0; run < runs; ++run ) {
+            u64 begin = perf_counter();
+            milton_load(&loaded_milton);
+            f32 ms = perf_count_to_sec(perf_counter() - begin) * 1000.0f;
+            if ( run == 0 || ms < best_load_ms ) {
+                best_load_ms = ms;
+            }
+        }
+        EXPECT_TRUE( layer::count_strokes(loaded_milton.canvas->root_layer) == num_strokes );
+
+        const char* encoding = compact ? "compact" : "raw";
+        milton_log("[benchmark] milton_save (%s): %d strokes, %.1f MB, best of %d: %.2f ms\n",
+                   encoding, num_strokes, bytes / (1024.0f * 1024.0f), runs, best_save_ms);
+        milton_log("[benchmark] milton_load (%s): %d strokes, %.1f MB, best of %d: %.2f ms\n",
+                   encoding, num_strokes, bytes / (1024.0f * 1024.0f), runs, best_load_ms);
+    }
+}
+
+static void
+benchmark_write_func(void* context, void* data, int size)
+{
+    fwrite(data, (size_t)size, 1, (FILE*)context);
+}
+
+void
+benchmark_png_export()
+{
+    // 8K and 16K UHD.
+    i32 sizes[2][2] = { { 7680, 4320 }, { 15360, 8640 } };
+    for ( int si = 0; si < 2; ++si ) {
+        i32 w = sizes[si][0];
+        i32 h = sizes[si][1];
+        u8* pixels = (u8*)mlt_calloc((size_t)w * h, 4, "Bitmap");
+        // White paper with dark diagonal strokes and some noise on them.
+        u32 seed = 1;
+        for ( i32 y = 0; y < h; ++y ) {
+            for ( i32 x = 0; x < w; ++x ) {
+                u8* p = pixels + ((size_t)y * w + x) * 4;
+                seed = seed * 1103515245 + 12345;
+                b32 ink = ((x + y) % 512) < 24 || ((x - y + h) % 997) < 6;
+                u8 v = ink ? (u8)(40 + ((seed >> 16) & 0x1f)) : 255;
+                p[0] = v;
+                p[1] = v;
+                p[2] = ink ? 160 : 255;
+                p[3] = 255;
+            }
+        }
+
+        u64 begin = perf_counter();
+        ImageWriter* writer = image_writer_begin(TO_PATH_STR("BENCHMARK_export.png"), w, h);
+        image_writer_rows(writer, pixels, h);
+        image_writer_end(writer);
+        f32 ms = perf_count_to_sec(perf_counter() - begin) * 1000.0f;
+        FILE* fd = fopen("BENCHMARK_export.png", "rb");
+        fseek(fd, 0, SEEK_END);
+        long bytes = ftell(fd);
+        fclose(fd);
+        milton_log("[benchmark] PNG export (%d threads): %dx%d, %.1f MB, %.2f ms\n",
+                   jobs_num_threads(), w, h, bytes / (1024.0f * 1024.0f), ms);
+
+        begin = perf_counter();
+        fd = fopen("BENCHMARK_stb.png", "wb");
+        stbi_write_png_to_func(benchmark_write_func, fd, w, h, 4, pixels, 0);
+        bytes = ftell(fd);
+        fclose(fd);
+        ms = perf_count_to_sec(perf_counter() - begin) * 1000.0f;
+        milton_log("[benchmark] PNG export (stb_image_write): %dx%d, %.1f MB, %.2f ms\n",
+                   w, h, bytes / (1024.0f * 1024.0f), ms);
+
+        mlt_free(pixels, "Bitmap");
+    }
+}
+// Visibility tests per bucket, reading whole strokes versus the bounds arrays.
+void
+benchmark_cull_buckets()
+{
+    Arena arena = arena_init();
+    StrokeList list = {};
+    list.arena = &arena;
+    strokelist_init_bucket(&list.root);
+
+    u32 seed = 3;
+    i64 num_buckets = 64;
+    for ( i64 i = 0; i < num_buckets * STROKELIST_BUCKET_COUNT; ++i ) {
+        push(&list, test_indexed_stroke(&seed));
+    }
+    Rect rect = { -200000, -200000, 200000, 200000 };
+    const int runs = 20;
+
+    f32 best_ms[3] = {};
+    i64 visible[3] = {};
+    for ( int method = 0; method < 3; ++method ) {
+        for ( int run = 0; run < runs; ++run ) {
+            u64 begin = perf_counter();
+            i64 n = 0;
+            for ( StrokeBucket* bucket = &list.root; bucket; bucket = bucket->next ) {
+                u64 mask[STROKELIST_MASK_WORDS] = {};
+                if ( method == 0 ) {
+                    for ( i64 i = 0; i < STROKELIST_BUCKET_COUNT; ++i ) {
+                        if ( rect_intersects_rect(bucket->data[i].bounding_rect, rect) ) {
+                            mask[i / 64] |= 1ULL << (i % 64);
+                        }
+                    }
+                }
+                else if ( method == 1 ) {
+                    cull_bucket_scalar(bucket, 0, STROKELIST_BUCKET_COUNT, rect, mask);
+                }
+                else {
+                    strokelist_cull_bucket(bucket, STROKELIST_BUCKET_COUNT, rect, mask);
+                }
+                for ( i64 wi = 0; wi < STROKELIST_MASK_WORDS; ++wi ) {
+                    for ( u64 bits = mask[wi]; bits != 0; bits &= bits - 1 ) {
+                        ++n;
+                    }
+                }
+            }
+            f32 ms = perf_count_to_sec(perf_counter() - begin) * 1000.0f;
+            if ( run == 0 || ms < best_ms[method] ) {
+                best_ms[method] = ms;
+            }
+            visible[method] = n;
+        }
+    }
+    EXPECT_TRUE( visible[0] == visible[1] && visible[1] == visible[2] );
+
+    milton_log("[benchmark] cull %lld buckets, %lld visible, best of %d: strokes %.2f ms, bounds arrays %.2f ms, kernel %d %.2f ms\n",
+               num_buckets, visible[2], runs, best_ms[0], best_ms[1], (int)cull_detect_kernel(), best_ms[2]);
+
+    arena_free(&arena);
+}
+
+// Geometry for a screen full of strokes, on this thread and on the job threads.
+void
+benchmark_stroke_geometry()
+{
+    Arena arena = arena_init();
+    i64 num_strokes = 20000;
+    i32 num_points = 64;
+    CookJob* jobs = arena_alloc_array(&arena, num_strokes, CookJob);
+    for ( i64 i = 0; i < num_strokes; ++i ) {
+        Stroke* stroke = arena_alloc_elem(&arena, Stroke);
+        stroke->brush = default_brush();
+        stroke->num_points = num_points;
+        stroke->points = arena_alloc_array(&arena, num_points, v2l);
+        stroke->pressures = arena_alloc_array(&arena, num_points, f32);
+        for ( i32 pi = 0; pi < num_points; ++pi ) {
+            stroke->points[pi] = { i * 64 + pi * 30, (i % 100) * 64 + pi * (pi % 7) * 4 };
+            stroke->pressures[pi] = pi / (f32)num_points;
+        }
+        jobs[i].stroke = stroke;
+        jobs[i].stroke_z = (i32)i + 1;
+        stroke_geometry_init(&jobs[i].geometry, stroke,
+                             arena_alloc_array(&arena, stroke_geometry_size(stroke), u8));
+    }
+
+    const int runs = 5;
+    f32 best_ms[2] = {};
+    for ( int threaded = 0; threaded < 2; ++threaded ) {
+        for ( int run = 0; run < runs; ++run ) {
+            u64 begin = perf_counter();
+            if ( threaded ) {
+                jobs_run(cook_job, jobs, num_strokes);
+            }
+            else {
+                for ( i64 i = 0; i < num_strokes; ++i ) {
+                    cook_job(jobs, i);
+                }
+            }
+            f32 ms = perf_count_to_sec(perf_counter() - begin) * 1000.0f;
+            if ( run == 0 || ms < best_ms[threaded] ) {
+                best_ms[threaded] = ms;
+            }
+        }
+    }
+
+    milton_log("[benchmark] stroke geometry, %lld strokes of %d points, best of %d: one thread %.2f ms, %d threads %.2f ms\n",
+               num_strokes, num_points, runs, best_ms[0], jobs_num_threads(), best_ms[1]);
+
+    arena_free(&arena);
+}
+#endif
+
 extern "C" int
 main()
 {
     test_save_load();
+    test_layer_sections();
+    test_compact_points();
+    test_load_many_strokes();
+    test_stroke_index();
+    test_cull_bucket();
+    test_residency();
+    test_stroke_geometry();
+    test_stroke_same_points();
+    test_gl_program_reflection();
+    test_blur();
+    test_load_v9();
+    test_journal();
+    test_save_snapshot();
+    test_image_writer();
+#if RUN_BENCHMARKS
+    benchmark_save_load();
+    benchmark_png_export();
+    benchmark_cull_buckets();
+    benchmark_stroke_geometry();
+#endif
     return 0;
 }
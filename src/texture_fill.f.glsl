@@ -10,14 +10,16 @@ uniform float u_alpha;
     uniform sampler2D u_canvas;
 #endif
 uniform vec2 u_screen_size;
+// From destination to source pixels. Used when copying tiles of the canvas.
+uniform vec2 u_texel_offset;
 
 void
 main()
 {
 #if HAS_TEXTURE_MULTISAMPLE
-    vec4 color = texelFetch(u_canvas, ivec2(gl_FragCoord.xy), gl_SampleID);
+    vec4 color = texelFetch(u_canvas, ivec2(gl_FragCoord.xy + u_texel_offset), gl_SampleID);
 #else
-    vec2 screen_point = vec2(gl_FragCoord.x, gl_FragCoord.y);
+    vec2 screen_point = vec2(gl_FragCoord.x, gl_FragCoord.y) + u_texel_offset;
     vec2 coord = screen_point / u_screen_size;
     vec4 color = texture(u_canvas, coord);
 #endif
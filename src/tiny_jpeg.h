@@ -160,6 +160,33 @@ int tje_encode_with_func(tje_write_func* func,
                          const int num_components,
                          const unsigned char* src_data);
 
+// - tje_stream_begin, tje_stream_rows, tje_stream_end -
+//
+// Usage
+//  Same as tje_encode_with_func, for images that are not in memory all at
+//  once. tje_stream_rows takes the rows from top to bottom, a strip at a time.
+//  All strips except the last one must be a multiple of 8 rows tall.
+//  tje_stream_end finishes the image and frees the stream.
+//
+//  RETURN:
+//      tje_stream_begin returns NULL on error. The others return 0 on error
+//      and 1 on success.
+
+typedef struct TJEStream_s TJEStream;
+
+TJEStream* tje_stream_begin(tje_write_func* func,
+                            void* context,
+                            const int quality,
+                            const int width,
+                            const int height,
+                            const int num_components);
+
+int tje_stream_rows(TJEStream* stream,
+                    const unsigned char* rows,
+                    const int num_rows);
+
+int tje_stream_end(TJEStream* stream);
+
 #endif // TJE_HEADER_GUARD
 
 
@@ -192,6 +219,7 @@ int tje_encode_with_func(tje_write_func* func,
 #include <inttypes.h>
 #include <math.h>   // floorf, ceilf
 #include <stdio.h>  // FILE, puts
+#include <stdlib.h> // calloc, free
 #include <string.h> // memcpy(float)[rsp+208h]
 
 
@@ -918,12 +946,34 @@ static void tjei_huff_expand (TJEState* state)
     }
 }
 
-static int tjei_encode_main(TJEState* state,
-                            const unsigned char* src_data,
+struct TJEStream_s {
+    TJEState state;
+#if TJE_USE_FAST_DCT
+    struct TJEProcessedQT pqt;
+#endif
+    int width;
+    int height;
+    int num_components;
+    int next_row;  // Rows encoded so far.
+
+    // DC prediction.
+    int pred_y;
+    int pred_b;
+    int pred_r;
+
+    // Bit stack
+    uint32_t bitbuffer;
+    uint32_t location;
+};
+
+// Check the image size and write everything that goes before the compressed data.
+static int tjei_stream_init(TJEStream* stream,
                             const int width,
                             const int height,
                             const int src_num_components)
 {
+    TJEState* state = &stream->state;
+
     if (src_num_components != 3 && src_num_components != 4) {
         return 0;
     }
@@ -932,8 +982,13 @@ static int tjei_encode_main(TJEState* state,
         return 0;
     }
 
+    stream->width = width;
+    stream->height = height;
+    stream->num_components = src_num_components;
+    tjei_g_output_buffer_count = 0;
+
 #if TJE_USE_FAST_DCT
-    struct TJEProcessedQT pqt;
+    struct TJEProcessedQT* pqt = &stream->pqt;
     // Again, taken from classic japanese implementation.
     //
     /* For float AA&N IDCT method, divisors are equal to quantization
@@ -953,8 +1008,8 @@ static int tjei_encode_main(TJEState* state,
     for(int y=0; y<8; y++) {
         for(int x=0; x<8; x++) {
             int i = y*8 + x;
-            pqt.luma[y*8+x] = 1.0f / (8 * aan_scales[x] * aan_scales[y] * state->qt_luma[tjei_zig_zag[i]]);
-            pqt.chroma[y*8+x] = 1.0f / (8 * aan_scales[x] * aan_scales[y] * state->qt_chroma[tjei_zig_zag[i]]);
+            pqt->luma[y*8+x] = 1.0f / (8 * aan_scales[x] * aan_scales[y] * state->qt_luma[tjei_zig_zag[i]]);
+            pqt->chroma[y*8+x] = 1.0f / (8 * aan_scales[x] * aan_scales[y] * state->qt_chroma[tjei_zig_zag[i]]);
         }
     }
 #endif
@@ -1048,41 +1103,46 @@ static int tjei_encode_main(TJEState* state,
         tjei_write(state, &header, sizeof(TJEScanHeader), 1);
 
     }
-    // Write compressed data.
+
+    return 1;
+}
+
+// Encode `num_rows` rows, starting at stream->next_row. Rows past the bottom of
+// the image repeat the last one, which has to be in this strip.
+static void tjei_encode_rows(TJEStream* stream,
+                             const unsigned char* src_data,
+                             const int num_rows)
+{
+    TJEState* state = &stream->state;
+    const int width = stream->width;
+    const int height = stream->height;
+    const int src_num_components = stream->num_components;
+    const int first_row = stream->next_row;
+    const int end_row = first_row + num_rows;
 
     float du_y[64];
     float du_b[64];
     float du_r[64];
 
-    // Set diff to 0.
-    int pred_y = 0;
-    int pred_b = 0;
-    int pred_r = 0;
-
-    // Bit stack
-    uint32_t bitbuffer = 0;
-    uint32_t location = 0;
-
-
-    for ( int y = 0; y < height; y += 8 ) {
+    for ( int y = first_row; y < end_row; y += 8 ) {
         for ( int x = 0; x < width; x += 8 ) {
             // Block loop: ====
             for ( int off_y = 0; off_y < 8; ++off_y ) {
                 for ( int off_x = 0; off_x < 8; ++off_x ) {
                     int block_index = (off_y * 8 + off_x);
 
-                    int src_index = (((y + off_y) * width) + (x + off_x)) * src_num_components;
-
                     int col = x + off_x;
                     int row = y + off_y;
 
                     if(row >= height) {
-                        src_index -= (width * (row - height + 1)) * src_num_components;
+                        row = height - 1;
                     }
                     if(col >= width) {
-                        src_index -= (col - width + 1) * src_num_components;
+                        col = width - 1;
                     }
-                    assert(src_index < width * height * src_num_components);
+                    assert(row < end_row);
+
+                    size_t src_index = (((size_t)(row - first_row) * width) + col) * src_num_components;
 
                     uint8_t r = src_data[src_index + 0];
                     uint8_t g = src_data[src_index + 1];
@@ -1100,40 +1160,46 @@ static int tjei_encode_main(TJEState* state,
 
             tjei_encode_and_write_MCU(state, du_y,
 #if TJE_USE_FAST_DCT
-                                     pqt.luma,
+                                     stream->pqt.luma,
 #else
                                      state->qt_luma,
 #endif
                                      state->ehuffsize[TJEI_LUMA_DC], state->ehuffcode[TJEI_LUMA_DC],
                                      state->ehuffsize[TJEI_LUMA_AC], state->ehuffcode[TJEI_LUMA_AC],
-                                     &pred_y, &bitbuffer, &location);
+                                     &stream->pred_y, &stream->bitbuffer, &stream->location);
             tjei_encode_and_write_MCU(state, du_b,
 #if TJE_USE_FAST_DCT
-                                     pqt.chroma,
+                                     stream->pqt.chroma,
 #else
                                      state->qt_chroma,
 #endif
                                      state->ehuffsize[TJEI_CHROMA_DC], state->ehuffcode[TJEI_CHROMA_DC],
                                      state->ehuffsize[TJEI_CHROMA_AC], state->ehuffcode[TJEI_CHROMA_AC],
-                                     &pred_b, &bitbuffer, &location);
+                                     &stream->pred_b, &stream->bitbuffer, &stream->location);
             tjei_encode_and_write_MCU(state, du_r,
 #if TJE_USE_FAST_DCT
-                                     pqt.chroma,
+                                     stream->pqt.chroma,
 #else
                                      state->qt_chroma,
 #endif
                                      state->ehuffsize[TJEI_CHROMA_DC], state->ehuffcode[TJEI_CHROMA_DC],
                                      state->ehuffsize[TJEI_CHROMA_AC], state->ehuffcode[TJEI_CHROMA_AC],
-                                     &pred_r, &bitbuffer, &location);
+                                     &stream->pred_r, &stream->bitbuffer, &stream->location);
 
 
         }
     }
 
-    // Finish the image.
+    stream->next_row = end_row;
+}
+
+// Finish the image.
+static void tjei_stream_finish(TJEStream* stream)
+{
+    TJEState* state = &stream->state;
     { // Flush
-        if (location > 0 && location < 8) {
-            tjei_write_bits(state, &bitbuffer, &location, (uint16_t)(8 - location), 0);
+        if (stream->location > 0 && stream->location < 8) {
+            tjei_write_bits(state, &stream->bitbuffer, &stream->location, (uint16_t)(8 - stream->location), 0);
         }
     }
     uint16_t EOI = tjei_be_word(0xffd9);
@@ -1143,8 +1209,6 @@ static int tjei_encode_main(TJEState* state,
         state->write_context.func(state->write_context.context, tjei_g_output_buffer, (int)tjei_g_output_buffer_count);
         tjei_g_output_buffer_count = 0;
     }
-
-    return 1;
 }
 
 int tje_encode_to_file(const char* dest_path,
@@ -1185,13 +1249,11 @@ int tje_encode_to_file_at_quality(const char* dest_path,
     return result;
 }
 
-int tje_encode_with_func(tje_write_func* func,
-                         void* context,
-                         const int quality,
-                         const int width,
-                         const int height,
-                         const int num_components,
-                         const unsigned char* src_data)
+// Quantization and huffman tables, and the output callback.
+static int tjei_state_init(TJEState* state_out,
+                           tje_write_func* func,
+                           void* context,
+                           const int quality)
 {
     if (quality < 1 || quality > 3) {
         tje_log("[ERROR] -- Valid 'quality' values are 1 (lowest), 2, or 3 (highest)\n");
@@ -1238,8 +1300,71 @@ int tje_encode_with_func(tje_write_func* func,
 
     tjei_huff_expand(&state);
 
-    int result = tjei_encode_main(&state, src_data, width, height, num_components);
+    *state_out = state;
+
+    return 1;
+}
+
+int tje_encode_with_func(tje_write_func* func,
+                         void* context,
+                         const int quality,
+                         const int width,
+                         const int height,
+                         const int num_components,
+                         const unsigned char* src_data)
+{
+    TJEStream* stream = tje_stream_begin(func, context, quality, width, height, num_components);
+    if (!stream) {
+        return 0;
+    }
+    tjei_encode_rows(stream, src_data, height);
+    return tje_stream_end(stream);
+}
 
+TJEStream* tje_stream_begin(tje_write_func* func,
+                            void* context,
+                            const int quality,
+                            const int width,
+                            const int height,
+                            const int num_components)
+{
+    TJEStream* stream = (TJEStream*)calloc(1, sizeof(TJEStream));
+    if (stream) {
+        if (!tjei_state_init(&stream->state, func, context, quality) ||
+            !tjei_stream_init(stream, width, height, num_components)) {
+            free(stream);
+            stream = NULL;
+        }
+    }
+    return stream;
+}
+
+int tje_stream_rows(TJEStream* stream,
+                    const unsigned char* rows,
+                    const int num_rows)
+{
+    int end_row = stream->next_row + num_rows;
+    if (num_rows <= 0 || end_row > stream->height) {
+        return 0;
+    }
+    if (num_rows % 8 != 0 && end_row != stream->height) {
+        tje_log("[ERROR] -- Strips must be a multiple of 8 rows tall, except for the last one.\n");
+        return 0;
+    }
+    tjei_encode_rows(stream, rows, num_rows);
+    return 1;
+}
+
+int tje_stream_end(TJEStream* stream)
+{
+    int result = stream->next_row == stream->height;
+    if (result) {
+        tjei_stream_finish(stream);
+    }
+    else {
+        tjei_g_output_buffer_count = 0;
+    }
+    free(stream);
     return result;
 }
 // ============================================================
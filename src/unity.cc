@@ -7,12 +7,14 @@
 #include "color.cc"
 #include "gl_helpers.cc"
 #include "gui.cc"
+#include "jobs.cc"
 #include "localization.cc"
 #include "memory.cc"
 #include "milton.cc"
 #include "persist.cc"
 #include "profiler.cc"
 #include "renderer.cc"
+#include "residency.cc"
 #include "sdl_milton.cc"
 #include "utils.cc"
 #include "vector.cc"
@@ -521,6 +521,32 @@ hash(char* string, size_t len)
     return h;
 }
 
+i32
+lowest_set_bit(u64 word)
+{
+    mlt_assert(word != 0);
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward64(&index, word);
+    return (i32)index;
+#else
+    return __builtin_ctzll(word);
+#endif
+}
+
+i32
+highest_set_bit(u64 word)
+{
+    mlt_assert(word != 0);
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanReverse64(&index, word);
+    return (i32)index;
+#else
+    return 63 - __builtin_clzll(word);
+#endif
+}
+
 u64
 difference_in_ms(WallTime start, WallTime end)
 {
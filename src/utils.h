@@ -53,6 +53,7 @@ v2l v2i_to_v2l(v2i p);
 
 #define I64_MAX 9223372036854775807L
 #define I64_MIN -9223372036854775807L
+#define U64_MAX 18446744073709551615UL
 
 f32 magnitude(v2f a);
 
@@ -133,6 +134,7 @@ Rect rect_without_size();
 // Set operations on rectangles
 Rect rect_union(Rect a, Rect b);
 Rect rect_intersect(Rect a, Rect b);
+b32 rect_intersects_rect(Rect a, Rect b);
 Rect rect_stretch(Rect rect, i32 width);
 
 Rect rect_clip_to_screen(Rect limits, v2i screen_size);
@@ -207,6 +209,10 @@ swap(T& a, T& b)
 
 u64 hash(char* string, size_t len);
 
+// Index of the lowest set bit. `word` must not be 0.
+i32 lowest_set_bit(u64 word);
+i32 highest_set_bit(u64 word);
+
 template<typename T>
 T lerp(T begin, T end, float t) {
     return begin * (1.0f - t) + (end * t);